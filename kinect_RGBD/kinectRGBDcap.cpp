@@ -1,32 +1,110 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <opencv2/opencv.hpp>
 
-#include <Kinect.h>
-
-#include <atlbase.h>
-
-#define ERROR_CHECK( ret )  \
-    if ( (ret) != S_OK ) {    \
-        std::stringstream ss;	\
-        ss << "failed " #ret " " << std::hex << ret << std::endl;			\
-        throw std::runtime_error( ss.str().c_str() );			\
-    }
+#include "../kinect_common/CaptureROI.h"
+#include "../kinect_common/ColorConvert.h"
+#include "../kinect_common/CoordinateMapCache.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/DepthSpatialFilter.h"
+#include "../kinect_common/DepthTemporalFilter.h"
+#include "../kinect_common/DepthWarp.h"
+#include "../kinect_common/FrameBuffer.h"
+#include "../kinect_common/FrameQueue.h"
+#include "../kinect_common/FrameSource.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/PointCloud.h"
+#include "../kinect_common/PointCloudWriter.h"
+#include "../kinect_common/RGBDFrame.h"
+#include "../kinect_common/RGBDRecord.h"
+#include "../kinect_common/RGBDStream.h"
+#include "../kinect_common/RGBDSynchronizer.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SharedFrameRing.h"
+#include "../kinect_common/SimulatedFrameSource.h"
+#include "../kinect_common/StageProfiler.h"
+#include "../kinect_common/StreamFrameSource.h"
+#include "../kinect_common/VoxelGrid.h"
 
 class KinectApp {
 private:
-	// Kinect SDK
-	CComPtr<IKinectSensor> kinect = nullptr;
-	CComPtr<ICoordinateMapper> coordinateMapper = nullptr;
+	// フレームの取得元 (Kinect本体 or 記録データ)
+	std::unique_ptr<FrameSource> source;
 
-	// RGBp̕ϐ
-	CComPtr<IColorFrameReader> colorFrameReader = nullptr;
+	// RGB用の変数
 	unsigned int colorBytesPerPixel;
-	ColorImageFormat colorFormat = ColorImageFormat::ColorImageFormat_Bgra;
-	std::vector<BYTE> colorBuffer;
-
-	// Dp̕ϐ
-	CComPtr<IDepthFrameReader> depthFrameReader = nullptr;
-	std::vector<UINT16> depthBuffer;
+	FrameBuffer<BYTE> colorBuffer; // RGBフレームのプール (参照カウントで寿命を管理する。取得元が対応していれば YUY2 のまま置く)
+	cv::Mat recordColor;           // 記録用に BGRA に変換したRGB (YUY2 の場合だけ)
+
+	// D用の変数
+	FrameBuffer<UINT16> depthBuffer; // Depthフレームのプール (参照カウントで寿命を管理する)
+	DepthTemporalFilter temporalFilter; // 時間方向のフィルタ (有効なら取得したフレームをその場で書き換える)
+	bool temporalEnabled = false;
+	DepthSpatialFilter spatialFilter;   // 空間方向のフィルタ (有効なら組にしたDepthを別のスロットに書き出して差し替える)
+	bool spatialEnabled = false;
+	cv::Mat spatialGuide;               // RGBで導く場合の、Depthの空間に写したRGB
+
+	// タイムスタンプで組にしたRGB-Dフレーム (変換処理は全てこのフレームを使う)
+	RGBDSynchronizer sync;
+	RGBDFrame rgbdFrame;
+	long long frameNumber = 0; // 組にしたフレームの数
+
+	// Depth座標系→RGB座標系の対応表 (Depthフレームごとに1回だけ計算する)
+	CoordinateMapCache mapCache;
+	DepthWarpOptions warpOptions; // DepthをRGBの空間に写すときの設定
+
+	// 処理する範囲 (解決済み。窓は常に空でなく、既定は全体)
+	CaptureROI roi;
+
+	// 点群用 (光線は最初に点群を作るときに取得元のパラメータから用意する)
+	PointCloudGenerator cloudGenerator;
+	VoxelGrid voxelGrid;              // 間引き用のハッシュ表 (フレームごとには確保しない)
+	VoxelGridOptions voxelOptions;
+
+	// 記録用
+	RGBDRecordWriter recorder;
+
+	// 他のプロセスへの配信用 (共有メモリのリング)
+	SharedFramePublisher publisher;
+
+	// 別の PC への送信用 (TCP)
+	RGBDStreamServer streamer;
+
+	// 組にしたフレームのデータ (RGBは BGRA、YUY2 なら変換する)
+	const BYTE *colorData() {
+		if (rgbdFrame.color.type() == CV_8UC4) return rgbdFrame.color.ptr<BYTE>(0);
+		yuy2ToBGRA(rgbdFrame.color, recordColor);
+		return recordColor.ptr<BYTE>(0);
+	}
+	const UINT16 *depthData() const { return rgbdFrame.depth.ptr<UINT16>(0); }
+
+	// 組にしたフレームのDepthに空間方向のフィルタをかけ、フィルタした新しいスロットに差し替える
+	// sigmaColor > 0 なら組のRGBをDepthの空間に写して段差と一緒に色の境界も保つ (位置合わせが使えなければDepthだけ)
+	// 同期待ちのDepthは他のフレームと組になる可能性があるので、組にしてから (使うフレームだけ) かける
+	void filterPairDepth(RGBDFrame &pair) {
+		cv::Mat guide;
+		if (spatialFilter.getOptions().sigmaColor > 0) {
+			mapCache.invalidate();
+			const ColorSpacePoint *colorSpace = mapCache.depthToColorSpace(pair.depth.ptr<UINT16>(0), depthBuffer.size());
+			if (colorSpace != nullptr) {
+				// 対応表とRGBは ROI の中だけが有効なので、ガイドも窓の中だけ写す (窓の外はDepthだけで導くのと同じになるよう0)
+				spatialGuide.create(depthHeight, depthWidth, CV_8UC4);
+				if (pair.roi.depthRect.area() < depthWidth * depthHeight) spatialGuide = cv::Scalar(0);
+				cv::Mat inside = spatialGuide(pair.roi.depthRect);
+				warpColorToDepth(pair.color, colorSpace, depthWidth, depthHeight, inside, pair.roi.depthRect);
+				guide = spatialGuide;
+			}
+		}
+		UINT16 *out = depthBuffer.beginWrite();
+		if (out == nullptr) return; // 空きスロットが無ければフィルタしないフレームを使う
+		spatialFilter.apply(pair.depth.ptr<UINT16>(0), out, guide);
+		depthBuffer.endWrite();
+		pair.depth = depthBuffer.view();
+	}
 public:
 	int colorWidth;
 	int colorHeight;
@@ -34,254 +112,730 @@ public:
 	int depthWidth;
 	int depthHeight;
 
-	~KinectApp() {
-		// Kinect̓I
-		if (kinect != nullptr) {
-			kinect->Close();
+	// 初期化 (replayPath を指定すると Kinect の代わりに記録データを fps で再生する。"sim" なら合成フレームを fps で届ける)
+	// "tcp://host:port" なら別の PC の startStreaming() が送るフレームを受け取る
+	void initialize(const char *replayPath = nullptr, double fps = 30.0) {
+		std::string path = (replayPath != nullptr) ? replayPath : "";
+		if (path == "sim") {
+			source.reset(new SimulatedFrameSource(fps));
+		} else if (path.compare(0, 6, "tcp://") == 0) {
+			size_t colon = path.rfind(':');
+			if (colon == std::string::npos || colon < 6) throw std::runtime_error("invalid stream address " + path);
+			source.reset(new StreamFrameSource(path.substr(6, colon - 6), atoi(path.c_str() + colon + 1)));
+		} else if (replayPath != nullptr) {
+			source.reset(new ReplayFrameSource(replayPath, fps));
+		} else {
+#ifdef _WIN32
+			source.reset(new KinectSensorSource());
+#else
+			throw std::runtime_error("Kinect is not available on this platform (specify a recorded data directory)");
+#endif
 		}
+		source->preferColorFormat(FrameSource::ColorYUY2); // BGRA への変換は表示や位置合わせで要る分だけ行う
+		source->open(FrameSource::ColorDepth);
+
+		colorWidth = source->colorWidth;
+		colorHeight = source->colorHeight;
+		colorBytesPerPixel = source->colorBytesPerPixel;
+		depthWidth = source->depthWidth;
+		depthHeight = source->depthHeight;
+
+		// RGB用のバッファーを作成する
+		colorBuffer.create(colorHeight, colorWidth, (source->colorFormat == FrameSource::ColorYUY2) ? CV_8UC2 : CV_8UC4, 4, 12); // 同期待ちの分も含めて多めに
+
+		// Depthのバッファーを作成する
+		depthBuffer.create(depthHeight, depthWidth, CV_16UC1, 4, 12);
+		temporalFilter.initialize(depthWidth, depthHeight);
+		spatialFilter.initialize(depthWidth, depthHeight);
+
+		// 最初の組ができるまでは0で埋めたフレームを使う
+		roi = CaptureROI();
+		roi.depthRect = cv::Rect(0, 0, depthWidth, depthHeight);
+		roi.colorRect = cv::Rect(0, 0, colorWidth, colorHeight);
+		rgbdFrame = RGBDFrame();
+		rgbdFrame.color = colorBuffer.view();
+		rgbdFrame.depth = depthBuffer.view();
+		rgbdFrame.roi = roi;
+		sync.reset();
+
+		mapCache.initialize(source.get(), depthWidth, depthHeight, colorWidth, colorHeight);
 	}
 
-	// 
-	void initialize() {
-		// ftHgKinect擾
-		ERROR_CHECK(::GetDefaultKinectSensor(&kinect));
-		ERROR_CHECK(kinect->Open());
-
-		// WϊC^tF[X擾
-		kinect->get_CoordinateMapper(&coordinateMapper);
-
-		// J[[_[擾
-		CComPtr<IColorFrameSource> colorFrameSource;
-		ERROR_CHECK(kinect->get_ColorFrameSource(&colorFrameSource));
-		ERROR_CHECK(colorFrameSource->OpenReader(&colorFrameReader));
-
-		// RGB摜̃TCY擾
-		CComPtr<IFrameDescription> colorFrameDescription;
-		ERROR_CHECK(colorFrameSource->CreateFrameDescription(colorFormat, &colorFrameDescription));
-		ERROR_CHECK(colorFrameDescription->get_Width(&colorWidth));
-		ERROR_CHECK(colorFrameDescription->get_Height(&colorHeight));
-		ERROR_CHECK(colorFrameDescription->get_BytesPerPixel(&colorBytesPerPixel));
-		std::cout << "create  : " << colorWidth << ", " << colorHeight << ", " << colorBytesPerPixel << std::endl;
-
-		// RGBp̃obt@[쐬
-		colorBuffer.resize(colorWidth * colorHeight * colorBytesPerPixel);
-
-		// Depth[_[擾
-		CComPtr<IDepthFrameSource> depthFrameSource;
-		ERROR_CHECK(kinect->get_DepthFrameSource(&depthFrameSource));
-		ERROR_CHECK(depthFrameSource->OpenReader(&depthFrameReader));
-
-		// Depth摜̃TCY擾
-		CComPtr<IFrameDescription> depthFrameDescription;
-		ERROR_CHECK(depthFrameSource->get_FrameDescription(&depthFrameDescription));
-		ERROR_CHECK(depthFrameDescription->get_Width(&depthWidth));
-		ERROR_CHECK(depthFrameDescription->get_Height(&depthHeight));
-		std::cout << "Depth       : " << depthWidth << std::endl;
-		std::cout << "Depth       : " << depthHeight << std::endl;
-
-		// Depth̍őlAŏl擾
-		UINT16 minDepthReliableDistance;
-		UINT16 maxDepthReliableDistance;
-		ERROR_CHECK(depthFrameSource->get_DepthMinReliableDistance(&minDepthReliableDistance));
-		ERROR_CHECK(depthFrameSource->get_DepthMaxReliableDistance(&maxDepthReliableDistance));
-		std::cout << "Depthŏl       : " << minDepthReliableDistance << std::endl;
-		std::cout << "Depthől       : " << maxDepthReliableDistance << std::endl;
-
-		// Depth̃obt@[쐬
-		depthBuffer.resize(depthWidth * depthHeight);
+	// 処理する範囲を設定する (窓が両方空で Depth値の範囲も無ければ全体に戻す)
+	// 窓は Depth画像か RGB画像のどちらかで指定すればよく、もう一方は位置合わせのパラメータ (無ければ Kinect v2 の代表値) から求める
+	// 以降の取得・変換・位置合わせ・点群は窓の中だけを処理し、結果も窓の大きさになる (範囲外のDepth値は値が無いものとして扱う)
+	// 古い ROI で取得した同期待ちのフレームは捨てる
+	void setCaptureROI(const CaptureROI &requested) {
+		KinectCalibration calibration;
+		if (!source->getCalibration(calibration) || !calibration.isValid()) calibration = defaultKinectCalibration();
+		if (calibration.depthWidth != depthWidth || calibration.depthHeight != depthHeight) calibration = KinectCalibration();
+		roi = resolveCaptureROI(requested, calibration, colorWidth, colorHeight);
+		roi.depthRect = clipCaptureRect(roi.depthRect, depthWidth, depthHeight);
+		mapCache.setCaptureROI(roi);
+		sync.clearPending();
+	}
+
+	// 解決済みの ROI (両方の窓が求まっている)
+	const CaptureROI &captureROI() const { return roi; }
+
+	// RGBDフレームの更新 (タイムスタンプの近いRGBとDepthの組が新しくできたら true)
+	// 各段の時間は KINECT_PROFILE を定義してビルドすると StageProfiler に記録される (取得した区間は次に組にするフレームの番号で記録する)
+	bool updateRGBDFrame() {
+		KINECT_PROFILE_FRAME(frameNumber + 1);
+		KINECT_PROFILE_SCOPE("updateRGBDFrame");
+
+		// RGBフレームを取得する (空いているスロットに書き込み、Depthと組になるまで同期待ちに置く)
+		// ROI の窓の行だけを取得する (記録中は全体を保存するので全ての行)
+		{
+			KINECT_PROFILE_SCOPE("acquire color");
+			BYTE *color = colorBuffer.beginWrite();
+			int rowBegin = recorder.isOpen() ? 0 : roi.colorRect.y;
+			int rowEnd = recorder.isOpen() ? colorHeight : roi.colorRect.y + roi.colorRect.height;
+			if (color != nullptr && source->acquireColorFrameRows(color, colorBuffer.size(), rowBegin, rowEnd)) {
+				colorBuffer.endWrite();
+				sync.pushColor(colorBuffer.view(), source->colorTimestamp);
+			}
+		}
+
+		// Depthフレームを取得する
+		{
+			KINECT_PROFILE_SCOPE("acquire depth");
+			UINT16 *depth = depthBuffer.beginWrite(); // 空いているスロット (利用者が持っているフレームには書き込まない)
+			if (depth != nullptr && source->acquireDepthFrame(depth, depthBuffer.size())) {
+				if (temporalEnabled) { // 書き込み中のスロットなので他の利用者には見えない
+					KINECT_PROFILE_SCOPE("temporal filter");
+					temporalFilter.apply(depth);
+				}
+				depthBuffer.endWrite();
+				sync.pushDepth(depthBuffer.view(), source->depthTimestamp);
+			}
+		}
+
+		// タイムスタンプが一番近いRGBとDepthを組にする (片方だけ新しいフレームでは更新しない)
+		RGBDFrame pair;
+		{
+			KINECT_PROFILE_SCOPE("sync");
+			if (!sync.pop(pair)) return false;
+		}
+		pair.roi = roi;
+		if (spatialEnabled) {
+			KINECT_PROFILE_SCOPE("spatial filter");
+			filterPairDepth(pair);
+		}
+		frameNumber++;
+		pair.number = frameNumber;
+		rgbdFrame = pair;
+		mapCache.invalidate();
+
+		// 記録中ならファイルに書き込む (ディスクが一杯などで書けなければ記録をやめる。書けたフレームは再生できる)
+		if (recorder.isOpen()) {
+			KINECT_PROFILE_SCOPE("record");
+			try {
+				recorder.writeFrame(rgbdFrame.depthTimestamp, depthData(), colorData());
+			} catch (std::exception &ex) {
+				std::cout << "record stopped: " << ex.what() << std::endl;
+				try {
+					recorder.close();
+				} catch (std::exception &) {
+				}
+			}
+		}
+
+		// 配信中なら共有メモリに書き込む (読み込み側は待たない)
+		if (publisher.isOpen()) {
+			KINECT_PROFILE_SCOPE("publish");
+			publisher.publish(rgbdFrame);
+		}
+
+		// 送信中なら送信スレッドに渡す (圧縮と送信は待たない)
+		if (streamer.isOpen()) {
+			KINECT_PROFILE_SCOPE("stream push");
+			streamer.push(rgbdFrame);
+		}
+		return true;
+	}
+
+	// 新しいRGBDフレームの組 ができるまで最大 timeoutMs 待つ (できたら true)
+	// 取得元にフレームが届いた時点で起きて取得するので、ポーリングの空回りや待ち時間による遅延が無い
+	bool waitRGBDFrame(int timeoutMs) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		for (;;) {
+			if (updateRGBDFrame()) return true;
+			auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remain <= 0) return false;
+			KINECT_PROFILE_SCOPE("wait for frame");
+			source->waitForFrame(FrameSource::ColorDepth, (int)remain);
+		}
+	}
+
+	// 最新フレームが届いてから今までの時間 [ms] (取得元のタイムスタンプがこの PC の時計でなければ -1)
+	double frameLatency() const {
+		if (!source->hostClock) return -1;
+		return (currentTimestamp() - (std::max)(rgbdFrame.colorTimestamp, rgbdFrame.depthTimestamp)) / 10000.0;
+	}
+
+	// RGBとDepthを組にする時刻差の上限 [100ns]
+	void setSyncTolerance(INT64 tolerance) { sync.setTolerance(tolerance); }
+
+	// 同期の統計 (組にできた数、相手が無く捨てた数、時刻差)
+	RGBDSyncStats syncStats() const { return sync.stats(); }
+
+	// 時間方向のフィルタを使うか (有効にするときは履歴を捨ててから始める)
+	void setTemporalFilter(bool enable, const DepthTemporalOptions &options = DepthTemporalOptions()) {
+		temporalFilter.setOptions(options);
+		if (enable && !temporalEnabled) temporalFilter.reset();
+		temporalEnabled = enable;
+	}
+
+	bool temporalFilterEnabled() const { return temporalEnabled; }
+
+	// 時間方向のフィルタの処理時間の統計
+	const DepthTemporalFilter &temporalFilterStats() const { return temporalFilter; }
+
+	// 空間方向のフィルタを使うか (options.sigmaColor > 0 ならRGBで導く)
+	void setSpatialFilter(bool enable, const DepthSpatialOptions &options = DepthSpatialOptions()) {
+		spatialFilter.setOptions(options);
+		spatialEnabled = enable;
+	}
+
+	bool spatialFilterEnabled() const { return spatialEnabled; }
+
+	// 空間方向のフィルタの処理時間の統計
+	const DepthSpatialFilter &spatialFilterStats() const { return spatialFilter; }
+
+	// 位置合わせを自前で計算するか (false なら ICoordinateMapper を使う)
+	void setSoftwareRegistration(bool enable) { mapCache.setSoftwareRegistration(enable); }
+
+	// 位置合わせの方法 ("software" / "sdk" / まだ計算していなければ "none")
+	std::string registrationMethod() const {
+		if (mapCache.softwareRegistration()) return "software";
+		return (mapCache.mappedFrames() > 0) ? "sdk" : "none";
+	}
+
+	// DepthをRGBの空間に写すときの設定 (Zバッファ、広げる大きさ、穴埋め、縮小率)
+	void setDepthWarpOptions(const DepthWarpOptions &options) { warpOptions = options; }
+	const DepthWarpOptions &depthWarpOptions() const { return warpOptions; }
+
+	// 最新フレームの点群を取得 (Depthカメラの座標系 [m]、Depth画像と同じ並びの x, y, z の平面、withColor なら各点の BGRA も)
+	// 平面はコピーせずにプールのスロットを指すので、そのまま別のスレッド (PointCloudWriter など) に渡してよい
+	// 取得元に位置合わせパラメータが無ければ Kinect v2 の代表値を使う
+	bool updatePointCloud(PointCloud &cloud, bool withColor = true) {
+		if (rgbdFrame.number < 0) return false;
+		if (!cloudGenerator.isInitialized()) {
+			KinectCalibration calibration;
+			if (!source->getCalibration(calibration) || calibration.depthRays.size() != (size_t)depthWidth * depthHeight * 2) calibration = defaultKinectCalibration();
+			if (calibration.depthWidth != depthWidth || calibration.depthHeight != depthHeight) return false;
+			cloudGenerator.initialize(calibration);
+		}
+		RGBDFrame frame = withColor ? currentFrame() : rgbdFrame;
+		const ColorSpacePoint *colorSpace = frame.colorSpace.empty() ? nullptr : frame.colorSpace.ptr<ColorSpacePoint>(0);
+		if (!cloudGenerator.generate(frame.depth, cloud, frame.color, colorSpace, frame.roi)) return false;
+		cloud.number = frame.number;
+		cloud.timestamp = frame.depthTimestamp;
+		return true;
+	}
+
+	// 点群を間引くときの設定 (範囲、ボクセルの大きさ、色の平均)
+	void setVoxelGridOptions(const VoxelGridOptions &options) { voxelOptions = options; }
+	const VoxelGridOptions &voxelGridOptions() const { return voxelOptions; }
+
+	// 最新フレームの点群を setVoxelGridOptions() の範囲で切り出し、ボクセルごとの重心 (と平均の色) に間引いて取得
+	bool updateVoxelCloud(VoxelCloud &voxels) {
+		PointCloud cloud;
+		if (!updatePointCloud(cloud, voxelOptions.withColor)) return false;
+		if (voxelGrid.capacity() == 0) voxelGrid.reserve((size_t)depthWidth * depthHeight);
+		voxelGrid.filter(cloud, voxelOptions, voxels);
+		return true;
+	}
+
+	// 記録の開始 (RGBは codec の形式で保存する)
+	void startRecording(const std::string &path, RGBDRecordColorCodec codec = RGBDRecordColorJPEG) {
+		recorder.open(path, depthWidth, depthHeight, colorWidth, colorHeight, codec);
+
+		// 再生時に位置合わせできるように、パラメータを記録ファイルと並べて保存する
+		KinectCalibration calibration;
+		if (source->getCalibration(calibration)) saveKinectCalibration(path + ".kcalib", calibration);
 	}
 
-	// RGBDt[̍XV
-	void updateRGBDFrame() {
-
-		// RGBt[擾
-		CComPtr<IColorFrame> colorFrame;
-		auto retRGB = colorFrameReader->AcquireLatestFrame(&colorFrame);
-		if (FAILED(retRGB)) return;
-
-		// f[^擾
-		ERROR_CHECK(colorFrame->CopyConvertedFrameDataToArray(colorBuffer.size(), &colorBuffer[0], colorFormat));
-
-		// Deptht[擾
-		CComPtr<IDepthFrame> depthFrame;
-		auto retD = depthFrameReader->AcquireLatestFrame(&depthFrame);
-		if (retD != S_OK) return;
-
-		// f[^擾
-		ERROR_CHECK(depthFrame->CopyFrameDataToArray(depthBuffer.size(), &depthBuffer[0]));
+	// 記録の終了 (記録したフレーム数を返す。ファイルを書き終えられなければ std::runtime_error を投げる)
+	size_t stopRecording() {
+		size_t frames = recorder.frameCount();
+		recorder.close();
+		return frames;
 	}
 
-	// RGBMat`Ŏ擾
+	bool isRecording() const { return recorder.isOpen(); }
+
+	// 組にしたフレームを共有メモリ name に配信する (slots はリングのスロット数、失敗したら std::runtime_error を投げる)
+	// RGB は取得した形式 (YUY2 か BGRA) のまま、ROI の窓の部分だけを書き込む。受け取り側は SharedFrameReader で開く
+	void startPublishing(const std::string &name, int slots = 4) {
+		publisher.open(name, slots, depthWidth, depthHeight, colorWidth, colorHeight, source->colorFormat);
+	}
+
+	// 配信の終了 (配信したフレーム数を返す)
+	unsigned long long stopPublishing() {
+		unsigned long long frames = publisher.published();
+		publisher.close();
+		return frames;
+	}
+
+	bool isPublishing() const { return publisher.isOpen(); }
+
+	// 配信の統計 (書き込んだフレーム数、書き込みにかかった時間)
+	const SharedFramePublisher &publisherStats() const { return publisher; }
+
+	// 組にしたフレームを TCP の port で待っているクライアント (initialize("tcp://host:port")) に送る (失敗したら std::runtime_error を投げる)
+	// Depth は予測符号化 (options.depthQuantStep > 1 なら誤差付き)、RGB は JPEG で、ROI の窓の部分だけを送る
+	// 回線が遅ければ古いフレームを捨て、クライアントの返事を待っているフレームが options.maxInFlight 個の間は送らない
+	void startStreaming(int port, const RGBDStreamOptions &options = RGBDStreamOptions()) {
+		KinectCalibration calibration;
+		if (!source->getCalibration(calibration)) calibration = KinectCalibration();
+		streamer.open(port, depthWidth, depthHeight, colorWidth, colorHeight, source->minDepthReliableDistance, source->maxDepthReliableDistance,
+			calibration, source->hostClock, options);
+	}
+
+	// 送信の終了
+	void stopStreaming() { streamer.close(); }
+
+	bool isStreaming() const { return streamer.isOpen(); }
+
+	// 送信の統計 (送ったフレーム数、捨てたフレーム数、帯域、圧縮時間、返事が届くまでの時間)
+	RGBDStreamStats streamStats() const { return streamer.stats(); }
+
+	// TCP で受け取っている場合の受信の統計 (それ以外の取得元なら false)
+	bool streamClientStats(RGBDStreamClientStats &stats) const {
+		StreamFrameSource *stream = dynamic_cast<StreamFrameSource *>(source.get());
+		if (stream == nullptr) return false;
+		stats = stream->stats();
+		return true;
+	}
+
+	// RGBをMat形式 (BGRA) で取得 (ROI の窓の部分)
+	// BGRA で取得している場合はコピーせずにフレームを指し (読み取り専用)、img を持っている間はそのフレームのデータは上書きされない
+	// YUY2 で取得している場合は窓の部分だけを img に変換する
 	void updateColorImage(cv::Mat &img) {
-		img = cv::Mat(colorHeight, colorWidth, CV_8UC4, &colorBuffer[0]);
+		updateColorImage(rgbdFrame, img);
+	}
+
+	// frame のRGBを BGRA で取得 (処理スレッドから呼んでよい)
+	void updateColorImage(const RGBDFrame &frame, cv::Mat &img) const {
+		KINECT_PROFILE_SCOPE("updateColorImage");
+		cv::Mat color = frame.color(frame.roi.colorRect);
+		if (color.type() == CV_8UC4) img = color;
+		else yuy2ToBGRA(color, img);
+	}
+
+	// frame のRGBを縦横半分の BGRA で img に書き込む (処理スレッドから呼んでよい)
+	// YUY2 なら縮小と変換を1回で行い、BGRA の全体は作らない
+	void updateColorHalfImage(const RGBDFrame &frame, cv::Mat &img) const {
+		KINECT_PROFILE_SCOPE("updateColorHalfImage");
+		cv::Mat color = frame.color(frame.roi.colorRect);
+		if (color.type() == CV_8UC2) yuy2ToBGRAHalf(color, img);
+		else cv::resize(color, img, cv::Size(color.cols / 2, color.rows / 2));
 	}
 
-	// RGBDepth̋ԂɎʑMat`Ŏ擾
+	// 最新フレームのハンドル (位置合わせの対応表も含む)
+	// コピーしないで済み、持っている間は上書きされないので、そのまま別のスレッドに渡してよい
+	RGBDFrame currentFrame() {
+		KINECT_PROFILE_SCOPE("currentFrame");
+		RGBDFrame frame = rgbdFrame;
+		frame.colorSpace = mapCache.depthToColorSpaceView(depthData(), depthBuffer.size());
+		return frame;
+	}
+
+	// RGBをDepthの空間に写像してMat形式で取得
 	void updateColor2DepthImage(cv::Mat &img) {
-		int i;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		for (i = 0; i < depthWidth * depthHeight; ++i) {
-			// DepthWnx[XɂA̓_RGB̂ǂ̂ƂW擾
-			int colorX = (int)(colorSpace[i].X + 0.5); // ľܓ
-			int colorY = (int)(colorSpace[i].Y + 0.5);
-			if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-			int colorIndex = (colorY * colorWidth) + colorX;
-			int colorImageIndex = i * colorBytesPerPixel;
-			int colorBufferIndex = colorIndex * colorBytesPerPixel;
-			img.data[colorImageIndex + 0] = colorBuffer[colorBufferIndex + 0];
-			img.data[colorImageIndex + 1] = colorBuffer[colorBufferIndex + 1];
-			img.data[colorImageIndex + 2] = colorBuffer[colorBufferIndex + 2];
-		}
+		updateColor2DepthImage(currentFrame(), img);
+	}
+
+	// frame のRGBをDepthの空間に写像してMat形式で取得 (処理スレッドから呼んでよい)
+	void updateColor2DepthImage(const RGBDFrame &frame, cv::Mat &img) const {
+		KINECT_PROFILE_SCOPE("updateColor2DepthImage");
+		// Depth座標系に対応するカラー座標系の一覧
+		if (frame.colorSpace.empty()) return;
+		warpColorToDepth(frame.color, frame.colorSpace.ptr<ColorSpacePoint>(0), depthWidth, depthHeight, img, frame.roi.depthRect);
 	}
 
-	// DepthRGB̋ԂɎʑMat`Ŏ擾 + 256~ɕϊĎ擾 (ŏlAől)
+	// DepthをRGBの空間に写像してMat形式で取得 + 256諧調に変換して取得 (最小値、最大値)
 	void updateDepth2ColorCvtImage(cv::Mat &img, int min, int max) {
-		int i, j, c = -1;
-		float del = (max - min) / 255;
-		UINT16 d;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		img = cv::Scalar(0); // SẴsNZ܂킯ł͂Ȃ̂ŎOɏĂ
-		for (i = 0; i < depthWidth; ++i) {
-			for (j = 0; j < depthHeight; ++j) {
-				c++;
-				// RGBWnx[XɂA̓_Deptĥǂ̂ƂW擾
-				int colorX = (int)(colorSpace[c].X + 0.5); // ľܓ
-				int colorY = (int)(colorSpace[c].Y + 0.5);
-				if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-				d = depthBuffer[c];
-				if (d < min) img.at<uchar>(colorY, colorX) = 0;
-				else if (d >= max) img.at<uchar>(colorY, colorX) = 255;
-				else img.at<uchar>(colorY, colorX) = (uchar)((d - min) / del);
-			}
-		}
+		updateDepth2ColorCvtImage(currentFrame(), img, min, max);
+	}
+
+	// frame のDepthをRGBの空間に写像して256諧調に変換して取得 (処理スレッドから呼んでよい)
+	// img の大きさは ROI のRGBの窓を setDepthWarpOptions() の縮小率で縮めた大きさに合わせて確保し直す
+	void updateDepth2ColorCvtImage(const RGBDFrame &frame, cv::Mat &img, int min, int max) const {
+		KINECT_PROFILE_SCOPE("updateDepth2ColorCvtImage");
+		static thread_local cv::Mat raw; // 写像したDepth (スレッドごと)
+		if (frame.colorSpace.empty()) return;
+		updateDepth2ColorRawImage(frame, raw);
+		depthWindowLUT(min, max).apply(raw, img);
 	}
 
-	// DepthRGB̋ԂɎʑMat`Ŏ擾
+	// DepthをRGBの空間に写像してMat形式で取得
 	void updateDepth2ColorRawImage(cv::Mat &img) {
-		int i, j, c = -1;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		img = cv::Scalar(0); // SẴsNZ܂킯ł͂Ȃ̂ŎOɏĂ
-		for (i = 0; i < depthWidth; ++i) {
-			for (j = 0; j < depthHeight; ++j) {
-				c++;
-				// RGBWnx[XɂA̓_Deptĥǂ̂ƂW擾
-				int colorX = (int)(colorSpace[c].X + 0.5); // ľܓ
-				int colorY = (int)(colorSpace[c].Y + 0.5);
-				if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-				img.at<UINT16>(colorY, colorX) = depthBuffer[c];
-			}
-		}
+		updateDepth2ColorRawImage(currentFrame(), img);
+	}
+
+	// frame のDepthをRGBの空間に写像してMat形式で取得 (処理スレッドから呼んでよい)
+	void updateDepth2ColorRawImage(const RGBDFrame &frame, cv::Mat &img) const {
+		KINECT_PROFILE_SCOPE("updateDepth2ColorRawImage");
+		// Depth座標系に対応するカラー座標系の一覧
+		if (frame.colorSpace.empty()) return;
+		warpDepthToColor(frame.depth.ptr<UINT16>(0), frame.colorSpace.ptr<ColorSpacePoint>(0), depthWidth, depthHeight, colorWidth, colorHeight, warpOptions, img,
+			frame.roi.depthRect, frame.roi.colorRect);
 	}
 
-	// DepthMat`̐f[^Ŏ擾
+	// DepthをMat形式の生データで取得 (img にコピーする。ROI の窓の部分)
 	void updateDepthRawImage(cv::Mat &img) {
-		int i, j, c = 0;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				img.at<UINT16>(j, i) = depthBuffer[c];
-				c++;
-			}
-		}
+		KINECT_PROFILE_SCOPE("updateDepthRawImage");
+		rgbdFrame.depth(rgbdFrame.roi.depthRect).copyTo(img);
+	}
+
+	// DepthをMat形式の生データで取得 (コピーせずにフレームを指す。読み取り専用、ROI の窓の部分)
+	// img を持っている間はそのフレームのデータは上書きされないので、次のフレームを取得した後も使える
+	void updateDepthRawView(cv::Mat &img) {
+		img = rgbdFrame.depth(rgbdFrame.roi.depthRect);
 	}
 
-	// DepthMat`256~ɕϊĎ擾 (ŏlAől)
+	// DepthをMat形式の256諧調に変換して取得 (最小値、最大値)
 	void updateDepthCvtImage(cv::Mat &img, int min, int max) {
-		int i, j, c = 0;
-		float del = (max - min) / 255;
-		UINT16 d;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				d = depthBuffer[c];
-				if (d < min) img.at<uchar>(j, i) = 0;
-				else if (d >= max) img.at<uchar>(j, i) = 255;
-				else img.at<uchar>(j, i) = (uchar)((d - min) / del);
-				c++;
-			}
-		}
+		updateDepthCvtImage(rgbdFrame, img, min, max);
+	}
+
+	// frame のDepthを256諧調に変換して取得 (処理スレッドから呼んでよい)
+	// ROI の窓の部分だけを変換し、範囲外のDepth値は0 (範囲が変わったときだけテーブルを作り直す)
+	void updateDepthCvtImage(const RGBDFrame &frame, cv::Mat &img, int min, int max) const {
+		KINECT_PROFILE_SCOPE("updateDepthCvtImage");
+		depthWindowLUT(min, max, frame.roi.depthMin(), frame.roi.depthMax()).apply(frame.depth(frame.roi.depthRect), img);
 	}
 };
 
-int main() {
+// 処理段の出力 (表示用の画像)
+struct RGBDView {
+	long long number = -1;
+	cv::Mat color;       // RGB画像 (縮小)
+	cv::Mat depth;       // 諧調補正をした距離画像
+	cv::Mat color2Depth; // 距離画像の座標系でのRGB画像
+	cv::Mat depth2Color; // RGB画像の座標系での距離画像 (縮小)
+};
+
+// 処理段 (Depthの変換と位置合わせ、表示用の縮小)
+// 処理スレッドごとに1つ作る。出力はこのスレッドのプールに書き込むので、表示段が持っている間は上書きされない
+class ProcessStage {
+private:
+	const KinectApp &knct;
+	FrameBuffer<BYTE> colorPool;
+	FrameBuffer<BYTE> depthPool;
+	FrameBuffer<BYTE> color2DepthPool;
+	FrameBuffer<BYTE> depth2ColorPool;
+
+public:
+	ProcessStage(const KinectApp &knct) : knct(knct) {
+		colorPool.create(knct.colorHeight / 2, knct.colorWidth / 2, CV_8UC4);
+		depthPool.create(knct.depthHeight, knct.depthWidth, CV_8UC1);
+		color2DepthPool.create(knct.depthHeight, knct.depthWidth, CV_8UC4);
+		depth2ColorPool.create(knct.colorHeight / 2, knct.colorWidth / 2, CV_8UC1);
+	}
+
+	// 1フレーム分の処理 (出力先のスロットが全て使用中なら false)
+	// ROI があれば、各スロットの窓の部分にだけ書き込み、その部分を指すハンドルを返す
+	bool process(const RGBDFrame &frame, RGBDView &view) {
+		KINECT_PROFILE_FRAME(frame.number);
+		KINECT_PROFILE_SCOPE("process");
+		const cv::Rect depthRect = frame.roi.depthRect;
+		const cv::Rect colorRect(frame.roi.colorRect.x / 2, frame.roi.colorRect.y / 2, frame.roi.colorRect.width / 2, frame.roi.colorRect.height / 2);
+		cv::Mat dispColM = colorPool.beginWriteMat();
+		cv::Mat dispDepM = depthPool.beginWriteMat();
+		cv::Mat depRGBspM = color2DepthPool.beginWriteMat();
+		cv::Mat rgbDspM = depth2ColorPool.beginWriteMat();
+		if (dispColM.empty() || dispDepM.empty() || depRGBspM.empty() || rgbDspM.empty()) return false;
+
+		// RGB画像を表示用に縦横半分にする (YUY2 なら縮小しながら変換する)
+		cv::Mat dispCol = dispColM(colorRect);
+		knct.updateColorHalfImage(frame, dispCol);
+
+		// 諧調補正をした距離画像の取得 (最小値-最大値間を256諧調に)
+		cv::Mat dispDep = dispDepM(depthRect);
+		knct.updateDepthCvtImage(frame, dispDep, 600, 3000);
+
+		// 距離画像の座標系でRGB画像を取得
+		cv::Mat depRGBsp = depRGBspM(depthRect);
+		knct.updateColor2DepthImage(frame, depRGBsp);
+
+		// RGB画像の座標系で諧調補正をした距離画像を取得 (最小値-最大値間を256諧調に)
+		// 表示用の半分の解像度で直接写すので縮小は要らない
+		cv::Mat rgbDsp = rgbDspM(colorRect);
+		knct.updateDepth2ColorCvtImage(frame, rgbDsp, 600, 1000);
+
+		colorPool.endWrite();
+		depthPool.endWrite();
+		color2DepthPool.endWrite();
+		depth2ColorPool.endWrite();
+
+		view.number = frame.number;
+		view.color = colorPool.view()(colorRect);
+		view.depth = depthPool.view()(depthRect);
+		view.color2Depth = color2DepthPool.view()(depthRect);
+		view.depth2Color = depth2ColorPool.view()(colorRect);
+		return true;
+	}
+};
+
+void printQueueStats(const char *name, const FrameQueueStats &stats) {
+	std::cout << name << " : capacity " << stats.capacity << ", max depth " << stats.maxDepth
+		<< ", pushed " << stats.pushed << ", popped " << stats.popped << ", dropped " << stats.dropped << std::endl;
+}
+
+// 引数: [記録データのディレクトリ ("sim" なら合成フレーム、"tcp://host:port" なら受信) [再生fps (0ならできるだけ速く)] [処理フレーム数 [処理スレッド数
+//        [点群の形式 (ply / pcd / - なら書き出さない) [共有メモリの名前 (- なら配信しない) [送信するポート (0 なら送信しない) [トレースの書き出し先]]]]]]]]
+// 取得・処理・表示をそれぞれ別のスレッドで行い、段の間は固定長のキューでつなぐ (満杯なら古いフレームを捨てる)
+// 処理フレーム数を指定すると、画像を表示せずにそのフレーム数を処理して処理速度と各段のキューの統計を表示する
+// 表示中は t キーで時間方向、s キーで空間方向 (RGBで導く) のフィルタを切り替える
+// o キーで ROI (Depth画像の中央の半分の窓、0.5m - 2m) を切り替える (取得・変換・位置合わせ・点群が窓の中だけになる)
+// 点群の形式を指定すると最初から点群を cloud_000001.ply のように書き出す (表示中は p キーで開始・終了)
+// 共有メモリの名前を指定すると組にしたフレームをその名前で配信する (kinect_shm_viewer などの別のプロセスで受け取る)
+// ポートを指定すると組にしたフレームを TCP で送る (別の PC で kinect_RGBD tcp://host:port として受け取る)
+// KINECT_PROFILE を定義してビルドすると、各段の時間 (回数、平均、p50、p99、最大) を10秒ごとと終了時に表示する
+// トレースの書き出し先を指定すると各フレームの区間を記録し、終了時に Chrome のトレースの形式 (chrome://tracing や Perfetto で開く) で書き出す
+int main(int argc, char *argv[]) {
 	KinectApp knct;
-	cv::Mat FHDrgbM, depRawM, dispColM, dispDepM;
-	cv::Mat depRGBspM, FHDrgbDspRawM, FHDrgbDspM, rgbDspM;
-
-	try { knct.initialize(); } // Kinect̏
-	catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
-
-	depRawM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_16UC1);
-	dispDepM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_8UC1);
-	depRGBspM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_8UC4);
-	FHDrgbDspRawM = cv::Mat(knct.colorHeight, knct.colorWidth, CV_16UC1);
-	FHDrgbDspM = cv::Mat(knct.colorHeight, knct.colorWidth, CV_8UC1);
-
-	while (1) { // C[v
-		knct.updateRGBDFrame();
-
-
-		// RGB摜̎擾
-		knct.updateColorImage(FHDrgbM);
-		cv::resize(FHDrgbM, dispColM, cv::Size(), 0.5, 0.5); // \pɃTCY
 
-		cv::imshow("color Image", dispColM); // RGB摜̕\
-
-		// 摜̐f[^(2bytef[^)ł̎擾
-		//float min = 600, max = 1000, del = (max - min) / 255;
-		//knct.updateDepthRawImage(depRawM); // f[^̎擾
-		//for (int j = 0; j < knct.depthHeight; j++) {
-		//	for (int i = 0; i < knct.depthWidth; i++) {
-		//		UINT16 d = depRawM.at<UINT16>(j, i);
-		//		if (d < min) dispDepM.at<uchar>(j, i) = 0;
-		//		else if(d >= max) dispDepM.at<uchar>(j, i) = 255;
-		//		else dispDepM.at<uchar>(j, i) = (uchar)((d - min) / del);
-		//	}
-		//}
-
-		// ~␳摜̎擾 (ŏl-őlԂ256~)
-		knct.updateDepthCvtImage(dispDepM, 600, 3000);
-
-		cv::imshow("depth Image", dispDepM); // 摜̕\
-
-		// 摜̍WnRGB摜擾
-		knct.updateColor2DepthImage(depRGBspM);
-
-		cv::imshow("color from depth space", depRGBspM); // 摜WłRGB\
-
-		// RGB摜̍Wn~␳摜̐f[^(2bytef[^)擾
-		//float min = 600, max = 1000, del = (max - min) / 255;
-		//knct.updateDepth2ColorRawImage(FHDrgbDspRawM); // f[^̎擾
-		//for (int j = 0; j < knct.colorHeight; j++) {
-		//	for (int i = 0; i < knct.colorWidth; i++) {
-		//		UINT16 d = FHDrgbDspRawM.at<UINT16>(j, i);
-		//		if (d < min) FHDrgbDspM.at<uchar>(j, i) = 0;
-		//		else if(d >= max) FHDrgbDspM.at<uchar>(j, i) = 255;
-		//		else FHDrgbDspM.at<uchar>(j, i) = (uchar)((d - min) / del);
-		//	}
-		//}
-
-		// RGB摜̍Wn~␳摜擾 (ŏl-őlԂ256~)
-		knct.updateDepth2ColorCvtImage(FHDrgbDspM, 600, 1000);
-
-		cv::resize(FHDrgbDspM, rgbDspM, cv::Size(), 0.5, 0.5); // \pɃTCY
-		cv::imshow("depth from color space", rgbDspM);
-
-		auto key = cv::waitKey(10);
+	const char *replayPath = (argc > 1) ? argv[1] : nullptr;
+	double replayFps = (argc > 2) ? atof(argv[2]) : 30.0;
+	int benchFrames = (argc > 3) ? atoi(argv[3]) : 0;
+	int workers = (argc > 4) ? atoi(argv[4]) : 2;
+	bool display = (benchFrames <= 0);
+	PointCloudFormat cloudFormat = (argc > 5 && std::string(argv[5]) == "pcd") ? PointCloudPCD : PointCloudPLY;
+	bool writeCloud = argc > 5 && std::string(argv[5]) != "-";
+	const char *publishName = (argc > 6 && std::string(argv[6]) != "-") ? argv[6] : nullptr;
+	int streamPort = (argc > 7) ? atoi(argv[7]) : 0;
+	const char *tracePath = (argc > 8) ? argv[8] : nullptr;
+	if (workers < 1) workers = 1;
+	if (tracePath != nullptr) StageProfiler::instance().setTracing(true);
+
+	try { knct.initialize(replayPath, replayFps); } // Kinectの初期化
+	catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+
+	if (publishName != nullptr) { // 共有メモリへの配信
+		try {
+			knct.startPublishing(publishName);
+			std::cout << "publish: " << publishName << std::endl;
+		} catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+	}
+	if (streamPort > 0) { // TCP での送信
+		try {
+			knct.startStreaming(streamPort);
+			std::cout << "stream: port " << streamPort << std::endl;
+		} catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+	}
+
+	// 表示用の距離画像は半分の解像度で写し、画素間隔に合わせて広げて穴を埋める
+	DepthWarpOptions warp;
+	warp.splat = 0;
+	warp.fillHoles = true;
+	warp.downscale = 2;
+	knct.setDepthWarpOptions(warp);
+
+	FrameQueue<RGBDFrame> captured(2); // 取得 → 処理
+	FrameQueue<RGBDView> processed(2); // 処理 → 表示
+	std::atomic<bool> running(true);
+	std::atomic<bool> toggleRecording(false);
+	std::atomic<bool> toggleCloud(writeCloud);
+	std::atomic<bool> toggleTemporal(false);
+	std::atomic<bool> toggleSpatial(false);
+	std::atomic<bool> toggleROI(false);
+	PointCloudWriter cloudWriter; // 点群の書き出し (別のスレッドで書くので取得は止まらない)
+	std::atomic<unsigned long long> processDrops(0); // 出力先が空かずに処理できなかったフレーム
+	double latencySum = 0, latencyMax = 0; // 届いてから取得するまでの時間 [ms] (合成フレームのときだけ測れる、取得スレッドだけが書く)
+	int latencyCount = 0;
+
+	// 取得段 (knct を書き換えるのはこのスレッドだけ)
+	std::thread captureThread([&]() {
+		KINECT_PROFILE_THREAD("capture");
+		while (running) {
+			if (toggleRecording.exchange(false)) { // 記録の開始・終了
+				try {
+					if (knct.isRecording()) {
+						std::cout << "record stop: " << knct.stopRecording() << " frames" << std::endl;
+					} else {
+						knct.startRecording("record.krgbd");
+						std::cout << "record start: record.krgbd" << std::endl;
+					}
+				} catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
+			}
+			if (toggleTemporal.exchange(false)) { // 時間方向のフィルタの切り替え
+				knct.setTemporalFilter(!knct.temporalFilterEnabled());
+				std::cout << "temporal filter: " << (knct.temporalFilterEnabled() ? "on" : "off") << std::endl;
+			}
+			if (toggleSpatial.exchange(false)) { // 空間方向のフィルタの切り替え (RGBの境界も保つ)
+				DepthSpatialOptions spatial;
+				spatial.sigmaColor = 30.0f;
+				knct.setSpatialFilter(!knct.spatialFilterEnabled(), spatial);
+				std::cout << "spatial filter: " << (knct.spatialFilterEnabled() ? "on" : "off") << std::endl;
+			}
+			if (toggleROI.exchange(false)) { // ROI の切り替え
+				CaptureROI roi;
+				if (knct.captureROI().depthRect.area() == knct.depthWidth * knct.depthHeight) {
+					roi.depthRect = cv::Rect(knct.depthWidth / 4, knct.depthHeight / 4, knct.depthWidth / 2, knct.depthHeight / 2);
+					roi.minDepth = 500;
+					roi.maxDepth = 2000;
+				}
+				knct.setCaptureROI(roi);
+				const CaptureROI &resolved = knct.captureROI();
+				std::cout << "roi: depth " << resolved.depthRect << ", color " << resolved.colorRect << std::endl;
+			}
+			if (toggleCloud.exchange(false)) { // 点群の書き出しの開始・終了
+				if (cloudWriter.isOpen()) {
+					std::cout << "point cloud stop: " << cloudWriter.close() << " files" << std::endl;
+				} else {
+					cloudWriter.open("cloud", cloudFormat);
+					std::cout << "point cloud start: cloud_*" << pointCloudExtension(cloudFormat) << std::endl;
+				}
+			}
+			if (!knct.waitRGBDFrame(100)) continue; // フレームが届くまで待つ
+			double latency = knct.frameLatency();
+			if (latency >= 0) {
+				latencySum += latency;
+				latencyMax = (std::max)(latencyMax, latency);
+				latencyCount++;
+			}
+			captured.push(knct.currentFrame());
+			if (cloudWriter.isOpen()) {
+				PointCloud cloud;
+				if (knct.updatePointCloud(cloud)) cloudWriter.push(cloud);
+			}
+		}
+		captured.close();
+	});
+
+	// 処理段
+	std::vector<std::thread> processThreads;
+	for (int n = 0; n < workers; n++) {
+		processThreads.push_back(std::thread([&]() {
+			KINECT_PROFILE_THREAD("process");
+			ProcessStage stage(knct);
+			for (;;) {
+				RGBDFrame frame;
+				if (!captured.pop(frame, 100)) {
+					if (captured.isClosed()) break;
+					continue;
+				}
+				RGBDView view;
+				if (stage.process(frame, view)) processed.push(view);
+				else processDrops++;
+			}
+		}));
+	}
+
+	// 表示段 (メインスレッド)
+	int frames = 0;
+	long long lastNumber = -1;
+	unsigned long long staleFrames = 0; // 処理スレッドの追い越しで後から届いた古いフレーム
+	double startTick = (double)cv::getTickCount();
+	double profileTick = startTick; // 前回に各段の時間を表示した時刻
+	KINECT_PROFILE_THREAD("display");
+	while (1) { // メインループ
+		RGBDView view;
+		if (processed.pop(view, display ? 1 : 100)) {
+			if (view.number <= lastNumber) {
+				staleFrames++;
+			} else {
+				lastNumber = view.number;
+				frames++;
+				if (display) {
+					KINECT_PROFILE_FRAME(view.number);
+					KINECT_PROFILE_SCOPE("imshow");
+					cv::imshow("color Image", view.color); // RGB画像の表示
+					cv::imshow("depth Image", view.depth); // 距離画像の表示
+					cv::imshow("color from depth space", view.color2Depth); // 距離画像座標でのRGB表示
+					cv::imshow("depth from color space", view.depth2Color);
+				}
+			}
+		}
+
+		if (((double)cv::getTickCount() - profileTick) / cv::getTickFrequency() >= 10.0) { // 各段の時間 (前回からの分)
+			profileTick = (double)cv::getTickCount();
+			StageProfiler::instance().printInterval(std::cout);
+		}
+
+		if (!display) { // 表示せずに処理速度を計測
+			if (frames >= benchFrames) break;
+			continue;
+		}
+		int key;
+		{
+			KINECT_PROFILE_SCOPE("waitKey");
+			key = cv::waitKey(1);
+		}
 		if (key == 'q') {
 			break;
 		}
+		if (key == 'r') { // 記録の開始・終了 (記録は取得スレッドで行う)
+			toggleRecording = true;
+		}
+		if (key == 'p') { // 点群の書き出しの開始・終了
+			toggleCloud = true;
+		}
+		if (key == 't') { // 時間方向のフィルタの切り替え
+			toggleTemporal = true;
+		}
+		if (key == 's') { // 空間方向のフィルタの切り替え
+			toggleSpatial = true;
+		}
+		if (key == 'o') { // ROI の切り替え
+			toggleROI = true;
+		}
 	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+
+	running = false;
+	captureThread.join();
+	for (size_t n = 0; n < processThreads.size(); n++) processThreads[n].join();
+	cloudWriter.close();
+
+	std::cout << "frames: " << frames << ", " << sec << " sec, " << frames / sec << " fps" << std::endl;
+	if (latencyCount > 0) std::cout << "latency (arrival -> acquired): mean " << latencySum / latencyCount << " ms, max " << latencyMax << " ms" << std::endl;
+	RGBDSyncStats sync = knct.syncStats();
+	std::cout << "sync: matched " << sync.matched << ", unmatched color " << sync.unmatchedColor << ", unmatched depth " << sync.unmatchedDepth
+		<< ", dropped " << sync.dropped << ", skew mean " << sync.meanSkew / 10000.0 << " ms, max " << sync.maxSkew / 10000.0 << " ms" << std::endl;
+	std::cout << "registration: " << knct.registrationMethod() << std::endl;
+	const DepthTemporalFilter &temporal = knct.temporalFilterStats();
+	if (temporal.frames() > 0) std::cout << "temporal filter: " << temporal.frames() << " frames, mean " << temporal.meanFrameMs() << " ms, max " << temporal.maxFrameMs() << " ms" << std::endl;
+	const DepthSpatialFilter &spatial = knct.spatialFilterStats();
+	if (spatial.frames() > 0) std::cout << "spatial filter: " << spatial.frames() << " frames, mean " << spatial.meanFrameMs() << " ms, max " << spatial.maxFrameMs() << " ms" << std::endl;
+	printQueueStats("capture -> process", captured.stats());
+	printQueueStats("process -> display", processed.stats());
+	std::cout << "process drops: " << processDrops << ", stale frames: " << staleFrames << std::endl;
+	StageProfiler::instance().printTotal(std::cout);
+	if (tracePath != nullptr) {
+		long long events = StageProfiler::instance().writeChromeTrace(tracePath);
+		if (events < 0) std::cout << "trace: failed to write " << tracePath << std::endl;
+		else std::cout << "trace: " << tracePath << " (" << events << " events)" << std::endl;
+	}
+	if (cloudWriter.written() > 0 || cloudWriter.dropped() > 0) {
+		std::cout << "point clouds: written " << cloudWriter.written() << " (" << cloudWriter.bytes() / (1024 * 1024) << " MB), dropped " << cloudWriter.dropped()
+			<< ", failed " << cloudWriter.failed() << std::endl;
+	}
+	const SharedFramePublisher &publisher = knct.publisherStats();
+	if (publisher.published() > 0) {
+		std::cout << "published: " << publisher.published() << " frames, mean " << publisher.meanPublishMs() << " ms, max " << publisher.maxPublishMs()
+			<< " ms, readers " << publisher.readerCount() << std::endl;
+	}
+	knct.stopPublishing();
+	RGBDStreamStats stream = knct.streamStats();
+	knct.stopStreaming();
+	if (stream.sent > 0) {
+		std::cout << "streamed: sent " << stream.sent << ", superseded " << stream.superseded << ", stale " << stream.stale
+			<< ", depth " << stream.depthBytes / (stream.sent * 1024) << " KB/frame, color " << stream.colorBytes / (stream.sent * 1024) << " KB/frame, "
+			<< stream.megabitsPerSecond << " Mbps" << std::endl;
+		std::cout << "stream encode: mean " << stream.meanEncodeMs << " ms, max " << stream.maxEncodeMs << " ms, latency (pushed -> acked): mean "
+			<< stream.meanLatencyMs << " ms, max " << stream.maxLatencyMs << " ms" << std::endl;
+	}
+	RGBDStreamClientStats client;
+	if (knct.streamClientStats(client)) {
+		std::cout << "received: " << client.received << " frames, failed " << client.failed << ", reconnects " << client.reconnects << ", "
+			<< client.megabitsPerSecond << " Mbps, decode mean " << client.meanDecodeMs << " ms, max " << client.maxDecodeMs << " ms" << std::endl;
+		if (client.meanLatencyMs >= 0) std::cout << "stream latency (pushed -> decoded): mean " << client.meanLatencyMs << " ms, max " << client.maxLatencyMs << " ms" << std::endl;
+	}
 	return 0;
 }
-
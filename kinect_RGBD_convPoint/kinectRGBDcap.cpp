@@ -1,32 +1,64 @@
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
-#include <Kinect.h>
-
-#include <atlbase.h>
-
-#define ERROR_CHECK( ret )  \
-    if ( (ret) != S_OK ) {    \
-        std::stringstream ss;	\
-        ss << "failed " #ret " " << std::hex << ret << std::endl;			\
-        throw std::runtime_error( ss.str().c_str() );			\
-    }
+#include "../kinect_common/CoordinateMapCache.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/DepthWarp.h"
+#include "../kinect_common/FrameBuffer.h"
+#include "../kinect_common/FrameSource.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/PointCloud.h"
+#include "../kinect_common/PointCloudWriter.h"
+#include "../kinect_common/RGBDFrame.h"
+#include "../kinect_common/RGBDRecord.h"
+#include "../kinect_common/RGBDSynchronizer.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SimulatedFrameSource.h"
 
 class KinectApp {
 private:
-	// Kinect SDK
-	CComPtr<IKinectSensor> kinect = nullptr;
-	CComPtr<ICoordinateMapper> coordinateMapper = nullptr;
+	// フレームの取得元 (Kinect本体 or 記録データ)
+	std::unique_ptr<FrameSource> source;
 
-	// RGBp̕ϐ
-	CComPtr<IColorFrameReader> colorFrameReader = nullptr;
+	// RGB用の変数
 	unsigned int colorBytesPerPixel;
-	ColorImageFormat colorFormat = ColorImageFormat::ColorImageFormat_Bgra;
-	std::vector<BYTE> colorBuffer;
+	FrameBuffer<BYTE> colorBuffer; // RGBフレームのプール (参照カウントで寿命を管理する)
 
-	// Dp̕ϐ
-	CComPtr<IDepthFrameReader> depthFrameReader = nullptr;
-	std::vector<UINT16> depthBuffer;
+	// D用の変数
+	FrameBuffer<UINT16> depthBuffer; // Depthフレームのプール (参照カウントで寿命を管理する)
+	DepthWindowLUTCache depthLuts; // 256諧調への変換テーブル (範囲ごと)
+
+	// タイムスタンプで組にしたRGB-Dフレーム (変換処理は全てこのフレームを使う)
+	RGBDSynchronizer sync;
+	RGBDFrame rgbdFrame;
+	long long frameNumber = 0; // 組にしたフレームの数
+
+	// Depth座標系→RGB座標系の対応表 (Depthフレームごとに1回だけ計算する)
+	CoordinateMapCache mapCache;
+	DepthWarpOptions warpOptions; // DepthをRGBの空間に写すときの設定
+	cv::Mat depth2ColorRaw;       // 256諧調に変換する前の写像したDepth
+
+	// 点群用 (光線は最初に点群を作るときに取得元のパラメータから用意する)
+	PointCloudGenerator cloudGenerator;
+
+	// 記録用
+	RGBDRecordWriter recorder;
+
+	// 組にしたフレームのデータ
+	const BYTE *colorData() const { return rgbdFrame.color.ptr<BYTE>(0); }
+	const UINT16 *depthData() const { return rgbdFrame.depth.ptr<UINT16>(0); }
+
+	// DepthをRGBの空間に写す (座標変換が使えなければ false)
+	bool warpDepth2Color(cv::Mat &img) {
+		// Depth座標系に対応するカラー座標系の一覧を取得する
+		const ColorSpacePoint *colorSpace = mapCache.depthToColorSpace(depthData(), depthBuffer.size());
+		if (colorSpace == nullptr) return false;
+		warpDepthToColor(depthData(), colorSpace, depthWidth, depthHeight, colorWidth, colorHeight, warpOptions, img);
+		return true;
+	}
 public:
 	int colorWidth;
 	int colorHeight;
@@ -34,196 +66,218 @@ public:
 	int depthWidth;
 	int depthHeight;
 
-	~KinectApp() {
-		// Kinect̓I
-		if (kinect != nullptr) {
-			kinect->Close();
+	// 初期化 (replayPath を指定すると Kinect の代わりに記録データを fps で再生する。"sim" なら合成フレームを fps で届ける)
+	void initialize(const char *replayPath = nullptr, double fps = 30.0) {
+		if (replayPath != nullptr && std::string(replayPath) == "sim") {
+			source.reset(new SimulatedFrameSource(fps));
+		} else if (replayPath != nullptr) {
+			source.reset(new ReplayFrameSource(replayPath, fps));
+		} else {
+#ifdef _WIN32
+			source.reset(new KinectSensorSource());
+#else
+			throw std::runtime_error("Kinect is not available on this platform (specify a recorded data directory)");
+#endif
 		}
-	}
+		source->open(FrameSource::ColorDepth);
 
-	// 
-	void initialize() {
-		// ftHgKinect擾
-		ERROR_CHECK(::GetDefaultKinectSensor(&kinect));
-		ERROR_CHECK(kinect->Open());
-
-		// WϊC^tF[X擾
-		kinect->get_CoordinateMapper(&coordinateMapper);
-
-		// J[[_[擾
-		CComPtr<IColorFrameSource> colorFrameSource;
-		ERROR_CHECK(kinect->get_ColorFrameSource(&colorFrameSource));
-		ERROR_CHECK(colorFrameSource->OpenReader(&colorFrameReader));
-
-		// RGB摜̃TCY擾
-		CComPtr<IFrameDescription> colorFrameDescription;
-		ERROR_CHECK(colorFrameSource->CreateFrameDescription(colorFormat, &colorFrameDescription));
-		ERROR_CHECK(colorFrameDescription->get_Width(&colorWidth));
-		ERROR_CHECK(colorFrameDescription->get_Height(&colorHeight));
-		ERROR_CHECK(colorFrameDescription->get_BytesPerPixel(&colorBytesPerPixel));
-		std::cout << "create  : " << colorWidth << ", " << colorHeight << ", " << colorBytesPerPixel << std::endl;
-
-		// RGBp̃obt@[쐬
-		colorBuffer.resize(colorWidth * colorHeight * colorBytesPerPixel);
-
-		// Depth[_[擾
-		CComPtr<IDepthFrameSource> depthFrameSource;
-		ERROR_CHECK(kinect->get_DepthFrameSource(&depthFrameSource));
-		ERROR_CHECK(depthFrameSource->OpenReader(&depthFrameReader));
-
-		// Depth摜̃TCY擾
-		CComPtr<IFrameDescription> depthFrameDescription;
-		ERROR_CHECK(depthFrameSource->get_FrameDescription(&depthFrameDescription));
-		ERROR_CHECK(depthFrameDescription->get_Width(&depthWidth));
-		ERROR_CHECK(depthFrameDescription->get_Height(&depthHeight));
-		std::cout << "Depth       : " << depthWidth << std::endl;
-		std::cout << "Depth       : " << depthHeight << std::endl;
-
-		// Depth̍őlAŏl擾
-		UINT16 minDepthReliableDistance;
-		UINT16 maxDepthReliableDistance;
-		ERROR_CHECK(depthFrameSource->get_DepthMinReliableDistance(&minDepthReliableDistance));
-		ERROR_CHECK(depthFrameSource->get_DepthMaxReliableDistance(&maxDepthReliableDistance));
-		std::cout << "Depthŏl       : " << minDepthReliableDistance << std::endl;
-		std::cout << "Depthől       : " << maxDepthReliableDistance << std::endl;
-
-		// Depth̃obt@[쐬
-		depthBuffer.resize(depthWidth * depthHeight);
-	}
+		colorWidth = source->colorWidth;
+		colorHeight = source->colorHeight;
+		colorBytesPerPixel = source->colorBytesPerPixel;
+		depthWidth = source->depthWidth;
+		depthHeight = source->depthHeight;
 
-	// RGBDt[̍XV
-	void updateRGBDFrame() {
+		// RGB用のバッファーを作成する
+		colorBuffer.create(colorHeight, colorWidth, CV_8UC4, 4, 12); // 同期待ちの分も含めて多めに
 
-		// RGBt[擾
-		CComPtr<IColorFrame> colorFrame;
-		auto retRGB = colorFrameReader->AcquireLatestFrame(&colorFrame);
-		if (FAILED(retRGB)) return;
+		// Depthのバッファーを作成する
+		depthBuffer.create(depthHeight, depthWidth, CV_16UC1, 4, 12);
+
+		// 最初の組ができるまでは0で埋めたフレームを使う
+		rgbdFrame = RGBDFrame();
+		rgbdFrame.color = colorBuffer.view();
+		rgbdFrame.depth = depthBuffer.view();
+		sync.reset();
 
-		// f[^擾
-		ERROR_CHECK(colorFrame->CopyConvertedFrameDataToArray(colorBuffer.size(), &colorBuffer[0], colorFormat));
+		mapCache.initialize(source.get(), depthWidth, depthHeight, colorWidth, colorHeight);
+	}
 
-		// Deptht[擾
-		CComPtr<IDepthFrame> depthFrame;
-		auto retD = depthFrameReader->AcquireLatestFrame(&depthFrame);
-		if (retD != S_OK) return;
+	// RGBDフレームの更新 (タイムスタンプの近いRGBとDepthの組が新しくできたら true)
+	bool updateRGBDFrame() {
+
+		// RGBフレームを取得する (空いているスロットに書き込み、Depthと組になるまで同期待ちに置く)
+		BYTE *color = colorBuffer.beginWrite();
+		if (color != nullptr && source->acquireColorFrame(color, colorBuffer.size())) {
+			colorBuffer.endWrite();
+			sync.pushColor(colorBuffer.view(), source->colorTimestamp);
+		}
+
+		// Depthフレームを取得する
+		UINT16 *depth = depthBuffer.beginWrite(); // 空いているスロット (利用者が持っているフレームには書き込まない)
+		if (depth != nullptr && source->acquireDepthFrame(depth, depthBuffer.size())) {
+			depthBuffer.endWrite();
+			sync.pushDepth(depthBuffer.view(), source->depthTimestamp);
+		}
+
+		// タイムスタンプが一番近いRGBとDepthを組にする (片方だけ新しいフレームでは更新しない)
+		RGBDFrame pair;
+		if (!sync.pop(pair)) return false;
+		frameNumber++;
+		pair.number = frameNumber;
+		rgbdFrame = pair;
+		mapCache.invalidate();
+
+		// 記録中ならファイルに書き込む (ディスクが一杯などで書けなければ記録をやめる。書けたフレームは再生できる)
+		if (recorder.isOpen()) {
+			try {
+				recorder.writeFrame(rgbdFrame.depthTimestamp, depthData(), colorData());
+			} catch (std::exception &ex) {
+				std::cout << "record stopped: " << ex.what() << std::endl;
+				try {
+					recorder.close();
+				} catch (std::exception &) {
+				}
+			}
+		}
+		return true;
+	}
+
+	// 新しいRGBDフレームの組 ができるまで最大 timeoutMs 待つ (できたら true)
+	// 取得元にフレームが届いた時点で起きて取得するので、ポーリングの空回りや待ち時間による遅延が無い
+	bool waitRGBDFrame(int timeoutMs) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		for (;;) {
+			if (updateRGBDFrame()) return true;
+			auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remain <= 0) return false;
+			source->waitForFrame(FrameSource::ColorDepth, (int)remain);
+		}
+	}
+
+	// 最新フレームが届いてから今までの時間 [ms] (取得元のタイムスタンプがこの PC の時計でなければ -1)
+	double frameLatency() const {
+		if (!source->hostClock) return -1;
+		return (currentTimestamp() - (std::max)(rgbdFrame.colorTimestamp, rgbdFrame.depthTimestamp)) / 10000.0;
+	}
+
+	// RGBとDepthを組にする時刻差の上限 [100ns]
+	void setSyncTolerance(INT64 tolerance) { sync.setTolerance(tolerance); }
+
+	// 同期の統計 (組にできた数、相手が無く捨てた数、時刻差)
+	RGBDSyncStats syncStats() const { return sync.stats(); }
 
-		// f[^擾
-		ERROR_CHECK(depthFrame->CopyFrameDataToArray(depthBuffer.size(), &depthBuffer[0]));
+	// 位置合わせを自前で計算するか (false なら ICoordinateMapper を使う)
+	void setSoftwareRegistration(bool enable) { mapCache.setSoftwareRegistration(enable); }
+
+	// 位置合わせの方法 ("software" / "sdk" / まだ計算していなければ "none")
+	std::string registrationMethod() const {
+		if (mapCache.softwareRegistration()) return "software";
+		return (mapCache.mappedFrames() > 0) ? "sdk" : "none";
+	}
+
+	// DepthをRGBの空間に写すときの設定 (Zバッファ、広げる大きさ、穴埋め、縮小率)
+	void setDepthWarpOptions(const DepthWarpOptions &options) { warpOptions = options; }
+	const DepthWarpOptions &depthWarpOptions() const { return warpOptions; }
+
+	// 最新フレームの点群を取得 (Depthカメラの座標系 [m]、Depth画像と同じ並びの x, y, z の平面、withColor なら各点の BGRA も)
+	// 平面はコピーせずにプールのスロットを指すので、そのまま別のスレッド (PointCloudWriter など) に渡してよい
+	// 取得元に位置合わせパラメータが無ければ Kinect v2 の代表値を使う
+	bool updatePointCloud(PointCloud &cloud, bool withColor = true) {
+		if (rgbdFrame.number < 0) return false;
+		if (!cloudGenerator.isInitialized()) {
+			KinectCalibration calibration;
+			if (!source->getCalibration(calibration) || calibration.depthRays.size() != (size_t)depthWidth * depthHeight * 2) calibration = defaultKinectCalibration();
+			if (calibration.depthWidth != depthWidth || calibration.depthHeight != depthHeight) return false;
+			cloudGenerator.initialize(calibration);
+		}
+		const ColorSpacePoint *colorSpace = withColor ? mapCache.depthToColorSpace(depthData(), depthBuffer.size()) : nullptr;
+		if (!cloudGenerator.generate(rgbdFrame.depth, cloud, rgbdFrame.color, colorSpace)) return false;
+		cloud.number = rgbdFrame.number;
+		cloud.timestamp = rgbdFrame.depthTimestamp;
+		return true;
+	}
+
+	// 記録の開始 (RGBは codec の形式で保存する)
+	void startRecording(const std::string &path, RGBDRecordColorCodec codec = RGBDRecordColorJPEG) {
+		recorder.open(path, depthWidth, depthHeight, colorWidth, colorHeight, codec);
+
+		// 再生時に位置合わせできるように、パラメータを記録ファイルと並べて保存する
+		KinectCalibration calibration;
+		if (source->getCalibration(calibration)) saveKinectCalibration(path + ".kcalib", calibration);
+	}
+
+	// 記録の終了 (記録したフレーム数を返す。ファイルを書き終えられなければ std::runtime_error を投げる)
+	size_t stopRecording() {
+		size_t frames = recorder.frameCount();
+		recorder.close();
+		return frames;
 	}
 
-	// RGBMat`Ŏ擾
+	bool isRecording() const { return recorder.isOpen(); }
+
+	// RGBをMat形式で取得 (コピーせずにフレームを指す。読み取り専用)
+	// img を持っている間はそのフレームのデータは上書きされないので、次のフレームを取得した後も使える
 	void updateColorImage(cv::Mat &img) {
-		img = cv::Mat(colorHeight, colorWidth, CV_8UC4, &colorBuffer[0]);
+		img = rgbdFrame.color;
 	}
 
-	// RGBDepth̋ԂɎʑMat`Ŏ擾
+	// RGBをDepthの空間に写像してMat形式で取得
 	void updateColor2DepthImage(cv::Mat &img) {
-		int i;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		for (i = 0; i < depthWidth * depthHeight; ++i) {
-			// DepthWnx[XɂA̓_RGB̂ǂ̂ƂW擾
-			int colorX = (int)(colorSpace[i].X + 0.5); // ľܓ
-			int colorY = (int)(colorSpace[i].Y + 0.5);
-			if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-			int colorIndex = (colorY * colorWidth) + colorX;
-			int colorImageIndex = i * colorBytesPerPixel;
-			int colorBufferIndex = colorIndex * colorBytesPerPixel;
-			img.data[colorImageIndex + 0] = colorBuffer[colorBufferIndex + 0];
-			img.data[colorImageIndex + 1] = colorBuffer[colorBufferIndex + 1];
-			img.data[colorImageIndex + 2] = colorBuffer[colorBufferIndex + 2];
-		}
+		// Depth座標系に対応するカラー座標系の一覧を取得する
+		const ColorSpacePoint *colorSpace = mapCache.depthToColorSpace(depthData(), depthBuffer.size());
+		if (colorSpace == nullptr) return;
+		warpColorToDepth(rgbdFrame.color, colorSpace, depthWidth, depthHeight, img);
 	}
 
-	// RGBԂ̍WDepth̋ԂɎʑ
+	// RGB空間の座標をDepthの空間に写像 (対応するDepthの画素が無ければ -1)
+	// Depthフレームごとに1回だけ作る逆引き表を使うので、マウス移動のたびに呼んでも軽い
 	void pointColor2DepthSpace(int x, int y, int &u, int &v) {
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<DepthSpacePoint> depthSpacePoints(colorWidth * colorHeight);
-		coordinateMapper->MapColorFrameToDepthSpace(depthBuffer.size(), &depthBuffer[0], depthSpacePoints.size(), &depthSpacePoints[0]);
+		DepthSpacePoint point;
+		u = v = -1;
+		if (!mapCache.colorToDepthSpace((float)x, (float)y, depthData(), depthBuffer.size(), point)) return;
 
-		u = (int)(depthSpacePoints[x + y * colorWidth].X + 0.5); // ľܓ
-		v = (int)(depthSpacePoints[x + y * colorWidth].Y + 0.5); // ľܓ
+		u = (int)(point.X + 0.5); // 四捨五入
+		v = (int)(point.Y + 0.5); // 四捨五入
 	}
 
-	// DepthRGB̋ԂɎʑMat`Ŏ擾 + 256~ɕϊĎ擾 (ŏlAől)
-	void updateDepth2ColorCvtImage(cv::Mat &img, int min, int max) {
-		int i, j, c = -1;
-		float del = (max - min) / 255;
-		UINT16 d;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		img = cv::Scalar(0); // SẴsNZ܂킯ł͂Ȃ̂ŎOɏĂ
-		for (i = 0; i < depthWidth; ++i) {
-			for (j = 0; j < depthHeight; ++j) {
-				c++;
-				// RGBWnx[XɂA̓_Deptĥǂ̂ƂW擾
-				int colorX = (int)(colorSpace[c].X + 0.5); // ľܓ
-				int colorY = (int)(colorSpace[c].Y + 0.5);
-				if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-				d = depthBuffer[c];
-				if (d < min) img.at<uchar>(colorY, colorX) = 0;
-				else if (d >= max) img.at<uchar>(colorY, colorX) = 255;
-				else img.at<uchar>(colorY, colorX) = (uchar)((d - min) / del);
-			}
+	// RGB空間の複数の座標をDepthの空間に写像 (対応するDepthの画素が無い点は (-1, -1))
+	void pointsColor2DepthSpace(const std::vector<cv::Point> &colorPoints, std::vector<cv::Point> &depthPoints) {
+		depthPoints.resize(colorPoints.size());
+		for (size_t k = 0; k < colorPoints.size(); k++) {
+			pointColor2DepthSpace(colorPoints[k].x, colorPoints[k].y, depthPoints[k].x, depthPoints[k].y);
 		}
 	}
 
-	// DepthRGB̋ԂɎʑMat`Ŏ擾
+	// DepthをRGBの空間に写像してMat形式で取得 + 256諧調に変換して取得 (最小値、最大値)
+	// img の大きさは setDepthWarpOptions() の縮小率に合わせて確保し直す
+	void updateDepth2ColorCvtImage(cv::Mat &img, int min, int max) {
+		if (!warpDepth2Color(depth2ColorRaw)) return;
+		depthLuts.get(min, max).apply(depth2ColorRaw, img);
+	}
+
+	// DepthをRGBの空間に写像してMat形式で取得
 	void updateDepth2ColorRawImage(cv::Mat &img) {
-		int i, j, c = -1;
-		// DepthWnɑΉJ[Wn̈ꗗ擾
-		std::vector<ColorSpacePoint> colorSpace(depthWidth * depthHeight);
-		coordinateMapper->MapDepthFrameToColorSpace(depthBuffer.size(), &depthBuffer[0], colorSpace.size(), &colorSpace[0]);
-
-		img = cv::Scalar(0); // SẴsNZ܂킯ł͂Ȃ̂ŎOɏĂ
-		for (i = 0; i < depthWidth; ++i) {
-			for (j = 0; j < depthHeight; ++j) {
-				c++;
-				// RGBWnx[XɂA̓_Deptĥǂ̂ƂW擾
-				int colorX = (int)(colorSpace[c].X + 0.5); // ľܓ
-				int colorY = (int)(colorSpace[c].Y + 0.5);
-				if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
-
-				img.at<UINT16>(colorY, colorX) = depthBuffer[c];
-			}
-		}
+		warpDepth2Color(img);
 	}
 
-	// DepthMat`̐f[^Ŏ擾
+	// DepthをMat形式の生データで取得 (img にコピーする)
 	void updateDepthRawImage(cv::Mat &img) {
-		int i, j, c = 0;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				img.at<UINT16>(j, i) = depthBuffer[c];
-				c++;
-			}
-		}
+		rgbdFrame.depth.copyTo(img);
+	}
+
+	// DepthをMat形式の生データで取得 (コピーせずにフレームを指す。読み取り専用)
+	// img を持っている間はそのフレームのデータは上書きされないので、次のフレームを取得した後も使える
+	void updateDepthRawView(cv::Mat &img) {
+		img = rgbdFrame.depth;
 	}
 
-	// DepthMat`256~ɕϊĎ擾 (ŏlAől)
+	// DepthをMat形式の256諧調に変換して取得 (最小値、最大値)
 	void updateDepthCvtImage(cv::Mat &img, int min, int max) {
-		int i, j, c = 0;
-		float del = (max - min) / 255;
-		UINT16 d;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				d = depthBuffer[c];
-				if (d < min) img.at<uchar>(j, i) = 0;
-				else if (d >= max) img.at<uchar>(j, i) = 255;
-				else img.at<uchar>(j, i) = (uchar)((d - min) / del);
-				c++;
-			}
-		}
+		depthLuts.get(min, max).apply(rgbdFrame.depth, img); // 初めての範囲のときだけテーブルを作る
 	}
 };
 
-// }EX֘Ȁ
+// マウス関連の処理
 int mouseX, mouseY, mouseW, mouseH, btnFlag;
 cv::Mat dispDepColM;
 void onMouse(int event, int x, int y, int flags, void*) {
@@ -238,13 +292,21 @@ void onMouse(int event, int x, int y, int flags, void*) {
 	}
 }
 
-int main() {
+// 引数: [記録データのディレクトリ ("sim" なら合成フレーム) [再生fps (0ならできるだけ速く)] [処理フレーム数]]
+// 処理フレーム数を指定すると、画像を表示せずにそのフレーム数を処理して処理速度を表示する
+// クリックした点のカメラ座標を距離画像に表示する。p キーで点群の cloud_000001.ply のような書き出しを開始・終了する
+int main(int argc, char *argv[]) {
 	KinectApp knct;
 	cv::Mat FHDrgbM, depRawM, dispColM, dispDepM;
 	cv::Mat depRGBspM, FHDrgbDspRawM, FHDrgbDspM, rgbDspM;
 
-	try { knct.initialize(); } // Kinect̏
-	catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
+	const char *replayPath = (argc > 1) ? argv[1] : nullptr;
+	double replayFps = (argc > 2) ? atof(argv[2]) : 30.0;
+	int benchFrames = (argc > 3) ? atoi(argv[3]) : 0;
+	bool display = (benchFrames <= 0);
+
+	try { knct.initialize(replayPath, replayFps); } // Kinectの初期化
+	catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
 
 	depRawM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_16UC1);
 	dispDepM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_8UC1);
@@ -254,27 +316,43 @@ int main() {
 
 	float resizeScale = 0.5;
 	int convX, convY;
+	PointCloud cloud;
+	PointCloudWriter cloudWriter; // 点群の書き出し (別のスレッドで書くので取得は止まらない)
 	mouseW = knct.colorWidth * resizeScale;
 	mouseH = knct.colorHeight * resizeScale;
 	btnFlag = -1;
 
-	cv::namedWindow("color Image", CV_WINDOW_AUTOSIZE | CV_WINDOW_KEEPRATIO | CV_GUI_NORMAL);
-	// }EXCxgɑ΂R[obN֐o^
-	cv::setMouseCallback("color Image", onMouse, 0);
-
-	while (1) { // C[v
-		knct.updateRGBDFrame();
-
-
-		// RGB摜̎擾
+	if (display) cv::namedWindow("color Image", CV_WINDOW_AUTOSIZE | CV_WINDOW_KEEPRATIO | CV_GUI_NORMAL);
+	// マウスイベントに対するコールバック関数を登録
+	if (display) cv::setMouseCallback("color Image", onMouse, 0);
+
+	int frames = 0;
+	double latencySum = 0, latencyMax = 0; // 届いてから取得するまでの時間 [ms] (合成フレームのときだけ測れる)
+	int latencyCount = 0;
+	double startTick = (double)cv::getTickCount();
+	while (1) { // メインループ
+		// フレームが届くまで待つ (表示中はウィンドウの処理のため最大30ms)
+		if (knct.waitRGBDFrame(display ? 30 : 1000)) {
+			frames++;
+			if (cloudWriter.isOpen() && knct.updatePointCloud(cloud)) cloudWriter.push(cloud);
+			double latency = knct.frameLatency();
+			if (latency >= 0) {
+				latencySum += latency;
+				latencyMax = (std::max)(latencyMax, latency);
+				latencyCount++;
+			}
+		}
+
+
+		// RGB画像の取得
 		knct.updateColorImage(FHDrgbM);
-		cv::resize(FHDrgbM, dispColM, cv::Size(), resizeScale, resizeScale); // \pɃTCY
+		cv::resize(FHDrgbM, dispColM, cv::Size(), resizeScale, resizeScale); // 表示用にリサイズ
 
-		cv::imshow("color Image", dispColM); // RGB摜̕\
+		if (display) cv::imshow("color Image", dispColM); // RGB画像の表示
 
-		// 摜̐f[^(2bytef[^)ł̎擾
+		// 距離画像の生データ(2byteデータ)での取得
 		//float min = 600, max = 1000, del = (max - min) / 255;
-		//knct.updateDepthRawImage(depRawM); // f[^̎擾
+		//knct.updateDepthRawImage(depRawM); // データの取得
 		//for (int j = 0; j < knct.depthHeight; j++) {
 		//	for (int i = 0; i < knct.depthWidth; i++) {
 		//		UINT16 d = depRawM.at<UINT16>(j, i);
@@ -284,7 +362,7 @@ int main() {
 		//	}
 		//}
 
-		// ~␳摜̎擾 (ŏl-őlԂ256~)
+		// 諧調補正をした距離画像の取得 (最小値-最大値間を256諧調に)
 		knct.updateDepthCvtImage(dispDepM, 600, 3000);
 
 		if (btnFlag == 1) {
@@ -292,16 +370,55 @@ int main() {
 			knct.pointColor2DepthSpace(mouseX * 2, mouseY * 2, convX, convY);
 			cv::circle(dispDepColM, cv::Point(convX, convY), 3, cv::Scalar(0, 0, 255), 1, CV_AA);
 
-			cv::imshow("depth Image", dispDepColM); // 摜̕\
+			// クリックした点のカメラ座標 [m] (点群の同じ位置の点)
+			if (convX >= 0 && knct.updatePointCloud(cloud, false)) {
+				float z = cloud.z.at<float>(convY, convX);
+				if (!std::isnan(z)) {
+					char text[64];
+					snprintf(text, sizeof(text), "(%.3f, %.3f, %.3f) m", cloud.x.at<float>(convY, convX), cloud.y.at<float>(convY, convX), z);
+					cv::putText(dispDepColM, text, cv::Point(5, 20), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 1, CV_AA);
+				}
+			}
+
+			if (display) cv::imshow("depth Image", dispDepColM); // 距離画像の表示
 		} else {
-			cv::imshow("depth Image", dispDepM); // 摜̕\
+			if (display) cv::imshow("depth Image", dispDepM); // 距離画像の表示
 		}
 
-		auto key = cv::waitKey(10);
+		if (!display) { // 表示せずに処理速度を計測
+			if (frames >= benchFrames) break;
+			continue;
+		}
+		auto key = cv::waitKey(1);
 		if (key == 'q') {
 			break;
 		}
+		if (key == 'r') { // 記録の開始・終了
+			try {
+				if (knct.isRecording()) {
+					std::cout << "record stop: " << knct.stopRecording() << " frames" << std::endl;
+				} else {
+					knct.startRecording("record.krgbd");
+					std::cout << "record start: record.krgbd" << std::endl;
+				}
+			} catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
+		}
+		if (key == 'p') { // 点群の書き出しの開始・終了
+			if (cloudWriter.isOpen()) {
+				std::cout << "point cloud stop: " << cloudWriter.close() << " files, dropped " << cloudWriter.dropped() << std::endl;
+			} else {
+				cloudWriter.open("cloud");
+				std::cout << "point cloud start: cloud_*.ply" << std::endl;
+			}
+		}
 	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+	std::cout << "frames: " << frames << ", " << sec << " sec, " << frames / sec << " fps" << std::endl;
+	if (latencyCount > 0) std::cout << "latency (arrival -> acquired): mean " << latencySum / latencyCount << " ms, max " << latencyMax << " ms" << std::endl;
+	RGBDSyncStats sync = knct.syncStats();
+	std::cout << "sync: matched " << sync.matched << ", unmatched color " << sync.unmatchedColor << ", unmatched depth " << sync.unmatchedDepth
+		<< ", dropped " << sync.dropped << ", skew mean " << sync.meanSkew / 10000.0 << " ms, max " << sync.maxSkew / 10000.0 << " ms" << std::endl;
+	std::cout << "registration: " << knct.registrationMethod() << std::endl;
 	return 0;
 }
 
@@ -0,0 +1,1806 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "../kinect_common/CaptureROI.h"
+#include "../kinect_common/ColorConvert.h"
+#include "../kinect_common/CoordinateMapCache.h"
+#include "../kinect_common/DepthCodec.h"
+#include "../kinect_common/DepthBackground.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/DepthRegistration.h"
+#include "../kinect_common/DepthSpatialFilter.h"
+#include "../kinect_common/DepthTemporalFilter.h"
+#include "../kinect_common/DepthWarp.h"
+#include "../kinect_common/FrameBuffer.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/KinectTypes.h"
+#include "../kinect_common/MultiSourceCapture.h"
+#include "../kinect_common/PointCloud.h"
+#include "../kinect_common/PointCloudWriter.h"
+#include "../kinect_common/RGBDStream.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SharedFrameRing.h"
+#include "../kinect_common/SimulatedFrameSource.h"
+#include "../kinect_common/StageProfiler.h"
+#include "../kinect_common/StreamFrameSource.h"
+#include "../kinect_common/VoxelGrid.h"
+
+// KinectApp の変換処理のベンチマーク
+// Kinect が無くても動くように、合成したフレームで計測する
+// Linux では次のようにビルドできる
+//   g++ -O2 -std=c++11 kinectBench.cpp -o kinectBench $(pkg-config --cflags --libs opencv4)
+
+// 確保の回数 (operator new と cv::Mat のデータ)
+// 計測中は他のスレッドの確保も数えるので、取得元や送受信のスレッドが動いている計測では参考値
+std::atomic<unsigned long long> heapAllocations(0);
+std::atomic<unsigned long long> matAllocations(0);
+
+inline void *countedAlloc(size_t size) {
+	heapAllocations++;
+	void *p = malloc(size ? size : 1);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+inline void *countedAllocNothrow(size_t size) noexcept {
+	heapAllocations++;
+	return malloc(size ? size : 1);
+}
+
+inline void countedFree(void *p) noexcept { free(p); }
+
+// 全ての形を置き換える (sized / nothrow を既定のままにすると malloc した領域を標準の解放に渡してしまう)
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return countedAllocNothrow(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return countedAllocNothrow(size); }
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, size_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { countedFree(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { countedFree(p); }
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+// cv::Mat のデータの確保を数える (確保と解放は OpenCV の標準のものに任せる)
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+	cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, MatAccessFlag flags, cv::UMatUsageFlags usageFlags) const {
+		if (data == nullptr) matAllocations++;
+		return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+	}
+
+	bool allocate(cv::UMatData *data, MatAccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const {
+		return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+	}
+
+	void deallocate(cv::UMatData *data) const {
+		cv::Mat::getStdAllocator()->deallocate(data);
+	}
+};
+
+// 計測結果 (CSV に書き出して、版の間で比べる)
+struct BenchResult {
+	std::string name;
+	std::string input;  // 入力のフレーム ("synthetic" / 記録データのパス)
+	double ms;          // 1回あたりの処理時間 [ms]
+	size_t pixels;      // 1回で処理する画素の数
+	double heapAllocs;  // 1回あたりの operator new の回数
+	double matAllocs;   // 1回あたりの cv::Mat のデータの確保の回数
+};
+
+std::vector<BenchResult> benchResults;
+std::string benchInput = "synthetic"; // 以降の printResult() で記録する入力
+double measuredHeapAllocs = 0, measuredMatAllocs = 0; // 直前の measure() の1回あたりの確保の回数
+
+// 1回あたりの処理時間 [ms] (iterations 回の平均、最初の1回は除く)
+// 最初の1回の後の確保の回数も数える (毎フレーム確保し直している処理が分かる)
+double measure(std::function<void()> func, int iterations) {
+	func();
+	unsigned long long heap = heapAllocations, mat = matAllocations;
+	double start = (double)cv::getTickCount();
+	for (int n = 0; n < iterations; n++) func();
+	double ms = ((double)cv::getTickCount() - start) / cv::getTickFrequency() * 1000.0 / iterations;
+	measuredHeapAllocs = (double)(heapAllocations - heap) / iterations;
+	measuredMatAllocs = (double)(matAllocations - mat) / iterations;
+	return ms;
+}
+
+// 直前の measure() の結果として表示し、benchResults に記録する
+void printResult(const std::string &name, double ms, size_t pixels) {
+	std::cout << name << " : " << ms << " ms/frame, " << ms * 1e6 / pixels << " ns/pixel, " << 1000.0 / ms << " fps, "
+		<< measuredHeapAllocs + measuredMatAllocs << " allocs/frame (Mat " << measuredMatAllocs << ")" << std::endl;
+	BenchResult result = { name, benchInput, ms, pixels, measuredHeapAllocs, measuredMatAllocs };
+	benchResults.push_back(result);
+}
+
+// CSV の1つの欄 (引用符で囲む)
+std::string csvField(const std::string &text) {
+	std::string field = "\"";
+	for (size_t i = 0; i < text.size(); i++) {
+		if (text[i] == '"') field += '"';
+		field += text[i];
+	}
+	return field + "\"";
+}
+
+// 計測結果を CSV に書き出す (1行に1つの計測。名前と入力の組で版の間の結果を対応させる)
+bool writeResultsCSV(const char *path) {
+	std::ofstream out(path);
+	if (!out) return false;
+	out << "name,input,ms_per_frame,ns_per_pixel,fps,heap_allocs_per_frame,mat_allocs_per_frame" << std::endl;
+	for (size_t n = 0; n < benchResults.size(); n++) {
+		const BenchResult &r = benchResults[n];
+		char values[160];
+		snprintf(values, sizeof(values), "%.6f,%.4f,%.2f,%.2f,%.2f", r.ms, r.ms * 1e6 / r.pixels, 1000.0 / r.ms, r.heapAllocs, r.matAllocs);
+		out << csvField(r.name) << "," << csvField(r.input) << "," << values << std::endl;
+	}
+	return (bool)out;
+}
+
+// 合成したDepthフレーム (奥の壁と手前の物体、ノイズ、無効画素を含む)
+std::vector<UINT16> makeDepthFrame(int width, int height) {
+	std::vector<UINT16> depth(width * height);
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> noise(-8, 8);
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			int d = 2500 + i + noise(rng);
+			int dx = i - width / 2, dy = j - height / 2;
+			if (dx * dx + dy * dy < 100 * 100) d = 900 + (dx * dx + dy * dy) / 50 + noise(rng); // 手前の物体
+			if (i < 10 || (rng() % 50) == 0) d = 0; // 無効画素
+			depth[j * width + i] = (UINT16)d;
+		}
+	}
+	return depth;
+}
+
+// 従来の updateDepthCvtImage (比較用)
+void depthCvtLegacy(const UINT16 *depthBuffer, int depthWidth, int depthHeight, cv::Mat &img, int min, int max) {
+	int i, j, c = 0;
+	float del = (max - min) / 255;
+	UINT16 d;
+	for (j = 0; j < depthHeight; j++) {
+		for (i = 0; i < depthWidth; i++) {
+			d = depthBuffer[c];
+			if (d < min) img.at<uchar>(j, i) = 0;
+			else if (d >= max) img.at<uchar>(j, i) = 255;
+			else img.at<uchar>(j, i) = (uchar)((d - min) / del);
+			c++;
+		}
+	}
+}
+
+// Depth → 256諧調の変換
+void benchDepthCvt(int iterations) {
+	std::vector<UINT16> depth = makeDepthFrame(kinectDepthWidth, kinectDepthHeight);
+	cv::Mat depthM(kinectDepthHeight, kinectDepthWidth, CV_16UC1, &depth[0]);
+	cv::Mat dispM(kinectDepthHeight, kinectDepthWidth, CV_8UC1);
+	size_t pixels = depth.size();
+
+	double legacy = measure([&]() { depthCvtLegacy(&depth[0], kinectDepthWidth, kinectDepthHeight, dispM, 600, 3000); }, iterations);
+	printResult("depthCvt legacy loop", legacy, pixels);
+
+	DepthWindowLUT lut;
+	double table = measure([&]() { lut.set(600, 3000); lut.apply(depthM, dispM); }, iterations);
+	printResult("depthCvt LUT", table, pixels);
+
+	// 毎フレーム範囲を変えてテーブルを作り直す場合
+	int frame = 0;
+	double rebuild = measure([&]() { lut.set(600 + (frame++ & 1), 3000); lut.apply(depthM, dispM); }, iterations);
+	printResult("depthCvt LUT (rebuild every frame)", rebuild, pixels);
+
+	// kinect_RGBD のように1フレームで2つの範囲を交互に使う場合 (範囲ごとのテーブルを使い回し、作り直さないこと)
+	depthWindowLUT(600, 3000);
+	depthWindowLUT(600, 1000);
+	unsigned long long rebuilds = depthWindowLUTCache().rebuilds();
+	double alternate = measure([&]() {
+		depthWindowLUT(600, 3000).apply(depthM, dispM);
+		depthWindowLUT(600, 1000).apply(depthM, dispM);
+	}, iterations);
+	printResult("depthCvt cached LUT (2 ranges per frame)", alternate, pixels * 2);
+	rebuilds = depthWindowLUTCache().rebuilds() - rebuilds;
+	std::cout << "depthCvt cached LUT rebuilds while alternating : " << rebuilds << ((rebuilds == 0) ? "" : " (NG)") << std::endl;
+
+	std::cout << "depthCvt speedup : " << legacy / table << "x" << std::endl;
+}
+
+// Depthの生データの受け渡し (画素ごとのコピー、一括コピー、コピーしない参照)
+void benchDepthRaw(int iterations) {
+	std::vector<UINT16> depth = makeDepthFrame(kinectDepthWidth, kinectDepthHeight);
+	FrameBuffer<UINT16> buffer;
+	buffer.create(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	memcpy(buffer.beginWrite(), &depth[0], depth.size() * sizeof(UINT16));
+	buffer.endWrite();
+	cv::Mat rawM(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	size_t pixels = depth.size();
+
+	double legacy = measure([&]() {
+		int c = 0;
+		for (int j = 0; j < kinectDepthHeight; j++) {
+			for (int i = 0; i < kinectDepthWidth; i++) {
+				rawM.at<UINT16>(j, i) = buffer[c];
+				c++;
+			}
+		}
+	}, iterations);
+	printResult("depthRaw per-pixel copy", legacy, pixels);
+
+	double copy = measure([&]() { buffer.copyTo(rawM); }, iterations);
+	printResult("depthRaw bulk copy", copy, pixels);
+
+	cv::Mat viewM;
+	double view = measure([&]() { viewM = buffer.view(); }, iterations);
+	printResult("depthRaw view", view, pixels);
+}
+
+// 2つの対応表の差の最大 [RGB画素] (片方だけ無効な画素は invalid に数える)
+double maxMapError(const std::vector<ColorSpacePoint> &a, const std::vector<ColorSpacePoint> &b, size_t &invalid) {
+	double maxError = 0;
+	invalid = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		bool va = std::isfinite(a[i].X), vb = std::isfinite(b[i].X);
+		if (va != vb) {
+			invalid++;
+			continue;
+		}
+		if (!va) continue;
+		double dx = a[i].X - b[i].X, dy = a[i].Y - b[i].Y;
+		maxError = (std::max)(maxError, std::sqrt(dx * dx + dy * dy));
+	}
+	return maxError;
+}
+
+// 従来の1画素ずつの計算 (倍精度、比較用)
+void registrationReference(const KinectCalibration &c, const UINT16 *depth, ColorSpacePoint *points) {
+	for (int i = 0; i < c.depthWidth * c.depthHeight; i++) {
+		double z = depth[i] * 0.001, u, v;
+		if (depth[i] == 0 || !projectColorPoint(c, c.depthRays[i * 2] * z, c.depthRays[i * 2 + 1] * z, z, u, v)) {
+			points[i].X = points[i].Y = -std::numeric_limits<float>::infinity();
+			continue;
+		}
+		points[i].X = (float)u;
+		points[i].Y = (float)v;
+	}
+}
+
+// Depth → RGB座標の位置合わせ (倍精度の1画素ずつの計算、DepthRegistration の1スレッド / 複数スレッド、Kinect があれば ICoordinateMapper)
+void benchRegistration(int iterations) {
+	KinectCalibration calibration = defaultKinectCalibration();
+#ifdef _WIN32
+	// Kinect が繋がっていれば本体のパラメータと座標変換で比べる
+	std::unique_ptr<KinectSensorSource> sensor;
+	try {
+		sensor.reset(new KinectSensorSource());
+		sensor->open(FrameSource::Depth);
+		std::vector<UINT16> frame(sensor->depthBufferSize());
+		bool ok = false;
+		for (int n = 0; n < 100 && !ok; n++) {
+			sensor->waitForFrame(FrameSource::Depth, 100);
+			ok = sensor->acquireDepthFrame(&frame[0], frame.size()) && sensor->getCalibration(calibration);
+		}
+		if (!ok) sensor.reset();
+	} catch (std::exception &) {
+		sensor.reset();
+	}
+	if (!sensor) calibration = defaultKinectCalibration();
+#endif
+	std::vector<UINT16> depth = makeDepthFrame(calibration.depthWidth, calibration.depthHeight);
+	size_t pixels = depth.size();
+	std::vector<ColorSpacePoint> reference(pixels), points(pixels);
+
+	// 代表値の射影にレンズの歪みを加えて作った対応から、射影行列と歪みを当てはめ直せるか
+	// (当てはめに使っていない点で測る。射影行列だけでは歪みを表せないので誤差が残る)
+	KinectCalibration distorted = calibration;
+	const double lens[5] = { 0.04, -0.09, 0.0012, -0.0008, 0.05 };
+	memcpy(distorted.colorDistortion, lens, sizeof(lens));
+	{
+		std::vector<CameraSpacePoint> cameraPoints[2];
+		std::vector<ColorSpacePoint> colorPoints[2];
+		for (size_t i = 0; i < pixels; i += 97) {
+			for (float z = 0.5f; z <= 4.5f; z += 0.5f) {
+				int set = (i / 97 + (int)(z * 2)) % 2;
+				CameraSpacePoint p = { distorted.depthRays[i * 2] * z, distorted.depthRays[i * 2 + 1] * z, z };
+				double u, v;
+				projectColorPoint(distorted, p.X, p.Y, p.Z, u, v);
+				ColorSpacePoint q = { (float)u, (float)v };
+				cameraPoints[set].push_back(p);
+				colorPoints[set].push_back(q);
+			}
+		}
+		double fitted[12], fittedLens[5];
+		fitColorProjection(cameraPoints[0], colorPoints[0], fitted);
+		double pinhole = colorProjectionError(cameraPoints[1], colorPoints[1], fitted, nullptr);
+		fitColorProjection(cameraPoints[0], colorPoints[0], fitted, fittedLens);
+		double withLens = colorProjectionError(cameraPoints[1], colorPoints[1], fitted, fittedLens);
+		std::cout << "registration projection fit error : " << pinhole << " px (projection only), " << withLens << " px (with lens distortion)" << std::endl;
+	}
+
+	double legacy = measure([&]() { registrationReference(calibration, &depth[0], &reference[0]); }, iterations);
+	printResult("registration per-pixel double", legacy, pixels);
+
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	int threads = cv::getNumThreads();
+	cv::setNumThreads(1);
+	double single = measure([&]() { registration.depthToColorSpace(&depth[0], &points[0]); }, iterations);
+	cv::setNumThreads(threads);
+	printResult("registration engine 1 thread", single, pixels);
+	double parallel = measure([&]() { registration.depthToColorSpace(&depth[0], &points[0]); }, iterations);
+	printResult("registration engine parallel", parallel, pixels);
+
+	size_t invalid;
+	double error = maxMapError(reference, points, invalid);
+	std::cout << "registration engine vs per-pixel : max " << error << " px, invalid mismatch " << invalid << std::endl;
+
+	// レンズの歪みがある場合
+	DepthRegistration distortedRegistration;
+	distortedRegistration.initialize(distorted);
+	std::vector<ColorSpacePoint> distortedReference(pixels);
+	registrationReference(distorted, &depth[0], &distortedReference[0]);
+	double lensParallel = measure([&]() { distortedRegistration.depthToColorSpace(&depth[0], &points[0]); }, iterations);
+	printResult("registration engine parallel (lens distortion)", lensParallel, pixels);
+	double lensError = maxMapError(distortedReference, points, invalid);
+	std::cout << "registration engine vs per-pixel (lens distortion) : max " << lensError << " px, invalid mismatch " << invalid << std::endl;
+	registration.depthToColorSpace(&depth[0], &points[0]); // ICoordinateMapper と比べる対応表に戻す
+	std::cout << "registration speedup : " << legacy / single << "x (1 thread), " << legacy / parallel << "x (" << cv::getNumberOfCPUs() << " cpus)" << std::endl;
+
+#ifdef _WIN32
+	if (sensor) {
+		std::vector<ColorSpacePoint> sdk(pixels);
+		double mapper = measure([&]() { sensor->mapDepthFrameToColorSpace(&depth[0], pixels, &sdk[0], pixels); }, iterations);
+		printResult("registration ICoordinateMapper", mapper, pixels);
+		error = maxMapError(sdk, points, invalid);
+		std::cout << "registration engine vs ICoordinateMapper : max " << error << " px (fit " << calibration.fitError << " px), invalid mismatch " << invalid << std::endl;
+		std::cout << "registration speedup vs ICoordinateMapper : " << mapper / parallel << "x" << std::endl;
+	}
+#endif
+}
+
+// 従来の updateDepth2ColorRawImage (比較用、後から書いた画素が残る)
+void depth2ColorLegacy(const UINT16 *depth, const ColorSpacePoint *colorSpace, int depthWidth, int depthHeight, int colorWidth, int colorHeight, cv::Mat &img) {
+	int i, j, c = -1;
+	img = cv::Scalar(0);
+	for (i = 0; i < depthWidth; ++i) {
+		for (j = 0; j < depthHeight; ++j) {
+			c++;
+			int colorX = (int)(colorSpace[c].X + 0.5);
+			int colorY = (int)(colorSpace[c].Y + 0.5);
+			if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
+			img.at<UINT16>(colorY, colorX) = depth[c];
+		}
+	}
+}
+
+bool sameImage(const cv::Mat &a, const cv::Mat &b) {
+	if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) return false;
+	for (int j = 0; j < a.rows; j++) {
+		if (memcmp(a.ptr(j), b.ptr(j), a.cols * a.elemSize()) != 0) return false;
+	}
+	return true;
+}
+
+// 画像中央 (縦横 60%) の穴 (値が0) の割合
+double holeRatio(const cv::Mat &img) {
+	int x0 = img.cols / 5, x1 = img.cols * 4 / 5, y0 = img.rows / 5, y1 = img.rows * 4 / 5;
+	size_t holes = 0;
+	for (int j = y0; j < y1; j++) {
+		for (int i = x0; i < x1; i++) {
+			if (img.at<UINT16>(j, i) == 0) holes++;
+		}
+	}
+	return (double)holes / ((size_t)(x1 - x0) * (y1 - y0));
+}
+
+// Depth → RGB座標系への写像 (従来の1画素ずつ、Zバッファ、広げて穴埋め、半分の解像度)
+void benchDepthWarp(int iterations) {
+	KinectCalibration calibration = defaultKinectCalibration();
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	std::vector<UINT16> depth = makeDepthFrame(width, height);
+	std::vector<ColorSpacePoint> colorSpace(depth.size());
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	registration.depthToColorSpace(&depth[0], &colorSpace[0]);
+	size_t pixels = depth.size();
+
+	cv::Mat img(kinectColorHeight, kinectColorWidth, CV_16UC1);
+	double legacy = measure([&]() { depth2ColorLegacy(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, img); }, iterations);
+	printResult("depth2Color legacy", legacy, pixels);
+	std::cout << "  holes " << holeRatio(img) * 100 << " %" << std::endl;
+
+	DepthWarpOptions options;
+	double ztest = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, options, img); }, iterations);
+	printResult("depth2Color z-test", ztest, pixels);
+	std::cout << "  holes " << holeRatio(img) * 100 << " %" << std::endl;
+
+	options.splat = 0;
+	options.fillHoles = true;
+	double filled = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, options, img); }, iterations);
+	printResult("depth2Color z-test + splat + fill", filled, pixels);
+	std::cout << "  footprint " << depthWarpFootprint(&depth[0], &colorSpace[0], width, height, 1) << ", holes " << holeRatio(img) * 100 << " %" << std::endl;
+
+	options.downscale = 2;
+	double half = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, options, img); }, iterations);
+	printResult("depth2Color half resolution + splat + fill", half, pixels);
+	std::cout << "  footprint " << depthWarpFootprint(&depth[0], &colorSpace[0], width, height, 2) << ", holes " << holeRatio(img) * 100 << " %" << std::endl;
+
+	// 従来の方法で全解像度に写してから半分に縮小する場合
+	cv::Mat full(kinectColorHeight, kinectColorWidth, CV_16UC1), small;
+	double resized = measure([&]() {
+		depth2ColorLegacy(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, full);
+		cv::resize(full, small, cv::Size(), 0.5, 0.5);
+	}, iterations);
+	printResult("depth2Color legacy + resize 0.5", resized, pixels);
+
+	// 行を入れ替えた対応表 (同時に書き込む帯の写る先が重なる) でも、1つずつ書き込んだ結果と同じになるか
+	std::vector<ColorSpacePoint> shuffled(colorSpace.size());
+	for (int j = 0; j < height; j++) std::copy(&colorSpace[(size_t)((j * 37) % height) * width], &colorSpace[(size_t)((j * 37) % height) * width] + width, &shuffled[(size_t)j * width]);
+	DepthWarpOptions splatOnly;
+	splatOnly.splat = 3;
+	for (int n = 0; n < 2; n++) {
+		const ColorSpacePoint *points = (n == 0) ? &colorSpace[0] : &shuffled[0];
+		warpDepthToColor(&depth[0], points, width, height, kinectColorWidth, kinectColorHeight, splatOnly, img);
+		cv::Mat serial = cv::Mat::zeros(kinectColorHeight, kinectColorWidth, CV_16UC1);
+		DepthSplat(splatOnly.splat, splatOnly.zTest, 1, kinectColorWidth, kinectColorHeight).splat(&depth[0], points, 0, (int)pixels, serial);
+		std::cout << "depth2Color bands vs serial (" << (n == 0 ? "map" : "shuffled rows") << ") : " << (sameImage(img, serial) ? "same" : "different") << std::endl;
+	}
+}
+
+// 従来の updateColor2DepthImage (比較用、1バイトずつ読む)
+void color2DepthLegacy(const BYTE *color, const ColorSpacePoint *colorSpace, int depthWidth, int depthHeight, int colorWidth, int colorHeight, cv::Mat &img) {
+	for (int i = 0; i < depthWidth * depthHeight; ++i) {
+		int colorX = (int)(colorSpace[i].X + 0.5);
+		int colorY = (int)(colorSpace[i].Y + 0.5);
+		if ((colorX < 0) || (colorWidth <= colorX) || (colorY < 0) || (colorHeight <= colorY)) continue;
+		int colorIndex = (colorY * colorWidth) + colorX;
+		img.data[i * 4 + 0] = color[colorIndex * 4 + 0];
+		img.data[i * 4 + 1] = color[colorIndex * 4 + 1];
+		img.data[i * 4 + 2] = color[colorIndex * 4 + 2];
+	}
+}
+
+// 位置合わせの処理のスレッド数による処理時間 (512x424 → 1920x1080)
+void benchRegistrationScaling(int iterations) {
+	KinectCalibration calibration = defaultKinectCalibration();
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	std::vector<UINT16> depth = makeDepthFrame(width, height);
+	std::vector<ColorSpacePoint> colorSpace(depth.size());
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	registration.depthToColorSpace(&depth[0], &colorSpace[0]);
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC4);
+	for (int j = 0; j < color.rows; j++) {
+		for (int i = 0; i < color.cols * 4; i++) color.ptr<uchar>(j)[i] = (uchar)(i * 7 + j * 3);
+	}
+	size_t pixels = depth.size();
+
+	cv::Mat legacyD2C(kinectColorHeight, kinectColorWidth, CV_16UC1), legacyC2D(height, width, CV_8UC4, cv::Scalar(0));
+	printResult("depth2Color legacy (1 thread)", measure([&]() { depth2ColorLegacy(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, legacyD2C); }, iterations), pixels);
+	printResult("color2Depth legacy (1 thread)", measure([&]() { color2DepthLegacy(color.ptr<BYTE>(0), &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, legacyC2D); }, iterations), pixels);
+
+	DepthWarpOptions full; // Zバッファ、広げない、全解像度
+	DepthWarpOptions filled;
+	filled.splat = 0;
+	filled.fillHoles = true;
+	cv::Mat d2c, d2cFilled, c2d, reference, referenceFilled, referenceC2D;
+
+	int defaultThreads = cv::getNumThreads();
+	int cpus = (std::max)(cv::getNumberOfCPUs(), 1);
+	std::cout << "threads, registration [ms], depth2Color [ms], depth2Color splat+fill [ms], color2Depth [ms], same as 1 thread" << std::endl;
+	for (int threads = 1; threads <= cpus; threads = (threads * 2 > cpus && threads < cpus) ? cpus : threads * 2) {
+		cv::setNumThreads(threads);
+		double reg = measure([&]() { registration.depthToColorSpace(&depth[0], &colorSpace[0]); }, iterations);
+		double warp = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, full, d2c); }, iterations);
+		double warpFilled = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, filled, d2cFilled); }, iterations);
+		double gather = measure([&]() { warpColorToDepth(color, &colorSpace[0], width, height, c2d); }, iterations);
+		if (threads == 1) {
+			d2c.copyTo(reference);
+			d2cFilled.copyTo(referenceFilled);
+			c2d.copyTo(referenceC2D);
+		}
+		bool same = sameImage(d2c, reference) && sameImage(d2cFilled, referenceFilled) && sameImage(c2d, referenceC2D);
+		std::cout << threads << ", " << reg << ", " << warp << ", " << warpFilled << ", " << gather << ", " << (same ? "yes" : "no") << std::endl;
+	}
+	cv::setNumThreads(defaultThreads);
+}
+
+// 点群を1点ずつの構造体の配列で作る場合 (比較用)
+void pointCloudReference(const KinectCalibration &c, const UINT16 *depth, std::vector<cv::Point3f> &points) {
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	points.resize((size_t)c.depthWidth * c.depthHeight);
+	for (size_t i = 0; i < points.size(); i++) {
+		if (depth[i] == 0) {
+			points[i] = cv::Point3f(nan, nan, nan);
+			continue;
+		}
+		float z = depth[i] / 1000.0f;
+		points[i] = cv::Point3f(c.depthRays[i * 2] * z, c.depthRays[i * 2 + 1] * z, z);
+	}
+}
+
+// 点群の生成と書き出し
+void benchPointCloud(int iterations) {
+	KinectCalibration calibration = defaultKinectCalibration();
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	std::vector<UINT16> depth = makeDepthFrame(width, height);
+	cv::Mat depthM(height, width, CV_16UC1, &depth[0]);
+	std::vector<ColorSpacePoint> colorSpace(depth.size());
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	registration.depthToColorSpace(&depth[0], &colorSpace[0]);
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC4, cv::Scalar(40, 120, 200, 255));
+	size_t pixels = depth.size();
+
+	std::vector<cv::Point3f> reference;
+	printResult("point cloud AoS reference", measure([&]() { pointCloudReference(calibration, &depth[0], reference); }, iterations), pixels);
+
+	PointCloudGenerator generator;
+	generator.initialize(calibration);
+	PointCloud cloud;
+	printResult("point cloud SoA", measure([&]() { generator.generate(depthM, cloud); }, iterations), pixels);
+	printResult("point cloud SoA + color", measure([&]() { generator.generate(depthM, cloud, color, &colorSpace[0]); }, iterations), pixels);
+
+	// 比較用と同じ値か (NaN の位置も含めて)
+	double maxError = 0;
+	size_t mismatch = 0;
+	for (size_t i = 0; i < pixels; i++) {
+		int u = (int)(i % width), v = (int)(i / width);
+		float z = cloud.z.at<float>(v, u);
+		if (std::isnan(z) != std::isnan(reference[i].z)) { mismatch++; continue; }
+		if (std::isnan(z)) continue;
+		maxError = (std::max)(maxError, (double)std::fabs(cloud.x.at<float>(v, u) - reference[i].x));
+		maxError = (std::max)(maxError, (double)std::fabs(cloud.y.at<float>(v, u) - reference[i].y));
+		maxError = (std::max)(maxError, (double)std::fabs(z - reference[i].z));
+	}
+	std::cout << "  max error " << maxError * 1000 << " mm, NaN mismatch " << mismatch << std::endl;
+
+	// 30fps で書き出しに渡したときに push() にかかる時間 (取得を止めないか) と書き出せた数
+	for (int f = 0; f < 2; f++) {
+		PointCloudFormat format = (f == 0) ? PointCloudPLY : PointCloudPCD;
+		PointCloudWriter writer;
+		writer.open("bench_cloud", format);
+		int frames = (std::max)(iterations, 30);
+		double pushMax = 0;
+		auto next = std::chrono::steady_clock::now();
+		double start = (double)cv::getTickCount();
+		for (int n = 0; n < frames; n++) {
+			next += std::chrono::microseconds(33333);
+			std::this_thread::sleep_until(next);
+			if (!generator.generate(depthM, cloud, color, &colorSpace[0])) continue; // プールが空かない (書き込み待ちで全て使用中)
+			cloud.number = n;
+			double t = (double)cv::getTickCount();
+			writer.push(cloud);
+			pushMax = (std::max)(pushMax, ((double)cv::getTickCount() - t) / cv::getTickFrequency() * 1000.0);
+		}
+		writer.close();
+		double sec = ((double)cv::getTickCount() - start) / cv::getTickFrequency();
+		std::cout << "point cloud writer " << pointCloudExtension(format) << " : " << frames << " frames at 30 fps, written " << writer.written()
+			<< ", dropped " << writer.dropped() << ", failed " << writer.failed() << ", push max " << pushMax << " ms, "
+			<< writer.bytes() / sec / (1024 * 1024) << " MB/s" << std::endl;
+		for (int n = 0; n < frames; n++) {
+			char name[64];
+			snprintf(name, sizeof(name), "bench_cloud_%06d%s", n, pointCloudExtension(format));
+			std::remove(name);
+		}
+	}
+}
+
+// フレーム間の変化の平均 [mm] (両方に値のある画素) と、片方だけ0の画素 (ちらつく穴) の割合
+void frameDifference(const std::vector<UINT16> &a, const std::vector<UINT16> &b, double &meanDiff, double &flicker) {
+	double sum = 0;
+	size_t valid = 0, holes = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i] == 0 || b[i] == 0) {
+			if (a[i] != b[i]) holes++;
+			continue;
+		}
+		sum += std::abs((int)a[i] - (int)b[i]);
+		valid++;
+	}
+	meanDiff = valid ? sum / valid : 0;
+	flicker = (double)holes / a.size();
+}
+
+// 時間方向のフィルタ (静止した場面に距離に比例した雑音と、フレームごとに変わる穴を加えたフレーム)
+void benchTemporalFilter(int iterations) {
+	int width = kinectDepthWidth, height = kinectDepthHeight;
+	std::vector<UINT16> base = makeDepthFrame(width, height);
+	const int sequence = 30;
+	std::vector<std::vector<UINT16> > frames(sequence, base);
+	std::mt19937 rng(2);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+	for (int n = 0; n < sequence; n++) {
+		for (size_t i = 0; i < base.size(); i++) {
+			if (base[i] == 0) continue;
+			float d = base[i] + noise(rng) * (2.0f + base[i] * 0.004f); // 1m で約6mm、3m で約14mm
+			frames[n][i] = ((rng() % 20) == 0) ? 0 : (UINT16)(std::max)(d, 1.0f);
+		}
+	}
+
+	DepthTemporalFilter filter;
+	filter.initialize(width, height);
+	std::vector<UINT16> work(base.size()), previous;
+	int f = 0;
+	double ms = measure([&]() {
+		work = frames[f];
+		filter.apply(&work[0]);
+		f = (f + 1) % sequence;
+	}, (std::max)(iterations, sequence));
+	printResult("temporal filter (copy + filter)", ms, base.size());
+	std::cout << "  filter only : mean " << filter.meanFrameMs() << " ms, max " << filter.maxFrameMs() << " ms" << std::endl;
+
+	// 1周分の後でのフレーム間の変化 (フィルタ無しと比べる)
+	double rawDiff = 0, rawFlicker = 0, filteredDiff = 0, filteredFlicker = 0;
+	filter.reset();
+	for (int n = 0; n < sequence; n++) {
+		work = frames[n];
+		filter.apply(&work[0]);
+		if (n >= sequence / 2) {
+			double d, fl;
+			frameDifference(frames[n], frames[n - 1], d, fl);
+			rawDiff += d;
+			rawFlicker += fl;
+			frameDifference(work, previous, d, fl);
+			filteredDiff += d;
+			filteredFlicker += fl;
+		}
+		previous = work;
+	}
+	int counted = sequence - sequence / 2;
+	std::cout << "  frame-to-frame change : raw " << rawDiff / counted << " mm, filtered " << filteredDiff / counted << " mm" << std::endl;
+	std::cout << "  flickering holes : raw " << rawFlicker / counted * 100 << " %, filtered " << filteredFlicker / counted * 100 << " %" << std::endl;
+}
+
+// 真値との差 : 段差から離れた画素の平均誤差 [mm]、段差の近く (3画素以内) で 100mm 以上ずれた (前景と背景が混ざった) 画素、穴の数
+void spatialError(const std::vector<UINT16> &truth, const std::vector<UINT16> &edge, const UINT16 *depth, double &flatError, size_t &mixed, size_t &holes) {
+	double sum = 0;
+	size_t count = 0;
+	mixed = holes = 0;
+	for (size_t i = 0; i < truth.size(); i++) {
+		if (depth[i] == 0) {
+			holes++;
+			continue;
+		}
+		int e = std::abs((int)depth[i] - (int)truth[i]);
+		if (edge[i]) {
+			if (e >= 100) mixed++;
+		} else {
+			sum += e;
+			count++;
+		}
+	}
+	flatError = count ? sum / count : 0;
+}
+
+// 空間方向のフィルタ (奥の壁と手前の円の真値に、距離に比例した雑音、穴、1画素の斑点を加えたフレーム)
+// Depthだけ / RGBで導く / cv::bilateralFilter (float に変換してかける、比較用) を比べる
+void benchSpatialFilter(int iterations) {
+	int width = kinectDepthWidth, height = kinectDepthHeight;
+	size_t pixels = (size_t)width * height;
+	std::vector<UINT16> truth(pixels), noisy(pixels), edge(pixels, 0);
+	cv::Mat guide(height, width, CV_8UC4);
+	std::mt19937 rng(3);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+	for (int j = 0; j < height; j++) {
+		uchar *g = guide.ptr<uchar>(j);
+		for (int i = 0; i < width; i++) {
+			int dx = i - width / 2, dy = j - height / 2;
+			bool object = dx * dx + dy * dy < 100 * 100;
+			int d = object ? 900 + (dx * dx + dy * dy) / 50 : 2500 + i;
+			int r = (int)std::sqrt((double)(dx * dx + dy * dy));
+			size_t k = (size_t)j * width + i;
+			truth[k] = (UINT16)d;
+			edge[k] = (r >= 97 && r <= 103) ? 1 : 0;
+			float v = d + noise(rng) * (2.0f + d * 0.004f);
+			if ((rng() % 500) == 0) v = d + 400.0f; // 斑点
+			noisy[k] = ((rng() % 50) == 0) ? 0 : (UINT16)v;
+			g[i * 4 + 0] = object ? 40 : 200;
+			g[i * 4 + 1] = object ? 60 : 180;
+			g[i * 4 + 2] = object ? 220 : 160;
+			g[i * 4 + 3] = 255;
+		}
+	}
+
+	DepthSpatialFilter filter;
+	filter.initialize(width, height);
+	std::vector<UINT16> out(pixels);
+	double flat, rawFlat;
+	size_t mixed, holes, rawMixed, rawHoles;
+	spatialError(truth, edge, &noisy[0], rawFlat, rawMixed, rawHoles);
+	std::cout << "spatial filter : raw error " << rawFlat << " mm, mixed edge pixels " << rawMixed << ", holes " << rawHoles << std::endl;
+
+	double ms = measure([&]() { filter.apply(&noisy[0], &out[0]); }, iterations);
+	printResult("spatial filter (depth)", ms, pixels);
+	spatialError(truth, edge, &out[0], flat, mixed, holes);
+	std::cout << "  error " << flat << " mm, mixed edge pixels " << mixed << ", holes " << holes << std::endl;
+
+	// スレッド数によらず同じ結果になるか
+	std::vector<UINT16> single(pixels);
+	int threads = cv::getNumThreads();
+	cv::setNumThreads(1);
+	double singleMs = measure([&]() { filter.apply(&noisy[0], &single[0]); }, iterations);
+	cv::setNumThreads(threads);
+	std::cout << "  1 thread : " << singleMs << " ms/frame, " << threads << " threads : " << ms << " ms/frame, same result : " << (single == out ? "yes" : "no") << std::endl;
+
+	DepthSpatialOptions options;
+	options.sigmaColor = 30.0f;
+	filter.setOptions(options);
+	ms = measure([&]() { filter.apply(&noisy[0], &out[0], guide); }, iterations);
+	printResult("spatial filter (depth + color)", ms, pixels);
+	spatialError(truth, edge, &out[0], flat, mixed, holes);
+	std::cout << "  error " << flat << " mm, mixed edge pixels " << mixed << ", holes " << holes << std::endl;
+
+	// cv::bilateralFilter (穴は0のまま混ざるので、比べるのは時間と誤差だけ)
+	cv::Mat noisyMat(height, width, CV_16UC1, &noisy[0]), floatMat, bilateral, bilateral16;
+	ms = measure([&]() {
+		noisyMat.convertTo(floatMat, CV_32F);
+		cv::bilateralFilter(floatMat, bilateral, 9, 50.0, 6.0);
+		bilateral.convertTo(bilateral16, CV_16U);
+	}, (std::max)(iterations / 10, 1));
+	printResult("cv::bilateralFilter (float, d = 9)", ms, pixels);
+	spatialError(truth, edge, bilateral16.ptr<UINT16>(0), flat, mixed, holes);
+	std::cout << "  error " << flat << " mm, mixed edge pixels " << mixed << ", holes " << holes << std::endl;
+}
+
+// 背景モデルと前景の塊 (奥の壁の前を円が横切る。学習中にも別の物が通り過ぎる)
+void benchBackground(int iterations) {
+	int width = kinectDepthWidth, height = kinectDepthHeight;
+	size_t pixels = (size_t)width * height;
+	const int warmup = 30, sequence = (std::max)(iterations, 60) + warmup;
+	std::mt19937 rng(4);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+	auto makeFrame = [&](int k, std::vector<UINT16> &depth, std::vector<uchar> &truth) {
+		int cx = 60 + (k * 3) % (width - 120), cy = height / 2;
+		for (int j = 0; j < height; j++) {
+			for (int i = 0; i < width; i++) {
+				int d = 2500 + i;
+				bool object = k >= warmup && (i - cx) * (i - cx) + (j - cy) * (j - cy) < 60 * 60;
+				if (object) d = 1500;
+				if (k < warmup && std::abs(i - k * 15) < 20) d = 1200; // 学習中に通り過ぎる物
+				size_t n = (size_t)j * width + i;
+				float v = d + noise(rng) * (2.0f + d * 0.004f);
+				depth[n] = ((rng() % 50) == 0) ? 0 : (UINT16)v;
+				truth[n] = object;
+			}
+		}
+	};
+	std::vector<std::vector<UINT16> > frames(sequence, std::vector<UINT16>(pixels));
+	std::vector<std::vector<uchar> > truths(sequence, std::vector<uchar>(pixels));
+	for (int k = 0; k < sequence; k++) makeFrame(k, frames[k], truths[k]);
+
+	// 1スレッドと複数スレッドで同じ前景になるか、と前景の正しさ
+	int threads = cv::getNumThreads();
+	DepthBackground single, multi;
+	single.initialize(width, height);
+	multi.initialize(width, height);
+	bool same = true;
+	double truePositive = 0, falsePositive = 0, falseNegative = 0;
+	for (int k = 0; k < sequence; k++) {
+		cv::setNumThreads(1);
+		single.apply(&frames[k][0]);
+		cv::setNumThreads(threads);
+		multi.apply(&frames[k][0]);
+		cv::Mat a = single.foreground(), b = multi.foreground();
+		same = same && memcmp(a.data, b.data, pixels) == 0 && memcmp(single.background().data, multi.background().data, pixels * 2) == 0;
+		if (k < warmup) continue;
+		for (size_t n = 0; n < pixels; n++) {
+			if (frames[k][n] == 0) continue;
+			bool fg = b.data[n] != 0;
+			if (fg && truths[k][n]) truePositive++;
+			else if (fg) falsePositive++;
+			else if (truths[k][n]) falseNegative++;
+		}
+	}
+	std::cout << "background model : 1 thread " << single.meanFrameMs() << " ms/frame, " << threads << " threads " << multi.meanFrameMs()
+		<< " ms/frame (max " << multi.maxFrameMs() << " ms), same result : " << (same ? "yes" : "no") << std::endl;
+	std::cout << "  foreground precision " << truePositive / (truePositive + falsePositive) << ", recall " << truePositive / (truePositive + falseNegative)
+		<< ", blobs " << multi.blobs().size() << " (area " << (multi.blobs().empty() ? 0 : multi.blobs()[0].area) << ")" << std::endl;
+
+	// 動く物がある場合と、静止した場面 (塊を求め直さない) の処理時間
+	DepthBackground model;
+	model.initialize(width, height);
+	for (int k = 0; k < warmup; k++) model.apply(&frames[k][0]);
+	int f = warmup;
+	double ms = measure([&]() {
+		model.apply(&frames[f][0]);
+		f = (f + 1 < sequence) ? f + 1 : warmup;
+	}, iterations);
+	printResult("background model (moving object)", ms, pixels);
+	std::cout << "  changed tiles " << model.changedTiles() << " / " << model.tiles() << std::endl;
+	unsigned long long labeled = model.blobFrames();
+	ms = measure([&]() { model.apply(&frames[sequence - 1][0]); }, iterations);
+	printResult("background model (static scene)", ms, pixels);
+	std::cout << "  blobs labeled in " << model.blobFrames() - labeled << " of " << iterations + 1 << " frames" << std::endl;
+}
+
+// 記録データのDepthフレームを最大 maxFrames 枚読み込む (読めなければ合成したフレーム1枚)
+std::vector<std::vector<UINT16> > loadDepthFrames(const char *path, size_t maxFrames, KinectCalibration &calibration) {
+	std::vector<std::vector<UINT16> > frames;
+	calibration = defaultKinectCalibration();
+	if (path != nullptr) {
+		try {
+			ReplayFrameSource source(path, 0, false); // 待たずに先頭から1回だけ
+			source.open(FrameSource::Depth);
+			KinectCalibration recorded;
+			if (source.getCalibration(recorded)) calibration = recorded;
+			std::vector<UINT16> depth(source.depthBufferSize());
+			while (frames.size() < maxFrames && source.acquireDepthFrame(&depth[0], depth.size())) frames.push_back(depth);
+		} catch (std::exception &ex) { std::cout << ex.what() << std::endl; }
+	}
+	if (frames.empty() || frames[0].size() != (size_t)calibration.depthWidth * calibration.depthHeight) {
+		frames.assign(1, makeDepthFrame(calibration.depthWidth, calibration.depthHeight));
+		std::cout << "voxel grid : synthetic frame" << std::endl;
+	} else {
+		std::cout << "voxel grid : " << frames.size() << " recorded frames from " << path << std::endl;
+		benchInput = path;
+	}
+	return frames;
+}
+
+// 範囲の切り出しとボクセルグリッドによる間引き (記録データを指定すればそのフレームを順に使う)
+void benchVoxelGrid(int iterations, const char *recordPath) {
+	KinectCalibration calibration;
+	std::vector<std::vector<UINT16> > frames = loadDepthFrames(recordPath, 100, calibration);
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	size_t pixels = (size_t)width * height;
+
+	// 色は全フレームで同じ画像から読む (読む量はフレームによらない)
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	std::vector<ColorSpacePoint> colorSpace(pixels);
+	registration.depthToColorSpace(&frames[0][0], &colorSpace[0]);
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC4, cv::Scalar(40, 120, 200, 255));
+
+	PointCloudGenerator generator;
+	generator.initialize(calibration);
+	std::vector<PointCloud> clouds(frames.size());
+	for (size_t f = 0; f < frames.size(); f++) {
+		cv::Mat depth(height, width, CV_16UC1, &frames[f][0]);
+		PointCloud cloud;
+		generator.generate(depth, cloud, color, &colorSpace[0]);
+		clouds[f] = cloud;
+		clouds[f].x = cloud.x.clone(); // プールのスロットは足りないので、持ち続ける分はコピーする
+		clouds[f].y = cloud.y.clone();
+		clouds[f].z = cloud.z.clone();
+		clouds[f].color = cloud.color.clone();
+	}
+
+	VoxelGrid grid;
+	grid.reserve(pixels);
+	VoxelCloud voxels;
+	const float leaves[] = { 0.005f, 0.01f, 0.02f, 0.05f };
+	for (int crop = 0; crop < 2; crop++) {
+		for (int k = 0; k < 4; k++) {
+			VoxelGridOptions options;
+			options.leafSize = leaves[k];
+			if (crop) { // 手前 0.5m～2m、左右上下 ±1m
+				options.box.minX = options.box.minY = -1.0f;
+				options.box.maxX = options.box.maxY = 1.0f;
+				options.box.minZ = 0.5f;
+				options.box.maxZ = 2.0f;
+			}
+			size_t f = 0, voxelSum = 0, inputSum = 0;
+			int runs = (std::max)(iterations, (int)frames.size());
+			double ms = measure([&]() {
+				grid.filter(clouds[f], options, voxels);
+				voxelSum += voxels.size();
+				inputSum += voxels.inputPoints;
+				f = (f + 1) % clouds.size();
+			}, runs);
+			char name[64];
+			snprintf(name, sizeof(name), "voxel grid %s%.0f mm", crop ? "crop + " : "", leaves[k] * 1000);
+			printResult(name, ms, pixels);
+			std::cout << "  " << pixels / ms / 1000.0 << " Mpoints/s, input " << inputSum / (runs + 1) << " points -> " << voxelSum / (runs + 1) << " voxels" << std::endl;
+		}
+	}
+}
+
+// ROI の面積と処理時間 (窓の中だけを処理するので面積にほぼ比例するか)
+// 窓は Depth画像の中央、RGBの窓は resolveCaptureROI() で求める
+void benchCaptureROI(int iterations) {
+	KinectCalibration calibration = defaultKinectCalibration();
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	std::vector<UINT16> depth = makeDepthFrame(width, height);
+	cv::Mat depthM(height, width, CV_16UC1, &depth[0]);
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	std::vector<ColorSpacePoint> colorSpace(depth.size()), reference(depth.size());
+	registration.depthToColorSpace(&depth[0], &reference[0]);
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC4);
+	for (int j = 0; j < color.rows; j++) {
+		for (int i = 0; i < color.cols * 4; i++) color.ptr<uchar>(j)[i] = (uchar)(i * 7 + j * 3);
+	}
+	cv::Mat colorCopy(kinectColorHeight, kinectColorWidth, CV_8UC4);
+	PointCloudGenerator generator;
+	generator.initialize(calibration);
+	PointCloud cloud, fullCloud;
+	generator.generate(depthM, fullCloud);
+	fullCloud.z = fullCloud.z.clone();
+	cv::Mat fullC2D;
+	warpColorToDepth(color, &reference[0], width, height, fullC2D);
+
+	DepthWarpOptions warp;
+	warp.splat = 0;
+	warp.fillHoles = true;
+	warp.downscale = 2;
+	cv::Mat cvt, d2c, c2d;
+	std::cout << "roi area [%], color rows [%], copy color [ms], depth cvt [ms], registration [ms], depth2Color [ms], color2Depth [ms], point cloud [ms], total [ms], same as full" << std::endl;
+	const double areas[] = { 1.0, 0.5, 0.25, 0.0625 };
+	for (size_t a = 0; a < sizeof(areas) / sizeof(areas[0]); a++) {
+		double side = std::sqrt(areas[a]);
+		CaptureROI requested;
+		requested.depthRect = cv::Rect((int)(width * (1 - side) / 2), (int)(height * (1 - side) / 2), (int)(width * side), (int)(height * side));
+		CaptureROI roi = resolveCaptureROI(requested, calibration, kinectColorWidth, kinectColorHeight);
+		const cv::Rect &dr = roi.depthRect, &cr = roi.colorRect;
+
+		// RGBは窓の行だけをコピーする (取得元の acquireColorFrameRows() と同じ)
+		double copy = measure([&]() { memcpy(colorCopy.ptr<uchar>(cr.y), color.ptr<uchar>(cr.y), (size_t)cr.height * color.step); }, iterations);
+		double conv = measure([&]() { depthWindowLUT(600, 3000, roi.depthMin(), roi.depthMax()).apply(depthM(dr), cvt); }, iterations);
+		double reg = measure([&]() { registration.depthToColorSpace(&depth[0], &colorSpace[0], dr, roi.depthMin(), roi.depthMax()); }, iterations);
+		double d2cMs = measure([&]() { warpDepthToColor(&depth[0], &colorSpace[0], width, height, kinectColorWidth, kinectColorHeight, warp, d2c, dr, cr); }, iterations);
+		double c2dMs = measure([&]() { warpColorToDepth(color, &colorSpace[0], width, height, c2d, dr); }, iterations);
+		double pc = measure([&]() { generator.generate(depthM, cloud, cv::Mat(), nullptr, roi); }, iterations);
+
+		// 窓の中は全体を処理したときと同じ結果か
+		bool same = sameImage(c2d, fullC2D(dr)) && sameImage(cloud.z, fullCloud.z(dr));
+		for (int j = dr.y; j < dr.y + dr.height && same; j++) {
+			for (int i = dr.x; i < dr.x + dr.width; i++) {
+				size_t k = (size_t)j * width + i;
+				if (memcmp(&colorSpace[k], &reference[k], sizeof(ColorSpacePoint)) != 0) { same = false; break; }
+			}
+		}
+		std::cout << 100.0 * dr.area() / (width * height) << ", " << 100.0 * cr.height / kinectColorHeight << ", " << copy << ", " << conv << ", " << reg << ", "
+			<< d2cMs << ", " << c2dMs << ", " << pc << ", " << copy + conv + reg + d2cMs + c2dMs + pc << ", " << (same ? "yes" : "no") << std::endl;
+	}
+
+	// Depth値の範囲 (0.5m - 2m) を付けると範囲外の点は対応表も点群も無効になる
+	CaptureROI ranged;
+	ranged.minDepth = 500;
+	ranged.maxDepth = 2000;
+	ranged = resolveCaptureROI(ranged, calibration, kinectColorWidth, kinectColorHeight);
+	generator.generate(depthM, cloud, cv::Mat(), nullptr, ranged);
+	registration.depthToColorSpace(&depth[0], &colorSpace[0], ranged.depthRect, ranged.depthMin(), ranged.depthMax());
+	size_t inRange = 0, valid = 0, mapped = 0;
+	for (size_t k = 0; k < depth.size(); k++) {
+		if (ranged.inRange(depth[k])) inRange++;
+		if (!std::isnan(cloud.z.at<float>((int)(k / width), (int)(k % width)))) valid++;
+		if (colorSpace[k].X > -1e30f) mapped++;
+	}
+	std::cout << "depth range 0.5-2m: in range " << inRange << ", point cloud " << valid << ", mapped " << mapped << std::endl;
+}
+
+// YUY2 のRGBフレームを BGRA に変換する処理 (全体、縦横半分、位置合わせで対応する画素だけ)
+// 比較用は SDK の CopyConvertedFrameDataToArray の代わりに cv::cvtColor で全体を BGRA にしてから使う場合
+void benchColorConvert(int iterations) {
+	cv::Mat yuy2(kinectColorHeight, kinectColorWidth, CV_8UC2);
+	std::mt19937 rng(3);
+	for (int j = 0; j < yuy2.rows; j++) {
+		BYTE *row = yuy2.ptr<BYTE>(j);
+		for (int i = 0; i < yuy2.cols * 2; i++) row[i] = (BYTE)((i & 1) ? (100 + ((i & 2) ? j / 20 : i / 70) + (rng() & 3)) : 40 + (i / 16 + j / 8) % 160 + (rng() & 15));
+	}
+	size_t pixels = yuy2.total();
+	std::cout << "color frame: YUY2 " << yuy2.total() * 2 / (1024 * 1024.0) << " MB, BGRA " << yuy2.total() * 4 / (1024 * 1024.0) << " MB" << std::endl;
+
+	cv::Mat bgra, half, reference, resized;
+	printResult("YUY2 -> BGRA cv::cvtColor", measure([&]() { cv::cvtColor(yuy2, reference, cv::COLOR_YUV2BGRA_YUY2); }, iterations), pixels);
+	printResult("YUY2 -> BGRA", measure([&]() { yuy2ToBGRA(yuy2, bgra); }, iterations), pixels);
+	printResult("YUY2 -> BGRA -> half cv::resize", measure([&]() { yuy2ToBGRA(yuy2, bgra); cv::resize(bgra, resized, cv::Size(), 0.5, 0.5); }, iterations), pixels);
+	printResult("YUY2 -> half BGRA fused", measure([&]() { yuy2ToBGRAHalf(yuy2, half); }, iterations), pixels);
+
+	// SSE2 の結果が1画素ずつの計算と同じか
+	size_t mismatch = 0, halfMismatch = 0;
+	for (int j = 0; j < yuy2.rows; j++) {
+		for (int i = 0; i < yuy2.cols; i++) {
+			if (bgra.ptr<uint32_t>(j)[i] != yuy2PixelBGRA(yuy2.ptr<BYTE>(j), i)) mismatch++;
+		}
+	}
+	for (int j = 0; j < half.rows; j++) {
+		const BYTE *a = yuy2.ptr<BYTE>(j * 2), *b = yuy2.ptr<BYTE>(j * 2 + 1);
+		for (int i = 0; i < half.cols; i++) {
+			const BYTE *p = a + i * 4, *q = b + i * 4;
+			int y = ((((p[0] + q[0] + 1) >> 1) + ((p[2] + q[2] + 1) >> 1) + 1) >> 1);
+			if (half.ptr<uint32_t>(j)[i] != yuvToBGRA(y, (p[1] + q[1] + 1) >> 1, (p[3] + q[3] + 1) >> 1)) halfMismatch++;
+		}
+	}
+	// 縮小してから変換するので、変換してから縮小するのとは丸めの分だけ違う
+	double halfError = 0, halfErrorSum = 0;
+	for (int j = 0; j < half.rows; j++) {
+		for (int i = 0; i < half.cols * 4; i++) {
+			double e = std::abs(half.ptr<uchar>(j)[i] - resized.ptr<uchar>(j)[i]);
+			halfError = (std::max)(halfError, e);
+			halfErrorSum += e;
+		}
+	}
+	std::cout << "  SSE2 vs scalar mismatch: full " << mismatch << ", half " << halfMismatch << ", fused half vs cv::resize diff mean " << halfErrorSum / (half.total() * 4)
+		<< ", max " << halfError << std::endl;
+
+	// RGB → Depth の写像 (Depth画素ごとに対応するRGB画素だけを変換する)
+	KinectCalibration calibration = defaultKinectCalibration();
+	int width = calibration.depthWidth, height = calibration.depthHeight;
+	std::vector<UINT16> depth = makeDepthFrame(width, height);
+	std::vector<ColorSpacePoint> colorSpace(depth.size());
+	DepthRegistration registration;
+	registration.initialize(calibration);
+	registration.depthToColorSpace(&depth[0], &colorSpace[0]);
+	cv::Mat c2dBGRA, c2dYUY2;
+	printResult("color2Depth from BGRA (after full conversion)", measure([&]() { yuy2ToBGRA(yuy2, bgra); warpColorToDepth(bgra, &colorSpace[0], width, height, c2dBGRA); }, iterations), depth.size());
+	printResult("color2Depth from YUY2 (per-pixel)", measure([&]() { warpColorToDepth(yuy2, &colorSpace[0], width, height, c2dYUY2); }, iterations), depth.size());
+	std::cout << "  same result: " << (sameImage(c2dBGRA, c2dYUY2) ? "yes" : "no") << std::endl;
+}
+
+// 共有メモリのリングでのフレームの受け渡し (同じプロセスの中で、書き込み側のスレッドと読み込み側ごとのマッピング)
+// 書き込み時間、届くまでの遅延、処理の遅い読み込み側の取りこぼしと、使っている間に上書きされたフレームを数える
+void benchSharedFrames(int iterations) {
+	const char *name = "kinect_bench_ring";
+	const int slots = 4;
+	const double fps = 30.0;
+	cv::Mat depth(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	std::vector<UINT16> synth = makeDepthFrame(kinectDepthWidth, kinectDepthHeight);
+	memcpy(depth.ptr<UINT16>(0), &synth[0], synth.size() * sizeof(UINT16));
+
+	for (int format = 0; format < 2; format++) {
+		cv::Mat color(kinectColorHeight, kinectColorWidth, (format == 0) ? CV_8UC4 : CV_8UC2, cv::Scalar(128));
+		SharedFramePublisher publisher;
+		try {
+			publisher.open(name, slots, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight, (format == 0) ? FrameSource::ColorBGRA : FrameSource::ColorYUY2);
+		} catch (std::exception &ex) {
+			std::cout << "shared frames: " << ex.what() << std::endl;
+			return;
+		}
+		RGBDFrame frame;
+		frame.depth = depth;
+		frame.color = color;
+		frame.roi.depthRect = cv::Rect(0, 0, kinectDepthWidth, kinectDepthHeight);
+		frame.roi.colorRect = cv::Rect(0, 0, kinectColorWidth, kinectColorHeight);
+		printResult((format == 0) ? "shared publish BGRA" : "shared publish YUY2", measure([&]() { frame.number++; publisher.publish(frame); }, iterations), color.total());
+		RGBDFrame half = frame;
+		half.roi.depthRect = cv::Rect(kinectDepthWidth / 4, kinectDepthHeight / 4, kinectDepthWidth / 2, kinectDepthHeight / 2);
+		half.roi.colorRect = cv::Rect(kinectColorWidth / 4, kinectColorHeight / 4, kinectColorWidth / 2, kinectColorHeight / 2);
+		printResult((format == 0) ? "shared publish BGRA (ROI 25%)" : "shared publish YUY2 (ROI 25%)", measure([&]() { half.number++; publisher.publish(half); }, iterations), color.total());
+	}
+
+	// fps で書き込み、処理時間の違う読み込み側 (0ms, 50ms, スロットの時間より長い 200ms) で受け取る
+	SharedFramePublisher publisher;
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC2, cv::Scalar(128));
+	publisher.open(name, slots, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight, FrameSource::ColorYUY2);
+	const int workMs[3] = { 0, 50, 200 };
+	const int frames = 90;
+	std::atomic<bool> done(false);
+	struct ReaderResult {
+		unsigned long long received = 0, missed = 0, torn = 0, checked = 0, mismatch = 0;
+		double latencySum = 0, latencyMax = 0;
+	} results[3];
+	std::vector<std::thread> readers;
+	for (int r = 0; r < 3; r++) {
+		readers.push_back(std::thread([&, r]() {
+			SharedFrameReader reader;
+			reader.open(name);
+			SharedFrame shared;
+			ReaderResult &result = results[r];
+			while (!done || reader.waitFrame(0)) {
+				if (!reader.waitFrame(50) || !reader.latest(shared)) continue;
+				double latency = (currentTimestamp() - shared.publishTimestamp) / 10000.0;
+				result.latencySum += latency;
+				result.latencyMax = (std::max)(result.latencyMax, latency);
+				// 中身は書き込んだフレームの番号 (読んでいる間に上書きされていなければ一致する)
+				UINT16 tag = shared.frame.depth.ptr<UINT16>(0)[0];
+				if (workMs[r] > 0) std::this_thread::sleep_for(std::chrono::milliseconds(workMs[r]));
+				UINT16 tagAfter = shared.frame.depth.ptr<UINT16>(0)[0];
+				if (reader.isValid(shared)) {
+					result.checked++;
+					if (tag != (UINT16)shared.frame.number || tagAfter != tag) result.mismatch++;
+				}
+			}
+			result.received = reader.received();
+			result.missed = reader.missed();
+			result.torn = reader.torn();
+		}));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100)); // 読み込み側が開くまで
+	RGBDFrame frame;
+	frame.depth = depth;
+	frame.color = color;
+	frame.roi.depthRect = cv::Rect(0, 0, kinectDepthWidth, kinectDepthHeight);
+	frame.roi.colorRect = cv::Rect(0, 0, kinectColorWidth, kinectColorHeight);
+	auto next = std::chrono::steady_clock::now();
+	double publishMax = 0;
+	for (int n = 1; n <= frames; n++) {
+		next += std::chrono::microseconds((long long)(1e6 / fps));
+		std::this_thread::sleep_until(next);
+		frame.number = n;
+		depth.ptr<UINT16>(0)[0] = (UINT16)n;
+		double start = (double)cv::getTickCount();
+		publisher.publish(frame);
+		publishMax = (std::max)(publishMax, ((double)cv::getTickCount() - start) / cv::getTickFrequency() * 1000.0);
+	}
+	done = true;
+	for (size_t r = 0; r < readers.size(); r++) readers[r].join();
+	std::cout << "shared frames: " << frames << " frames at " << fps << " fps, " << slots << " slots, publish max " << publishMax << " ms (readers never block the writer)" << std::endl;
+	for (int r = 0; r < 3; r++) {
+		const ReaderResult &result = results[r];
+		std::cout << "  reader work " << workMs[r] << " ms: received " << result.received << ", missed " << result.missed << ", torn " << result.torn
+			<< ", latency mean " << (result.received > 0 ? result.latencySum / result.received : 0) << " ms, max " << result.latencyMax
+			<< " ms, corrupted " << result.mismatch << "/" << result.checked << std::endl;
+	}
+}
+
+// Depth の圧縮 (差分 + ランレングス、予測符号化の可逆 / 4mm 刻み)
+// 雑音の多いフレームと、合成フレーム (SimulatedFrameSource と同じ雑音の無い場面) で圧縮率と処理時間を比べる
+void benchDepthCodec(int iterations) {
+	const int width = kinectDepthWidth, height = kinectDepthHeight;
+	std::vector<UINT16> smooth(width * height);
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			int dx = i - width / 2, dy = j - height / 2;
+			int r2 = dx * dx + dy * dy;
+			smooth[j * width + i] = (UINT16)((i < 10) ? 0 : (r2 < 60 * 60) ? 900 + r2 / 50 : 2500 + i);
+		}
+	}
+	const char *frameNames[2] = { "noisy", "smooth" };
+	std::vector<UINT16> frames[2] = { makeDepthFrame(width, height), smooth };
+	const size_t rawBytes = (size_t)width * height * sizeof(UINT16);
+	std::vector<UINT16> decoded(width * height);
+	for (int f = 0; f < 2; f++) {
+		const std::vector<UINT16> &depth = frames[f];
+		std::vector<BYTE> encoded;
+		double encodeMs = measure([&]() { DepthCodec::encode(&depth[0], width, height, encoded); }, iterations);
+		double decodeMs = measure([&]() { DepthCodec::decode(&encoded[0], encoded.size(), width, height, &decoded[0]); }, iterations);
+		std::cout << "depth codec rle (" << frameNames[f] << ") : " << encoded.size() / 1024 << " KB (" << 100.0 * encoded.size() / rawBytes
+			<< "%), encode " << encodeMs << " ms, decode " << decodeMs << " ms, " << (decoded == depth ? "lossless" : "MISMATCH") << std::endl;
+
+		const int steps[2] = { 1, 4 };
+		for (int s = 0; s < 2; s++) {
+			encodeMs = measure([&]() { DepthCodec::encodePredictive(&depth[0], width, width, height, steps[s], encoded); }, iterations);
+			decodeMs = measure([&]() { DepthCodec::decodePredictive(&encoded[0], encoded.size(), width, height, &decoded[0], width); }, iterations);
+			int maxError = 0;
+			for (size_t i = 0; i < depth.size(); i++) maxError = (std::max)(maxError, std::abs((int)decoded[i] - (int)depth[i]));
+			std::cout << "depth codec predictive step " << steps[s] << " (" << frameNames[f] << ") : " << encoded.size() / 1024 << " KB ("
+				<< 100.0 * encoded.size() / rawBytes << "%), encode " << encodeMs << " ms, decode " << decodeMs << " ms, max error " << maxError << " mm" << std::endl;
+		}
+	}
+}
+
+// TCP での送受信 (同じプロセスの中で、RGBDStreamServer から 127.0.0.1 の StreamFrameSource へ)
+// 30fps と、送信が追いつかない速さ (120fps) でフレームを渡し、帯域、遅延、捨てたフレームを数える
+// 追いつかない場合もキューに溜めずに古いフレームを捨てるので、遅延は 30fps のときと同じ程度に収まる
+void benchStreaming() {
+	const int port = 5599;
+	const int frames = 90;
+	cv::Mat depth(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	std::vector<UINT16> synth = makeDepthFrame(kinectDepthWidth, kinectDepthHeight);
+	memcpy(depth.ptr<UINT16>(0), &synth[0], synth.size() * sizeof(UINT16));
+	cv::Mat color(kinectColorHeight, kinectColorWidth, CV_8UC2);
+	for (int j = 0; j < color.rows; j++) {
+		BYTE *row = color.ptr<BYTE>(j);
+		for (int i = 0; i < color.cols * 2; i += 2) {
+			row[i] = (BYTE)(64 + j * 128 / color.rows); // Y は縦方向のグラデーション
+			row[i + 1] = (BYTE)(128 + ((i / 64) % 2) * 32); // U, V は縞
+		}
+	}
+
+	const double rates[2] = { 30.0, 120.0 };
+	for (int r = 0; r < 2; r++) {
+		RGBDStreamServer server;
+		std::unique_ptr<StreamFrameSource> client(new StreamFrameSource("127.0.0.1", port));
+		try {
+			server.open(port, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight, 500, 4500, defaultKinectCalibration(), true);
+			client->open(FrameSource::ColorDepth);
+		} catch (std::exception &ex) {
+			std::cout << "streaming: " << ex.what() << std::endl;
+			return;
+		}
+		while (!server.isConnected()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		// 受け取る側 (展開済みのフレームを取得するだけ)
+		std::atomic<bool> done(false);
+		unsigned long long acquired = 0;
+		std::thread consumer([&]() {
+			std::vector<UINT16> depthBuffer(client->depthBufferSize());
+			std::vector<BYTE> colorBuffer(client->colorBufferSize());
+			while (!done) {
+				if (!client->waitForFrame(FrameSource::ColorDepth, 50)) continue;
+				if (client->acquireDepthFrame(&depthBuffer[0], depthBuffer.size())) acquired++;
+				client->acquireColorFrame(&colorBuffer[0], colorBuffer.size());
+			}
+		});
+
+		RGBDFrame frame;
+		frame.depth = depth;
+		frame.color = color;
+		frame.roi.depthRect = cv::Rect(0, 0, kinectDepthWidth, kinectDepthHeight);
+		frame.roi.colorRect = cv::Rect(0, 0, kinectColorWidth, kinectColorHeight);
+		auto next = std::chrono::steady_clock::now();
+		for (int n = 1; n <= frames; n++) {
+			next += std::chrono::microseconds((long long)(1e6 / rates[r]));
+			std::this_thread::sleep_until(next);
+			frame.number = n;
+			frame.colorTimestamp = frame.depthTimestamp = currentTimestamp();
+			server.push(frame);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(300)); // 送信中のフレームが届くまで
+		done = true;
+		consumer.join();
+		RGBDStreamStats sent = server.stats();
+		RGBDStreamClientStats received = client->stats();
+		client.reset();
+		server.close();
+
+		std::cout << "streaming " << rates[r] << " fps (" << frames << " frames) : sent " << sent.sent << ", superseded " << sent.superseded << ", stale " << sent.stale
+			<< ", received " << received.received << ", acquired " << acquired << std::endl;
+		if (sent.sent == 0) continue;
+		std::cout << "  depth " << sent.depthBytes / (sent.sent * 1024) << " KB/frame, color " << sent.colorBytes / (sent.sent * 1024) << " KB/frame, "
+			<< sent.megabitsPerSecond << " Mbps, encode mean " << sent.meanEncodeMs << " ms, decode mean " << received.meanDecodeMs << " ms" << std::endl;
+		std::cout << "  latency pushed -> decoded: mean " << received.meanLatencyMs << " ms, max " << received.maxLatencyMs
+			<< " ms, pushed -> acked: mean " << sent.meanLatencyMs << " ms, max " << sent.maxLatencyMs << " ms" << std::endl;
+	}
+}
+
+// 合成フレームの取得元を 1, 2, 4 つ同時に取得して、共有の変換スレッドで処理したときの取得元ごとの fps と遅延
+void benchMultiSource() {
+	const int counts[3] = { 1, 2, 4 };
+	const double seconds = 3.0;
+	for (int c = 0; c < 3; c++) {
+		MultiSourceCapture capture;
+		for (int n = 0; n < counts[c]; n++) capture.addSource("sim" + std::to_string(n), new SimulatedFrameSource(30.0));
+		try {
+			capture.start();
+		} catch (std::exception &ex) {
+			std::cout << "multi source: " << ex.what() << std::endl;
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds((int)(seconds * 1000)));
+		capture.stop();
+
+		const WorkStealingPool *pool = capture.workerPool();
+		unsigned long long executed = 0, stolen = 0;
+		for (size_t t = 0; t < pool->threadCount(); t++) {
+			executed += pool->executed(t);
+			stolen += pool->stolen(t);
+		}
+		std::cout << "multi source x" << counts[c] << " (" << pool->threadCount() << " workers) : executed " << executed << ", stolen " << stolen << std::endl;
+		for (int n = 0; n < capture.sourceCount(); n++) {
+			MultiSourceStats s = capture.stats(n);
+			std::cout << "  " << capture.sourceName(n) << " : " << s.processed / seconds << " fps, throttled " << s.throttled << ", late " << s.late
+				<< ", process mean " << s.meanProcessMs << " ms, latency mean " << s.meanLatencyMs << " ms, max " << s.maxLatencyMs << " ms" << std::endl;
+		}
+	}
+}
+
+// 計測に使う1組のフレーム (合成、または記録データの先頭のフレーム。どちらも Kinect v2 の解像度)
+struct BenchFrame {
+	std::string input;             // "synthetic" / 記録データのパス
+	KinectCalibration calibration;
+	cv::Mat depth;                 // CV_16UC1
+	cv::Mat colorBGRA;             // CV_8UC4 (記録データ、kinect_RGBD_convPoint の入力)
+	cv::Mat colorYUY2;             // CV_8UC2 (Kinect から YUY2 で取得する kinect_color / kinect_RGBD / kinect_multi の入力)
+};
+
+// BGRA → YUY2 (2画素の U, V は平均する)
+void bgraToYUY2(const cv::Mat &src, cv::Mat &dst) {
+	dst.create(src.rows, src.cols, CV_8UC2);
+	for (int j = 0; j < src.rows; j++) {
+		const BYTE *s = src.ptr<BYTE>(j);
+		BYTE *d = dst.ptr<BYTE>(j);
+		for (int i = 0; i + 1 < src.cols; i += 2) {
+			BYTE y0, u0, v0, y1, u1, v1;
+			bgrToYUV(s[i * 4 + 0], s[i * 4 + 1], s[i * 4 + 2], y0, u0, v0);
+			bgrToYUV(s[i * 4 + 4], s[i * 4 + 5], s[i * 4 + 6], y1, u1, v1);
+			d[i * 2 + 0] = y0;
+			d[i * 2 + 1] = (BYTE)((u0 + u1 + 1) / 2);
+			d[i * 2 + 2] = y1;
+			d[i * 2 + 3] = (BYTE)((v0 + v1 + 1) / 2);
+		}
+	}
+}
+
+// 合成フレーム (Depth は makeDepthFrame()、RGB は縦のグラデーションと縞)
+BenchFrame makeBenchFrame() {
+	BenchFrame frame;
+	frame.input = "synthetic";
+	frame.calibration = defaultKinectCalibration();
+	std::vector<UINT16> depth = makeDepthFrame(kinectDepthWidth, kinectDepthHeight);
+	frame.depth = cv::Mat(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	memcpy(frame.depth.ptr<UINT16>(0), &depth[0], depth.size() * sizeof(UINT16));
+	frame.colorYUY2 = cv::Mat(kinectColorHeight, kinectColorWidth, CV_8UC2);
+	for (int j = 0; j < kinectColorHeight; j++) {
+		BYTE *row = frame.colorYUY2.ptr<BYTE>(j);
+		for (int i = 0; i < kinectColorWidth * 2; i += 2) {
+			row[i] = (BYTE)(64 + j * 128 / kinectColorHeight);
+			row[i + 1] = (BYTE)(128 + ((i / 64) % 2) * 32);
+		}
+	}
+	yuy2ToBGRA(frame.colorYUY2, frame.colorBGRA);
+	return frame;
+}
+
+// 記録データの先頭の RGB と Depth (読めなければ false)
+bool loadBenchFrame(const char *path, BenchFrame &frame) {
+	try {
+		ReplayFrameSource source(path, 0, false);
+		source.open(FrameSource::ColorDepth);
+		if (source.depthWidth != kinectDepthWidth || source.depthHeight != kinectDepthHeight ||
+			source.colorWidth != kinectColorWidth || source.colorHeight != kinectColorHeight) return false;
+		frame.input = path;
+		if (!source.getCalibration(frame.calibration)) frame.calibration = defaultKinectCalibration();
+		frame.depth = cv::Mat(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+		frame.colorBGRA = cv::Mat(kinectColorHeight, kinectColorWidth, CV_8UC4);
+		if (!source.acquireDepthFrame(frame.depth.ptr<UINT16>(0), source.depthBufferSize())) return false;
+		if (!source.acquireColorFrame(frame.colorBGRA.ptr<BYTE>(0), source.colorBufferSize())) return false;
+	} catch (std::exception &ex) {
+		std::cout << ex.what() << std::endl;
+		return false;
+	}
+	bgraToYUY2(frame.colorBGRA, frame.colorYUY2);
+	return true;
+}
+
+// 同じフレームを何度でも渡す取得元 (KinectApp と同じ取得と CoordinateMapCache の計測に使う)
+class StillFrameSource : public FrameSource {
+private:
+	const BenchFrame &frame;
+
+public:
+	StillFrameSource(const BenchFrame &frame) : frame(frame) {}
+
+	void open(int streams) {
+		if (streams & Color) {
+			colorWidth = kinectColorWidth;
+			colorHeight = kinectColorHeight;
+			colorFormat = requestedColorFormat;
+			colorBytesPerPixel = (colorFormat == ColorYUY2) ? 2 : kinectColorBytesPerPixel;
+		}
+		if (streams & Depth) {
+			depthWidth = kinectDepthWidth;
+			depthHeight = kinectDepthHeight;
+		}
+	}
+
+	bool acquireColorFrame(BYTE *buffer, size_t size) {
+		const cv::Mat &color = (colorFormat == ColorYUY2) ? frame.colorYUY2 : frame.colorBGRA;
+		memcpy(buffer, color.ptr<BYTE>(0), (std::min)(size, color.total() * color.elemSize()));
+		return true;
+	}
+
+	bool acquireDepthFrame(UINT16 *buffer, size_t size) {
+		memcpy(buffer, frame.depth.ptr<UINT16>(0), (std::min)(size, frame.depth.total()) * sizeof(UINT16));
+		return true;
+	}
+
+	bool getCalibration(KinectCalibration &calibration) {
+		calibration = frame.calibration;
+		return true;
+	}
+};
+
+// KinectApp の変換処理を1つずつ (各サンプルの KinectApp と同じ関数・同じ設定で)
+void benchKernels(int iterations, const BenchFrame &frame) {
+	benchInput = frame.input;
+	const size_t depthPixels = frame.depth.total(), colorPixels = frame.colorBGRA.total();
+	DepthRegistration registration;
+	registration.initialize(frame.calibration);
+	cv::Mat colorSpace(frame.depth.rows, frame.depth.cols, CV_32FC2);
+	const ColorSpacePoint *points = colorSpace.ptr<ColorSpacePoint>(0);
+	registration.depthToColorSpace(frame.depth.ptr<UINT16>(0), colorSpace.ptr<ColorSpacePoint>(0));
+	cv::Mat img, raw;
+
+	printResult("kernel updateDepthCvtImage", measure([&]() { depthWindowLUT(600, 3000).apply(frame.depth, img); }, iterations), depthPixels);
+	printResult("kernel updateDepthRawImage", measure([&]() { frame.depth.copyTo(img); }, iterations), depthPixels);
+	printResult("kernel updateColorImage (YUY2)", measure([&]() { yuy2ToBGRA(frame.colorYUY2, img); }, iterations), colorPixels);
+	printResult("kernel updateColorHalfImage (YUY2)", measure([&]() { yuy2ToBGRAHalf(frame.colorYUY2, img); }, iterations), colorPixels);
+	printResult("kernel display resize 0.5 (BGRA)", measure([&]() { cv::resize(frame.colorBGRA, img, cv::Size(), 0.5, 0.5); }, iterations), colorPixels);
+	printResult("kernel registration depthToColorSpace", measure([&]() {
+		registration.depthToColorSpace(frame.depth.ptr<UINT16>(0), colorSpace.ptr<ColorSpacePoint>(0));
+	}, iterations), depthPixels);
+	printResult("kernel updateColor2DepthImage (BGRA)", measure([&]() {
+		warpColorToDepth(frame.colorBGRA, points, frame.depth.cols, frame.depth.rows, img);
+	}, iterations), depthPixels);
+	printResult("kernel updateColor2DepthImage (YUY2)", measure([&]() {
+		warpColorToDepth(frame.colorYUY2, points, frame.depth.cols, frame.depth.rows, img);
+	}, iterations), depthPixels);
+
+	// kinect_RGBD_convPoint の既定の設定 (全解像度、Zバッファ)
+	DepthWarpOptions full;
+	printResult("kernel updateDepth2ColorRawImage", measure([&]() {
+		warpDepthToColor(frame.depth.ptr<UINT16>(0), points, frame.depth.cols, frame.depth.rows, kinectColorWidth, kinectColorHeight, full, img);
+	}, iterations), depthPixels);
+
+	// kinect_RGBD の表示の設定 (半分の解像度、広げて穴埋め)
+	DepthWarpOptions half;
+	half.splat = 0;
+	half.fillHoles = true;
+	half.downscale = 2;
+	printResult("kernel updateDepth2ColorCvtImage (half, fill)", measure([&]() {
+		warpDepthToColor(frame.depth.ptr<UINT16>(0), points, frame.depth.cols, frame.depth.rows, kinectColorWidth, kinectColorHeight, half, raw);
+		depthWindowLUT(600, 1000).apply(raw, img);
+	}, iterations), depthPixels);
+
+	// 逆引き表は新しいDepthフレームの最初の呼び出しで作るので、その分と、作った後の1点あたりを分けて計る
+	StillFrameSource source(frame);
+	source.open(FrameSource::ColorDepth);
+	CoordinateMapCache mapCache;
+	mapCache.initialize(&source, source.depthWidth, source.depthHeight, source.colorWidth, source.colorHeight);
+	mapCache.setSoftwareRegistration(true);
+	const UINT16 *depth = frame.depth.ptr<UINT16>(0);
+	DepthSpacePoint found;
+	printResult("kernel pointColor2DepthSpace (new frame)", measure([&]() {
+		mapCache.invalidate();
+		mapCache.colorToDepthSpace(kinectColorWidth / 2.0f, kinectColorHeight / 2.0f, depth, depthPixels, found);
+	}, iterations), depthPixels);
+	const int lookups = 1000;
+	printResult("kernel pointColor2DepthSpace x1000 (cached)", measure([&]() {
+		for (int k = 0; k < lookups; k++) {
+			mapCache.colorToDepthSpace((float)(k * 37 % kinectColorWidth), (float)(k * 17 % kinectColorHeight), depth, depthPixels, found);
+		}
+	}, iterations), lookups);
+
+	PointCloudGenerator generator;
+	generator.initialize(frame.calibration);
+	PointCloud cloud;
+	printResult("kernel updatePointCloud (color)", measure([&]() { generator.generate(frame.depth, cloud, frame.colorBGRA, points); }, iterations), depthPixels);
+}
+
+// 各サンプルの main() のメインループの1フレーム分 (取得元からの取得から表示する画像を作るまで。待ち時間と cv::imshow は含まない)
+void benchFrameLoops(int iterations, const BenchFrame &frame) {
+	benchInput = frame.input;
+	const size_t depthPixels = frame.depth.total(), colorPixels = frame.colorBGRA.total();
+	StillFrameSource yuy2Source(frame), bgraSource(frame);
+	yuy2Source.preferColorFormat(FrameSource::ColorYUY2);
+	yuy2Source.open(FrameSource::ColorDepth);
+	bgraSource.open(FrameSource::ColorDepth);
+
+	FrameBuffer<UINT16> depthBuffer;
+	depthBuffer.create(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	FrameBuffer<BYTE> yuy2Buffer, bgraBuffer;
+	yuy2Buffer.create(kinectColorHeight, kinectColorWidth, CV_8UC2);
+	bgraBuffer.create(kinectColorHeight, kinectColorWidth, CV_8UC4);
+	auto acquireDepth = [&](FrameSource &source) {
+		source.acquireDepthFrame(depthBuffer.beginWrite(), depthBuffer.size());
+		depthBuffer.endWrite();
+		return depthBuffer.view();
+	};
+	auto acquireColor = [&](FrameSource &source, FrameBuffer<BYTE> &buffer) {
+		source.acquireColorFrame(buffer.beginWrite(), buffer.size());
+		buffer.endWrite();
+		return buffer.view();
+	};
+
+	// kinect_color : 取得して縦横半分の BGRA にする
+	cv::Mat dispCol;
+	printResult("loop kinect_color", measure([&]() { yuy2ToBGRAHalf(acquireColor(yuy2Source, yuy2Buffer), dispCol); }, iterations), colorPixels);
+
+	// kinect_depth : 取得して256諧調にする (フィルタと背景モデルを全て使う場合も)
+	cv::Mat dispDep;
+	DepthWindowLUT lut;
+	printResult("loop kinect_depth", measure([&]() { lut.set(600, 3000); lut.apply(acquireDepth(yuy2Source), dispDep); }, iterations), depthPixels);
+	DepthTemporalFilter temporal;
+	DepthSpatialFilter spatial;
+	DepthBackground background;
+	temporal.initialize(kinectDepthWidth, kinectDepthHeight);
+	spatial.initialize(kinectDepthWidth, kinectDepthHeight);
+	background.initialize(kinectDepthWidth, kinectDepthHeight);
+	printResult("loop kinect_depth (t+s+b)", measure([&]() {
+		UINT16 *depth = depthBuffer.beginWrite();
+		yuy2Source.acquireDepthFrame(depth, depthBuffer.size());
+		background.apply(depth);
+		temporal.apply(depth);
+		spatial.apply(depth);
+		depthBuffer.endWrite();
+		lut.set(600, 3000);
+		lut.apply(depthBuffer.view(), dispDep);
+	}, iterations), depthPixels);
+
+	// kinect_RGBD : 取得して位置合わせし、処理段 (ProcessStage::process) の4つの画像を作る
+	CoordinateMapCache mapCache;
+	mapCache.initialize(&yuy2Source, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight);
+	mapCache.setSoftwareRegistration(true);
+	DepthWarpOptions half;
+	half.splat = 0;
+	half.fillHoles = true;
+	half.downscale = 2;
+	cv::Mat depRGBsp, raw, rgbDsp;
+	printResult("loop kinect_RGBD", measure([&]() {
+		cv::Mat color = acquireColor(yuy2Source, yuy2Buffer);
+		cv::Mat depth = acquireDepth(yuy2Source);
+		mapCache.invalidate();
+		const ColorSpacePoint *points = mapCache.depthToColorSpace(depth.ptr<UINT16>(0), depth.total());
+		yuy2ToBGRAHalf(color, dispCol);
+		depthWindowLUT(600, 3000).apply(depth, dispDep);
+		warpColorToDepth(color, points, kinectDepthWidth, kinectDepthHeight, depRGBsp);
+		warpDepthToColor(depth.ptr<UINT16>(0), points, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight, half, raw);
+		depthWindowLUT(600, 1000).apply(raw, rgbDsp);
+	}, iterations), depthPixels + colorPixels);
+
+	// kinect_RGBD_convPoint : BGRA で取得して表示用に縮小し、256諧調にする
+	// クリック中は逆引きと点群 (色なし) も求める
+	PointCloudGenerator generator;
+	generator.initialize(frame.calibration);
+	PointCloud cloud;
+	cv::Mat dispDepCol;
+	printResult("loop kinect_RGBD_convPoint", measure([&]() {
+		cv::Mat color = acquireColor(bgraSource, bgraBuffer);
+		cv::Mat depth = acquireDepth(bgraSource);
+		mapCache.invalidate();
+		cv::resize(color, dispCol, cv::Size(), 0.5, 0.5);
+		lut.set(600, 3000);
+		lut.apply(depth, dispDep);
+	}, iterations), depthPixels + colorPixels);
+	printResult("loop kinect_RGBD_convPoint (clicked)", measure([&]() {
+		cv::Mat color = acquireColor(bgraSource, bgraBuffer);
+		cv::Mat depth = acquireDepth(bgraSource);
+		mapCache.invalidate();
+		cv::resize(color, dispCol, cv::Size(), 0.5, 0.5);
+		lut.set(600, 3000);
+		lut.apply(depth, dispDep);
+		cv::cvtColor(dispDep, dispDepCol, cv::COLOR_GRAY2BGR);
+		DepthSpacePoint point;
+		if (mapCache.colorToDepthSpace(kinectColorWidth / 2.0f, kinectColorHeight / 2.0f, depth.ptr<UINT16>(0), depth.total(), point)) {
+			generator.generate(depth, cloud);
+		}
+	}, iterations), depthPixels + colorPixels);
+
+	// kinect_multi : 取得元1つ分の変換 (YUY2 → BGRA と位置合わせ、1スレッド)
+	cv::Mat colorBGRA(kinectColorHeight, kinectColorWidth, CV_8UC4), colorSpace(kinectDepthHeight, kinectDepthWidth, CV_32FC2);
+	DepthRegistration registration;
+	registration.initialize(frame.calibration);
+	printResult("loop kinect_multi (per source)", measure([&]() {
+		cv::Mat color = acquireColor(yuy2Source, yuy2Buffer);
+		cv::Mat depth = acquireDepth(yuy2Source);
+		for (int j = 0; j < color.rows; j++) yuy2ToBGRARow(color.ptr<BYTE>(j), colorBGRA.ptr<BYTE>(j), color.cols);
+		registration.mapRows(depth.ptr<UINT16>(0), colorSpace.ptr<ColorSpacePoint>(0), 0, kinectDepthHeight);
+	}, iterations), depthPixels + colorPixels);
+}
+
+// 段ごとの時間の計測 (StageProfiler) の負荷
+// KINECT_PROFILE の有無に関わらず計れるように、マクロではなく StageTimer を直接使う
+// 区間1つの時間 (トレース無し / 有り) と、kinect_RGBD のループの各段を計ったときの増分を比べる
+void benchProfiler(int iterations, const BenchFrame &frame) {
+	benchInput = frame.input;
+	StageProfiler &profiler = StageProfiler::instance();
+	const int scopes = 1000; // 1回の measure() で計る区間の数
+	const int empty = profiler.stage("bench empty");
+	double untraced = measure([&]() {
+		for (int n = 0; n < scopes; n++) StageTimer timer(empty);
+	}, iterations);
+	printResult("profiler scope x1000", untraced, scopes);
+	profiler.setTracing(true, (size_t)(iterations + 1) * scopes * 2); // 容量はここで決まる (ループの分も含めて捨てずに記録できる大きさ)
+	double traced = measure([&]() {
+		for (int n = 0; n < scopes; n++) StageTimer timer(empty);
+	}, iterations);
+	printResult("profiler scope x1000 (trace)", traced, scopes);
+	profiler.setTracing(false);
+
+	StillFrameSource source(frame);
+	source.preferColorFormat(FrameSource::ColorYUY2);
+	source.open(FrameSource::ColorDepth);
+	FrameBuffer<UINT16> depthBuffer;
+	depthBuffer.create(kinectDepthHeight, kinectDepthWidth, CV_16UC1);
+	FrameBuffer<BYTE> colorBuffer;
+	colorBuffer.create(kinectColorHeight, kinectColorWidth, CV_8UC2);
+	CoordinateMapCache mapCache;
+	mapCache.initialize(&source, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight);
+	mapCache.setSoftwareRegistration(true);
+	DepthWarpOptions half;
+	half.splat = 0;
+	half.fillHoles = true;
+	half.downscale = 2;
+	cv::Mat dispCol, dispDep, depRGBsp, raw, rgbDsp;
+
+	// kinect_RGBD と同じ段 (profiled なら各段と全体で9区間)
+	const char *names[] = { "bench loop", "bench acquire color", "bench acquire depth", "bench coordinate mapping", "bench process",
+		"bench updateColorHalfImage", "bench updateDepthCvtImage", "bench updateColor2DepthImage", "bench updateDepth2ColorCvtImage" };
+	const int stageCount = sizeof(names) / sizeof(names[0]);
+	int stages[stageCount];
+	for (int n = 0; n < stageCount; n++) stages[n] = profiler.stage(names[n]);
+	auto loop = [&](bool profiled) {
+		const int none = -1; // 記録しない段 (計測しない場合の時計の読み出しは残る)
+		auto stage = [&](int n) { return profiled ? stages[n] : none; };
+		StageTimer total(stage(0));
+		cv::Mat color, depth;
+		{
+			StageTimer timer(stage(1));
+			source.acquireColorFrame(colorBuffer.beginWrite(), colorBuffer.size());
+			colorBuffer.endWrite();
+			color = colorBuffer.view();
+		}
+		{
+			StageTimer timer(stage(2));
+			source.acquireDepthFrame(depthBuffer.beginWrite(), depthBuffer.size());
+			depthBuffer.endWrite();
+			depth = depthBuffer.view();
+		}
+		const ColorSpacePoint *points;
+		{
+			StageTimer timer(stage(3));
+			mapCache.invalidate();
+			points = mapCache.depthToColorSpace(depth.ptr<UINT16>(0), depth.total());
+		}
+		StageTimer process(stage(4));
+		{
+			StageTimer timer(stage(5));
+			yuy2ToBGRAHalf(color, dispCol);
+		}
+		{
+			StageTimer timer(stage(6));
+			depthWindowLUT(600, 3000).apply(depth, dispDep);
+		}
+		{
+			StageTimer timer(stage(7));
+			warpColorToDepth(color, points, kinectDepthWidth, kinectDepthHeight, depRGBsp);
+		}
+		{
+			StageTimer timer(stage(8));
+			warpDepthToColor(depth.ptr<UINT16>(0), points, kinectDepthWidth, kinectDepthHeight, kinectColorWidth, kinectColorHeight, half, raw);
+			depthWindowLUT(600, 1000).apply(raw, rgbDsp);
+		}
+	};
+	const size_t pixels = frame.depth.total() + frame.colorBGRA.total();
+	double plain = measure([&]() { loop(false); }, iterations);
+	printResult("loop kinect_RGBD (not profiled)", plain, pixels);
+	double profiled = measure([&]() { loop(true); }, iterations);
+	printResult("loop kinect_RGBD (profiled)", profiled, pixels);
+	profiler.setTracing(true);
+	double tracedLoop = measure([&]() { loop(true); }, iterations);
+	printResult("loop kinect_RGBD (profiled + trace)", tracedLoop, pixels);
+	profiler.setTracing(false);
+
+	// 区間1つの時間から見積もった負荷 (ループ同士の差は揺らぎに埋もれやすい)
+	double scopeMs = untraced / scopes, tracedScopeMs = traced / scopes;
+	std::cout << "profiler overhead : " << scopeMs * 1e6 << " ns/scope (" << tracedScopeMs * 1e6 << " ns with trace), " << stageCount << " scopes/frame = "
+		<< stageCount * scopeMs / plain * 100.0 << " % (" << stageCount * tracedScopeMs / plain * 100.0 << " % with trace) of loop kinect_RGBD, measured "
+		<< (profiled / plain - 1.0) * 100.0 << " % (" << (tracedLoop / plain - 1.0) * 100.0 << " % with trace)" << std::endl;
+}
+
+// CSV の1行を欄に分ける (引用符で囲んだ欄の中の "" は " にする)
+std::vector<std::string> splitCSVLine(const std::string &line) {
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for (size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if (quoted) {
+			if (c != '"') fields.back() += c;
+			else if (i + 1 < line.size() && line[i + 1] == '"') fields.back() += line[++i];
+			else quoted = false;
+		} else if (c == '"') {
+			quoted = true;
+		} else if (c == ',') {
+			fields.push_back(std::string());
+		} else if (c != '\r') {
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
+// writeResultsCSV() で書き出した結果を読む
+bool readResultsCSV(const char *path, std::vector<BenchResult> &results) {
+	std::ifstream in(path);
+	if (!in) return false;
+	std::string line;
+	std::getline(in, line); // 見出し
+	while (std::getline(in, line)) {
+		std::vector<std::string> f = splitCSVLine(line);
+		if (f.size() < 7) continue;
+		double ms = atof(f[2].c_str()), nsPerPixel = atof(f[3].c_str());
+		BenchResult r = { f[0], f[1], ms, (size_t)(nsPerPixel > 0 ? ms * 1e6 / nsPerPixel + 0.5 : 1), atof(f[5].c_str()), atof(f[6].c_str()) };
+		results.push_back(r);
+	}
+	return true;
+}
+
+// 2つの版の結果を比べる (名前と入力が同じ計測ごとに処理時間の比と確保の回数の差を表示する)
+// 処理時間が tolerance [%] より遅くなったもの、確保が増えたものの数を返す
+int compareResults(const char *basePath, const char *currentPath, double tolerance) {
+	std::vector<BenchResult> base, current;
+	if (!readResultsCSV(basePath, base) || !readResultsCSV(currentPath, current)) {
+		std::cout << "cannot read " << basePath << " or " << currentPath << std::endl;
+		return -1;
+	}
+	int regressions = 0;
+	for (size_t n = 0; n < current.size(); n++) {
+		const BenchResult &c = current[n];
+		const BenchResult *b = nullptr;
+		for (size_t k = 0; k < base.size() && b == nullptr; k++) {
+			if (base[k].name == c.name && base[k].input == c.input) b = &base[k];
+		}
+		if (b == nullptr) {
+			std::cout << "  new  " << c.name << " [" << c.input << "] : " << c.ms << " ms" << std::endl;
+			continue;
+		}
+		double ratio = c.ms / b->ms;
+		double allocs = (c.heapAllocs + c.matAllocs) - (b->heapAllocs + b->matAllocs);
+		bool slower = ratio > 1.0 + tolerance / 100.0;
+		bool moreAllocs = allocs >= 0.5;
+		if (slower || moreAllocs) regressions++;
+		char line[256];
+		snprintf(line, sizeof(line), "%s %-48s [%s] : %.3f -> %.3f ms (%+.1f %%), allocs %+.1f", (slower || moreAllocs) ? "  NG " : "     ",
+			c.name.c_str(), c.input.c_str(), b->ms, c.ms, (ratio - 1.0) * 100.0, allocs);
+		std::cout << line << std::endl;
+	}
+	std::cout << regressions << " regressions (slower than " << tolerance << " % or more allocations)" << std::endl;
+	return regressions;
+}
+
+// 引数: [繰り返し回数 [記録データ (- なら使わない) [結果の CSV (- なら書き出さない) [計測する項目 (カンマ区切り、既定は全て)]]]]
+//       diff 前の版の CSV 今の版の CSV [遅くなったとみなす割合 % (既定 10)]
+// 記録データはボクセルグリッドと、KinectApp の変換処理 (kernels)・メインループ (loops) の計測に使う (合成フレームでも計測する)
+// diff は名前と入力が同じ計測を比べ、遅くなったものか確保が増えたものがあれば 1 を返す
+int main(int argc, char *argv[]) {
+	if (argc > 3 && strcmp(argv[1], "diff") == 0) {
+		int regressions = compareResults(argv[2], argv[3], (argc > 4) ? atof(argv[4]) : 10.0);
+		return (regressions == 0) ? 0 : 1;
+	}
+	int iterations = (argc > 1) ? atoi(argv[1]) : 100;
+	const char *recordPath = (argc > 2 && strcmp(argv[2], "-") != 0) ? argv[2] : nullptr;
+	const char *csvPath = (argc > 3 && strcmp(argv[3], "-") != 0) ? argv[3] : nullptr;
+	std::string selected = (argc > 4) ? "," + std::string(argv[4]) + "," : "";
+
+	static CountingMatAllocator matAllocator;
+	cv::Mat::setDefaultAllocator(&matAllocator);
+
+	BenchFrame synthetic = makeBenchFrame(), recorded;
+	bool hasRecorded = recordPath != nullptr && loadBenchFrame(recordPath, recorded);
+	if (recordPath != nullptr && !hasRecorded) std::cout << "kernels / loops : cannot read " << recordPath << ", synthetic frame only" << std::endl;
+
+	struct Bench {
+		const char *name;
+		std::function<void()> run;
+	};
+	const Bench benches[] = {
+		{ "depthCvt", [&]() { benchDepthCvt(iterations); } },
+		{ "depthRaw", [&]() { benchDepthRaw(iterations); } },
+		{ "registration", [&]() { benchRegistration(iterations); } },
+		{ "depthWarp", [&]() { benchDepthWarp(iterations); } },
+		{ "registrationScaling", [&]() { benchRegistrationScaling(iterations); } },
+		{ "pointCloud", [&]() { benchPointCloud(iterations); } },
+		{ "voxelGrid", [&]() { benchVoxelGrid(iterations, recordPath); } },
+		{ "temporalFilter", [&]() { benchTemporalFilter(iterations); } },
+		{ "spatialFilter", [&]() { benchSpatialFilter(iterations); } },
+		{ "background", [&]() { benchBackground(iterations); } },
+		{ "captureROI", [&]() { benchCaptureROI(iterations); } },
+		{ "colorConvert", [&]() { benchColorConvert(iterations); } },
+		{ "sharedFrames", [&]() { benchSharedFrames(iterations); } },
+		{ "depthCodec", [&]() { benchDepthCodec(iterations); } },
+		{ "streaming", [&]() { benchStreaming(); } },
+		{ "multiSource", [&]() { benchMultiSource(); } },
+		{ "kernels", [&]() {
+			benchKernels(iterations, synthetic);
+			if (hasRecorded) benchKernels(iterations, recorded);
+		} },
+		{ "loops", [&]() {
+			benchFrameLoops(iterations, synthetic);
+			if (hasRecorded) benchFrameLoops(iterations, recorded);
+		} },
+		{ "profiler", [&]() { benchProfiler(iterations, synthetic); } },
+	};
+	for (size_t n = 0; n < sizeof(benches) / sizeof(benches[0]); n++) {
+		if (!selected.empty() && selected.find("," + std::string(benches[n].name) + ",") == std::string::npos) continue;
+		benchInput = "synthetic";
+		benches[n].run();
+	}
+
+	if (csvPath != nullptr) {
+		if (writeResultsCSV(csvPath)) std::cout << benchResults.size() << " results written to " << csvPath << std::endl;
+		else std::cout << "cannot write " << csvPath << std::endl;
+	}
+	return 0;
+}
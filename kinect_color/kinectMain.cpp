@@ -1,104 +1,139 @@
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
-#include <Kinect.h>
-
-#include <atlbase.h>
-
-#define ERROR_CHECK( ret )  \
-    if ( (ret) != S_OK ) {    \
-        std::stringstream ss;	\
-        ss << "failed " #ret " " << std::hex << ret << std::endl;			\
-        throw std::runtime_error( ss.str().c_str() );			\
-    }
+#include "../kinect_common/ColorConvert.h"
+#include "../kinect_common/FrameBuffer.h"
+#include "../kinect_common/FrameSource.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SimulatedFrameSource.h"
 
 class KinectApp{
 private:
-	// Kinect SDK
-	CComPtr<IKinectSensor> kinect = nullptr;
-	CComPtr<IColorFrameReader> colorFrameReader = nullptr;
+	// フレームの取得元 (Kinect本体 or 記録データ)
+	std::unique_ptr<FrameSource> source;
 
 	int colorWidth;
 	int colorHeight;
 	unsigned int colorBytesPerPixel;
-	ColorImageFormat colorFormat = ColorImageFormat::ColorImageFormat_Bgra;
 
-	// \
-	std::vector<BYTE> colorBuffer;
+	// 表示部分
+	FrameBuffer<BYTE> colorBuffer; // RGBフレームのプール (参照カウントで寿命を管理する。取得元が対応していれば YUY2 のまま置く)
 
 public:
-	~KinectApp(){
-		// Kinect̓I
-		if (kinect != nullptr) {
-			kinect->Close();
+	// 初期化 (replayPath を指定すると Kinect の代わりに記録データを fps で再生する。"sim" なら合成フレームを fps で届ける)
+	void initialize(const char *replayPath = nullptr, double fps = 30.0){
+		if (replayPath != nullptr && std::string(replayPath) == "sim") {
+			source.reset(new SimulatedFrameSource(fps));
+		} else if (replayPath != nullptr) {
+			source.reset(new ReplayFrameSource(replayPath, fps));
+		} else {
+#ifdef _WIN32
+			source.reset(new KinectSensorSource());
+#else
+			throw std::runtime_error("Kinect is not available on this platform (specify a recorded data directory)");
+#endif
 		}
-	}
-
-	// 
-	void initialize(){
-		// ftHgKinect擾
-		ERROR_CHECK(::GetDefaultKinectSensor(&kinect));
-		ERROR_CHECK(kinect->Open());
-
-		// J[[_[擾
-		CComPtr<IColorFrameSource> colorFrameSource;
-		ERROR_CHECK(kinect->get_ColorFrameSource(&colorFrameSource));
-		ERROR_CHECK(colorFrameSource->OpenReader(&colorFrameReader));
-
-		// ftHg̃J[摜̃TCY擾
-		CComPtr<IFrameDescription> defaultColorFrameDescription;
-		ERROR_CHECK(colorFrameSource->get_FrameDescription(&defaultColorFrameDescription));
-		ERROR_CHECK(defaultColorFrameDescription->get_Width(&colorWidth));
-		ERROR_CHECK(defaultColorFrameDescription->get_Height(&colorHeight));
-		ERROR_CHECK(defaultColorFrameDescription->get_BytesPerPixel(&colorBytesPerPixel));
-		std::cout << "default : " << colorWidth << ", " << colorHeight << ", " << colorBytesPerPixel << std::endl;
+		source->preferColorFormat(FrameSource::ColorYUY2); // BGRA への変換は表示する分だけ行う
+		source->open(FrameSource::Color);
 
-		// J[摜̃TCY擾
-		CComPtr<IFrameDescription> colorFrameDescription;
-		ERROR_CHECK(colorFrameSource->CreateFrameDescription(colorFormat, &colorFrameDescription));
-		ERROR_CHECK(colorFrameDescription->get_Width(&colorWidth));
-		ERROR_CHECK(colorFrameDescription->get_Height(&colorHeight));
-		ERROR_CHECK(colorFrameDescription->get_BytesPerPixel(&colorBytesPerPixel));
-		std::cout << "create  : " << colorWidth << ", " << colorHeight << ", " << colorBytesPerPixel << std::endl;
+		colorWidth = source->colorWidth;
+		colorHeight = source->colorHeight;
+		colorBytesPerPixel = source->colorBytesPerPixel;
 
-		// obt@[쐬
-		colorBuffer.resize(colorWidth * colorHeight * colorBytesPerPixel);
+		// バッファーを作成する
+		colorBuffer.create(colorHeight, colorWidth, (source->colorFormat == FrameSource::ColorYUY2) ? CV_8UC2 : CV_8UC4);
 	}
 
-	// J[t[̍XV
-	void updateColorFrame(){
-		// t[擾
-		CComPtr<IColorFrame> colorFrame;
-		auto ret = colorFrameReader->AcquireLatestFrame(&colorFrame);
-		if (FAILED(ret))return;
-
-		// w̌`Ńf[^擾
-		ERROR_CHECK(colorFrame->CopyConvertedFrameDataToArray(colorBuffer.size(), &colorBuffer[0], colorFormat));
+	// カラーフレームの更新 (新しいフレームを取得できたら true)
+	bool updateColorFrame(){
+		// フレームを取得する
+		BYTE *color = colorBuffer.beginWrite(); // 空いているスロット (利用者が持っているフレームには書き込まない)
+		if (color == nullptr || !source->acquireColorFrame(color, colorBuffer.size())) return false;
+		colorBuffer.endWrite();
+		return true;
 	}
 
-	// RGBMat`Ŏ擾
+	// 新しいカラーフレーム ができるまで最大 timeoutMs 待つ (できたら true)
+	// 取得元にフレームが届いた時点で起きて取得するので、ポーリングの空回りや待ち時間による遅延が無い
+	bool waitColorFrame(int timeoutMs) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		for (;;) {
+			if (updateColorFrame()) return true;
+			auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remain <= 0) return false;
+			source->waitForFrame(FrameSource::Color, (int)remain);
+		}
+	}
+
+	// 最新フレームが届いてから今までの時間 [ms] (取得元のタイムスタンプがこの PC の時計でなければ -1)
+	double frameLatency() const {
+		if (!source->hostClock) return -1;
+		return (currentTimestamp() - source->colorTimestamp) / 10000.0;
+	}
+
+	// RGBをMat形式 (BGRA) で取得
+	// BGRA で取得している場合はコピーせずにフレームを指し (読み取り専用)、img を持っている間はそのフレームのデータは上書きされない
+	// YUY2 で取得している場合は img に変換する
 	void updateColorImage(cv::Mat &img) {
-		img = cv::Mat(colorHeight, colorWidth, CV_8UC4, &colorBuffer[0]);
+		cv::Mat color = colorBuffer.view();
+		if (color.type() == CV_8UC4) img = color;
+		else yuy2ToBGRA(color, img);
+	}
+
+	// RGBを縦横半分の BGRA で取得 (YUY2 なら縮小と変換を1回で行う)
+	void updateColorHalfImage(cv::Mat &img) {
+		cv::Mat color = colorBuffer.view();
+		if (color.type() == CV_8UC2) yuy2ToBGRAHalf(color, img);
+		else cv::resize(color, img, cv::Size(), 0.5, 0.5);
 	}
 };
 
-int main() {
+// 引数: [記録データのディレクトリ ("sim" なら合成フレーム) [再生fps (0ならできるだけ速く)] [処理フレーム数]]
+// 処理フレーム数を指定すると、画像を表示せずにそのフレーム数を処理して処理速度を表示する
+int main(int argc, char *argv[]) {
 	KinectApp knct;
-	cv::Mat capM, dispM;
-
-	try { knct.initialize(); } // Kinect̏
-	catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
-
-	while (1) { // C[v
-		knct.updateColorFrame();
-		knct.updateColorImage(capM);
-		cv::resize(capM, dispM, cv::Size(), 0.5, 0.5);
-
+	cv::Mat dispM;
+
+	const char *replayPath = (argc > 1) ? argv[1] : nullptr;
+	double replayFps = (argc > 2) ? atof(argv[2]) : 30.0;
+	int benchFrames = (argc > 3) ? atoi(argv[3]) : 0;
+	bool display = (benchFrames <= 0);
+
+	try { knct.initialize(replayPath, replayFps); } // Kinectの初期化
+	catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+
+	int frames = 0;
+	double latencySum = 0, latencyMax = 0; // 届いてから取得するまでの時間 [ms] (合成フレームのときだけ測れる)
+	int latencyCount = 0;
+	double startTick = (double)cv::getTickCount();
+	while (1) { // メインループ
+		// フレームが届くまで待つ (表示中はウィンドウの処理のため最大30ms)
+		if (knct.waitColorFrame(display ? 30 : 1000)) {
+			frames++;
+			double latency = knct.frameLatency();
+			if (latency >= 0) {
+				latencySum += latency;
+				latencyMax = (std::max)(latencyMax, latency);
+				latencyCount++;
+			}
+		}
+		knct.updateColorHalfImage(dispM);
+
+		if (!display) { // 表示せずに処理速度を計測
+			if (frames >= benchFrames) break;
+			continue;
+		}
 		cv::imshow("color Image", dispM);
-		auto key = cv::waitKey(10);
+		auto key = cv::waitKey(1);
 		if (key == 'q') {
 			break;
 		}
 	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+	std::cout << "frames: " << frames << ", " << sec << " sec, " << frames / sec << " fps" << std::endl;
+	if (latencyCount > 0) std::cout << "latency (arrival -> acquired): mean " << latencySum / latencyCount << " ms, max " << latencyMax << " ms" << std::endl;
 	return 0;
 }
\ No newline at end of file
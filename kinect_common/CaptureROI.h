@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+#include "KinectCalibration.h"
+#include "KinectTypes.h"
+
+// 処理する範囲 (作業空間) の指定
+// 窓は Depth画像か RGB画像のどちらかで指定し、もう一方は resolveCaptureROI() で位置合わせのパラメータから求める
+// 範囲外のDepth値は値が無い (0) ものとして扱う
+struct CaptureROI {
+	cv::Rect depthRect;  // Depth画像上の窓 (空なら colorRect から求める。両方空なら全体)
+	cv::Rect colorRect;  // RGB画像上の窓 (空なら depthRect から求める)
+	UINT16 minDepth = 0; // 処理するDepth値の範囲 [mm] (0 なら制限しない)
+	UINT16 maxDepth = 0;
+
+	// Depth値の範囲 (境界を含む。0 は常に範囲外)
+	UINT16 depthMin() const { return (std::max)(minDepth, (UINT16)1); }
+	UINT16 depthMax() const { return (maxDepth > 0) ? maxDepth : (UINT16)65535; }
+	bool inRange(UINT16 d) const { return d >= depthMin() && d <= depthMax(); }
+	bool hasDepthRange() const { return minDepth > 1 || maxDepth > 0; }
+};
+
+// RGBカメラの射影行列とレンズの歪みで Depth画素 i の Depth値 z [m] の点が写るRGB座標
+inline cv::Point2f projectDepthPixel(const KinectCalibration &c, size_t i, double z) {
+	double u, v;
+	projectColorPoint(c, c.depthRays[i * 2] * z, c.depthRays[i * 2 + 1] * z, z, u, v);
+	return cv::Point2f((float)u, (float)v);
+}
+
+// 窓を画像の中に収める (空なら画像全体)
+inline cv::Rect clipCaptureRect(const cv::Rect &r, int width, int height) {
+	if (r.width <= 0 || r.height <= 0) return cv::Rect(0, 0, width, height);
+	int x0 = (std::max)(r.x, 0), y0 = (std::max)(r.y, 0);
+	int x1 = (std::min)(r.x + r.width, width), y1 = (std::min)(r.y + r.height, height);
+	if (x1 <= x0 || y1 <= y0) return cv::Rect(0, 0, width, height);
+	return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// RGBの窓の位置と大きさを偶数にそろえる (YUY2 の2画素の組と、縦横半分の縮小の2x2 画素が窓の境界で分かれないように)
+inline cv::Rect alignColorRect(const cv::Rect &r, int width, int height) {
+	int x0 = r.x & ~1, y0 = r.y & ~1;
+	int x1 = (std::min)((r.x + r.width + 1) & ~1, width & ~1), y1 = (std::min)((r.y + r.height + 1) & ~1, height & ~1);
+	return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// 指定の無い方の窓を求め、両方の窓を画像の中に収めた ROI を返す (設定したときに1回だけ呼ぶ)
+// RGBの窓は alignColorRect() で偶数にそろえる
+// Depthの窓の点を範囲の手前と奥 (範囲が無ければ 0.5m と 8m) でRGBへ写した外接矩形、または
+// 手前か奥でRGBの窓に写るDepth画素の外接矩形を、視差の誤差の分だけ広げる
+inline CaptureROI resolveCaptureROI(const CaptureROI &requested, const KinectCalibration &c, int colorWidth, int colorHeight) {
+	CaptureROI roi = requested;
+	const int depthWidth = c.depthWidth, depthHeight = c.depthHeight;
+	const bool hasDepth = requested.depthRect.width > 0 && requested.depthRect.height > 0;
+	const bool hasColor = requested.colorRect.width > 0 && requested.colorRect.height > 0;
+	const double zNear = (requested.minDepth > 0 ? requested.minDepth : 500) * 0.001;
+	const double zFar = (requested.maxDepth > 0 ? requested.maxDepth : 8000) * 0.001;
+	const int margin = 4;
+
+	roi.depthRect = clipCaptureRect(requested.depthRect, depthWidth, depthHeight);
+	roi.colorRect = alignColorRect(clipCaptureRect(requested.colorRect, colorWidth, colorHeight), colorWidth, colorHeight);
+	if (hasDepth == hasColor || !c.isValid()) return roi; // 両方指定、両方全体、パラメータが無い場合はそのまま
+
+	if (hasDepth) {
+		float x0 = 1e9f, y0 = 1e9f, x1 = -1e9f, y1 = -1e9f;
+		const cv::Rect &r = roi.depthRect;
+		for (int v = r.y; v < r.y + r.height; v++) {
+			for (int u = r.x; u < r.x + r.width; u++) {
+				size_t i = (size_t)v * depthWidth + u;
+				cv::Point2f a = projectDepthPixel(c, i, zNear), b = projectDepthPixel(c, i, zFar);
+				x0 = (std::min)(x0, (std::min)(a.x, b.x));
+				y0 = (std::min)(y0, (std::min)(a.y, b.y));
+				x1 = (std::max)(x1, (std::max)(a.x, b.x));
+				y1 = (std::max)(y1, (std::max)(a.y, b.y));
+			}
+		}
+		cv::Rect color((int)std::floor(x0) - margin, (int)std::floor(y0) - margin, (int)std::ceil(x1 - x0) + margin * 2 + 1, (int)std::ceil(y1 - y0) + margin * 2 + 1);
+		roi.colorRect = alignColorRect(clipCaptureRect(color, colorWidth, colorHeight), colorWidth, colorHeight);
+		return roi;
+	}
+
+	// 手前と奥の写る先を結んだ線分の外接矩形がRGBの窓と重なるDepth画素
+	const cv::Rect &r = roi.colorRect;
+	int x0 = depthWidth, y0 = depthHeight, x1 = -1, y1 = -1;
+	for (int v = 0; v < depthHeight; v++) {
+		for (int u = 0; u < depthWidth; u++) {
+			size_t i = (size_t)v * depthWidth + u;
+			cv::Point2f a = projectDepthPixel(c, i, zNear), b = projectDepthPixel(c, i, zFar);
+			if ((std::max)(a.x, b.x) < r.x || (std::min)(a.x, b.x) >= r.x + r.width) continue;
+			if ((std::max)(a.y, b.y) < r.y || (std::min)(a.y, b.y) >= r.y + r.height) continue;
+			x0 = (std::min)(x0, u);
+			y0 = (std::min)(y0, v);
+			x1 = (std::max)(x1, u);
+			y1 = (std::max)(y1, v);
+		}
+	}
+	if (x1 < 0) return roi; // RGBの窓に写るDepth画素が無い
+	roi.depthRect = clipCaptureRect(cv::Rect(x0 - margin, y0 - margin, x1 - x0 + 1 + margin * 2, y1 - y0 + 1 + margin * 2), depthWidth, depthHeight);
+	return roi;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define COLOR_CONVERT_SSE2
+#endif
+
+#include "KinectTypes.h"
+
+// Kinect v2 のRGBカメラが出す YUY2 (2画素で Y0 U Y1 V の4バイト、CV_8UC2 の Mat に入れる) を BGRA に変換する
+// BGRA (8MB/フレーム) に展開するのは必要な分だけにして、メモリの読み書きを減らすために使う
+//   全体 (または行の範囲) : yuy2ToBGRA()
+//   縦横半分 : yuy2ToBGRAHalf() (2x2 画素の平均と変換を1回で行うので、全体を変換して縮小するより速い)
+//   1画素 : yuy2PixelBGRA() (位置合わせで対応する画素だけを読む場合)
+//
+// 変換式は BT.601 (Y は 16-235) の係数を 64倍した整数で、SSE2 (16bit の飽和演算) と1画素ずつの計算は同じ結果になる
+//   C = Y - 16, D = U - 128, E = V - 128
+//   R = (75C + 102E + 32) >> 6
+//   G = (75C - 25D - 52E + 32) >> 6
+//   B = (75C + 129D + 32) >> 6  (それぞれ 0-255 に丸める)
+
+inline BYTE clampColor(int v) {
+	return (BYTE)((v < 0) ? 0 : (v > 255) ? 255 : v);
+}
+
+// Y, U, V から BGRA (リトルエンディアンで B が最下位バイト)
+inline uint32_t yuvToBGRA(int y, int u, int v) {
+	int c = (y - 16) * 75 + 32, d = u - 128, e = v - 128;
+	uint32_t b = clampColor((c + 129 * d) >> 6);
+	uint32_t g = clampColor((c - 25 * d - 52 * e) >> 6);
+	uint32_t r = clampColor((c + 102 * e) >> 6);
+	return b | (g << 8) | (r << 16) | 0xff000000u;
+}
+
+// BGR から Y, U, V (合成フレームを YUY2 で作る場合に使う。上の変換の逆)
+inline void bgrToYUV(int b, int g, int r, BYTE &y, BYTE &u, BYTE &v) {
+	y = clampColor((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+	u = clampColor((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+	v = clampColor((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+}
+
+// YUY2 の行 row の x 番目の画素
+inline uint32_t yuy2PixelBGRA(const BYTE *row, int x) {
+	const BYTE *pair = row + (x & ~1) * 2;
+	return yuvToBGRA(pair[(x & 1) * 2], pair[1], pair[3]);
+}
+
+#ifdef COLOR_CONVERT_SSE2
+// 8画素分の Y, U, V (16bit) を BGRA に変換して dst に32バイト書き込む
+inline void yuvToBGRA8(__m128i y, __m128i u, __m128i v, BYTE *dst) {
+	const __m128i c = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(75)), _mm_set1_epi16(32));
+	const __m128i d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+	const __m128i e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+	__m128i b = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(129))), 6);
+	__m128i g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(25))), _mm_mullo_epi16(e, _mm_set1_epi16(52))), 6);
+	__m128i r = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(102))), 6);
+	__m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+	__m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_set1_epi8(-1));
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+#endif
+
+// YUY2 の1行 (width 画素、偶数) を BGRA に変換する
+inline void yuy2ToBGRARow(const BYTE *src, BYTE *dst, int width) {
+	int x = 0;
+#ifdef COLOR_CONVERT_SSE2
+	const __m128i lowByte = _mm_set1_epi16(0x00ff);
+	const __m128i lowWord = _mm_set1_epi32(0x0000ffff);
+	for (; x + 8 <= width; x += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + x * 2));
+		__m128i y = _mm_and_si128(s, lowByte);
+		__m128i uv = _mm_srli_epi16(s, 8);               // U0 V0 U1 V1 ...
+		__m128i u = _mm_and_si128(uv, lowWord);          // U0 0 U1 0 ...
+		__m128i v = _mm_srli_epi32(uv, 16);              // V0 0 V1 0 ...
+		yuvToBGRA8(y, _mm_or_si128(u, _mm_slli_epi32(u, 16)), _mm_or_si128(v, _mm_slli_epi32(v, 16)), dst + x * 4);
+	}
+#endif
+	uint32_t *out = (uint32_t *)dst;
+	for (; x + 2 <= width; x += 2) {
+		const BYTE *pair = src + x * 2;
+		out[x] = yuvToBGRA(pair[0], pair[1], pair[3]);
+		out[x + 1] = yuvToBGRA(pair[2], pair[1], pair[3]);
+	}
+}
+
+// YUY2 (CV_8UC2) の rowBegin 行目から rowEnd 行目の手前までを BGRA (CV_8UC4) に変換する (rowEnd < 0 なら最後まで)
+// dst は src と同じ大きさに確保し、範囲外の行は書き換えない。行の帯ごとに複数のスレッドで処理する
+inline void yuy2ToBGRA(const cv::Mat &src, cv::Mat &dst, int rowBegin = 0, int rowEnd = -1) {
+	CV_Assert(src.type() == CV_8UC2);
+	dst.create(src.rows, src.cols, CV_8UC4);
+	rowBegin = (std::max)(rowBegin, 0);
+	rowEnd = (rowEnd < 0) ? src.rows : (std::min)(rowEnd, src.rows);
+	if (rowEnd <= rowBegin) return;
+	const int rowsPerStripe = 16;
+	cv::parallel_for_(cv::Range(rowBegin, rowEnd), [&](const cv::Range &r) {
+		for (int j = r.start; j < r.end; j++) yuy2ToBGRARow(src.ptr<BYTE>(j), dst.ptr<BYTE>(j), src.cols);
+	}, (double)(rowEnd - rowBegin + rowsPerStripe - 1) / rowsPerStripe);
+}
+
+// YUY2 の2行 (a, b) を縦横半分の BGRA の1行 (width / 2 画素) にする
+// 2x2 画素の Y の平均と、縦に並んだ2つの U, V の平均を変換する (平均は2回の切り上げ平均で、SSE2 の pavgb と同じ)
+inline void yuy2ToBGRAHalfRow(const BYTE *a, const BYTE *b, BYTE *dst, int width) {
+	int x = 0, half = width / 2;
+#ifdef COLOR_CONVERT_SSE2
+	const __m128i lowByte = _mm_set1_epi32(0x000000ff);
+	for (; x + 8 <= half; x += 8) {
+		// 縦の平均 (Y0 U Y1 V が4組ずつ)
+		__m128i s0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + x * 4)), _mm_loadu_si128((const __m128i *)(b + x * 4)));
+		__m128i s1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + x * 4 + 16)), _mm_loadu_si128((const __m128i *)(b + x * 4 + 16)));
+		// 横の平均 (Y0 と Y1)
+		__m128i y0 = _mm_packs_epi32(_mm_avg_epu8(_mm_and_si128(s0, lowByte), _mm_and_si128(_mm_srli_epi32(s0, 16), lowByte)),
+			_mm_avg_epu8(_mm_and_si128(s1, lowByte), _mm_and_si128(_mm_srli_epi32(s1, 16), lowByte)));
+		__m128i u = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(s0, 8), lowByte), _mm_and_si128(_mm_srli_epi32(s1, 8), lowByte));
+		__m128i v = _mm_packs_epi32(_mm_srli_epi32(s0, 24), _mm_srli_epi32(s1, 24));
+		yuvToBGRA8(y0, u, v, dst + x * 4);
+	}
+#endif
+	uint32_t *out = (uint32_t *)dst;
+	for (; x < half; x++) {
+		const BYTE *p = a + x * 4, *q = b + x * 4;
+		int y0 = (p[0] + q[0] + 1) >> 1, y1 = (p[2] + q[2] + 1) >> 1;
+		out[x] = yuvToBGRA((y0 + y1 + 1) >> 1, (p[1] + q[1] + 1) >> 1, (p[3] + q[3] + 1) >> 1);
+	}
+}
+
+// YUY2 (CV_8UC2) を縦横半分の BGRA (CV_8UC4) に縮小しながら変換する (dst は半分の大きさに確保する)
+// 全体を BGRA に変換してから cv::resize で縮小するのと比べ、読むのは YUY2 の 4MB、書くのは 2MB だけになる
+inline void yuy2ToBGRAHalf(const cv::Mat &src, cv::Mat &dst) {
+	CV_Assert(src.type() == CV_8UC2);
+	dst.create(src.rows / 2, src.cols / 2, CV_8UC4);
+	const int rowsPerStripe = 8;
+	cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range &r) {
+		for (int j = r.start; j < r.end; j++) yuy2ToBGRAHalfRow(src.ptr<BYTE>(j * 2), src.ptr<BYTE>(j * 2 + 1), dst.ptr<BYTE>(j), src.cols);
+	}, (double)(dst.rows + rowsPerStripe - 1) / rowsPerStripe);
+}
+
+// RGB画像 (BGRA または YUY2) を BGRA で取得する (BGRA ならコピーせずにそのまま指す)
+inline void colorToBGRA(const cv::Mat &src, cv::Mat &dst) {
+	if (src.type() == CV_8UC4) {
+		dst = src;
+		return;
+	}
+	yuy2ToBGRA(src, dst);
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "CaptureROI.h"
+#include "DepthRegistration.h"
+#include "FrameBuffer.h"
+#include "FrameSource.h"
+#include "StageProfiler.h"
+
+// Depth座標系 → RGB座標系の対応表のキャッシュ
+// 同じDepthフレームに対する MapDepthFrameToColorSpace は1回だけ計算し、
+// 新しいDepthフレームが来る (invalidate() が呼ばれる) まで全ての位置合わせ処理で使い回す
+// 取得元から位置合わせパラメータが得られれば、対応表は ICoordinateMapper ではなく DepthRegistration で計算する
+// (パラメータの誤差が registrationTolerance を超える場合と setSoftwareRegistration(false) の場合は取得元の座標変換を使う。
+//  記録データの再生のように取得元に座標変換が無ければ、誤差が大きくてもパラメータで計算する)
+//
+// RGB座標 → Depth座標の逆引きもこの対応表から求める
+// RGB画像を cellSize 四方のセルに分け、各セルに写るDepth画素の一覧を (Depthフレームごとに1回だけ) 作っておき、
+// 問い合わせ点の周りのセルだけを探すので、MapColorFrameToDepthSpace で全画素を変換するより桁違いに速い
+//
+// setCaptureROI() で ROI を設定すると、対応表も逆引きも ROI のDepthの窓の中だけを計算する
+// (窓の外の対応表は不定、Depth値が範囲外の画素は -infinity)
+class CoordinateMapCache {
+private:
+	static const int cellSize = 8;    // 逆引き用のセルの大きさ [RGB画素]
+	static const int searchRadius = 4; // 対応するDepth画素を探す範囲 [RGB画素]
+	static const int calibrationAttempts = 30; // 位置合わせパラメータを取得し直す回数 (Kinect は最初のフレームが届くまで取得できない)
+
+	FrameSource *source = nullptr;
+	int depthWidth = 0;
+	int depthHeight = 0;
+	int colorWidth = 0;
+	int colorHeight = 0;
+
+	FrameBuffer<ColorSpacePoint> colorSpace; // 対応表のプール (depthToColorSpaceView() で渡した対応表は次のフレームでも上書きされない)
+	bool colorSpaceValid = false;
+	unsigned long long mapCount = 0; // 実際に座標変換を計算した回数
+
+	// 自前の位置合わせ
+	DepthRegistration registration;
+	bool preferRegistration = true;
+	bool registrationUsed = false; // 最後の対応表を DepthRegistration で計算したか
+	int calibrationTries = 0;
+	double calibrationError = -1; // 読み込んだ位置合わせパラメータの誤差 [RGB画素]
+
+	// 逆引き用 (全て initialize() で確保し、フレームごとには確保しない)
+	int cellsX = 0;
+	int cellsY = 0;
+	std::vector<int> cellStart;  // セルごとの cellPixels の開始位置 (cellsX * cellsY + 1)
+	std::vector<int> cellPixels; // セル順に並べたDepth画素の番号
+	std::vector<int> pixelCell;  // Depth画素ごとのセル番号 (RGB画像の外なら -1)
+	bool inverseValid = false;
+
+	CaptureROI roi; // 解決済みの ROI (depthRect は常に空でない)
+
+	// セルごとのDepth画素の一覧を作る (計数ソート、ROI の窓の中だけ)
+	bool buildInverse(const UINT16 *depth, size_t depthSize) {
+		KINECT_PROFILE_SCOPE("inverse mapping");
+		const ColorSpacePoint *points = depthToColorSpace(depth, depthSize);
+		if (points == nullptr) return false;
+
+		std::fill(cellStart.begin(), cellStart.end(), 0);
+		const cv::Rect &r = roi.depthRect;
+		for (int j = r.y; j < r.y + r.height; j++) {
+			for (int i = j * depthWidth + r.x; i < j * depthWidth + r.x + r.width; i++) {
+				float x = points[i].X;
+				float y = points[i].Y;
+				// 無効な点 (-infinity) も範囲外として扱う
+				if (depth[i] == 0 || !(x >= 0 && x < colorWidth && y >= 0 && y < colorHeight)) {
+					pixelCell[i] = -1;
+					continue;
+				}
+				int cell = ((int)y / cellSize) * cellsX + (int)x / cellSize;
+				pixelCell[i] = cell;
+				cellStart[cell + 1]++;
+			}
+		}
+		for (size_t c = 1; c < cellStart.size(); c++) cellStart[c] += cellStart[c - 1];
+
+		// cellStart を書き込み位置として使い、最後に1つずらして戻す
+		for (int j = r.y; j < r.y + r.height; j++) {
+			for (int i = j * depthWidth + r.x; i < j * depthWidth + r.x + r.width; i++) {
+				if (pixelCell[i] >= 0) cellPixels[cellStart[pixelCell[i]]++] = i;
+			}
+		}
+		for (size_t c = cellStart.size() - 1; c > 0; c--) cellStart[c] = cellStart[c - 1];
+		cellStart[0] = 0;
+
+		inverseValid = true;
+		return true;
+	}
+
+	// 位置合わせパラメータを用意する (まだ無ければ取得を試みる。誤差が大きくても取得元に座標変換が無いときのために持っておく)
+	bool loadCalibration() {
+		if (registration.isInitialized()) return true;
+		if (calibrationTries >= calibrationAttempts) return false;
+		calibrationTries++;
+		KinectCalibration calibration;
+		if (!source->getCalibration(calibration) || !calibration.isValid()) return false;
+		if (calibration.depthWidth != depthWidth || (int)(calibration.depthRays.size() / 2) != (int)colorSpace.size()) return false;
+		registration.initialize(calibration);
+		calibrationError = calibration.fitError;
+		return true;
+	}
+
+	// 取得元の座標変換より自前の位置合わせを優先して使えるか
+	bool registrationReady() {
+		return preferRegistration && loadCalibration() && calibrationError <= registrationTolerance;
+	}
+
+	// 逆引きの本体 (buildInverse() 済みであること)
+	bool findDepthPoint(const UINT16 *depth, float x, float y, int &index) const {
+		int cx0 = (int)((x - searchRadius) / cellSize), cx1 = (int)((x + searchRadius) / cellSize);
+		int cy0 = (int)((y - searchRadius) / cellSize), cy1 = (int)((y + searchRadius) / cellSize);
+		if (cx0 < 0) cx0 = 0;
+		if (cy0 < 0) cy0 = 0;
+		if (cx1 >= cellsX) cx1 = cellsX - 1;
+		if (cy1 >= cellsY) cy1 = cellsY - 1;
+
+		// 一番近くに写るDepth画素を探す (ほぼ同じ距離なら手前のものを優先する)
+		float maxDist = (float)(searchRadius * searchRadius);
+		float bestDist = maxDist;
+		int best = -1;
+		for (int cy = cy0; cy <= cy1; cy++) {
+			for (int cx = cx0; cx <= cx1; cx++) {
+				int cell = cy * cellsX + cx;
+				for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+					int i = cellPixels[k];
+					float dx = colorSpace[i].X - x;
+					float dy = colorSpace[i].Y - y;
+					float dist = dx * dx + dy * dy;
+					if (dist > maxDist) continue;
+					if (best < 0 || dist < bestDist - 1.0f || (dist < bestDist + 1.0f && depth[i] < depth[best])) {
+						best = i;
+						bestDist = dist;
+					}
+				}
+			}
+		}
+		index = best;
+		return best >= 0;
+	}
+
+public:
+	// 自前の位置合わせを使う誤差の上限 [RGB画素]
+	static constexpr double registrationTolerance = KinectCalibration::registrationTolerance;
+
+	void initialize(FrameSource *source, int depthWidth, int depthHeight, int colorWidth, int colorHeight) {
+		this->source = source;
+		this->depthWidth = depthWidth;
+		this->depthHeight = depthHeight;
+		this->colorWidth = colorWidth;
+		this->colorHeight = colorHeight;
+		colorSpace.create(depthHeight, depthWidth, CV_32FC2);
+		colorSpaceValid = false;
+
+		cellsX = (colorWidth + cellSize - 1) / cellSize;
+		cellsY = (colorHeight + cellSize - 1) / cellSize;
+		cellStart.resize(cellsX * cellsY + 1);
+		cellPixels.resize(depthWidth * depthHeight);
+		pixelCell.resize(depthWidth * depthHeight);
+		inverseValid = false;
+
+		registration = DepthRegistration();
+		registrationUsed = false;
+		calibrationTries = 0;
+		calibrationError = -1;
+		setCaptureROI(CaptureROI());
+	}
+
+	// 対応表を計算する範囲 (resolveCaptureROI() 済みの ROI。窓が空なら全体)
+	void setCaptureROI(const CaptureROI &roi) {
+		this->roi = roi;
+		this->roi.depthRect = clipCaptureRect(roi.depthRect, depthWidth, depthHeight);
+		invalidate();
+	}
+
+	// 対応表を自前の位置合わせで計算するか (false なら取得元の座標変換を使う。座標変換が無い取得元では自前で計算する)
+	void setSoftwareRegistration(bool enable) { preferRegistration = enable; }
+
+	// 自前の位置合わせで計算しているか (最後に計算した対応表)
+	bool softwareRegistration() const { return registrationUsed; }
+
+	// 自前の位置合わせのパラメータの誤差 [RGB画素] (使っていない、または不明なら負、代表値なら0)
+	double registrationError() const { return softwareRegistration() ? calibrationError : -1; }
+
+	// 新しいDepthフレームを取得したら呼ぶ
+	void invalidate() {
+		colorSpaceValid = false;
+		inverseValid = false;
+	}
+
+	// Depth座標系の各点に対応するRGB座標の一覧 (座標変換が使えない場合は nullptr)
+	const ColorSpacePoint *depthToColorSpace(const UINT16 *depth, size_t depthSize) {
+		if (!colorSpaceValid) {
+			KINECT_PROFILE_SCOPE("coordinate mapping");
+			ColorSpacePoint *points = colorSpace.beginWrite();
+			if (points == nullptr) return nullptr;
+			const cv::Rect &r = roi.depthRect;
+			bool full = r.width == depthWidth && r.height == depthHeight && !roi.hasDepthRange();
+			registrationUsed = registrationReady();
+			if (!registrationUsed && !source->mapDepthFrameToColorSpace(depth, depthSize, points, colorSpace.size())) {
+				// 取得元に座標変換が無ければ、誤差が大きいパラメータや setSoftwareRegistration(false) でも自前で計算する
+				if (!loadCalibration()) return nullptr;
+				registrationUsed = true;
+			}
+			if (registrationUsed) {
+				if (full) registration.depthToColorSpace(depth, points);
+				else registration.depthToColorSpace(depth, points, r, roi.depthMin(), roi.depthMax());
+			} else {
+				// 取得元の座標変換は全体を計算するので、範囲外のDepth値の画素だけ後から無効にする
+				const float ninf = -std::numeric_limits<float>::infinity();
+				for (int j = r.y; j < r.y + r.height && roi.hasDepthRange(); j++) {
+					for (int i = j * depthWidth + r.x; i < j * depthWidth + r.x + r.width; i++) {
+						if (!roi.inRange(depth[i])) points[i].X = points[i].Y = ninf;
+					}
+				}
+			}
+			colorSpace.endWrite();
+			colorSpaceValid = true;
+			mapCount++;
+		}
+		return colorSpace.data();
+	}
+
+	// depthToColorSpace() の対応表を指す Mat (CV_32FC2、コピーしない。座標変換が使えない場合は空)
+	// 別のスレッドに渡しても、持っている間は次のフレームの対応表で上書きされない
+	cv::Mat depthToColorSpaceView(const UINT16 *depth, size_t depthSize) {
+		if (depthToColorSpace(depth, depthSize) == nullptr) return cv::Mat();
+		return colorSpace.view();
+	}
+
+	// RGB座標 (x, y) に対応するDepth座標を求める (対応するDepth画素が無ければ false)
+	bool colorToDepthSpace(float x, float y, const UINT16 *depth, size_t depthSize, DepthSpacePoint &point) {
+		if (!inverseValid && !buildInverse(depth, depthSize)) return false;
+		int index;
+		if (!findDepthPoint(depth, x, y, index)) return false;
+		point.X = (float)(index % depthWidth);
+		point.Y = (float)(index / depthWidth);
+		return true;
+	}
+
+	// 複数点の逆引き (対応が無い点は MapColorFrameToDepthSpace と同じく -infinity) 対応が見つかった点の数を返す
+	size_t colorToDepthSpace(const ColorSpacePoint *colorPoints, size_t count, const UINT16 *depth, size_t depthSize, DepthSpacePoint *depthPoints) {
+		size_t found = 0;
+		for (size_t k = 0; k < count; k++) {
+			if (colorToDepthSpace(colorPoints[k].X, colorPoints[k].Y, depth, depthSize, depthPoints[k])) {
+				found++;
+			} else {
+				depthPoints[k].X = depthPoints[k].Y = -std::numeric_limits<float>::infinity();
+			}
+		}
+		return found;
+	}
+
+	unsigned long long mappedFrames() const { return mapCount; }
+};
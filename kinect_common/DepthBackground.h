@@ -0,0 +1,353 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEPTH_BACKGROUND_SSE2
+#endif
+
+#include "KinectTypes.h"
+
+// 背景モデルの設定 (距離は全て mm)
+struct DepthBackgroundOptions {
+	int warmupFrames = 30;       // 最初にこのフレーム数だけ背景を学習する (この間は前景を出さない)
+	int threshold = 40;          // 背景よりこれ以上手前なら前景
+	float thresholdSlope = 0.03f; // 遠いほど雑音が大きいので、閾値に 背景 x thresholdSlope を足す
+	int warmupStep = 8;          // 学習中に背景を1フレームで動かす最大の量 (近似のメディアン)
+	int recedeStep = 16;         // 学習後、背景より奥が見えた (置いてあった物が無くなった) ときに1フレームで背景を奥へ動かす最大の量
+	int updateInterval = 4;      // 学習後は背景の画素をこのフレーム数ごとに 1mm ずつ今の値へ近づける (ゆっくりした変化に追従する)
+	int minBlobArea = 200;       // これより小さな前景の塊は出力しない [画素]
+	int maxBlobs = 32;           // 出力する塊の最大の数 (大きい順)
+};
+
+// 前景の塊 (8近傍でつながった前景の画素)
+struct DepthBlob {
+	cv::Rect box;           // 外接矩形
+	int area = 0;           // 画素数
+	cv::Point2f centroid;   // 重心 [Depth画素]
+	UINT16 minDepth = 0;    // 一番手前の Depth値
+	float meanDepth = 0;    // Depth値の平均
+};
+
+// Depthの背景モデルと前景の抽出
+// 背景は画素ごとの UINT16 の1枚だけで、学習中は今の値へ warmupStep ずつ近づける近似のメディアン (通り過ぎた人は残らない)、
+// 学習後は背景の画素だけを updateInterval フレームごとに 1mm ずつ近づけ、奥が見えた画素は recedeStep ずつ奥へ動かす
+// (1フレームだけの外れ値では動かない)。背景が無い (学習中ずっと0だった) 画素は、値があれば前景とする
+// 前景の判定と背景の更新は SSE2 で8画素ずつ、16行の帯ごとに複数のスレッドで生のDepthバッファから行う
+// 塊は 16x16 画素のタイルごとに前景の画素数と前フレームからの変化を数えておき、前景のあるタイルだけを走査して
+// 行ごとの連続区間を union-find でつなぐ。どのタイルも変化していないフレームでは前の結果をそのまま使う
+// 作業領域は initialize() で確保するので、1つの DepthBackground は1つのスレッドから使う
+class DepthBackground {
+private:
+	static const int tileSize = 16;
+
+	int width = 0;
+	int height = 0;
+	int tilesX = 0;
+	int tilesY = 0;
+	DepthBackgroundOptions options;
+	std::vector<UINT16> model;      // 背景の Depth値 (0 なら背景が無い)
+	std::vector<uchar> mask;        // 前景なら 255
+	std::vector<int> tileCount;     // タイルごとの前景の画素数
+	std::vector<uchar> tileChanged; // タイルの中で前景が変化したか
+	long long frameIndex = 0;       // 今までに処理したフレーム数
+
+	// 塊の抽出用 (一度大きくなれば確保しない)
+	struct Run {
+		int row, begin, end; // end は含まない
+		int parent;
+	};
+	std::vector<Run> runs;
+	std::vector<int> rowStart; // 行ごとの最初の区間の番号 (height + 1 個)
+	std::vector<int> blobOfRoot;
+	std::vector<DepthBlob> blobList;
+	std::vector<double> sumX, sumY, sumDepth;
+	bool blobsValid = false;
+
+	unsigned long long frameCount = 0;
+	double lastMs = 0;
+	double totalMs = 0;
+	double maxMs = 0;
+	unsigned long long labeledFrames = 0;
+	int changedTileCount = 0;
+	int foregroundCount = 0;
+
+	static int popcount8(unsigned int x) {
+		x = x - ((x >> 1) & 0x55);
+		x = (x & 0x33) + ((x >> 2) & 0x33);
+		return (int)((x + (x >> 4)) & 0x0f);
+	}
+
+	// 1画素分 (SSE2 の端数と SSE2 が無い環境で使う。SSE2 と同じ式)
+	uchar updatePixel(UINT16 d, UINT16 &bg, bool warm, bool updateNow, int slope) const {
+		if (d == 0) return 0;
+		if (bg == 0) {
+			if (warm) bg = d;
+			return warm ? 0 : 255;
+		}
+		int thr = (std::min)(options.threshold + ((bg * slope) >> 16), 65535);
+		int nearDiff = (std::max)(bg - d, 0), farDiff = (std::max)(d - bg, 0);
+		bool fg = !warm && nearDiff > thr;
+		int step = warm ? options.warmupStep : fg ? 0 : (farDiff > thr) ? options.recedeStep : (updateNow ? 1 : 0);
+		bg = (UINT16)(bg + (std::min)(farDiff, step) - (std::min)(nearDiff, step));
+		return fg ? 255 : 0;
+	}
+
+	// 1行分の背景の更新と前景の判定 (count, changed はこの行のタイル行の先頭)
+	void updateRow(const UINT16 *depth, int j, bool warm, bool updateNow, int slope, int *count, uchar *changed) {
+		const UINT16 *d = depth + (size_t)j * width;
+		UINT16 *bg = &model[(size_t)j * width];
+		uchar *m = &mask[(size_t)j * width];
+		int i = 0;
+#ifdef DEPTH_BACKGROUND_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(-1);
+		const __m128i base = _mm_set1_epi16((short)options.threshold);
+		const __m128i slopeQ = _mm_set1_epi16((short)slope);
+		const __m128i warmMask = warm ? ones : zero;
+		const __m128i recede = _mm_set1_epi16((short)options.recedeStep);
+		const __m128i update = _mm_set1_epi16(updateNow ? 1 : 0);
+		const __m128i warmStep = _mm_set1_epi16((short)options.warmupStep);
+		for (; i + 8 <= width; i += 8) {
+			__m128i dv = _mm_loadu_si128((const __m128i *)(d + i));
+			__m128i bv = _mm_loadu_si128((const __m128i *)(bg + i));
+			__m128i dz = _mm_cmpeq_epi16(dv, zero);
+			__m128i bz = _mm_cmpeq_epi16(bv, zero);
+			__m128i thr = _mm_adds_epu16(base, _mm_mulhi_epu16(bv, slopeQ));
+			__m128i nearDiff = _mm_subs_epu16(bv, dv);
+			__m128i farDiff = _mm_subs_epu16(dv, bv);
+			__m128i nearOver = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_subs_epu16(nearDiff, thr), zero), ones);
+			__m128i farOver = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_subs_epu16(farDiff, thr), zero), ones);
+
+			// 前景 : 学習後で、値があり、背景より閾値以上手前か背景が無い
+			__m128i fg = _mm_andnot_si128(_mm_or_si128(dz, warmMask), _mm_or_si128(nearOver, bz));
+			// 背景を動かす量 : 学習中は warmupStep、前景と穴は0、奥が見えたら recedeStep、それ以外は update
+			__m128i step = _mm_or_si128(_mm_and_si128(farOver, recede), _mm_andnot_si128(farOver, update));
+			step = _mm_or_si128(_mm_and_si128(warmMask, warmStep), _mm_andnot_si128(warmMask, step));
+			step = _mm_andnot_si128(_mm_or_si128(dz, fg), step);
+			// min(a, b) = a - subs(a, b)
+			__m128i up = _mm_sub_epi16(farDiff, _mm_subs_epu16(farDiff, step));
+			__m128i down = _mm_sub_epi16(nearDiff, _mm_subs_epu16(nearDiff, step));
+			__m128i nb = _mm_sub_epi16(_mm_add_epi16(bv, up), down);
+			__m128i init = _mm_and_si128(bz, warmMask); // 学習中に初めて値が来た画素
+			nb = _mm_or_si128(_mm_and_si128(init, dv), _mm_andnot_si128(init, nb));
+			_mm_storeu_si128((__m128i *)(bg + i), nb);
+
+			__m128i m8 = _mm_packs_epi16(fg, zero);
+			__m128i old = _mm_loadl_epi64((const __m128i *)(m + i));
+			_mm_storel_epi64((__m128i *)(m + i), m8);
+			int bits = _mm_movemask_epi8(m8) & 0xff;
+			int diff = _mm_movemask_epi8(_mm_xor_si128(m8, old)) & 0xff;
+			int t = i / tileSize;
+			count[t] += popcount8((unsigned int)bits);
+			changed[t] |= (diff != 0);
+		}
+#endif
+		for (; i < width; i++) {
+			uchar v = updatePixel(d[i], bg[i], warm, updateNow, slope);
+			int t = i / tileSize;
+			if (v) count[t]++;
+			if (v != m[i]) changed[t] = 1;
+			m[i] = v;
+		}
+	}
+
+	int findRoot(int r) {
+		while (runs[r].parent != r) {
+			runs[r].parent = runs[runs[r].parent].parent; // 経路を半分にする
+			r = runs[r].parent;
+		}
+		return r;
+	}
+
+	void unite(int a, int b) {
+		a = findRoot(a);
+		b = findRoot(b);
+		if (a == b) return;
+		if (a < b) runs[b].parent = a;
+		else runs[a].parent = b;
+	}
+
+	// 前景のあるタイルだけを走査して塊を求める
+	void extractBlobs(const UINT16 *depth) {
+		runs.clear();
+		rowStart.assign(height + 1, 0);
+		for (int j = 0; j < height; j++) {
+			rowStart[j] = (int)runs.size();
+			const uchar *m = &mask[(size_t)j * width];
+			const int *count = &tileCount[(size_t)(j / tileSize) * tilesX];
+			for (int tx = 0; tx < tilesX; tx++) {
+				if (count[tx] == 0) continue;
+				// 前景のあるタイルが続く範囲 (前景の無いタイルをまたぐ区間は無い)
+				int x0 = tx * tileSize;
+				while (tx + 1 < tilesX && count[tx + 1] > 0) tx++;
+				int x1 = (std::min)((tx + 1) * tileSize, width);
+				for (int i = x0; i < x1; i++) {
+					if (!m[i]) continue;
+					Run run;
+					run.row = j;
+					run.begin = i;
+					while (i < x1 && m[i]) i++;
+					run.end = i;
+					run.parent = (int)runs.size();
+					runs.push_back(run);
+				}
+			}
+			// 前の行の区間と8近傍で重なればつなぐ
+			if (j > 0) {
+				int p = rowStart[j - 1], pEnd = rowStart[j];
+				for (int c = rowStart[j]; c < (int)runs.size(); c++) {
+					while (p < pEnd && runs[p].end < runs[c].begin) p++; // 左に離れた区間を飛ばす (end は含まないので隣接は残る)
+					for (int q = p; q < pEnd && runs[q].begin <= runs[c].end; q++) unite(q, c);
+				}
+			}
+		}
+		rowStart[height] = (int)runs.size();
+
+		// 根ごとに集計する
+		blobList.clear();
+		sumX.clear();
+		sumY.clear();
+		sumDepth.clear();
+		blobOfRoot.assign(runs.size(), -1);
+		for (int r = 0; r < (int)runs.size(); r++) {
+			int root = findRoot(r);
+			int b = blobOfRoot[root];
+			const Run &run = runs[r];
+			if (b < 0) {
+				b = blobOfRoot[root] = (int)blobList.size();
+				DepthBlob blob;
+				blob.box = cv::Rect(run.begin, run.row, 0, 1);
+				blob.minDepth = 65535;
+				blobList.push_back(blob);
+				sumX.push_back(0);
+				sumY.push_back(0);
+				sumDepth.push_back(0);
+			}
+			DepthBlob &blob = blobList[b];
+			int x0 = (std::min)(blob.box.x, run.begin), x1 = (std::max)(blob.box.x + blob.box.width, run.end);
+			int y1 = (std::max)(blob.box.y + blob.box.height, run.row + 1);
+			blob.box = cv::Rect(x0, blob.box.y, x1 - x0, y1 - blob.box.y);
+			int n = run.end - run.begin;
+			blob.area += n;
+			sumX[b] += (run.begin + run.end - 1) * 0.5 * n;
+			sumY[b] += (double)run.row * n;
+			const UINT16 *d = depth + (size_t)run.row * width;
+			for (int i = run.begin; i < run.end; i++) {
+				sumDepth[b] += d[i];
+				blob.minDepth = (std::min)(blob.minDepth, d[i]);
+			}
+		}
+		for (size_t b = 0; b < blobList.size(); b++) {
+			DepthBlob &blob = blobList[b];
+			blob.centroid = cv::Point2f((float)(sumX[b] / blob.area), (float)(sumY[b] / blob.area));
+			blob.meanDepth = (float)(sumDepth[b] / blob.area);
+		}
+		int minArea = options.minBlobArea;
+		blobList.erase(std::remove_if(blobList.begin(), blobList.end(), [minArea](const DepthBlob &b) { return b.area < minArea; }), blobList.end());
+		std::sort(blobList.begin(), blobList.end(), [](const DepthBlob &a, const DepthBlob &b) { return a.area > b.area; });
+		if ((int)blobList.size() > options.maxBlobs) blobList.resize((std::max)(options.maxBlobs, 0));
+		labeledFrames++;
+	}
+
+public:
+	void initialize(int width, int height) {
+		this->width = width;
+		this->height = height;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		tileCount.assign((size_t)tilesX * tilesY, 0);
+		tileChanged.assign((size_t)tilesX * tilesY, 0);
+		model.assign((size_t)width * height, 0);
+		mask.assign((size_t)width * height, 0);
+		reset();
+	}
+
+	bool isInitialized() const { return width > 0; }
+
+	void setOptions(const DepthBackgroundOptions &options) {
+		this->options = options;
+		this->options.threshold = (std::min)((std::max)(options.threshold, 0), 65535);
+		this->options.warmupStep = (std::min)((std::max)(options.warmupStep, 1), 65535);
+		this->options.recedeStep = (std::min)((std::max)(options.recedeStep, 0), 65535);
+		this->options.updateInterval = (std::max)(options.updateInterval, 0);
+	}
+	const DepthBackgroundOptions &getOptions() const { return options; }
+
+	// 背景を捨てて学習からやり直す
+	void reset() {
+		std::fill(model.begin(), model.end(), 0);
+		std::fill(mask.begin(), mask.end(), 0);
+		std::fill(tileCount.begin(), tileCount.end(), 0);
+		blobList.clear();
+		blobsValid = false;
+		frameIndex = 0;
+		foregroundCount = 0;
+	}
+
+	// 学習中か (学習中は前景を出さない)
+	bool isLearning() const { return frameIndex < options.warmupFrames; }
+
+	// depth (width x height の生のDepth) で背景を更新し、前景と塊を求める
+	void apply(const UINT16 *depth) {
+		double start = (double)cv::getTickCount();
+		const bool warm = isLearning();
+		const bool updateNow = options.updateInterval > 0 && (frameIndex % options.updateInterval) == 0;
+		const int slope = (int)(std::min)((std::max)(options.thresholdSlope, 0.0f) * 65536.0f, 65535.0f);
+		std::fill(tileCount.begin(), tileCount.end(), 0);
+		std::fill(tileChanged.begin(), tileChanged.end(), 0);
+
+		// タイルの行ごとに分ける (タイルの画素数と変化は同じ帯のスレッドだけが書く)
+		cv::parallel_for_(cv::Range(0, tilesY), [&](const cv::Range &r) {
+			for (int ty = r.start; ty < r.end; ty++) {
+				int *count = &tileCount[(size_t)ty * tilesX];
+				uchar *changed = &tileChanged[(size_t)ty * tilesX];
+				for (int j = ty * tileSize; j < (std::min)((ty + 1) * tileSize, height); j++) updateRow(depth, j, warm, updateNow, slope, count, changed);
+			}
+		});
+		frameIndex++;
+
+		changedTileCount = 0;
+		foregroundCount = 0;
+		for (size_t t = 0; t < tileCount.size(); t++) {
+			changedTileCount += tileChanged[t];
+			foregroundCount += tileCount[t];
+		}
+		if (changedTileCount > 0 || !blobsValid) { // 前景が変わっていなければ前の塊のまま
+			extractBlobs(depth);
+			blobsValid = true;
+		}
+
+		lastMs = ((double)cv::getTickCount() - start) / cv::getTickFrequency() * 1000.0;
+		totalMs += lastMs;
+		maxMs = (std::max)(maxMs, lastMs);
+		frameCount++;
+	}
+
+	// 前景のマスク (CV_8UC1、前景は255。コピーせずに内部の配列を指すので、次の apply() で書き換わる)
+	cv::Mat foreground() { return cv::Mat(height, width, CV_8UC1, &mask[0]); }
+
+	// 背景の Depth (CV_16UC1、0 は背景が無い画素。コピーせずに内部の配列を指す)
+	cv::Mat background() { return cv::Mat(height, width, CV_16UC1, &model[0]); }
+
+	// 前景の塊 (面積の大きい順)
+	const std::vector<DepthBlob> &blobs() const { return blobList; }
+
+	int foregroundPixels() const { return foregroundCount; }
+
+	// 直前のフレームで前景が変化したタイルの数と、全タイル数
+	int changedTiles() const { return changedTileCount; }
+	int tiles() const { return tilesX * tilesY; }
+
+	// 1フレームあたりの処理時間 [ms] と、塊を求め直したフレームの数
+	unsigned long long frames() const { return frameCount; }
+	double lastFrameMs() const { return lastMs; }
+	double meanFrameMs() const { return frameCount ? totalMs / frameCount : 0; }
+	double maxFrameMs() const { return maxMs; }
+	unsigned long long blobFrames() const { return labeledFrames; }
+};
@@ -0,0 +1,447 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "KinectTypes.h"
+
+// 16bit Depth の可逆圧縮
+// 左隣の画素 (行頭は上の行の先頭画素) からの差分を可変長で符号化し、差分0の連続はランレングスで符号化する
+//   0xxxxxxx                   : 差分 (zigzag 0..127)
+//   10xxxxxx xxxxxxxx          : 差分 (zigzag 0..16383)
+//   110xxxxx xxxxxxxx          : 差分0 が (x + 1) 個続く (1..8192)
+//   11100000 xxxxxxxx xxxxxxxx : 生の値 (差分が大きい場合)
+// 無効画素 (0) の領域や平面が多い Kinect の Depth では生データの半分以下になる (512x424 で圧縮・展開とも 1ms 程度)
+//
+// encodePredictive() / decodePredictive() は回線で送るための、より縮む (少し遅い) 形式 (JPEG-LS を簡単にしたもの)
+//   画素ごとに左・上・左上から MED で予測し、予測誤差を局所的な勾配で分けた文脈ごとに適応する Golomb-Rice 符号で符号化する
+//   周りが全て同じ値の所 (無効画素の領域や平らな所) は同じ値の続く長さだけを符号化する
+//   quantStep > 1 なら Depth値を quantStep 刻みに丸めてから符号化する (誤差は quantStep / 2 以下、0 は 0 のまま)
+//   行の帯ごとに独立に符号化するので、帯ごとに複数のスレッドで圧縮・展開できる
+//   [u8 'P'][u8 帯の数][u8 quantStep][u8 0][u32 帯ごとのバイト数 x 帯の数][帯0][帯1] ...
+namespace DepthCodec {
+
+	// 最悪の場合の圧縮後サイズ
+	inline size_t maxEncodedSize(size_t pixels) {
+		return pixels * 3;
+	}
+
+	// width x height の Depth を dst に圧縮し、書き込んだバイト数を返す (dst は maxEncodedSize() 以上)
+	inline size_t encode(const UINT16 *src, int width, int height, BYTE *dst) {
+		BYTE *p = dst;
+		int run = 0;
+		int rowStart = 0;
+		for (int j = 0; j < height; j++) {
+			const UINT16 *row = src + (size_t)j * width;
+			int prev = rowStart;
+			for (int i = 0; i < width; i++) {
+				int d = row[i];
+				int r = d - prev;
+				prev = d;
+				if (r == 0) {
+					if (++run == 8192) {
+						p[0] = (BYTE)(0xC0 | ((run - 1) >> 8));
+						p[1] = (BYTE)((run - 1) & 0xFF);
+						p += 2;
+						run = 0;
+					}
+					continue;
+				}
+				if (run > 0) {
+					if (run == 1) {
+						*p++ = 0; // zigzag(0)
+					} else {
+						p[0] = (BYTE)(0xC0 | ((run - 1) >> 8));
+						p[1] = (BYTE)((run - 1) & 0xFF);
+						p += 2;
+					}
+					run = 0;
+				}
+				unsigned int z = (r < 0) ? ((unsigned int)(-r) << 1) - 1 : (unsigned int)r << 1; // zigzag
+				if (z < 0x80) {
+					*p++ = (BYTE)z;
+				} else if (z < 0x4000) {
+					p[0] = (BYTE)(0x80 | (z >> 8));
+					p[1] = (BYTE)(z & 0xFF);
+					p += 2;
+				} else {
+					p[0] = 0xE0;
+					p[1] = (BYTE)(d >> 8);
+					p[2] = (BYTE)(d & 0xFF);
+					p += 3;
+				}
+			}
+			rowStart = row[0];
+		}
+		if (run > 0) {
+			p[0] = (BYTE)(0xC0 | ((run - 1) >> 8));
+			p[1] = (BYTE)((run - 1) & 0xFF);
+			p += 2;
+		}
+		return p - dst;
+	}
+
+	inline size_t encode(const UINT16 *src, int width, int height, std::vector<BYTE> &dst) {
+		dst.resize(maxEncodedSize((size_t)width * height));
+		size_t size = encode(src, width, height, &dst[0]);
+		dst.resize(size);
+		return size;
+	}
+
+	// encode() で圧縮したデータを展開する (壊れたデータなら false)
+	inline bool decode(const BYTE *src, size_t size, int width, int height, UINT16 *dst) {
+		const BYTE *p = src;
+		const BYTE *end = src + size;
+		int run = 0;
+		int rowStart = 0;
+		for (int j = 0; j < height; j++) {
+			UINT16 *row = dst + (size_t)j * width;
+			int prev = rowStart;
+			for (int i = 0; i < width; i++) {
+				if (run > 0) {
+					run--;
+					row[i] = (UINT16)prev;
+					continue;
+				}
+				if (p >= end) return false;
+				BYTE b = *p;
+				if (b < 0x80) {
+					prev += (b & 1) ? -(int)((b + 1) >> 1) : (int)(b >> 1);
+					p++;
+				} else if (b < 0xC0) {
+					if (p + 2 > end) return false;
+					unsigned int z = ((b & 0x3F) << 8) | p[1];
+					prev += (z & 1) ? -(int)((z + 1) >> 1) : (int)(z >> 1);
+					p += 2;
+				} else if (b < 0xE0) {
+					if (p + 2 > end) return false;
+					run = ((b & 0x1F) << 8) | p[1]; // この画素を含めて run + 1 個
+					p += 2;
+				} else {
+					if (p + 3 > end) return false;
+					prev = (p[1] << 8) | p[2];
+					p += 3;
+				}
+				row[i] = (UINT16)prev;
+			}
+			rowStart = row[0];
+		}
+		return run == 0 && p == end;
+	}
+
+	// ビット単位の書き込み (上位ビットから)
+	class BitWriter {
+	private:
+		BYTE *p;
+		uint64_t acc = 0;
+		int bits = 0;
+
+	public:
+		BitWriter(BYTE *dst) : p(dst) {}
+
+		// value の下位 n ビット (n <= 32)
+		void put(uint32_t value, int n) {
+			acc = (acc << n) | value;
+			bits += n;
+			if (bits >= 32) {
+				bits -= 32;
+				uint32_t v = (uint32_t)(acc >> bits);
+				p[0] = (BYTE)(v >> 24);
+				p[1] = (BYTE)(v >> 16);
+				p[2] = (BYTE)(v >> 8);
+				p[3] = (BYTE)v;
+				p += 4;
+			}
+		}
+
+		// 書き込んだ位置 (端数のビットを書き出してから)
+		BYTE *finish() {
+			while (bits >= 8) {
+				bits -= 8;
+				*p++ = (BYTE)(acc >> bits);
+			}
+			if (bits > 0) *p++ = (BYTE)(acc << (8 - bits));
+			bits = 0;
+			return p;
+		}
+	};
+
+	// 上位から続く 0 のビット数 (v != 0)
+	inline int leadingZeros(uint64_t v) {
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, v);
+		return 63 - (int)index;
+#elif defined(__GNUC__)
+		return __builtin_clzll(v);
+#else
+		int n = 0;
+		while (!(v >> 63)) {
+			v <<= 1;
+			n++;
+		}
+		return n;
+#endif
+	}
+
+	// ビット単位の読み込み (終端を越えた分は0として読み、overrun() で判定する)
+	class BitReader {
+	private:
+		const BYTE *p;
+		const BYTE *end;
+		uint64_t acc = 0;
+		int bits = 0;
+		int extra = 0; // 終端を越えて補ったバイト数
+
+		void fill() {
+			while (bits <= 56) {
+				if (p < end) acc |= (uint64_t)*p++ << (56 - bits);
+				else extra++;
+				bits += 8;
+			}
+		}
+
+	public:
+		BitReader(const BYTE *src, size_t size) : p(src), end(src + size) { fill(); }
+
+		uint32_t get(int n) {
+			if (n == 0) return 0;
+			if (bits < n) fill();
+			uint32_t v = (uint32_t)(acc >> (64 - n));
+			acc <<= n;
+			bits -= n;
+			return v;
+		}
+
+		// 次の 1 までの 0 の数 (limit で打ち切り、limit 個の 0 は読み進める)
+		int zeros(int limit) {
+			if (bits < limit + 1) fill();
+			int n = (acc == 0) ? 64 : leadingZeros(acc);
+			if (n > limit) n = limit;
+			acc <<= n;
+			bits -= n;
+			return n;
+		}
+
+		bool overrun() const { return extra * 8 > bits; }
+	};
+
+	// 予測符号化の文脈ごとの統計 (予測誤差の絶対値の和 A と数 N から Rice 符号の k を決める)
+	struct RiceContext {
+		int a = 4;
+		int n = 1;
+
+		int k() const {
+			if (a <= n) return 0;
+			int k = leadingZeros((uint64_t)n) - leadingZeros((uint64_t)a);
+			if ((n << k) < a) k++;
+			return k;
+		}
+
+		void update(unsigned int m) {
+			a += (int)m;
+			if (++n >= 64) {
+				a = (a + 1) >> 1;
+				n >>= 1;
+			}
+		}
+	};
+
+	const int predictiveContexts = 8; // 勾配の大きさで分ける文脈の数
+	const int riceLimit = 24;         // これ以上 0 が続く値は生の 17bit で書く
+
+	// 周りの勾配の大きさ (0 なら平ら) から文脈の番号
+	inline int gradientContext(int g) {
+		int bits = 64 - leadingZeros((uint64_t)g | 1); // g のビット長
+		return (std::min)(bits >> 1, predictiveContexts - 1);
+	}
+
+	// MED (Median Edge Detector) による予測
+	// 無効画素 (0) の隣で 0 を使うと予測が大きく外れるので、0 の近傍は他の近傍で置き換える (全て 0 なら 0)
+	inline int medPredict(int a, int b, int c) {
+		if (a == 0 || b == 0 || c == 0) {
+			if (a == 0) a = b ? b : c;
+			if (b == 0) b = a;
+			if (c == 0) c = (a < b) ? a : b;
+			if (a == 0) return 0;
+		}
+		int mx = (std::max)(a, b), mn = (std::min)(a, b);
+		return (std::min)((std::max)(a + b - c, mn), mx); // c >= max なら min、c <= min なら max、それ以外は a + b - c
+	}
+
+	inline void putRice(BitWriter &w, unsigned int m, int k) {
+		unsigned int q = m >> k;
+		if (q < (unsigned int)riceLimit) {
+			w.put(1, q + 1);
+			if (k > 0) w.put(m & ((1u << k) - 1), k);
+		} else {
+			w.put(1, riceLimit + 1);
+			w.put(m, 17);
+		}
+	}
+
+	inline unsigned int getRice(BitReader &r, int k) {
+		int q = r.zeros(riceLimit);
+		r.get(1);
+		if (q >= riceLimit) return r.get(17);
+		return ((unsigned int)q << k) | r.get(k);
+	}
+
+	inline void codeRice(BitWriter &w, unsigned int &m, int k) { putRice(w, m, k); }
+	inline void codeRice(BitReader &r, unsigned int &m, int k) { m = getRice(r, k); }
+
+	// 1つの帯 (rows 行、値は量子化済み、行の間隔は stride 画素) を予測符号化する (Decode なら展開して base に書き込む)
+	// 符号化と展開で同じ手順を通るように1つの関数にしてある (符号化では base に書き込まない)
+	template <bool Decode, typename Coder>
+	inline bool codeStripe(Coder &coder, UINT16 *base, size_t stride, int width, int rows) {
+		RiceContext contexts[predictiveContexts];
+		RiceContext runContext;
+		static thread_local std::vector<UINT16> zeroRow;
+		zeroRow.assign(width, 0);
+		for (int j = 0; j < rows; j++) {
+			UINT16 *row = base + (size_t)j * stride;
+			const UINT16 *up = (j > 0) ? row - stride : &zeroRow[0]; // 帯の1行目の上は0 (無効画素) の行とみなす
+			int i = 0;
+			while (i < width) {
+				// 左 a、上 b、左上 c、右上 d (行頭と行末は上で代用する)
+				int b = up[i];
+				int a = (i > 0) ? row[i - 1] : b;
+				int c = (i > 0) ? up[i - 1] : b;
+				int d = (i + 1 < width) ? up[i + 1] : b;
+				int g = std::abs(d - b) + std::abs(b - c) + std::abs(c - a);
+				if (g == 0) {
+					// 平らな所は a と同じ値の続く長さ (行末まで)
+					unsigned int run = 0;
+					if (!Decode) {
+						while (i + (int)run < width && row[i + run] == a) run++;
+					}
+					codeRice(coder, run, runContext.k());
+					if (Decode) {
+						if (run > (unsigned int)(width - i)) return false;
+						for (unsigned int n = 0; n < run; n++) row[i + n] = (UINT16)a;
+					}
+					runContext.update(run);
+					if (run > 0) {
+						i += run;
+						if (i >= width) break;
+						// 続きが途切れた画素は通常の予測で符号化する (勾配を求め直す)
+						b = up[i];
+						a = row[i - 1];
+						c = up[i - 1];
+						d = (i + 1 < width) ? up[i + 1] : b;
+						g = std::abs(d - b) + std::abs(b - c) + std::abs(c - a);
+					}
+				}
+				RiceContext &ctx = contexts[gradientContext(g)];
+				int pred = medPredict(a, b, c);
+				// 符号は 0 が無効画素、それ以外は予測誤差の zigzag + 1
+				unsigned int m = 0;
+				if (!Decode && row[i] != 0) {
+					int e = row[i] - pred;
+					m = (((unsigned int)e << 1) ^ (unsigned int)(e >> 31)) + 1; // zigzag
+				}
+				codeRice(coder, m, ctx.k());
+				if (Decode) {
+					int v = 0;
+					if (m > 0) v = pred + ((m & 1) ? (int)(m >> 1) : -(int)(m >> 1));
+					if (v < 0 || v > 65535) return false;
+					row[i] = (UINT16)v;
+				}
+				ctx.update(m);
+				i++;
+			}
+		}
+		return true;
+	}
+
+	// 帯の数 (帯ごとにスレッドで分ける。小さい画像は分けない)
+	inline int predictiveStripes(int height) {
+		return (std::max)(1, (std::min)(8, height / 32));
+	}
+
+	// 最悪の場合の圧縮後サイズ
+	inline size_t maxPredictiveSize(int width, int height) {
+		return 4 + 4 * (size_t)predictiveStripes(height) + ((size_t)width * height * (riceLimit + 1 + 17) + 7) / 8 + (size_t)height * 8 + 16;
+	}
+
+	// width x height の Depth (行の間隔は stride 画素) を予測符号化して dst に書き込み、バイト数を返す
+	inline size_t encodePredictive(const UINT16 *src, size_t stride, int width, int height, int quantStep, std::vector<BYTE> &dst) {
+		quantStep = (std::max)(1, (std::min)(quantStep, 255));
+		const int stripes = predictiveStripes(height);
+		const size_t capacity = ((size_t)width * ((height + stripes - 1) / stripes) * (riceLimit + 1 + 17) + 7) / 8 + 16; // 帯ごとの最悪の場合
+		const size_t headerSize = 4 + 4 * (size_t)stripes;
+		dst.resize(headerSize + capacity * stripes);
+		std::vector<uint32_t> sizes(stripes);
+		static thread_local std::vector<UINT16> quantized;
+		const UINT16 *values = src;
+		size_t valueStride = stride;
+		if (quantStep > 1) {
+			// 丸めた値 (quantStep 単位) を符号化する
+			quantized.resize((size_t)width * height);
+			const int maxLevel = 65535 / quantStep;
+			for (int j = 0; j < height; j++) {
+				for (int i = 0; i < width; i++) quantized[(size_t)j * width + i] = (UINT16)(std::min)((src[j * stride + i] + quantStep / 2) / quantStep, maxLevel);
+			}
+			values = &quantized[0];
+			valueStride = width;
+		}
+		cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &r) {
+			for (int s = r.start; s < r.end; s++) {
+				int row0 = height * s / stripes, row1 = height * (s + 1) / stripes;
+				BYTE *out = &dst[headerSize + capacity * s];
+				BitWriter w(out);
+				codeStripe<false>(w, const_cast<UINT16 *>(values) + (size_t)row0 * valueStride, valueStride, width, row1 - row0);
+				sizes[s] = (uint32_t)(w.finish() - out);
+			}
+		}, stripes);
+		// 帯を詰めて並べる
+		size_t offset = headerSize;
+		for (int s = 0; s < stripes; s++) {
+			if (offset != headerSize + capacity * s) memmove(&dst[offset], &dst[headerSize + capacity * s], sizes[s]);
+			offset += sizes[s];
+		}
+		dst[0] = 'P';
+		dst[1] = (BYTE)stripes;
+		dst[2] = (BYTE)quantStep;
+		dst[3] = 0;
+		memcpy(&dst[4], &sizes[0], 4 * (size_t)stripes);
+		dst.resize(offset);
+		return offset;
+	}
+
+	// encodePredictive() で圧縮したデータを展開する (行の間隔は stride 画素、壊れたデータなら false)
+	inline bool decodePredictive(const BYTE *src, size_t size, int width, int height, UINT16 *dst, size_t stride) {
+		if (size < 4 || src[0] != 'P') return false;
+		const int stripes = src[1];
+		const int quantStep = src[2];
+		const size_t headerSize = 4 + 4 * (size_t)stripes;
+		if (stripes != predictiveStripes(height) || quantStep < 1 || size < headerSize) return false;
+		std::vector<uint32_t> sizes(stripes);
+		memcpy(&sizes[0], src + 4, 4 * (size_t)stripes);
+		std::vector<size_t> offsets(stripes + 1, headerSize);
+		for (int s = 0; s < stripes; s++) offsets[s + 1] = offsets[s] + sizes[s];
+		if (offsets[stripes] != size) return false;
+		std::atomic<bool> ok(true);
+		cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &r) {
+			for (int s = r.start; s < r.end; s++) {
+				int row0 = height * s / stripes, row1 = height * (s + 1) / stripes;
+				BitReader reader(src + offsets[s], sizes[s]);
+				bool stripeOk = codeStripe<true>(reader, dst + (size_t)row0 * stride, stride, width, row1 - row0);
+				if (!stripeOk || reader.overrun()) ok = false;
+				if (quantStep > 1) {
+					for (int j = row0; j < row1; j++) {
+						for (int i = 0; i < width; i++) dst[j * stride + i] = (UINT16)(dst[j * stride + i] * quantStep);
+					}
+				}
+			}
+		}, stripes);
+		return ok;
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "KinectTypes.h"
+
+// Depth (16bit) を 256諧調に変換するための参照テーブル
+//   d < min : 0
+//   d >= max : 255
+//   その間 : (d - min) * 255 / (max - min) を四捨五入
+//   validMin - validMax の範囲外 (ROI の Depth の範囲) : 0
+// テーブルは min, max が変わったときだけ作り直すので、画素ごとの処理は表引き1回だけになる
+class DepthWindowLUT {
+private:
+	std::vector<uchar> table;
+	int tableMin = -1;
+	int tableMax = -1;
+	int tableValidMin = 0;
+	int tableValidMax = 65535;
+	unsigned long long rebuildCount = 0;
+
+public:
+	DepthWindowLUT() : table(65536) {
+	}
+
+	// 今のテーブルがこの変換範囲のものか
+	bool matches(int min, int max, int validMin = 0, int validMax = 65535) const {
+		return min == tableMin && max == tableMax && validMin == tableValidMin && validMax == tableValidMax;
+	}
+
+	// 変換範囲を設定する (前回と同じなら何もしない)
+	void set(int min, int max, int validMin = 0, int validMax = 65535) {
+		if (matches(min, max, validMin, validMax)) return;
+		rebuildCount++;
+		tableMin = min;
+		tableMax = max;
+		tableValidMin = validMin;
+		tableValidMax = validMax;
+		double scale = (max > min) ? 255.0 / (max - min) : 0.0;
+		for (int d = 0; d < 65536; d++) {
+			if (d < validMin || d > validMax) table[d] = 0;
+			else if (d < min) table[d] = 0;
+			else if (d >= max) table[d] = 255;
+			else table[d] = (uchar)((d - min) * scale + 0.5);
+		}
+	}
+
+	uchar operator[](UINT16 d) const { return table[d]; }
+
+	// テーブルを作り直した回数
+	unsigned long long rebuilds() const { return rebuildCount; }
+
+	// n 画素を変換する
+	void apply(const UINT16 *src, uchar *dst, size_t n) const {
+		const uchar *t = &table[0];
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			dst[i + 0] = t[src[i + 0]];
+			dst[i + 1] = t[src[i + 1]];
+			dst[i + 2] = t[src[i + 2]];
+			dst[i + 3] = t[src[i + 3]];
+		}
+		for (; i < n; i++) dst[i] = t[src[i]];
+	}
+
+	// CV_16UC1 の Mat を CV_8UC1 に変換する (dst は必要なら確保する)
+	void apply(const cv::Mat &src, cv::Mat &dst) const {
+		CV_Assert(src.type() == CV_16UC1);
+		dst.create(src.rows, src.cols, CV_8UC1);
+		if (src.isContinuous() && dst.isContinuous()) {
+			apply(src.ptr<UINT16>(0), dst.ptr<uchar>(0), src.total());
+			return;
+		}
+		for (int j = 0; j < src.rows; j++) {
+			apply(src.ptr<UINT16>(j), dst.ptr<uchar>(j), src.cols);
+		}
+	}
+};
+
+// 変換範囲ごとのテーブルを slots 個まで持っておく
+// 1フレームの中で違う範囲の変換を交互に使っても (kinect_RGBD の Depth画像と位置合わせ後の画像など)、
+// 範囲の種類が slots 以下ならテーブルを作り直さない (溢れたら一番長く使っていないものを作り直す)
+class DepthWindowLUTCache {
+private:
+	static const int slots = 4;
+	DepthWindowLUT luts[slots];
+	unsigned long long lastUse[slots] = {};
+	unsigned long long useCount = 0;
+
+public:
+	const DepthWindowLUT &get(int min, int max, int validMin = 0, int validMax = 65535) {
+		int slot = 0;
+		for (int k = 0; k < slots; k++) {
+			if (luts[k].matches(min, max, validMin, validMax)) {
+				slot = k;
+				break;
+			}
+			if (lastUse[k] < lastUse[slot]) slot = k;
+		}
+		luts[slot].set(min, max, validMin, validMax);
+		lastUse[slot] = ++useCount;
+		return luts[slot];
+	}
+
+	// 全てのテーブルを作り直した回数の合計
+	unsigned long long rebuilds() const {
+		unsigned long long n = 0;
+		for (int k = 0; k < slots; k++) n += luts[k].rebuilds();
+		return n;
+	}
+};
+
+// このスレッドの変換テーブルのキャッシュ
+inline DepthWindowLUTCache &depthWindowLUTCache() {
+	static thread_local DepthWindowLUTCache cache;
+	return cache;
+}
+
+// min-max 間の変換テーブル
+// テーブルはスレッドごとに範囲の種類ごとに持ち、使ったことのある範囲なら作り直さない (複数のスレッドから呼んでよい)
+inline const DepthWindowLUT &depthWindowLUT(int min, int max, int validMin = 0, int validMax = 65535) {
+	return depthWindowLUTCache().get(min, max, validMin, validMax);
+}
+
+// CV_16UC1 の Mat を min-max 間で 256諧調の CV_8UC1 に変換する
+inline void convertDepthWindow(const cv::Mat &src, cv::Mat &dst, int min, int max) {
+	depthWindowLUT(min, max).apply(src, dst);
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEPTH_REGISTRATION_SSE2
+#endif
+
+#include "KinectCalibration.h"
+
+// ICoordinateMapper を使わない Depth座標系 → RGB座標系の位置合わせ (MapDepthFrameToColorSpace の代わり)
+// 射影行列と各Depth画素の光線 (X, Y, 1) の積を initialize() で画素ごとに求めておくので、
+// フレームごとの計算は画素あたり 積和3組と割り算1回だけになる
+//   u = (rayU * z + P[3]) / (rayW * z + P[11]),  v = (rayV * z + P[7]) / (rayW * z + P[11])  (z は Depth [m])
+// RGBカメラのレンズの歪み (colorDistortion) があれば、その後に歪みの多項式を加える (画素あたり積和十数回)
+// SSE2 で4画素ずつ計算し、行をまとめて cv::parallel_for_ で複数のスレッドに分ける
+// 結果は MapDepthFrameToColorSpace と同じ形式 (Depth値が0の画素は -infinity)
+class DepthRegistration {
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<float> rayU; // 画素ごとの P[0..2]・(X, Y, 1)
+	std::vector<float> rayV; // 画素ごとの P[4..6]・(X, Y, 1)
+	std::vector<float> rayW; // 画素ごとの P[8..10]・(X, Y, 1)
+	float offsetU = 0;       // P[3]
+	float offsetV = 0;       // P[7]
+	float offsetW = 0;       // P[11]
+
+	// RGBカメラのレンズの歪み (distorted が false なら使わない)
+	bool distorted = false;
+	float fx = 0, fy = 0, cx = 0, cy = 0;
+	float invFx = 0, invFy = 0;
+	float k1 = 0, k2 = 0, k3 = 0, p1 = 0, p2 = 0;
+
+	// 射影したRGB座標に歪みを加える (SSE2 の方と同じ順に計算する)
+	void distort(float &u, float &v) const {
+		float x = (u - cx) * invFx, y = (v - cy) * invFy;
+		float xx = x * x, yy = y * y, xy = x * y;
+		float r2 = xx + yy;
+		float radial = 1.0f + r2 * (k1 + r2 * (k2 + r2 * k3));
+		float xd = x * radial + (2.0f * p1 * xy + p2 * (r2 + 2.0f * xx));
+		float yd = y * radial + (p1 * (r2 + 2.0f * yy) + 2.0f * p2 * xy);
+		u = cx + fx * xd;
+		v = cy + fy * yd;
+	}
+
+	// 1画素分 (SSE2 の端数と SSE2 が無い環境で使う)
+	void mapPixel(int i, UINT16 d, ColorSpacePoint &p, UINT16 minDepth = 1, UINT16 maxDepth = 65535) const {
+		const float ninf = -std::numeric_limits<float>::infinity();
+		float z = d * 0.001f;
+		float w = rayW[i] * z + offsetW;
+		if (d == 0 || d < minDepth || d > maxDepth || w <= 0) {
+			p.X = p.Y = ninf;
+			return;
+		}
+		// SSE2 の方と同じく除算する (逆数を掛けると最下位ビットが変わり、窓の端の画素だけ結果がずれる)
+		p.X = (rayU[i] * z + offsetU) / w;
+		p.Y = (rayV[i] * z + offsetV) / w;
+		if (distorted) distort(p.X, p.Y);
+	}
+
+public:
+	void initialize(const KinectCalibration &c) {
+		width = c.depthWidth;
+		height = c.depthHeight;
+		size_t n = (size_t)width * height;
+		rayU.resize(n);
+		rayV.resize(n);
+		rayW.resize(n);
+		const double *P = c.colorProjection;
+		for (size_t i = 0; i < n; i++) {
+			double x = c.depthRays[i * 2], y = c.depthRays[i * 2 + 1];
+			rayU[i] = (float)(P[0] * x + P[1] * y + P[2]);
+			rayV[i] = (float)(P[4] * x + P[5] * y + P[6]);
+			rayW[i] = (float)(P[8] * x + P[9] * y + P[10]);
+		}
+		offsetU = (float)P[3];
+		offsetV = (float)P[7];
+		offsetW = (float)P[11];
+
+		distorted = c.hasColorDistortion();
+		double ifx, ify, icx, icy;
+		colorCameraIntrinsics(P, ifx, ify, icx, icy);
+		fx = (float)ifx;
+		fy = (float)ify;
+		cx = (float)icx;
+		cy = (float)icy;
+		invFx = (float)(1 / ifx);
+		invFy = (float)(1 / ify);
+		k1 = (float)c.colorDistortion[0];
+		k2 = (float)c.colorDistortion[1];
+		p1 = (float)c.colorDistortion[2];
+		p2 = (float)c.colorDistortion[3];
+		k3 = (float)c.colorDistortion[4];
+	}
+
+	bool isInitialized() const { return width > 0; }
+	size_t size() const { return (size_t)width * height; }
+
+	// Depthフレームの rowBegin 行目から rowEnd 行目の手前までを変換する (スレッドごとの処理の単位)
+	void mapRows(const UINT16 *depth, ColorSpacePoint *points, int rowBegin, int rowEnd) const {
+		mapSpan(depth, points, rowBegin * width, rowEnd * width, 1, 65535);
+	}
+
+	// 画素 i から end の手前までを変換する (Depth値が minDepth - maxDepth の範囲外の画素も -infinity)
+	void mapSpan(const UINT16 *depth, ColorSpacePoint *points, int i, int end, UINT16 minDepth, UINT16 maxDepth) const {
+#ifdef DEPTH_REGISTRATION_SSE2
+		const __m128 scale = _mm_set1_ps(0.001f);
+		const __m128 ou = _mm_set1_ps(offsetU), ov = _mm_set1_ps(offsetV), ow = _mm_set1_ps(offsetW);
+		const __m128 ninf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+		const __m128 zero = _mm_setzero_ps();
+		const __m128i zeroi = _mm_setzero_si128();
+		const __m128i lower = _mm_set1_epi32((int)(std::max)(minDepth, (UINT16)1));
+		const __m128i upper = _mm_set1_epi32(maxDepth);
+		const __m128 dfx = _mm_set1_ps(fx), dfy = _mm_set1_ps(fy), dcx = _mm_set1_ps(cx), dcy = _mm_set1_ps(cy), difx = _mm_set1_ps(invFx), dify = _mm_set1_ps(invFy);
+		const __m128 dk1 = _mm_set1_ps(k1), dk2 = _mm_set1_ps(k2), dk3 = _mm_set1_ps(k3), dp1 = _mm_set1_ps(p1), dp2 = _mm_set1_ps(p2);
+		const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+		for (; i + 4 <= end; i += 4) {
+			__m128i d = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(depth + i)), zeroi);
+			__m128 z = _mm_mul_ps(_mm_cvtepi32_ps(d), scale);
+			__m128 w = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&rayW[i]), z), ow);
+			__m128 u = _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&rayU[i]), z), ou), w);
+			__m128 v = _mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&rayV[i]), z), ov), w);
+			if (distorted) {
+				__m128 x = _mm_mul_ps(_mm_sub_ps(u, dcx), difx), y = _mm_mul_ps(_mm_sub_ps(v, dcy), dify);
+				__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), xy = _mm_mul_ps(x, y);
+				__m128 r2 = _mm_add_ps(xx, yy);
+				__m128 radial = _mm_add_ps(one, _mm_mul_ps(r2, _mm_add_ps(dk1, _mm_mul_ps(r2, _mm_add_ps(dk2, _mm_mul_ps(r2, dk3))))));
+				__m128 xd = _mm_add_ps(_mm_mul_ps(x, radial), _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, dp1), xy), _mm_mul_ps(dp2, _mm_add_ps(r2, _mm_mul_ps(two, xx)))));
+				__m128 yd = _mm_add_ps(_mm_mul_ps(y, radial), _mm_add_ps(_mm_mul_ps(dp1, _mm_add_ps(r2, _mm_mul_ps(two, yy))), _mm_mul_ps(_mm_mul_ps(two, dp2), xy)));
+				u = _mm_add_ps(dcx, _mm_mul_ps(dfx, xd));
+				v = _mm_add_ps(dcy, _mm_mul_ps(dfy, yd));
+			}
+
+			// Depth値が0と範囲外 (w <= 0 も含む) の画素は -infinity
+			__m128 invalid = _mm_cmple_ps(w, zero);
+			invalid = _mm_or_ps(invalid, _mm_castsi128_ps(_mm_or_si128(_mm_cmplt_epi32(d, lower), _mm_cmpgt_epi32(d, upper))));
+			u = _mm_or_ps(_mm_and_ps(invalid, ninf), _mm_andnot_ps(invalid, u));
+			v = _mm_or_ps(_mm_and_ps(invalid, ninf), _mm_andnot_ps(invalid, v));
+
+			_mm_storeu_ps(&points[i].X, _mm_unpacklo_ps(u, v));
+			_mm_storeu_ps(&points[i + 2].X, _mm_unpackhi_ps(u, v));
+		}
+#endif
+		for (; i < end; i++) mapPixel(i, depth[i], points[i], minDepth, maxDepth);
+	}
+
+	// Depthフレーム全体を変換する (points は size() 個)
+	void depthToColorSpace(const UINT16 *depth, ColorSpacePoint *points) const {
+		const int rowsPerStripe = 16;
+		cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &r) {
+			mapRows(depth, points, r.start, r.end);
+		}, (double)(height + rowsPerStripe - 1) / rowsPerStripe);
+	}
+
+	// rect の中の画素だけを変換する (Depth値が minDepth - maxDepth の範囲外の画素も -infinity。rect の外の points は書き換えない)
+	void depthToColorSpace(const UINT16 *depth, ColorSpacePoint *points, const cv::Rect &rect, UINT16 minDepth, UINT16 maxDepth) const {
+		const int rowsPerStripe = 16;
+		cv::parallel_for_(cv::Range(rect.y, rect.y + rect.height), [&](const cv::Range &r) {
+			for (int j = r.start; j < r.end; j++) mapSpan(depth, points, j * width + rect.x, j * width + rect.x + rect.width, minDepth, maxDepth);
+		}, (double)(rect.height + rowsPerStripe - 1) / rowsPerStripe);
+	}
+};
+
+// カメラ座標 [m] と RGB画素の対応から射影行列を最小二乗法で求める (P[10] = 1 に固定。当てはめられなければ false)
+inline bool fitPinholeProjection(const std::vector<CameraSpacePoint> &cameraPoints, const std::vector<ColorSpacePoint> &colorPoints, double P[12]) {
+	size_t n = (std::min)(cameraPoints.size(), colorPoints.size());
+	cv::Mat A((int)n * 2, 11, CV_64FC1), b((int)n * 2, 1, CV_64FC1);
+	int rows = 0;
+	for (size_t k = 0; k < n; k++) {
+		double X = cameraPoints[k].X, Y = cameraPoints[k].Y, Z = cameraPoints[k].Z;
+		double u = colorPoints[k].X, v = colorPoints[k].Y;
+		if (!std::isfinite(u) || !std::isfinite(v) || Z <= 0) continue;
+		// 未知数の並び : P[0..3], P[4..7], P[8], P[9], P[11]
+		double *a = A.ptr<double>(rows);
+		double ru[11] = { X, Y, Z, 1, 0, 0, 0, 0, -u * X, -u * Y, -u };
+		memcpy(a, ru, sizeof(ru));
+		b.at<double>(rows++, 0) = u * Z;
+		a = A.ptr<double>(rows);
+		double rv[11] = { 0, 0, 0, 0, X, Y, Z, 1, -v * X, -v * Y, -v };
+		memcpy(a, rv, sizeof(rv));
+		b.at<double>(rows++, 0) = v * Z;
+	}
+	if (rows < 22) return false;
+
+	cv::Mat x;
+	if (!cv::solve(A.rowRange(0, rows), b.rowRange(0, rows), x, cv::DECOMP_QR)) return false;
+	const double *s = x.ptr<double>(0);
+	for (int k = 0; k < 8; k++) P[k] = s[k];
+	P[8] = s[8];
+	P[9] = s[9];
+	P[10] = 1;
+	P[11] = s[10];
+	return true;
+}
+
+// 射影行列とレンズの歪みで変換したときの誤差の最大 [RGB画素] (distortion が nullptr なら歪み無し)
+inline double colorProjectionError(const std::vector<CameraSpacePoint> &cameraPoints, const std::vector<ColorSpacePoint> &colorPoints, const double P[12], const double *distortion) {
+	size_t n = (std::min)(cameraPoints.size(), colorPoints.size());
+	double maxError = 0;
+	for (size_t k = 0; k < n; k++) {
+		double u, v;
+		if (!std::isfinite(colorPoints[k].X) || !std::isfinite(colorPoints[k].Y) || cameraPoints[k].Z <= 0) continue;
+		if (!projectColorPoint(P, distortion, cameraPoints[k].X, cameraPoints[k].Y, cameraPoints[k].Z, u, v)) continue;
+		double du = u - colorPoints[k].X, dv = v - colorPoints[k].Y;
+		maxError = (std::max)(maxError, std::sqrt(du * du + dv * dv));
+	}
+	return maxError;
+}
+
+// 射影行列 (P[10] 以外の11個) と歪み (5個) を並べたパラメータで変換したときの誤差を residuals に並べる (二乗和を返す)
+inline double colorProjectionResiduals(const std::vector<CameraSpacePoint> &cameraPoints, const std::vector<ColorSpacePoint> &colorPoints, const double params[16], std::vector<double> &residuals) {
+	double P[12] = { params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8], params[9], 1, params[10] };
+	const double *d = params + 11;
+	double fx, fy, cx, cy;
+	colorCameraIntrinsics(P, fx, fy, cx, cy);
+	residuals.clear();
+	double sum = 0;
+	for (size_t k = 0; k < cameraPoints.size(); k++) {
+		double X = cameraPoints[k].X, Y = cameraPoints[k].Y, Z = cameraPoints[k].Z;
+		double w = P[8] * X + P[9] * Y + P[10] * Z + P[11];
+		double x = ((P[0] * X + P[1] * Y + P[2] * Z + P[3]) / w - cx) / fx;
+		double y = ((P[4] * X + P[5] * Y + P[6] * Z + P[7]) / w - cy) / fy;
+		distortNormalizedPoint(d, x, y);
+		double du = cx + fx * x - colorPoints[k].X, dv = cy + fy * y - colorPoints[k].Y;
+		residuals.push_back(du);
+		residuals.push_back(dv);
+		sum += du * du + dv * dv;
+	}
+	return sum;
+}
+
+// カメラ座標 [m] と RGB画素の対応から射影行列 (とレンズの歪み) を求める
+// distortion を渡すと歪み (k1, k2, p1, p2, k3) も求める。歪み無しの射影行列から始めて、
+// 射影行列と歪みをまとめて Levenberg-Marquardt 法で当てはめる (ヤコビ行列は差分で求める)
+// 戻り値は当てはめた点を変換したときの誤差の最大 [RGB画素] (点が足りなければ負)
+inline double fitColorProjection(const std::vector<CameraSpacePoint> &cameraPoints, const std::vector<ColorSpacePoint> &colorPoints, double P[12], double *distortion = nullptr) {
+	if (!fitPinholeProjection(cameraPoints, colorPoints, P)) return -1;
+	if (distortion == nullptr) return colorProjectionError(cameraPoints, colorPoints, P, nullptr);
+
+	// 無効な点を除いておく
+	std::vector<CameraSpacePoint> cameras;
+	std::vector<ColorSpacePoint> colors;
+	for (size_t k = 0; k < (std::min)(cameraPoints.size(), colorPoints.size()); k++) {
+		if (!std::isfinite(colorPoints[k].X) || !std::isfinite(colorPoints[k].Y) || cameraPoints[k].Z <= 0) continue;
+		cameras.push_back(cameraPoints[k]);
+		colors.push_back(colorPoints[k]);
+	}
+
+	const int count = 16;
+	double params[count] = { P[0], P[1], P[2], P[3], P[4], P[5], P[6], P[7], P[8], P[9], P[11], 0, 0, 0, 0, 0 };
+	std::vector<double> residuals, shifted;
+	std::vector<std::vector<double>> jacobian(count);
+	double cost = colorProjectionResiduals(cameras, colors, params, residuals);
+	double lambda = 1e-3;
+	for (int iteration = 0; iteration < 100 && lambda < 1e10; iteration++) {
+		for (int j = 0; j < count; j++) {
+			double saved = params[j];
+			double h = 1e-7 * (std::max)(std::fabs(saved), 1e-2);
+			params[j] = saved + h;
+			colorProjectionResiduals(cameras, colors, params, jacobian[j]);
+			params[j] = saved;
+			for (size_t r = 0; r < residuals.size(); r++) jacobian[j][r] = (jacobian[j][r] - residuals[r]) / h;
+		}
+		cv::Mat JtJ(count, count, CV_64FC1), Jtr(count, 1, CV_64FC1);
+		for (int a = 0; a < count; a++) {
+			for (int b = a; b < count; b++) {
+				double sum = 0;
+				for (size_t r = 0; r < residuals.size(); r++) sum += jacobian[a][r] * jacobian[b][r];
+				JtJ.at<double>(a, b) = JtJ.at<double>(b, a) = sum;
+			}
+			double sum = 0;
+			for (size_t r = 0; r < residuals.size(); r++) sum += jacobian[a][r] * residuals[r];
+			Jtr.at<double>(a, 0) = -sum;
+		}
+
+		// 誤差が減るまで減衰を強くする
+		bool improved = false;
+		while (!improved && lambda < 1e10) {
+			cv::Mat damped = JtJ.clone(), step;
+			for (int a = 0; a < count; a++) damped.at<double>(a, a) *= 1 + lambda;
+			if (!cv::solve(damped, Jtr, step, cv::DECOMP_CHOLESKY)) {
+				lambda *= 10;
+				continue;
+			}
+			double trial[count];
+			for (int a = 0; a < count; a++) trial[a] = params[a] + step.at<double>(a, 0);
+			double trialCost = colorProjectionResiduals(cameras, colors, trial, shifted);
+			if (trialCost < cost) {
+				improved = true;
+				bool converged = cost - trialCost < 1e-12 * cost;
+				memcpy(params, trial, sizeof(params));
+				residuals.swap(shifted);
+				cost = trialCost;
+				lambda = (std::max)(lambda / 10, 1e-12);
+				if (converged) lambda = 1e10;
+			} else {
+				lambda *= 10;
+			}
+		}
+	}
+
+	double fitted[12] = { params[0], params[1], params[2], params[3], params[4], params[5], params[6], params[7], params[8], params[9], 1, params[10] };
+	memcpy(P, fitted, sizeof(fitted));
+	for (int k = 0; k < 5; k++) distortion[k] = params[11 + k];
+	return colorProjectionError(cameraPoints, colorPoints, P, distortion);
+}
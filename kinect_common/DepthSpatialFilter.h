@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEPTH_SPATIAL_SSE2
+#endif
+
+#include "DepthWarp.h"
+#include "KinectTypes.h"
+
+// 空間方向のフィルタの設定
+struct DepthSpatialOptions {
+	float sigmaSpatial = 6.0f; // 平滑化する範囲 [画素]
+	float sigmaDepth = 50.0f;  // これより大きな段差は平滑化しない [mm] (3m での雑音の数倍)
+	float sigmaColor = 0.0f;   // RGB で導く場合の色の差の目安 (0 なら RGB を使わない)
+	int iterations = 2;        // 横・縦の組を繰り返す回数 (増やすと縞が減る)
+	int maxHoleSize = 4;       // フィルタの後に埋める穴の最大の幅 [画素] (0 なら埋めない)
+	bool removeSpeckles = true; // 上下左右の全てと sigmaDepth の4倍以上離れた1画素の点 (斑点) を穴にする
+};
+
+// 段差を保つ Depth の空間方向のフィルタ (Domain Transform の再帰フィルタ、Gastal and Oliveira 2011)
+// 隣り合う画素の間の距離を 1 + sigmaSpatial / sigmaDepth * |Depthの差| (+ RGB の差の項) とみなし、
+// 横の往復、縦の往復の1次の再帰フィルタをかける。段差の所は重みがほぼ0になるので前景と背景が混ざらない
+// 重みは距離を量子化した表から引き、隣との距離は最初に1回だけ求める (繰り返しでは表を変えるだけ)
+// Depth値が0の画素との間の重みは0で、フィルタはその画素を飛ばす (穴はその後に fillDepthHoles() で埋める)
+// 横は行の帯、縦は列の帯に分けて複数のスレッドで処理する (縦の帯の中は行に沿って連続に読み書きするので SIMD になる)
+// 作業領域は initialize() で確保するので、1つの DepthSpatialFilter は1つのスレッドから使う
+class DepthSpatialFilter {
+private:
+	static const int distanceScale = 8;   // 距離の量子化 (1/8 画素単位)
+	static const int distanceLevels = 1024; // これ以上遠い (128 画素分を超える) 隣との重みは0
+
+	int width = 0;
+	int height = 0;
+	DepthSpatialOptions options;
+	std::vector<float> value;          // フィルタ中の値
+	std::vector<uint16_t> distanceH;   // 左隣との距離 (量子化した値、distanceLevels - 1 なら切れている)
+	std::vector<uint16_t> distanceV;   // 上隣との距離
+	std::vector<float> weightTable;    // 繰り返しごとの 距離 → 重み
+	std::vector<float> weightV;        // 表から引いた縦の重み (繰り返しごとに作り直す、横は表を直接引く)
+
+	unsigned long long frameCount = 0;
+	double lastMs = 0;
+	double totalMs = 0;
+	double maxMs = 0;
+
+	// 隣り合う2画素の距離を量子化する (どちらかが穴なら切る)
+	uint16_t quantizeDistance(UINT16 d0, UINT16 d1, const uchar *c0, const uchar *c1, float depthRatio, float colorRatio) const {
+		if (d0 == 0 || d1 == 0) return distanceLevels - 1;
+		float dt = 1.0f + depthRatio * std::abs((int)d0 - (int)d1);
+		if (c0 != nullptr) dt += colorRatio * (std::abs(c0[0] - c1[0]) + std::abs(c0[1] - c1[1]) + std::abs(c0[2] - c1[2]));
+		return (uint16_t)(std::min)((int)(dt * distanceScale + 0.5f), distanceLevels - 1);
+	}
+
+	// Depthだけの場合の a[i] と b[i] の距離 (SSE2 で8画素ずつ、端数は同じ式で1画素ずつ)
+	static void depthDistances(const UINT16 *a, const UINT16 *b, uint16_t *d, int n, float depthScale) {
+		int i = 0;
+#ifdef DEPTH_SPATIAL_SSE2
+		const __m128 scale = _mm_set1_ps(depthScale);
+		const __m128 offset = _mm_set1_ps(distanceScale + 0.5f);
+		const __m128i cut = _mm_set1_epi16(distanceLevels - 1);
+		const __m128i zeroi = _mm_setzero_si128();
+		for (; i + 8 <= n; i += 8) {
+			__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+			__m128i diff = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+			__m128 lo = _mm_add_ps(offset, _mm_mul_ps(scale, _mm_cvtepi32_ps(_mm_unpacklo_epi16(diff, zeroi))));
+			__m128 hi = _mm_add_ps(offset, _mm_mul_ps(scale, _mm_cvtepi32_ps(_mm_unpackhi_epi16(diff, zeroi))));
+			__m128i q = _mm_min_epi16(_mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)), cut);
+			__m128i hole = _mm_or_si128(_mm_cmpeq_epi16(va, zeroi), _mm_cmpeq_epi16(vb, zeroi));
+			_mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(_mm_and_si128(hole, cut), _mm_andnot_si128(hole, q)));
+		}
+#endif
+		for (; i < n; i++) {
+			int q = (int)(distanceScale + 0.5f + depthScale * (float)std::abs((int)a[i] - (int)b[i]));
+			q = (std::min)(q, distanceLevels - 1);
+			d[i] = (uint16_t)((a[i] == 0 || b[i] == 0) ? distanceLevels - 1 : q);
+		}
+	}
+
+	void computeDistances(const UINT16 *depth, const cv::Mat &guide, int rowBegin, int rowEnd) {
+		float depthRatio = options.sigmaSpatial / options.sigmaDepth;
+		bool useColor = !guide.empty() && options.sigmaColor > 0;
+		if (!useColor) {
+			for (int j = rowBegin; j < rowEnd; j++) {
+				const UINT16 *row = depth + (size_t)j * width;
+				uint16_t *dh = &distanceH[(size_t)j * width];
+				uint16_t *dv = &distanceV[(size_t)j * width];
+				dh[0] = distanceLevels - 1;
+				depthDistances(row, row + 1, dh + 1, width - 1, depthRatio * distanceScale);
+				if (j > 0) depthDistances(row - width, row, dv, width, depthRatio * distanceScale);
+				else std::fill(dv, dv + width, (uint16_t)(distanceLevels - 1));
+			}
+			return;
+		}
+		float colorRatio = useColor ? options.sigmaSpatial / options.sigmaColor / 3.0f : 0.0f;
+		for (int j = rowBegin; j < rowEnd; j++) {
+			const UINT16 *row = depth + (size_t)j * width;
+			const UINT16 *up = (j > 0) ? row - width : nullptr;
+			const uchar *c = useColor ? guide.ptr<uchar>(j) : nullptr;
+			const uchar *cu = (useColor && j > 0) ? guide.ptr<uchar>(j - 1) : nullptr;
+			uint16_t *dh = &distanceH[(size_t)j * width];
+			uint16_t *dv = &distanceV[(size_t)j * width];
+			dh[0] = distanceLevels - 1;
+			for (int i = 1; i < width; i++) dh[i] = quantizeDistance(row[i - 1], row[i], c ? c + (i - 1) * 4 : nullptr, c ? c + i * 4 : nullptr, depthRatio, colorRatio);
+			for (int i = 0; i < width; i++) dv[i] = up ? quantizeDistance(up[i], row[i], cu ? cu + i * 4 : nullptr, c ? c + i * 4 : nullptr, depthRatio, colorRatio) : (uint16_t)(distanceLevels - 1);
+		}
+	}
+
+	// 横の往復 (value[i] = value[i] + w * (value[i-1] - value[i]))
+	// 1行の再帰は前の画素の結果を待つので、4行を交互に進めて待ち時間を埋める
+	void filterRows(int rowBegin, int rowEnd) {
+		const float *table = &weightTable[0];
+		int j = rowBegin;
+		for (; j + 4 <= rowEnd; j += 4) {
+			float *v0 = &value[(size_t)j * width], *v1 = v0 + width, *v2 = v1 + width, *v3 = v2 + width;
+			const uint16_t *d0 = &distanceH[(size_t)j * width], *d1 = d0 + width, *d2 = d1 + width, *d3 = d2 + width;
+			for (int i = 1; i < width; i++) {
+				v0[i] += table[d0[i]] * (v0[i - 1] - v0[i]);
+				v1[i] += table[d1[i]] * (v1[i - 1] - v1[i]);
+				v2[i] += table[d2[i]] * (v2[i - 1] - v2[i]);
+				v3[i] += table[d3[i]] * (v3[i - 1] - v3[i]);
+			}
+			for (int i = width - 2; i >= 0; i--) {
+				v0[i] += table[d0[i + 1]] * (v0[i + 1] - v0[i]);
+				v1[i] += table[d1[i + 1]] * (v1[i + 1] - v1[i]);
+				v2[i] += table[d2[i + 1]] * (v2[i + 1] - v2[i]);
+				v3[i] += table[d3[i + 1]] * (v3[i + 1] - v3[i]);
+			}
+		}
+		for (; j < rowEnd; j++) {
+			float *v = &value[(size_t)j * width];
+			const uint16_t *d = &distanceH[(size_t)j * width];
+			for (int i = 1; i < width; i++) v[i] += table[d[i]] * (v[i - 1] - v[i]);
+			for (int i = width - 2; i >= 0; i--) v[i] += table[d[i + 1]] * (v[i + 1] - v[i]);
+		}
+	}
+
+	// 縦の往復 (列 colBegin から colEnd の手前まで、行ごとに連続した範囲を処理する)
+	void filterCols(int colBegin, int colEnd) {
+		for (int j = 1; j < height; j++) {
+			float *v = &value[(size_t)j * width];
+			const float *up = v - width;
+			const float *w = &weightV[(size_t)j * width];
+			for (int i = colBegin; i < colEnd; i++) v[i] += w[i] * (up[i] - v[i]);
+		}
+		for (int j = height - 2; j >= 0; j--) {
+			float *v = &value[(size_t)j * width];
+			const float *down = v + width;
+			const float *w = &weightV[(size_t)(j + 1) * width];
+			for (int i = colBegin; i < colEnd; i++) v[i] += w[i] * (down[i] - v[i]);
+		}
+	}
+
+public:
+	void initialize(int width, int height) {
+		this->width = width;
+		this->height = height;
+		size_t n = (size_t)width * height;
+		value.resize(n);
+		distanceH.resize(n);
+		distanceV.resize(n);
+		weightV.resize(n);
+		weightTable.resize(distanceLevels);
+	}
+
+	bool isInitialized() const { return width > 0; }
+
+	void setOptions(const DepthSpatialOptions &options) { this->options = options; }
+	const DepthSpatialOptions &getOptions() const { return options; }
+
+	// in をフィルタして out に書き込む (in == out でもよい)
+	// guide (CV_8UC4、Depthと同じ大きさの位置合わせしたRGB) を渡し sigmaColor > 0 なら、色の境界でも平滑化を止める
+	void apply(const UINT16 *in, UINT16 *out, const cv::Mat &guide = cv::Mat()) {
+		double start = (double)cv::getTickCount();
+		const int rowsPerStripe = 16, colsPerStripe = 64;
+		const int rowStripes = (height + rowsPerStripe - 1) / rowsPerStripe;
+		const int colStripes = (width + colsPerStripe - 1) / colsPerStripe;
+		const cv::Mat guideMat = (!guide.empty() && guide.type() == CV_8UC4 && guide.rows == height && guide.cols == width) ? guide : cv::Mat();
+
+		cv::parallel_for_(cv::Range(0, rowStripes), [&](const cv::Range &r) {
+			int rowEnd = (std::min)(r.end * rowsPerStripe, height);
+			computeDistances(in, guideMat, r.start * rowsPerStripe, rowEnd);
+			for (size_t i = (size_t)r.start * rowsPerStripe * width; i < (size_t)rowEnd * width; i++) value[i] = in[i];
+		});
+
+		int iterations = (std::max)(options.iterations, 1);
+		for (int k = 0; k < iterations; k++) {
+			// 繰り返しごとに範囲を狭める (全体で sigmaSpatial になるように)
+			double sigmaH = options.sigmaSpatial * std::sqrt(3.0) * std::pow(2.0, iterations - k - 1) / std::sqrt(std::pow(4.0, iterations) - 1);
+			double a = std::exp(-std::sqrt(2.0) / sigmaH);
+			for (int q = 0; q < distanceLevels - 1; q++) weightTable[q] = (float)std::pow(a, (double)q / distanceScale);
+			weightTable[distanceLevels - 1] = 0;
+
+			cv::parallel_for_(cv::Range(0, rowStripes), [&](const cv::Range &r) {
+				int rowEnd = (std::min)(r.end * rowsPerStripe, height);
+				for (size_t i = (size_t)r.start * rowsPerStripe * width; i < (size_t)rowEnd * width; i++) weightV[i] = weightTable[distanceV[i]];
+				filterRows(r.start * rowsPerStripe, rowEnd);
+			});
+			cv::parallel_for_(cv::Range(0, colStripes), [&](const cv::Range &r) {
+				filterCols(r.start * colsPerStripe, (std::min)(r.end * colsPerStripe, width));
+			});
+		}
+
+		// 穴はそのまま0で、値のある画素だけ書き戻す (斑点は隣との距離が全て speckle 以上の画素)
+		const int speckle = options.removeSpeckles ? (int)((1.0f + options.sigmaSpatial * 4.0f) * distanceScale) : distanceLevels;
+		cv::parallel_for_(cv::Range(0, rowStripes), [&](const cv::Range &r) {
+			int rowEnd = (std::min)(r.end * rowsPerStripe, height);
+			for (int j = r.start * rowsPerStripe; j < rowEnd; j++) {
+				size_t row = (size_t)j * width;
+				for (int i = 0; i < width; i++) {
+					size_t k = row + i;
+					if (in[k] == 0) {
+						out[k] = 0;
+						continue;
+					}
+					bool isolated = distanceH[k] >= speckle && distanceV[k] >= speckle
+						&& (i + 1 >= width || distanceH[k + 1] >= speckle) && (j + 1 >= height || distanceV[k + width] >= speckle);
+					out[k] = isolated ? 0 : (UINT16)(value[k] + 0.5f);
+				}
+			}
+		});
+
+		if (options.maxHoleSize > 0) {
+			cv::Mat outMat(height, width, CV_16UC1, out);
+			fillDepthHoles(outMat, options.maxHoleSize);
+		}
+
+		lastMs = ((double)cv::getTickCount() - start) / cv::getTickFrequency() * 1000.0;
+		totalMs += lastMs;
+		maxMs = (std::max)(maxMs, lastMs);
+		frameCount++;
+	}
+
+	// depth をその場でフィルタする
+	void apply(UINT16 *depth, const cv::Mat &guide = cv::Mat()) { apply(depth, depth, guide); }
+
+	// 1フレームあたりの処理時間 [ms]
+	unsigned long long frames() const { return frameCount; }
+	double lastFrameMs() const { return lastMs; }
+	double meanFrameMs() const { return frameCount ? totalMs / frameCount : 0; }
+	double maxFrameMs() const { return maxMs; }
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEPTH_TEMPORAL_SSE2
+#endif
+
+#include "KinectTypes.h"
+
+// 時間方向のフィルタの設定
+struct DepthTemporalOptions {
+	float alpha = 0.3f;             // 新しいフレームの重み (小さいほど滑らかだが動きに遅れる)
+	float resetThreshold = 30.0f;   // 平均との差がこれを超えたら動いたとみなして平均を捨てる [mm] (1m での値)
+	float resetSlope = 0.02f;       // 遠いほど雑音が大きいので、閾値に 平均 [mm] x resetSlope を足す
+	int holePersistence = 3;        // Depth値が0になっても、この数のフレームまでは平均を出し続ける (ちらつく穴を埋める)
+};
+
+// Depthフレームの時間方向のフィルタ (画素ごとの指数移動平均)
+//   平均との差が閾値以下 : 平均 += alpha * (Depth - 平均) を出力する
+//   閾値を超えた (動いた) : 平均を新しい値に置き換える (動いた物が尾を引かない)
+//   Depth値が0 (穴) : holePersistence フレームまでは平均を出し、それを過ぎたら0
+// 状態は画素ごとの平均 (float) と穴が続いたフレーム数だけなので、履歴の大きさは固定
+// Depthバッファを直接書き換え、SSE2 で4画素ずつ、行の帯ごとに複数のスレッドで処理する
+class DepthTemporalFilter {
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<float> average;  // 0 なら平均が無い
+	std::vector<uint8_t> holeAge; // 穴が続いているフレーム数
+	DepthTemporalOptions options;
+
+	// 処理時間の統計
+	unsigned long long frameCount = 0;
+	double lastMs = 0;
+	double totalMs = 0;
+	double maxMs = 0;
+
+	// 1画素分 (SSE2 の端数と SSE2 が無い環境で使う)
+	void filterPixel(UINT16 &d, float &a, uint8_t &age) const {
+		if (d == 0) {
+			if (a > 0 && age < options.holePersistence) {
+				age++;
+				d = (UINT16)std::lrint(a);
+			} else {
+				a = 0;
+				age = 0;
+			}
+			return;
+		}
+		float diff = d - a;
+		if (a == 0 || std::abs(diff) > options.resetThreshold + a * options.resetSlope) a = d;
+		else a += options.alpha * diff;
+		age = 0;
+		d = (UINT16)std::lrint(a); // SSE2 と同じく偶数への丸め
+	}
+
+	void filterRows(UINT16 *depth, int rowBegin, int rowEnd) {
+		int i = rowBegin * width;
+		int end = rowEnd * width;
+		float *avg = &average[0];
+		uint8_t *ages = &holeAge[0];
+#ifdef DEPTH_TEMPORAL_SSE2
+		const __m128 alpha = _mm_set1_ps(options.alpha);
+		const __m128 threshold = _mm_set1_ps(options.resetThreshold);
+		const __m128 slope = _mm_set1_ps(options.resetSlope);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		const __m128 zero = _mm_setzero_ps();
+		const __m128i zeroi = _mm_setzero_si128();
+		const __m128i persistence = _mm_set1_epi32(options.holePersistence);
+		const __m128i one = _mm_set1_epi32(1);
+		const __m128i bias = _mm_set1_epi32(32768);
+		for (; i + 8 <= end; i += 8) {
+			__m128i d16 = _mm_loadu_si128((const __m128i *)(depth + i));
+			__m128i age16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(ages + i)), zeroi);
+			__m128i out[2], outAge[2];
+			for (int h = 0; h < 2; h++) { // 4画素ずつ2回
+				__m128i di = h ? _mm_unpackhi_epi16(d16, zeroi) : _mm_unpacklo_epi16(d16, zeroi);
+				__m128i age = h ? _mm_unpackhi_epi16(age16, zeroi) : _mm_unpacklo_epi16(age16, zeroi);
+				__m128 d = _mm_cvtepi32_ps(di);
+				__m128 a = _mm_loadu_ps(avg + i + h * 4);
+
+				__m128 hole = _mm_castsi128_ps(_mm_cmpeq_epi32(di, zeroi));
+				__m128 noAverage = _mm_cmpeq_ps(a, zero);
+				__m128 diff = _mm_sub_ps(d, a);
+				__m128 limit = _mm_add_ps(threshold, _mm_mul_ps(a, slope));
+				__m128 reset = _mm_or_ps(noAverage, _mm_cmpgt_ps(_mm_and_ps(diff, absMask), limit));
+				__m128 blended = _mm_add_ps(a, _mm_mul_ps(alpha, diff));
+				__m128 updated = _mm_or_ps(_mm_and_ps(reset, d), _mm_andnot_ps(reset, blended));
+
+				// 穴 : 平均があり、続いたフレーム数が holePersistence 未満なら平均を保つ
+				__m128 keep = _mm_andnot_ps(noAverage, _mm_castsi128_ps(_mm_cmpgt_epi32(persistence, age)));
+				__m128 holeAverage = _mm_and_ps(keep, a);
+				a = _mm_or_ps(_mm_and_ps(hole, holeAverage), _mm_andnot_ps(hole, updated));
+				_mm_storeu_ps(avg + i + h * 4, a);
+				__m128i ageInc = _mm_and_si128(_mm_castps_si128(_mm_and_ps(hole, keep)), _mm_add_epi32(age, one));
+				outAge[h] = ageInc; // 値があれば0、穴を埋めたら +1、埋めなければ0 (平均も0なので次も埋めない)
+				out[h] = _mm_sub_epi32(_mm_cvtps_epi32(a), bias); // 四捨五入して、符号付きで詰められるようにずらす
+			}
+			__m128i packed = _mm_xor_si128(_mm_packs_epi32(out[0], out[1]), _mm_set1_epi16((short)0x8000));
+			_mm_storeu_si128((__m128i *)(depth + i), packed);
+			__m128i packedAge = _mm_packus_epi16(_mm_packs_epi32(outAge[0], outAge[1]), zeroi);
+			_mm_storel_epi64((__m128i *)(ages + i), packedAge);
+		}
+#endif
+		for (; i < end; i++) filterPixel(depth[i], avg[i], ages[i]);
+	}
+
+public:
+	void initialize(int width, int height) {
+		this->width = width;
+		this->height = height;
+		average.assign((size_t)width * height, 0.0f);
+		holeAge.assign((size_t)width * height, 0);
+	}
+
+	bool isInitialized() const { return width > 0; }
+
+	void setOptions(const DepthTemporalOptions &options) {
+		this->options = options;
+		this->options.holePersistence = (std::min)((std::max)(options.holePersistence, 0), 255);
+	}
+	const DepthTemporalOptions &getOptions() const { return options; }
+
+	// 履歴を捨てる (シーンが切り替わったときなど)
+	void reset() {
+		std::fill(average.begin(), average.end(), 0.0f);
+		std::fill(holeAge.begin(), holeAge.end(), 0);
+	}
+
+	// depth (width x height) をフィルタした値で書き換える
+	void apply(UINT16 *depth) {
+		double start = (double)cv::getTickCount();
+		const int rowsPerStripe = 16;
+		cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &r) {
+			filterRows(depth, r.start, r.end);
+		}, (double)(height + rowsPerStripe - 1) / rowsPerStripe);
+		lastMs = ((double)cv::getTickCount() - start) / cv::getTickFrequency() * 1000.0;
+		totalMs += lastMs;
+		maxMs = (std::max)(maxMs, lastMs);
+		frameCount++;
+	}
+
+	// 1フレームあたりの処理時間 [ms]
+	unsigned long long frames() const { return frameCount; }
+	double lastFrameMs() const { return lastMs; }
+	double meanFrameMs() const { return frameCount ? totalMs / frameCount : 0; }
+	double maxFrameMs() const { return maxMs; }
+};
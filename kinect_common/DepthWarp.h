@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "ColorConvert.h"
+#include "KinectTypes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEPTH_WARP_SSE2
+#endif
+
+// Depth画像をRGB画像の座標系へ写す (前方ワープ) ときの設定
+struct DepthWarpOptions {
+	bool zTest = true;      // 同じ画素に複数のDepth画素が写るときは手前 (値の小さい方) を残す (false なら後から書いたもの)
+	int splat = 1;          // Depth1画素を出力の何画素四方に広げるか (0なら対応表の画素間隔から決める)
+	bool fillHoles = false; // 広げても残った小さな穴を両側の奥側の値で埋める
+	int maxHoleSize = 0;    // 埋める穴の最大の幅 [出力画素] (0なら広げる大きさの2倍)
+	int downscale = 1;      // 出力の縮小率 (1 : RGB画像と同じ解像度、2 : 縦横半分)
+};
+
+// 対応表の画素間隔から、穴が空かないように広げる大きさを求める [出力画素]
+// (画像中央の行で、隣り合う画素の距離がほぼ同じものの間隔の平均を切り上げる。Kinect v2 では全解像度で3、半分で2)
+// depthRect を指定すると、その窓の中央の行の窓の中だけを見る (窓の外の対応表は計算されていないことがある)
+inline int depthWarpFootprint(const UINT16 *depth, const ColorSpacePoint *colorSpace, int depthWidth, int depthHeight, int downscale,
+	const cv::Rect &depthRect = cv::Rect()) {
+	const cv::Rect dr = (depthRect.width > 0 && depthRect.height > 0) ? depthRect : cv::Rect(0, 0, depthWidth, depthHeight);
+	int row = dr.y + dr.height / 2;
+	double sum = 0;
+	int count = 0;
+	for (int i = row * depthWidth + dr.x; i + 1 < row * depthWidth + dr.x + dr.width; i++) {
+		if (depth[i] == 0 || depth[i + 1] == 0 || std::abs((int)depth[i] - (int)depth[i + 1]) > 30) continue;
+		float dx = std::fabs(colorSpace[i + 1].X - colorSpace[i].X);
+		if (!(dx < 64)) continue; // 無効な点 (-infinity)
+		sum += dx;
+		count++;
+	}
+	if (count == 0) return 1;
+	return (std::max)(1, (int)std::ceil(sum / count / (std::max)(downscale, 1) - 0.05));
+}
+
+// 横方向の穴埋め (行 rowBegin から rowEnd の手前まで)
+inline void fillDepthHolesRows(cv::Mat &img, int maxHole, int rowBegin, int rowEnd) {
+	int width = img.cols;
+	for (int j = rowBegin; j < rowEnd; j++) {
+		UINT16 *row = img.ptr<UINT16>(j);
+		int i = 0;
+		while (i < width && row[i] == 0) i++; // 左端の値の無い所は埋めない
+		while (i < width) {
+			while (i < width && row[i] != 0) i++;
+			int start = i; // 穴の先頭
+			while (i < width && row[i] == 0) i++;
+			if (i >= width) break; // 右端の値の無い所も埋めない
+			if (i - start <= maxHole) {
+				UINT16 v = (std::max)(row[start - 1], row[i]);
+				for (int k = start; k < i; k++) row[k] = v;
+			}
+		}
+	}
+}
+
+// 縦方向の穴埋め (列 colBegin から colEnd の手前まで、last は列ごとの作業領域)
+// 列ごとに最後に値があった行を覚えて行の順に走査し、穴の下端に来たときだけ上へ戻って埋める
+inline void fillDepthHolesCols(cv::Mat &img, int maxHole, int colBegin, int colEnd, int *last) {
+	for (int i = colBegin; i < colEnd; i++) last[i] = -1;
+	for (int j = 0; j < img.rows; j++) {
+		const UINT16 *row = img.ptr<UINT16>(j);
+		for (int i = colBegin; i < colEnd; i++) {
+			if (row[i] == 0) continue;
+			int gap = j - last[i] - 1;
+			if (gap > 0 && gap <= maxHole && last[i] >= 0) {
+				UINT16 v = (std::max)(img.ptr<UINT16>(last[i])[i], row[i]);
+				for (int k = last[i] + 1; k < j; k++) img.ptr<UINT16>(k)[i] = v;
+			}
+			last[i] = j;
+		}
+	}
+}
+
+// 0 の画素が maxHole 個以下続く所を、両側の値の大きい方 (奥側、前景に隠れていた背景) で埋める (横、縦の順)
+// 横は行の帯、縦は列の帯に分けて複数のスレッドで処理する (帯どうしは書き込む画素が重ならない)
+inline void fillDepthHoles(cv::Mat &img, int maxHole) {
+	const int rowsPerStripe = 32, colsPerStripe = 64;
+	cv::parallel_for_(cv::Range(0, (img.rows + rowsPerStripe - 1) / rowsPerStripe), [&](const cv::Range &r) {
+		fillDepthHolesRows(img, maxHole, r.start * rowsPerStripe, (std::min)(r.end * rowsPerStripe, img.rows));
+	});
+
+	static thread_local std::vector<int> lastRow;
+	lastRow.resize(img.cols);
+	int *last = &lastRow[0]; // 他のスレッドからは呼び出したスレッドの領域を使う
+	cv::parallel_for_(cv::Range(0, (img.cols + colsPerStripe - 1) / colsPerStripe), [&](const cv::Range &r) {
+		fillDepthHolesCols(img, maxHole, r.start * colsPerStripe, (std::min)(r.end * colsPerStripe, img.cols), last);
+	});
+}
+
+// Zバッファの値 v (0 は値無し) と新しい値 d (1以上) の手前の方 (分岐しないように 0 を 65536 として比べる)
+inline UINT16 nearer(UINT16 v, UINT16 d) {
+	return (UINT16)((std::min)((UINT16)(v - 1), (UINT16)(d - 1)) + 1);
+}
+
+// Depth画素を出力へ広げて書き込むときの定数 (warpDepthToColor() の中だけで使う)
+struct DepthSplat {
+	int footprint;
+	bool zTest;
+	float inv;     // 1 / 縮小率
+	float offsetX; // 縮小した画素の中心と広げる範囲の左上へのずれ (負の座標でも切り捨てで四捨五入できるように footprint だけ正の側にずらす)
+	float offsetY; // (出力がRGB画像の一部 (originX, originY から) なら、その分も引いておく)
+	float limitX;
+	float limitY;
+
+	DepthSplat(int footprint, bool zTest, int scale, int outWidth, int outHeight, int originX = 0, int originY = 0)
+		: footprint(footprint), zTest(zTest), inv(1.0f / scale),
+		offsetX(-(scale - 1) * 0.5f / scale - (footprint - 1) * 0.5f + 0.5f + footprint - (float)originX / scale),
+		offsetY(-(scale - 1) * 0.5f / scale - (footprint - 1) * 0.5f + 0.5f + footprint - (float)originY / scale),
+		limitX((float)(outWidth + footprint)), limitY((float)(outHeight + footprint)) {
+	}
+
+	// Depth画素 c から c1 の手前までを出力に書き込む
+	void splat(const UINT16 *depth, const ColorSpacePoint *colorSpace, int c, int c1, cv::Mat &out) const {
+		uchar *base = out.ptr<uchar>(0);
+		const size_t step = out.step;
+		const int outWidth = out.cols, outHeight = out.rows;
+		for (; c < c1; c++) {
+			UINT16 d = depth[c];
+			if (d == 0) continue;
+			// RGB座標系をベースにした、その点でDepthのどこを見るのかという座標を取得
+			float x = colorSpace[c].X * inv + offsetX;
+			float y = colorSpace[c].Y * inv + offsetY;
+			if (!(x >= 0 && x < limitX && y >= 0 && y < limitY)) continue; // 範囲外と無効な点 (-infinity)
+			int x0 = (int)x - footprint, y0 = (int)y - footprint; // 四捨五入
+			if (footprint == 1) { // 広げない場合 (範囲の判定だけで済む)
+				if (x0 >= outWidth || y0 >= outHeight || x0 < 0 || y0 < 0) continue;
+				UINT16 &v = ((UINT16 *)(base + y0 * step))[x0];
+				v = zTest ? nearer(v, d) : d;
+				continue;
+			}
+			int x1 = (std::min)(x0 + footprint, outWidth), y1 = (std::min)(y0 + footprint, outHeight);
+			x0 = (std::max)(x0, 0);
+			y0 = (std::max)(y0, 0);
+			for (int yy = y0; yy < y1; yy++) {
+				UINT16 *row = (UINT16 *)(base + yy * step);
+				for (int xx = x0; xx < x1; xx++) {
+					row[xx] = zTest ? nearer(row[xx], d) : d;
+				}
+			}
+		}
+	}
+
+	// Depth画素 c から c1 の手前までを splat() したときに書き込みうる出力の行を rowBegin, rowEnd に広げる
+	// (縦の座標だけを見るので、横が範囲外で書き込まない画素の分も含む)
+	void rowExtent(const UINT16 *depth, const ColorSpacePoint *colorSpace, int c, int c1, int outHeight, int &rowBegin, int &rowEnd) const {
+		float yMin = limitY, yMax = -1.0f;
+#ifdef DEPTH_WARP_SSE2
+		// 4画素ずつ (範囲外の画素は yMin, yMax を変えない値に置き換えて min / max を取る)
+		const __m128 scaleY = _mm_set1_ps(inv), offset = _mm_set1_ps(offsetY);
+		const __m128 zeroF = _mm_setzero_ps(), limit = _mm_set1_ps(limitY), none = _mm_set1_ps(-1.0f);
+		const __m128i zero = _mm_setzero_si128();
+		__m128 minV = limit, maxV = none;
+		for (; c + 4 <= c1; c += 4) {
+			__m128 p0 = _mm_loadu_ps(&colorSpace[c].X), p1 = _mm_loadu_ps(&colorSpace[c + 2].X);
+			__m128 y = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1)), scaleY), offset);
+			__m128i d = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(depth + c)), zero);
+			__m128 valid = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(d, zero)), _mm_and_ps(_mm_cmpge_ps(y, zeroF), _mm_cmplt_ps(y, limit)));
+			minV = _mm_min_ps(minV, _mm_or_ps(_mm_and_ps(valid, y), _mm_andnot_ps(valid, limit)));
+			maxV = _mm_max_ps(maxV, _mm_or_ps(_mm_and_ps(valid, y), _mm_andnot_ps(valid, none)));
+		}
+		float mins[4], maxs[4];
+		_mm_storeu_ps(mins, minV);
+		_mm_storeu_ps(maxs, maxV);
+		for (int k = 0; k < 4; k++) {
+			yMin = (std::min)(yMin, mins[k]);
+			yMax = (std::max)(yMax, maxs[k]);
+		}
+#endif
+		for (; c < c1; c++) {
+			float y = colorSpace[c].Y * inv + offsetY;
+			if (depth[c] == 0 || !(y >= 0 && y < limitY)) continue;
+			yMin = (std::min)(yMin, y);
+			yMax = (std::max)(yMax, y);
+		}
+		if (yMax < 0) return;
+		// splat() の y0 = (int)y - footprint から (int)y の手前まで
+		rowBegin = (std::min)(rowBegin, (std::max)((int)yMin - footprint, 0));
+		rowEnd = (std::max)(rowEnd, (std::min)((int)yMax, outHeight));
+	}
+};
+
+// Depth画像を対応表 (MapDepthFrameToColorSpace の結果) でRGB画像の座標系へ写す
+// out は (colorHeight / downscale) x (colorWidth / downscale) の CV_16UC1 (値の無い画素は0)
+// zTest では出力自体を Zバッファとして使うので、別の領域は使わない
+// Depthの行の帯ごとに cv::parallel_for_ で複数のスレッドに分ける (結果はスレッド数によらず同じ)
+// depthRect, colorRect を指定すると、depthRect の中のDepth画素だけを写し、out は colorRect の部分 (の縮小) だけになる
+inline void warpDepthToColor(const UINT16 *depth, const ColorSpacePoint *colorSpace, int depthWidth, int depthHeight,
+	int colorWidth, int colorHeight, const DepthWarpOptions &options, cv::Mat &out,
+	const cv::Rect &depthRect = cv::Rect(), const cv::Rect &colorRect = cv::Rect()) {
+	const cv::Rect dr = (depthRect.width > 0 && depthRect.height > 0) ? depthRect : cv::Rect(0, 0, depthWidth, depthHeight);
+	const cv::Rect cr = (colorRect.width > 0 && colorRect.height > 0) ? colorRect : cv::Rect(0, 0, colorWidth, colorHeight);
+	int scale = (std::max)(options.downscale, 1);
+	int outWidth = cr.width / scale, outHeight = cr.height / scale;
+	out.create(outHeight, outWidth, CV_16UC1);
+
+	int footprint = (options.splat > 0) ? options.splat : depthWarpFootprint(depth, colorSpace, depthWidth, depthHeight, scale, dr);
+	DepthSplat splat(footprint, options.zTest, scale, outWidth, outHeight, cr.x, cr.y);
+
+	// 全てのピクセルがうまるわけではないので事前に初期化しておく
+	cv::parallel_for_(cv::Range(0, outHeight), [&](const cv::Range &r) {
+		for (int y = r.start; y < r.end; y++) memset(out.ptr<UINT16>(y), 0, outWidth * sizeof(UINT16));
+	}, 8);
+
+	// Depthを行の帯に分け、偶数番目の帯を並列に書き込んでから奇数番目の帯を並列に書き込む
+	// 同時に書き込む帯どうしが出力の同じ画素に触れなければ排他は要らない。ふつうの対応表なら帯の高さ (32行) が
+	// 隣の帯と写る先が重なる幅 (RGBカメラとの視差) より十分大きいのでそうなるが、読み込んだパラメータや対応表が
+	// おかしいと重なりうるので、帯ごとに書き込む出力の行を対応表から求め、同じ組の帯で重なれば帯を1つずつ書き込む
+	// 書き込む順は帯の番号だけで決まるので、結果はスレッド数によらず同じ
+	const int rowsPerBand = 32;
+	const int bands = (dr.height + rowsPerBand - 1) / rowsPerBand;
+	const bool fullRows = dr.x == 0 && dr.width == depthWidth;
+
+	static thread_local std::vector<cv::Range> extents; // 帯ごとに書き込む出力の行 [start, end) (書き込まなければ空)
+	extents.assign(bands, cv::Range(outHeight, 0));
+	cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range &r) {
+		for (int band = r.start; band < r.end; band++) {
+			int rowBegin = dr.y + band * rowsPerBand;
+			int rowEnd = (std::min)(rowBegin + rowsPerBand, dr.y + dr.height);
+			cv::Range &e = extents[band];
+			if (fullRows) {
+				splat.rowExtent(depth, colorSpace, rowBegin * depthWidth, rowEnd * depthWidth, outHeight, e.start, e.end);
+				continue;
+			}
+			for (int j = rowBegin; j < rowEnd; j++) splat.rowExtent(depth, colorSpace, j * depthWidth + dr.x, j * depthWidth + dr.x + dr.width, outHeight, e.start, e.end);
+		}
+	});
+	bool disjoint = true;
+	for (int a = 0; a < bands && disjoint; a++) {
+		for (int b = a + 2; b < bands; b += 2) {
+			if (extents[a].start < extents[b].end && extents[b].start < extents[a].end) {
+				disjoint = false;
+				break;
+			}
+		}
+	}
+
+	for (int phase = 0; phase < 2; phase++) {
+		auto splatBands = [&](const cv::Range &r) {
+			for (int k = r.start; k < r.end; k++) {
+				int band = k * 2 + phase;
+				int rowBegin = dr.y + band * rowsPerBand;
+				int rowEnd = (std::min)(rowBegin + rowsPerBand, dr.y + dr.height);
+				if (fullRows) {
+					splat.splat(depth, colorSpace, rowBegin * depthWidth, rowEnd * depthWidth, out);
+					continue;
+				}
+				for (int j = rowBegin; j < rowEnd; j++) splat.splat(depth, colorSpace, j * depthWidth + dr.x, j * depthWidth + dr.x + dr.width, out);
+			}
+		};
+		cv::Range range(0, (bands + 1 - phase) / 2);
+		if (disjoint) cv::parallel_for_(range, splatBands);
+		else splatBands(range);
+	}
+
+	if (options.fillHoles) fillDepthHoles(out, (options.maxHoleSize > 0) ? options.maxHoleSize : footprint * 2);
+}
+
+// RGB画像 (CV_8UC4) を対応表でDepth画像の座標系へ写す (各Depth画素が対応するRGB画素を1つ読む)
+// out は depthHeight x depthWidth の CV_8UC4 (対応するRGB画素が無い画素は0)
+// 画素は BGRA の4バイトをまとめてコピーし、Depthの行の帯ごとに cv::parallel_for_ で複数のスレッドに分ける
+// depthRect を指定すると、その中のDepth画素だけを写し、out は depthRect の大きさになる
+// color は BGRA (CV_8UC4) か YUY2 (CV_8UC2)。YUY2 なら対応する画素だけをその場で BGRA に変換する (全体を変換しない)
+inline void warpColorToDepth(const cv::Mat &color, const ColorSpacePoint *colorSpace, int depthWidth, int depthHeight, cv::Mat &out, const cv::Rect &depthRect = cv::Rect()) {
+	CV_Assert(color.type() == CV_8UC4 || color.type() == CV_8UC2);
+	const bool yuy2 = color.type() == CV_8UC2;
+	const cv::Rect dr = (depthRect.width > 0 && depthRect.height > 0) ? depthRect : cv::Rect(0, 0, depthWidth, depthHeight);
+	out.create(dr.height, dr.width, CV_8UC4);
+	const int colorWidth = color.cols, colorHeight = color.rows;
+	const int rowsPerStripe = 16;
+	cv::parallel_for_(cv::Range(0, (dr.height + rowsPerStripe - 1) / rowsPerStripe), [&](const cv::Range &r) {
+		int rowEnd = (std::min)(r.end * rowsPerStripe, dr.height);
+		for (int j = r.start * rowsPerStripe; j < rowEnd; j++) {
+			uint32_t *dst = out.ptr<uint32_t>(j);
+			const ColorSpacePoint *points = colorSpace + (size_t)(j + dr.y) * depthWidth + dr.x;
+			for (int i = 0; i < dr.width; i++) {
+				// Depth座標系をベースにした、その点でRGBのどこを見るのかという座標を取得 (四捨五入、無効な点 (-infinity) は範囲外)
+				float x = points[i].X + 0.5f, y = points[i].Y + 0.5f;
+				if (!(x >= 0 && x < colorWidth && y >= 0 && y < colorHeight)) {
+					dst[i] = 0;
+					continue;
+				}
+				dst[i] = yuy2 ? yuy2PixelBGRA(color.ptr<BYTE>((int)y), (int)x) : color.ptr<uint32_t>((int)y)[(int)x];
+			}
+		}
+	});
+}
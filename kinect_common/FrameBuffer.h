@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// 参照カウント付きのフレームのプール
+// 同じ大きさのフレーム領域 (スロット) を最初に確保しておき、取得したフレームは空いているスロットに書き込む
+// view() はコピーせずに最新フレームのスロットを指す Mat (ハンドル) を返す。寿命と所有権は次のとおり
+//   - スロットの所有者は FrameBuffer だが、解放は Mat の参照カウントに任せる
+//     (利用者がハンドルを持っている間はデータは解放されず、FrameBuffer が先に破棄されても有効)
+//   - 利用者がハンドルを持っている間、そのスロットに次のフレームは書き込まれない
+//     (ハンドルは Mat::release() するか破棄すれば手放したことになる)
+//   - ハンドルは読み取り専用として扱う (書き込むと他の利用者にも見える)
+// 空いているスロットが無いときだけ maxSlots までスロットを追加するので、
+// 利用者がハンドルを持ち続ける数が一定なら、定常状態ではフレームごとの確保は起きない
+template<typename T>
+class FrameBuffer {
+private:
+	int rows = 0;
+	int cols = 0;
+	int type = 0;
+	size_t maxSlots = 0;
+	std::vector<cv::Mat> slots;
+	int current = 0;  // 最新フレームのスロット
+	int writing = -1; // beginWrite() で渡したスロット
+	unsigned long long allocCount = 0; // スロットを確保した回数
+
+	// プール以外から参照されていないスロットか
+	static bool isFree(const cv::Mat &m) {
+		return m.u == nullptr || m.u->refcount == 1;
+	}
+
+	void addSlot() {
+		slots.push_back(cv::Mat(rows, cols, type, cv::Scalar(0)));
+		allocCount++;
+	}
+
+public:
+	// rows x cols, type (CV_16UC1 など) のスロットを slots 個確保する (足りなければ maxSlots 個まで増やす)
+	void create(int rows, int cols, int type, size_t slots = 3, size_t maxSlots = 8) {
+		this->rows = rows;
+		this->cols = cols;
+		this->type = type;
+		this->maxSlots = (std::max)(slots, maxSlots);
+		this->slots.clear();
+		for (size_t n = 0; n < (std::max)(slots, (size_t)2); n++) addSlot();
+		current = 0;
+		writing = -1;
+	}
+
+	// 次のフレームを書き込む領域 (書き終わったら endWrite() を呼ぶ。呼ばなければ最新フレームは変わらない)
+	// 全てのスロットが使用中で増やせないときは nullptr
+	T *beginWrite() {
+		writing = -1;
+		for (size_t n = 0; n < slots.size(); n++) {
+			if ((int)n != current && isFree(slots[n])) {
+				writing = (int)n;
+				break;
+			}
+		}
+		if (writing < 0) {
+			if (slots.size() >= maxSlots) return nullptr;
+			addSlot();
+			writing = (int)slots.size() - 1;
+		}
+		return slots[writing].ptr<T>(0);
+	}
+
+	// beginWrite() の領域を指す Mat (endWrite() までの書き込みにだけ使う。全てのスロットが使用中なら空)
+	cv::Mat beginWriteMat() {
+		T *p = beginWrite();
+		if (p == nullptr) return cv::Mat();
+		return cv::Mat(rows, cols, type, p);
+	}
+
+	// beginWrite() のスロットを最新フレームにする
+	void endWrite() {
+		if (writing < 0) return;
+		current = writing;
+		writing = -1;
+	}
+
+	// 最新フレームのハンドル (コピーしない)
+	cv::Mat view() const { return slots[current]; }
+
+	// 最新フレームを dst にコピーする (dst は必要なら確保する)
+	void copyTo(cv::Mat &dst) const { slots[current].copyTo(dst); }
+
+	const T &operator[](size_t i) const { return slots[current].ptr<T>(0)[i]; }
+	const T *data() const { return slots[current].ptr<T>(0); }
+
+	// 1フレームの要素数 (T 単位)
+	size_t size() const { return (size_t)rows * cols * CV_ELEM_SIZE(type) / sizeof(T); }
+
+	// 空いているスロットの数
+	size_t freeSlots() const {
+		size_t n = 0;
+		for (size_t i = 0; i < slots.size(); i++) {
+			if ((int)i != current && isFree(slots[i])) n++;
+		}
+		return n;
+	}
+
+	size_t slotCount() const { return slots.size(); }
+	unsigned long long allocations() const { return allocCount; }
+};
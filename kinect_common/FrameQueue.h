@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// 満杯のときの扱い
+enum FrameQueuePolicy {
+	FrameQueueDropOldest = 0, // 一番古い要素を捨てて入れる (表示などで遅延を溜めたくない場合)
+	FrameQueueDropNewest = 1  // 入れようとした要素を捨てる
+};
+
+struct FrameQueueStats {
+	size_t capacity;
+	size_t depth;    // 今入っている数
+	size_t maxDepth; // これまでの最大
+	unsigned long long pushed;
+	unsigned long long popped;
+	unsigned long long dropped;
+};
+
+// パイプラインの段の間でフレームを受け渡す固定長のキュー
+// 要素の出し入れはロックを使わないリングバッファ (複数の生産者・消費者から使える) で行う
+// pop() で待つときだけ条件変数を使い、待っている消費者がいなければ push() はロックを取らない
+// 容量は2のべき乗に切り上げる
+template<typename T>
+class FrameQueue {
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	FrameQueuePolicy policy;
+	std::atomic<size_t> enqueuePos;
+	std::atomic<size_t> dequeuePos;
+	std::atomic<bool> closed;
+
+	// 統計
+	std::atomic<size_t> maxDepth;
+	std::atomic<unsigned long long> pushCount;
+	std::atomic<unsigned long long> popCount;
+	std::atomic<unsigned long long> dropCount;
+
+	// 待ち合わせ用
+	std::mutex waitMutex;
+	std::condition_variable waitCond;
+	std::atomic<int> waiters;
+
+	void wakeWaiters() {
+		std::atomic_thread_fence(std::memory_order_seq_cst); // 要素を書き込んでから waiters を読む
+		if (waiters.load() == 0) return;
+		{ std::lock_guard<std::mutex> lock(waitMutex); } // pop() が条件を確かめてから待つまでの間に通知しないように
+		waitCond.notify_all();
+	}
+
+public:
+	explicit FrameQueue(size_t capacity = 4, FrameQueuePolicy policy = FrameQueueDropOldest)
+		: policy(policy), enqueuePos(0), dequeuePos(0), closed(false),
+		maxDepth(0), pushCount(0), popCount(0), dropCount(0), waiters(0) {
+		size_t n = 2;
+		while (n < capacity) n <<= 1;
+		cells.reset(new Cell[n]);
+		mask = n - 1;
+		for (size_t i = 0; i < n; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	FrameQueue(const FrameQueue &) = delete;
+	FrameQueue &operator=(const FrameQueue &) = delete;
+
+	// 空きがあれば入れる (満杯なら false で、value はそのまま)
+	bool tryPush(T &value) {
+		Cell *cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+
+		pushCount++;
+		size_t d = depth();
+		size_t m = maxDepth.load(std::memory_order_relaxed);
+		while (d > m && !maxDepth.compare_exchange_weak(m, d, std::memory_order_relaxed)) {}
+		wakeWaiters();
+		return true;
+	}
+
+	// 要素があれば取り出す (空なら false)
+	bool tryPop(T &value) {
+		Cell *cell;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		value = std::move(cell->data);
+		cell->data = T(); // フレームのハンドルなどをキューに残さない
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		popCount++;
+		return true;
+	}
+
+	// 満杯なら policy に従って捨てる (value を入れたら true)
+	bool push(T value) {
+		if (closed.load()) return false;
+		while (!tryPush(value)) {
+			if (policy == FrameQueueDropNewest) {
+				dropCount++;
+				return false;
+			}
+			T oldest;
+			if (tryPop(oldest)) {
+				popCount--; // 捨てた分は取り出した数に数えない
+				dropCount++;
+			}
+		}
+		return true;
+	}
+
+	// 要素が来るまで最大 timeoutMs 待って取り出す (close() 後に空になったら false)
+	bool pop(T &value, int timeoutMs) {
+		if (tryPop(value)) return true;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		std::unique_lock<std::mutex> lock(waitMutex);
+		waiters++;
+		bool popped = false;
+		for (;;) {
+			if (tryPop(value)) { popped = true; break; }
+			if (closed.load()) break;
+			if (waitCond.wait_until(lock, deadline) == std::cv_status::timeout) {
+				popped = tryPop(value);
+				break;
+			}
+		}
+		waiters--;
+		return popped;
+	}
+
+	// これ以上入れない (待っている消費者を起こす)
+	void close() {
+		closed.store(true);
+		{ std::lock_guard<std::mutex> lock(waitMutex); }
+		waitCond.notify_all();
+	}
+
+	bool isClosed() const { return closed.load(); }
+
+	size_t capacity() const { return mask + 1; }
+
+	// 今入っている数 (他のスレッドが出し入れしている間は目安)
+	size_t depth() const {
+		size_t in = enqueuePos.load(std::memory_order_relaxed);
+		size_t out = dequeuePos.load(std::memory_order_relaxed);
+		return (in > out) ? in - out : 0;
+	}
+
+	FrameQueueStats stats() const {
+		FrameQueueStats s;
+		s.capacity = capacity();
+		s.depth = depth();
+		s.maxDepth = maxDepth.load();
+		s.pushed = pushCount.load();
+		s.popped = popCount.load();
+		s.dropped = dropCount.load();
+		return s;
+	}
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "KinectCalibration.h"
+#include "KinectTypes.h"
+
+// この PC の時計での現在時刻 [100ns] (単調増加)
+inline INT64 currentTimestamp() {
+	return std::chrono::duration_cast<std::chrono::duration<INT64, std::ratio<1, 10000000>>>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// RGB-Dフレームの取得元 (Kinect本体、記録データの再生など) の共通インタフェース
+// KinectApp の変換処理はこのインタフェースだけを使うので、センサが無い環境でも同じ処理を動かせる
+class FrameSource {
+public:
+	// 開くストリームの指定
+	enum Stream {
+		Color = 1,
+		Depth = 2,
+		ColorDepth = Color | Depth
+	};
+
+	// RGBフレームの画素の形式
+	enum ColorFormat {
+		ColorBGRA, // CV_8UC4
+		ColorYUY2  // CV_8UC2 (2画素で Y0 U Y1 V。Kinect v2 のRGBカメラの元の形式で、BGRA の半分の大きさ)
+	};
+
+	// open() 後に設定される画像サイズ (開いていないストリームは0)
+	int colorWidth = 0;
+	int colorHeight = 0;
+	unsigned int colorBytesPerPixel = 0;
+	ColorFormat colorFormat = ColorBGRA; // acquireColorFrame() で渡す形式
+
+	int depthWidth = 0;
+	int depthHeight = 0;
+	UINT16 minDepthReliableDistance = 0;
+	UINT16 maxDepthReliableDistance = 0;
+
+	// 最後に取得したフレームのタイムスタンプ [100ns] (Kinect の RelativeTime と同じ単位。RGBとDepthで同じ時計)
+	INT64 colorTimestamp = 0;
+	INT64 depthTimestamp = 0;
+	bool hostClock = false; // タイムスタンプが currentTimestamp() と同じ時計か (届いてから処理するまでの遅延を測れる)
+
+	virtual ~FrameSource() {}
+
+	// RGBを変換せずに YUY2 のまま受け取りたいときに open() の前に呼ぶ
+	// YUY2 で渡せない取得元 (記録データなど) は BGRA のままなので、open() 後の colorFormat で判断する
+	void preferColorFormat(ColorFormat format) { requestedColorFormat = format; }
+
+	// ストリームを開く (失敗したら std::runtime_error を投げる)
+	virtual void open(int streams) = 0;
+
+	// 新しいRGBフレームをバッファにコピーし、colorTimestamp を更新する (新しいフレームが無ければ false)
+	virtual bool acquireColorFrame(BYTE *buffer, size_t size) = 0;
+
+	// 新しいRGBフレームの rowBegin 行目から rowEnd 行目の手前までだけをバッファの同じ位置にコピーする (他の行は不定)
+	// ROI で使う行だけを変換・コピーするための口。行だけを取り出せない取得元の既定の実装では全体を取得する
+	virtual bool acquireColorFrameRows(BYTE *buffer, size_t size, int /*rowBegin*/, int /*rowEnd*/) {
+		return acquireColorFrame(buffer, size);
+	}
+
+	// 新しいDepthフレームをバッファにコピーし、depthTimestamp を更新する (新しいフレームが無ければ false)
+	virtual bool acquireDepthFrame(UINT16 *buffer, size_t size) = 0;
+
+	// streams のどれかに新しいフレームが届くまで最大 timeoutMs 待つ (届いたら true、時間切れなら false)
+	// true が返ったら acquireColorFrame() / acquireDepthFrame() で取得する
+	// 届いたことを知る仕組みが無い取得元の既定の実装では、少しだけ眠って true を返す (取得できたかは acquire で判断する)
+	virtual bool waitForFrame(int /*streams*/, int timeoutMs) {
+		std::this_thread::sleep_for(std::chrono::milliseconds((std::max)((std::min)(timeoutMs, 1), 0)));
+		return true;
+	}
+
+	// Depth座標系の各点に対応するRGB座標を取得 (座標変換が使えない取得元では false)
+	virtual bool mapDepthFrameToColorSpace(const UINT16 * /*depth*/, size_t /*depthSize*/, ColorSpacePoint * /*colorSpace*/, size_t /*colorSpaceSize*/) {
+		return false;
+	}
+
+	// RGB座標系の各点に対応するDepth座標を取得 (座標変換が使えない取得元では false)
+	virtual bool mapColorFrameToDepthSpace(const UINT16 * /*depth*/, size_t /*depthSize*/, DepthSpacePoint * /*depthSpace*/, size_t /*depthSpaceSize*/) {
+		return false;
+	}
+
+	// 位置合わせのパラメータを取得 (DepthRegistration で座標変換を自前で計算するときに使う。分からない取得元では false)
+	virtual bool getCalibration(KinectCalibration & /*calibration*/) {
+		return false;
+	}
+
+	size_t colorBufferSize() const { return (size_t)colorWidth * colorHeight * colorBytesPerPixel; }
+	size_t depthBufferSize() const { return (size_t)depthWidth * depthHeight; }
+
+protected:
+	ColorFormat requestedColorFormat = ColorBGRA;
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "KinectTypes.h"
+
+// Depth座標系 → RGB座標系の位置合わせに使うパラメータ
+//   depthRays        : Depth画素ごとの Z=1[m] でのカメラ座標 (X, Y) の並び (GetDepthFrameToCameraSpaceTable と同じ内容)
+//                      Depth値 d[mm] の画素のカメラ座標は (X * d / 1000, Y * d / 1000, d / 1000)
+//   colorProjection  : カメラ座標 [m] → RGB画素 (u, v) の 3x4 射影行列 (行優先)
+//                      (u, v) = (P[0..3]・(X,Y,Z,1), P[4..7]・(X,Y,Z,1)) / P[8..11]・(X,Y,Z,1)
+//   colorDistortion  : RGBカメラのレンズの歪み (OpenCV と同じ並びの k1, k2, p1, p2, k3。全て0なら歪み無し)
+//                      射影行列で求めた (u, v) を射影行列の焦点距離と画像中心 (colorCameraIntrinsics()) で正規化した (x, y) に加える
+//                      r2 = x*x + y*y,  x' = x (1 + k1 r2 + k2 r2^2 + k3 r2^3) + 2 p1 x y + p2 (r2 + 2 x*x),  y' = y (1 + ...) + p1 (r2 + 2 y*y) + 2 p2 x y
+// Kinect 本体からは KinectSensorSource::getCalibration() で取得できる (RGBカメラの射影と歪みは座標変換の結果から当てはめる)
+struct KinectCalibration {
+	int depthWidth = 0;
+	int depthHeight = 0;
+	CameraIntrinsics depthIntrinsics; // GetDepthCameraIntrinsics の値 (depthRays を作り直すときに使う)
+	std::vector<float> depthRays;     // depthWidth * depthHeight * 2
+	double colorProjection[12];
+	double colorDistortion[5];
+	double fitError = 0;              // 当てはめに使っていない点を変換したときの誤差の最大 [RGB画素] (0なら不明)
+
+	KinectCalibration() {
+		memset(&depthIntrinsics, 0, sizeof(depthIntrinsics));
+		memset(colorProjection, 0, sizeof(colorProjection));
+		memset(colorDistortion, 0, sizeof(colorDistortion));
+	}
+
+	bool hasColorDistortion() const {
+		for (int k = 0; k < 5; k++) if (colorDistortion[k] != 0) return true;
+		return false;
+	}
+
+	bool isValid() const {
+		return depthWidth > 0 && depthHeight > 0 && depthRays.size() == (size_t)depthWidth * depthHeight * 2 && colorProjection[10] != 0;
+	}
+
+	// 自前の位置合わせを取得元の座標変換の代わりに使える誤差の上限 [RGB画素] (対応表を四捨五入して使う処理では結果がほぼ変わらない)
+	static constexpr double registrationTolerance = 0.5;
+
+	// 当てはめの誤差が registrationTolerance 以下か (不明なら使えるものとする)
+	bool withinTolerance() const { return fitError <= registrationTolerance; }
+};
+
+// 射影行列の左の3x3 から RGBカメラの焦点距離と画像中心を求める (レンズの歪みを計算する正規化座標に使う)
+inline void colorCameraIntrinsics(const double P[12], double &fx, double &fy, double &cx, double &cy) {
+	double n = std::sqrt(P[8] * P[8] + P[9] * P[9] + P[10] * P[10]);
+	double r3[3] = { P[8] / n, P[9] / n, P[10] / n };
+	cx = (P[0] * r3[0] + P[1] * r3[1] + P[2] * r3[2]) / n;
+	cy = (P[4] * r3[0] + P[5] * r3[1] + P[6] * r3[2]) / n;
+	double r2[3], r1[3];
+	for (int k = 0; k < 3; k++) r2[k] = P[4 + k] / n - cy * r3[k];
+	fy = std::sqrt(r2[0] * r2[0] + r2[1] * r2[1] + r2[2] * r2[2]);
+	for (int k = 0; k < 3; k++) r2[k] /= fy;
+	for (int k = 0; k < 3; k++) r1[k] = P[k] / n - cx * r3[k];
+	double skew = r1[0] * r2[0] + r1[1] * r2[1] + r1[2] * r2[2];
+	for (int k = 0; k < 3; k++) r1[k] -= skew * r2[k];
+	fx = std::sqrt(r1[0] * r1[0] + r1[1] * r1[1] + r1[2] * r1[2]);
+}
+
+// 正規化座標 (x, y) にレンズの歪みを加える (d は k1, k2, p1, p2, k3)
+inline void distortNormalizedPoint(const double d[5], double &x, double &y) {
+	double r2 = x * x + y * y;
+	double radial = 1 + r2 * (d[0] + r2 * (d[1] + r2 * d[4]));
+	double xd = x * radial + 2 * d[2] * x * y + d[3] * (r2 + 2 * x * x);
+	double yd = y * radial + d[2] * (r2 + 2 * y * y) + 2 * d[3] * x * y;
+	x = xd;
+	y = yd;
+}
+
+// カメラ座標 [m] の点が写るRGB座標 (射影行列とレンズの歪み。カメラの後ろの点なら false)
+inline bool projectColorPoint(const double P[12], const double distortion[5], double X, double Y, double Z, double &u, double &v) {
+	double w = P[8] * X + P[9] * Y + P[10] * Z + P[11];
+	u = (P[0] * X + P[1] * Y + P[2] * Z + P[3]) / w;
+	v = (P[4] * X + P[5] * Y + P[6] * Z + P[7]) / w;
+	if (distortion != nullptr && (distortion[0] != 0 || distortion[1] != 0 || distortion[2] != 0 || distortion[3] != 0 || distortion[4] != 0)) {
+		double fx, fy, cx, cy;
+		colorCameraIntrinsics(P, fx, fy, cx, cy);
+		double x = (u - cx) / fx, y = (v - cy) / fy;
+		distortNormalizedPoint(distortion, x, y);
+		u = cx + fx * x;
+		v = cy + fy * y;
+	}
+	return w > 0;
+}
+
+inline bool projectColorPoint(const KinectCalibration &c, double X, double Y, double Z, double &u, double &v) {
+	return projectColorPoint(c.colorProjection, c.colorDistortion, X, Y, Z, u, v);
+}
+
+// Depthカメラの内部パラメータから depthRays を求める (放射方向の歪みは反復して取り除く)
+// Kinect のカメラ座標系に合わせて Y は上向き
+inline void computeDepthRays(const CameraIntrinsics &intrinsics, int width, int height, std::vector<float> &rays) {
+	rays.resize((size_t)width * height * 2);
+	for (int v = 0; v < height; v++) {
+		for (int u = 0; u < width; u++) {
+			double xd = (u - intrinsics.PrincipalPointX) / intrinsics.FocalLengthX;
+			double yd = (v - intrinsics.PrincipalPointY) / intrinsics.FocalLengthY;
+			double x = xd, y = yd;
+			for (int n = 0; n < 8; n++) {
+				double r2 = x * x + y * y;
+				double k = 1 + r2 * (intrinsics.RadialDistortionSecondOrder + r2 * (intrinsics.RadialDistortionFourthOrder + r2 * intrinsics.RadialDistortionSixthOrder));
+				x = xd / k;
+				y = yd / k;
+			}
+			size_t i = ((size_t)v * width + u) * 2;
+			rays[i] = (float)x;
+			rays[i + 1] = (float)-y;
+		}
+	}
+}
+
+// Kinect v2 の代表的なパラメータ (記録データや合成フレームのように本体の値が無い場合に使う。個体差があるので目安)
+inline KinectCalibration defaultKinectCalibration() {
+	KinectCalibration c;
+	c.depthWidth = kinectDepthWidth;
+	c.depthHeight = kinectDepthHeight;
+	c.depthIntrinsics.FocalLengthX = 365.5f;
+	c.depthIntrinsics.FocalLengthY = 365.5f;
+	c.depthIntrinsics.PrincipalPointX = 255.5f;
+	c.depthIntrinsics.PrincipalPointY = 211.5f;
+	c.depthIntrinsics.RadialDistortionSecondOrder = 0.09f;
+	c.depthIntrinsics.RadialDistortionFourthOrder = -0.27f;
+	c.depthIntrinsics.RadialDistortionSixthOrder = 0.09f;
+	computeDepthRays(c.depthIntrinsics, c.depthWidth, c.depthHeight, c.depthRays);
+
+	// RGBカメラ : 焦点距離 1081.37 画素、中心は画像の中央、Depthカメラから横に 52mm
+	const double f = 1081.37, cx = 959.5, cy = 539.5, baseline = 0.052;
+	double P[12] = {
+		f, 0, cx, f * baseline,
+		0, -f, cy, 0,
+		0, 0, 1, 0
+	};
+	memcpy(c.colorProjection, P, sizeof(P));
+	return c;
+}
+
+// 位置合わせパラメータのファイル (.kcalib)
+//   "KCALIB02", depthWidth, depthHeight (int32), depthIntrinsics (float x 7), colorProjection (double x 12), fitError (double),
+//   colorDistortion (double x 5), depthRays (float x 2 x 画素数)
+// 歪みの無い "KCALIB01" (colorDistortion が無い) も読み込める
+static const char kinectCalibrationMagic[8] = { 'K', 'C', 'A', 'L', 'I', 'B', '0', '2' };
+static const char kinectCalibrationMagicV1[8] = { 'K', 'C', 'A', 'L', 'I', 'B', '0', '1' };
+
+inline FILE *openCalibrationFile(const std::string &path, const char *mode) {
+#ifdef _WIN32
+	FILE *fp = nullptr;
+	if (fopen_s(&fp, path.c_str(), mode) != 0) return nullptr;
+	return fp;
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+// .kcalib と同じ並びのバイト列にする (ネットワークで送る場合など)
+inline bool serializeKinectCalibration(const KinectCalibration &c, std::vector<BYTE> &data) {
+	if (!c.isValid()) return false;
+	int32_t size[2] = { c.depthWidth, c.depthHeight };
+	data.clear();
+	auto append = [&](const void *p, size_t n) { data.insert(data.end(), (const BYTE *)p, (const BYTE *)p + n); };
+	append(kinectCalibrationMagic, sizeof(kinectCalibrationMagic));
+	append(size, sizeof(size));
+	append(&c.depthIntrinsics, sizeof(c.depthIntrinsics));
+	append(c.colorProjection, sizeof(c.colorProjection));
+	append(&c.fitError, sizeof(c.fitError));
+	append(c.colorDistortion, sizeof(c.colorDistortion));
+	append(&c.depthRays[0], sizeof(float) * c.depthRays.size());
+	return true;
+}
+
+// serializeKinectCalibration() のバイト列から読み込む (読み込めなければ false、c は変更しない)
+inline bool deserializeKinectCalibration(const BYTE *data, size_t length, KinectCalibration &c) {
+	KinectCalibration loaded;
+	size_t offset = 0;
+	auto read = [&](void *p, size_t n) {
+		if (offset + n > length) return false;
+		memcpy(p, data + offset, n);
+		offset += n;
+		return true;
+	};
+	char magic[8];
+	int32_t size[2];
+	bool ok = read(magic, sizeof(magic));
+	bool v1 = ok && memcmp(magic, kinectCalibrationMagicV1, sizeof(magic)) == 0;
+	ok = ok && (v1 || memcmp(magic, kinectCalibrationMagic, sizeof(magic)) == 0)
+		&& read(size, sizeof(size)) && size[0] > 0 && size[1] > 0 && size[0] <= 4096 && size[1] <= 4096
+		&& read(&loaded.depthIntrinsics, sizeof(loaded.depthIntrinsics))
+		&& read(loaded.colorProjection, sizeof(loaded.colorProjection))
+		&& read(&loaded.fitError, sizeof(loaded.fitError))
+		&& (v1 || read(loaded.colorDistortion, sizeof(loaded.colorDistortion)));
+	if (ok) {
+		loaded.depthWidth = size[0];
+		loaded.depthHeight = size[1];
+		loaded.depthRays.resize((size_t)size[0] * size[1] * 2);
+		ok = read(&loaded.depthRays[0], sizeof(float) * loaded.depthRays.size());
+	}
+	if (!ok || !loaded.isValid()) return false;
+	c = loaded;
+	return true;
+}
+
+inline bool saveKinectCalibration(const std::string &path, const KinectCalibration &c) {
+	std::vector<BYTE> data;
+	if (!serializeKinectCalibration(c, data)) return false;
+	FILE *fp = openCalibrationFile(path, "wb");
+	if (fp == nullptr) return false;
+	bool ok = fwrite(&data[0], 1, data.size(), fp) == data.size();
+	fclose(fp);
+	return ok;
+}
+
+// 読み込めなければ false (c は変更しない)
+inline bool loadKinectCalibration(const std::string &path, KinectCalibration &c) {
+	FILE *fp = openCalibrationFile(path, "rb");
+	if (fp == nullptr) return false;
+	std::vector<BYTE> data;
+	BYTE buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) data.insert(data.end(), buffer, buffer + n);
+	fclose(fp);
+	return !data.empty() && deserializeKinectCalibration(&data[0], data.size(), c);
+}
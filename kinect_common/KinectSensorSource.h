@@ -0,0 +1,272 @@
+#pragma once
+
+// Kinect v2 本体からフレームを取得する FrameSource (Windows + Kinect SDK のみ)
+#ifdef _WIN32
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <winsock2.h>
+#include <Kinect.h>
+
+#include <atlbase.h>
+
+#include "ColorConvert.h"
+#include "DepthRegistration.h"
+#include "FrameSource.h"
+#include "StageProfiler.h"
+
+#ifndef ERROR_CHECK
+#define ERROR_CHECK( ret )  \
+    if ( (ret) != S_OK ) {    \
+        std::stringstream ss;	\
+        ss << "failed " #ret " " << std::hex << ret << std::endl;			\
+        throw std::runtime_error( ss.str().c_str() );			\
+    }
+#endif
+
+class KinectSensorSource : public FrameSource {
+private:
+	// Kinect SDK
+	CComPtr<IKinectSensor> kinect = nullptr;
+	CComPtr<ICoordinateMapper> coordinateMapper = nullptr;
+	KinectCalibration calibrationCache; // 一度当てはめた位置合わせパラメータ (当てはめに時間がかかるので使い回す)
+
+	// RGB用の変数
+	CComPtr<IColorFrameReader> colorFrameReader = nullptr;
+	ColorImageFormat sdkColorFormat = ColorImageFormat::ColorImageFormat_Bgra; // colorFormat に対応する SDK の形式
+
+	// D用の変数
+	CComPtr<IDepthFrameReader> depthFrameReader = nullptr;
+
+	// フレーム到着のイベント (waitForFrame で待つ)
+	WAITABLE_HANDLE colorFrameEvent = 0;
+	WAITABLE_HANDLE depthFrameEvent = 0;
+public:
+	~KinectSensorSource() {
+		if (colorFrameEvent != 0) colorFrameReader->UnsubscribeFrameArrived(colorFrameEvent);
+		if (depthFrameEvent != 0) depthFrameReader->UnsubscribeFrameArrived(depthFrameEvent);
+
+		// Kinectの動作を終了する
+		if (kinect != nullptr) {
+			kinect->Close();
+		}
+	}
+
+	void open(int streams) {
+		// デフォルトのKinectを取得する
+		ERROR_CHECK(::GetDefaultKinectSensor(&kinect));
+		ERROR_CHECK(kinect->Open());
+
+		// 座標変換インタフェースを取得
+		kinect->get_CoordinateMapper(&coordinateMapper);
+
+		if (streams & Color) {
+			// カラーリーダーを取得する
+			CComPtr<IColorFrameSource> colorFrameSource;
+			ERROR_CHECK(kinect->get_ColorFrameSource(&colorFrameSource));
+			ERROR_CHECK(colorFrameSource->OpenReader(&colorFrameReader));
+			ERROR_CHECK(colorFrameReader->SubscribeFrameArrived(&colorFrameEvent));
+
+			// RGB画像のサイズを取得する
+			CComPtr<IFrameDescription> colorFrameDescription;
+			colorFormat = requestedColorFormat;
+			sdkColorFormat = (colorFormat == ColorYUY2) ? ColorImageFormat::ColorImageFormat_Yuy2 : ColorImageFormat::ColorImageFormat_Bgra;
+			ERROR_CHECK(colorFrameSource->CreateFrameDescription(sdkColorFormat, &colorFrameDescription));
+			ERROR_CHECK(colorFrameDescription->get_Width(&colorWidth));
+			ERROR_CHECK(colorFrameDescription->get_Height(&colorHeight));
+			ERROR_CHECK(colorFrameDescription->get_BytesPerPixel(&colorBytesPerPixel));
+			std::cout << "create  : " << colorWidth << ", " << colorHeight << ", " << colorBytesPerPixel << std::endl;
+		}
+
+		if (streams & Depth) {
+			// Depthリーダーを取得する
+			CComPtr<IDepthFrameSource> depthFrameSource;
+			ERROR_CHECK(kinect->get_DepthFrameSource(&depthFrameSource));
+			ERROR_CHECK(depthFrameSource->OpenReader(&depthFrameReader));
+			ERROR_CHECK(depthFrameReader->SubscribeFrameArrived(&depthFrameEvent));
+
+			// Depth画像のサイズを取得する
+			CComPtr<IFrameDescription> depthFrameDescription;
+			ERROR_CHECK(depthFrameSource->get_FrameDescription(&depthFrameDescription));
+			ERROR_CHECK(depthFrameDescription->get_Width(&depthWidth));
+			ERROR_CHECK(depthFrameDescription->get_Height(&depthHeight));
+			std::cout << "Depth横幅       : " << depthWidth << std::endl;
+			std::cout << "Depth立幅       : " << depthHeight << std::endl;
+
+			// Depthの最大値、最小値を取得する
+			ERROR_CHECK(depthFrameSource->get_DepthMinReliableDistance(&minDepthReliableDistance));
+			ERROR_CHECK(depthFrameSource->get_DepthMaxReliableDistance(&maxDepthReliableDistance));
+			std::cout << "Depth最小値       : " << minDepthReliableDistance << std::endl;
+			std::cout << "Depth最大値       : " << maxDepthReliableDistance << std::endl;
+		}
+	}
+
+	bool acquireColorFrame(BYTE *buffer, size_t size) {
+		// RGBフレームを取得する
+		CComPtr<IColorFrame> colorFrame;
+		HRESULT ret;
+		{
+			KINECT_PROFILE_SCOPE("color AcquireLatestFrame");
+			ret = colorFrameReader->AcquireLatestFrame(&colorFrame);
+		}
+		if (FAILED(ret)) return false;
+
+		// 指定の形式でデータを取得する (元の形式と同じならそのままコピーする)
+		ColorImageFormat rawFormat;
+		ERROR_CHECK(colorFrame->get_RawColorImageFormat(&rawFormat));
+		if (rawFormat == sdkColorFormat) {
+			KINECT_PROFILE_SCOPE("color CopyRawFrameDataToArray");
+			ERROR_CHECK(colorFrame->CopyRawFrameDataToArray((UINT)size, buffer));
+		} else {
+			KINECT_PROFILE_SCOPE("color CopyConvertedFrameDataToArray");
+			ERROR_CHECK(colorFrame->CopyConvertedFrameDataToArray((UINT)size, buffer, sdkColorFormat));
+		}
+		ERROR_CHECK(colorFrame->get_RelativeTime(&colorTimestamp));
+		return true;
+	}
+
+	// 元の YUY2 のバッファから必要な行だけをコピー (BGRA なら変換) する
+	// 元の形式が YUY2 でなければ全体を変換する
+	bool acquireColorFrameRows(BYTE *buffer, size_t size, int rowBegin, int rowEnd) {
+		CComPtr<IColorFrame> colorFrame;
+		HRESULT ret;
+		{
+			KINECT_PROFILE_SCOPE("color AcquireLatestFrame");
+			ret = colorFrameReader->AcquireLatestFrame(&colorFrame);
+		}
+		if (FAILED(ret)) return false;
+
+		ColorImageFormat rawFormat;
+		ERROR_CHECK(colorFrame->get_RawColorImageFormat(&rawFormat));
+		if (rawFormat != ColorImageFormat::ColorImageFormat_Yuy2) {
+			KINECT_PROFILE_SCOPE("color CopyConvertedFrameDataToArray");
+			ERROR_CHECK(colorFrame->CopyConvertedFrameDataToArray((UINT)size, buffer, sdkColorFormat));
+		} else {
+			KINECT_PROFILE_SCOPE("color copy rows");
+			UINT capacity = 0;
+			BYTE *raw = nullptr;
+			ERROR_CHECK(colorFrame->AccessRawUnderlyingBuffer(&capacity, &raw));
+			rowBegin = (std::max)(rowBegin, 0);
+			rowEnd = (std::min)(rowEnd, colorHeight);
+			size_t rawStride = (size_t)colorWidth * 2;
+			if (capacity < rawStride * colorHeight || size < colorBufferSize()) return false;
+			if (colorFormat == ColorYUY2) {
+				if (rowEnd > rowBegin) memcpy(buffer + rowBegin * rawStride, raw + rowBegin * rawStride, (rowEnd - rowBegin) * rawStride);
+			} else {
+				cv::Mat src(colorHeight, colorWidth, CV_8UC2, raw), dst(colorHeight, colorWidth, CV_8UC4, buffer);
+				yuy2ToBGRA(src, dst, rowBegin, rowEnd);
+			}
+		}
+		ERROR_CHECK(colorFrame->get_RelativeTime(&colorTimestamp));
+		return true;
+	}
+
+	bool acquireDepthFrame(UINT16 *buffer, size_t size) {
+		// Depthフレームを取得する
+		CComPtr<IDepthFrame> depthFrame;
+		HRESULT ret;
+		{
+			KINECT_PROFILE_SCOPE("depth AcquireLatestFrame");
+			ret = depthFrameReader->AcquireLatestFrame(&depthFrame);
+		}
+		if (ret != S_OK) return false;
+
+		// データを取得する
+		KINECT_PROFILE_SCOPE("depth CopyFrameDataToArray");
+		ERROR_CHECK(depthFrame->CopyFrameDataToArray((UINT)size, buffer));
+		ERROR_CHECK(depthFrame->get_RelativeTime(&depthTimestamp));
+		return true;
+	}
+
+	// フレーム到着のイベントを待つ
+	bool waitForFrame(int streams, int timeoutMs) {
+		HANDLE events[2];
+		DWORD count = 0;
+		if ((streams & Color) && colorFrameEvent != 0) events[count++] = reinterpret_cast<HANDLE>(colorFrameEvent);
+		if ((streams & Depth) && depthFrameEvent != 0) events[count++] = reinterpret_cast<HANDLE>(depthFrameEvent);
+		if (count == 0) return false;
+
+		DWORD ret = WaitForMultipleObjects(count, events, FALSE, (DWORD)(std::max)(timeoutMs, 0));
+		if (ret < WAIT_OBJECT_0 || ret >= WAIT_OBJECT_0 + count) return false;
+
+		// イベントデータを受け取ってイベントを戻す
+		HANDLE signaled = events[ret - WAIT_OBJECT_0];
+		if (signaled == reinterpret_cast<HANDLE>(colorFrameEvent)) {
+			CComPtr<IColorFrameArrivedEventArgs> args;
+			colorFrameReader->GetFrameArrivedEventData(colorFrameEvent, &args);
+		} else {
+			CComPtr<IDepthFrameArrivedEventArgs> args;
+			depthFrameReader->GetFrameArrivedEventData(depthFrameEvent, &args);
+		}
+		return true;
+	}
+
+	bool mapDepthFrameToColorSpace(const UINT16 *depth, size_t depthSize, ColorSpacePoint *colorSpace, size_t colorSpaceSize) {
+		KINECT_PROFILE_SCOPE("MapDepthFrameToColorSpace");
+		return coordinateMapper->MapDepthFrameToColorSpace((UINT)depthSize, depth, (UINT)colorSpaceSize, colorSpace) == S_OK;
+	}
+
+	bool mapColorFrameToDepthSpace(const UINT16 *depth, size_t depthSize, DepthSpacePoint *depthSpace, size_t depthSpaceSize) {
+		KINECT_PROFILE_SCOPE("MapColorFrameToDepthSpace");
+		return coordinateMapper->MapColorFrameToDepthSpace((UINT)depthSize, depth, (UINT)depthSpaceSize, depthSpace) == S_OK;
+	}
+
+	// 位置合わせパラメータを取得する
+	// Depthの光線は GetDepthFrameToCameraSpaceTable から取り、RGBカメラの射影行列とレンズの歪みは
+	// Depth画素の光線上に並べた点を MapCameraPointsToColorSpace で変換した結果から当てはめる
+	// fitError は当てはめに使った点の間 (4画素ずらした光線の途中の距離) の点を変換して測る
+	// (起動直後は座標変換の値が入っていないので、最初のDepthフレームが届くまでは false)
+	bool getCalibration(KinectCalibration &calibration) {
+		if (coordinateMapper == nullptr || depthWidth == 0) return false;
+		if (calibrationCache.isValid()) {
+			calibration = calibrationCache;
+			return true;
+		}
+		KinectCalibration c;
+		c.depthWidth = depthWidth;
+		c.depthHeight = depthHeight;
+		if (coordinateMapper->GetDepthCameraIntrinsics(&c.depthIntrinsics) != S_OK || c.depthIntrinsics.FocalLengthX == 0) return false;
+
+		UINT32 count = 0;
+		PointF *table = nullptr;
+		if (coordinateMapper->GetDepthFrameToCameraSpaceTable(&count, &table) != S_OK || table == nullptr) return false;
+		if (count != (UINT32)(depthWidth * depthHeight)) {
+			CoTaskMemFree(table);
+			return false;
+		}
+		c.depthRays.resize(count * 2);
+		for (UINT32 i = 0; i < count; i++) {
+			c.depthRays[i * 2] = table[i].X;
+			c.depthRays[i * 2 + 1] = table[i].Y;
+		}
+		CoTaskMemFree(table);
+
+		// 当てはめる点は 8画素おきの光線上で 0.5m～4.5m、測る点はその間の光線上で 1m～4m
+		std::vector<CameraSpacePoint> cameraPoints, checkPoints;
+		for (int set = 0; set < 2; set++) {
+			std::vector<CameraSpacePoint> &points = (set == 0) ? cameraPoints : checkPoints;
+			for (int v = set * 4; v < depthHeight; v += 8) {
+				for (int u = set * 4; u < depthWidth; u += 8) {
+					size_t i = (size_t)v * depthWidth + u;
+					for (float z = 0.5f + set * 0.5f; z <= 4.5f; z += 1.0f) {
+						CameraSpacePoint p = { c.depthRays[i * 2] * z, c.depthRays[i * 2 + 1] * z, z };
+						points.push_back(p);
+					}
+				}
+			}
+		}
+		std::vector<ColorSpacePoint> colorPoints(cameraPoints.size()), checkColorPoints(checkPoints.size());
+		if (coordinateMapper->MapCameraPointsToColorSpace((UINT)cameraPoints.size(), &cameraPoints[0], (UINT)colorPoints.size(), &colorPoints[0]) != S_OK) return false;
+		if (coordinateMapper->MapCameraPointsToColorSpace((UINT)checkPoints.size(), &checkPoints[0], (UINT)checkColorPoints.size(), &checkColorPoints[0]) != S_OK) return false;
+		if (fitColorProjection(cameraPoints, colorPoints, c.colorProjection, c.colorDistortion) < 0) return false;
+		c.fitError = colorProjectionError(checkPoints, checkColorPoints, c.colorProjection, c.colorDistortion);
+
+		calibrationCache = c;
+		calibration = c;
+		return true;
+	}
+};
+#endif
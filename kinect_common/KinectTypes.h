@@ -0,0 +1,49 @@
+#pragma once
+
+// Kinect SDK の型定義
+// Windows 以外 (Kinect SDK が無い環境) では SDK と同じメモリ配置の型を自前で定義する
+#ifdef _WIN32
+#include <winsock2.h> // Kinect.h が読む windows.h より先に読む (後から読むと winsock.h と衝突する。RGBDStream.h で使う)
+#include <Kinect.h>
+#else
+#include <cstdint>
+
+typedef uint16_t UINT16;
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef int64_t INT64;
+typedef int64_t TIMESPAN; // 100ns 単位
+
+typedef struct _ColorSpacePoint {
+	float X;
+	float Y;
+} ColorSpacePoint;
+
+typedef struct _DepthSpacePoint {
+	float X;
+	float Y;
+} DepthSpacePoint;
+
+typedef struct _CameraSpacePoint {
+	float X;
+	float Y;
+	float Z;
+} CameraSpacePoint;
+
+typedef struct _CameraIntrinsics {
+	float FocalLengthX;
+	float FocalLengthY;
+	float PrincipalPointX;
+	float PrincipalPointY;
+	float RadialDistortionSecondOrder;
+	float RadialDistortionFourthOrder;
+	float RadialDistortionSixthOrder;
+} CameraIntrinsics;
+#endif
+
+// Kinect v2 の既定の解像度
+const int kinectColorWidth = 1920;
+const int kinectColorHeight = 1080;
+const int kinectColorBytesPerPixel = 4; // BGRA
+const int kinectDepthWidth = 512;
+const int kinectDepthHeight = 424;
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "ColorConvert.h"
+#include "DepthRegistration.h"
+#include "FrameBuffer.h"
+#include "FrameSource.h"
+#include "KinectCalibration.h"
+#include "RGBDFrame.h"
+#include "RGBDSynchronizer.h"
+#include "WorkStealingPool.h"
+
+// 複数の取得元をまとめて動かすときの設定
+struct MultiSourceOptions {
+	int workers = 0;           // 変換スレッドの数 (0 なら CPU の数。全ての取得元で共有する)
+	int maxInFlight = 2;       // 取得元ごとに変換待ち・変換中にしておけるフレームの数 (超えたら取得したフレームを変換せずに捨てる)
+	double frameBudgetMs = 50; // 組にしてからこの時間内に変換を始められなかったフレームは捨てる (全ての取得元で共通)
+};
+
+// 取得元ごとの統計
+struct MultiSourceStats {
+	unsigned long long captured = 0;  // 組にしたフレーム
+	unsigned long long processed = 0; // 変換して渡したフレーム
+	unsigned long long throttled = 0; // 変換待ちが maxInFlight 個あって捨てたフレーム
+	unsigned long long late = 0;      // frameBudgetMs を過ぎて捨てたフレーム
+	unsigned long long noSlot = 0;    // 出力のスロットが空かずに捨てたフレーム
+	double meanProcessMs = 0;         // 1フレームの変換時間
+	double maxProcessMs = 0;
+	double meanLatencyMs = 0;         // 組にしてから変換し終わるまで (変換待ちを含む)
+	double maxLatencyMs = 0;
+};
+
+// 複数の RGB-D の取得元 (Kinect、記録データの再生、合成フレーム、TCP の受信) を同時に動かす
+// 取得元ごとに取得のスレッドがあり、RGBとDepthを組にして変換処理を WorkStealingPool に渡す
+// 変換 (YUY2 → BGRA と、Depth座標系 → RGB座標系の対応表) は全ての取得元で1つのプールを共有する
+//   - 取得元ごとに変換待ちのフレームを maxInFlight 個までに抑え (それ以上は取得のスレッドで捨てる)、
+//     1つの取得元が重くてもプールのキューを埋めて他の取得元を待たせない
+//   - 組にしてから frameBudgetMs 以内に変換を始められなかったフレームは変換せずに捨てるので、
+//     取得元を増やしてプールが足りなくなっても、遅延は増えずに各取得元の fps が下がるだけになる
+// 変換したフレームは setFrameHandler() の関数にプールのスレッドから渡す (複数のスレッドから同時に呼ばれる。
+// 同じ取得元のフレームが番号の順に届くとは限らない)。latestFrame() で取得元ごとの最新フレームも取得できる
+// Kinect v2 は1台の PC に1台しかつなげないので、KinectSensorSource は1つだけにする
+class MultiSourceCapture {
+public:
+	typedef std::function<void(int source, const RGBDFrame &frame)> FrameHandler;
+
+private:
+	// 取得元ごとの状態
+	struct Source {
+		std::string name;
+		std::unique_ptr<FrameSource> source;
+		std::thread thread;
+		bool opened = false; // 取得元を開いたか (開くのは最初の start() だけ。stop() しても閉じない)
+
+		// 取得 (取得のスレッドだけが使う)
+		FrameBuffer<BYTE> colorBuffer;
+		FrameBuffer<UINT16> depthBuffer;
+		RGBDSynchronizer sync;
+		long long frameNumber = 0;
+		int calibrationTries = 0;
+
+		// 変換 (registration と sourceMapping は registrationReady になってからは書き換えない)
+		DepthRegistration registration;
+		bool sourceMapping = false; // パラメータの誤差が大きいので取得元の座標変換を使う (使えなければ registration)
+		std::mutex mapperMutex;     // 取得元の座標変換を複数の変換スレッドから同時に呼ばないように
+		std::atomic<bool> registrationReady;
+		std::atomic<int> inFlight;
+		std::mutex outputMutex; // 出力のプールのスロットを取るときだけ
+		FrameBuffer<BYTE> colorOut;
+		FrameBuffer<ColorSpacePoint> mapOut;
+
+		// 結果 (mutex で保護)
+		std::mutex mutex;
+		RGBDFrame latest;
+		MultiSourceStats stats;
+		double processSum = 0;
+		double latencySum = 0;
+
+		Source() : registrationReady(false), inFlight(0) {}
+	};
+
+	std::vector<std::unique_ptr<Source>> sources;
+	MultiSourceOptions options;
+	FrameHandler handler;
+	std::unique_ptr<WorkStealingPool> pool;
+	std::atomic<bool> running;
+
+	static const int calibrationAttempts = 30; // 位置合わせパラメータを取得し直す回数 (Kinect は最初のフレームが届くまで取得できない)
+
+	// 出力のプールから書き込み先のスロットを取る (取ったスロットは返したハンドルを手放すまで他のフレームに使われない)
+	template<typename T>
+	static cv::Mat takeSlot(FrameBuffer<T> &buffer) {
+		if (buffer.beginWrite() == nullptr) return cv::Mat();
+		buffer.endWrite();
+		return buffer.view();
+	}
+
+	// 位置合わせのパラメータを用意する (取得元から取れなければ Kinect v2 の代表値)
+	// CoordinateMapCache と同じく、誤差が registrationTolerance を超えるパラメータは取得元の座標変換が使えないときだけ使う
+	void prepareRegistration(Source &s) {
+		if (s.registrationReady || s.calibrationTries >= calibrationAttempts) return;
+		KinectCalibration calibration;
+		bool found = s.source->getCalibration(calibration) && calibration.isValid();
+		if (!found && ++s.calibrationTries < calibrationAttempts) return;
+		if (!found) calibration = defaultKinectCalibration();
+		s.calibrationTries = calibrationAttempts;
+		if (calibration.depthWidth != s.source->depthWidth || calibration.depthHeight != s.source->depthHeight) return;
+		s.registration.initialize(calibration);
+		s.sourceMapping = !calibration.withinTolerance();
+		s.registrationReady = true;
+	}
+
+	// 1フレーム分の変換 (プールのスレッドで実行する)
+	void process(int index, RGBDFrame frame, INT64 paired) {
+		Source &s = *sources[index];
+		INT64 start = currentTimestamp();
+		if (start - paired > (INT64)(options.frameBudgetMs * 10000)) {
+			std::lock_guard<std::mutex> lock(s.mutex);
+			s.stats.late++;
+			s.inFlight--;
+			return;
+		}
+
+		cv::Mat color, map;
+		{
+			std::lock_guard<std::mutex> lock(s.outputMutex);
+			if (frame.color.type() == CV_8UC2) color = takeSlot(s.colorOut);
+			if (s.registrationReady) map = takeSlot(s.mapOut);
+		}
+		if ((frame.color.type() == CV_8UC2 && color.empty()) || (s.registrationReady && map.empty())) {
+			std::lock_guard<std::mutex> lock(s.mutex);
+			s.stats.noSlot++;
+			s.inFlight--;
+			return;
+		}
+
+		// 並列にするのは取得元やフレームの間なので、1フレームの中は1スレッドで処理する
+		if (!color.empty()) {
+			for (int j = 0; j < frame.color.rows; j++) yuy2ToBGRARow(frame.color.ptr<BYTE>(j), color.ptr<BYTE>(j), frame.color.cols);
+			frame.color = color;
+		}
+		if (!map.empty()) {
+			bool mapped = false;
+			if (s.sourceMapping) {
+				std::lock_guard<std::mutex> lock(s.mapperMutex);
+				mapped = s.source->mapDepthFrameToColorSpace(frame.depth.ptr<UINT16>(0), frame.depth.total(), map.ptr<ColorSpacePoint>(0), map.total());
+			}
+			if (!mapped) s.registration.mapRows(frame.depth.ptr<UINT16>(0), map.ptr<ColorSpacePoint>(0), 0, frame.depth.rows);
+			frame.colorSpace = map;
+		}
+
+		INT64 end = currentTimestamp();
+		double processMs = (end - start) / 10000.0;
+		double latencyMs = (end - paired) / 10000.0;
+		if (handler) handler(index, frame);
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			if (frame.number > s.latest.number) s.latest = frame;
+			s.stats.processed++;
+			s.processSum += processMs;
+			s.latencySum += latencyMs;
+			s.stats.maxProcessMs = (std::max)(s.stats.maxProcessMs, processMs);
+			s.stats.maxLatencyMs = (std::max)(s.stats.maxLatencyMs, latencyMs);
+		}
+		s.inFlight--;
+	}
+
+	// 取得のスレッド (取得元ごと)
+	void capture(int index) {
+		Source &s = *sources[index];
+		FrameSource &source = *s.source;
+		while (running) {
+			if (!source.waitForFrame(FrameSource::ColorDepth, 100)) continue;
+
+			BYTE *color = s.colorBuffer.beginWrite();
+			if (color != nullptr && source.acquireColorFrame(color, s.colorBuffer.size())) {
+				s.colorBuffer.endWrite();
+				s.sync.pushColor(s.colorBuffer.view(), source.colorTimestamp);
+			}
+			UINT16 *depth = s.depthBuffer.beginWrite();
+			if (depth != nullptr && source.acquireDepthFrame(depth, s.depthBuffer.size())) {
+				s.depthBuffer.endWrite();
+				s.sync.pushDepth(s.depthBuffer.view(), source.depthTimestamp);
+			}
+
+			RGBDFrame pair;
+			while (s.sync.pop(pair)) {
+				prepareRegistration(s);
+				pair.number = ++s.frameNumber;
+				pair.roi.depthRect = cv::Rect(0, 0, source.depthWidth, source.depthHeight);
+				pair.roi.colorRect = cv::Rect(0, 0, source.colorWidth, source.colorHeight);
+				{
+					std::lock_guard<std::mutex> lock(s.mutex);
+					s.stats.captured++;
+				}
+
+				// 変換待ちが多ければ変換せずに捨てる (この取得元だけが fps を落とす)
+				if (s.inFlight >= options.maxInFlight) {
+					std::lock_guard<std::mutex> lock(s.mutex);
+					s.stats.throttled++;
+					continue;
+				}
+				s.inFlight++;
+				INT64 paired = currentTimestamp();
+				pool->submit([this, index, pair, paired]() { process(index, pair, paired); }, (size_t)index);
+			}
+		}
+	}
+
+public:
+	MultiSourceCapture() : running(false) {
+	}
+
+	~MultiSourceCapture() {
+		stop();
+	}
+
+	MultiSourceCapture(const MultiSourceCapture &) = delete;
+	MultiSourceCapture &operator=(const MultiSourceCapture &) = delete;
+
+	// 取得元を追加する (所有権を持つ。start() の前に呼ぶ) 取得元の番号を返す
+	int addSource(const std::string &name, FrameSource *source) {
+		if (running) throw std::runtime_error("cannot add a source while running");
+		std::unique_ptr<Source> s(new Source());
+		s->name = name;
+		s->source.reset(source);
+		sources.push_back(std::move(s));
+		return (int)sources.size() - 1;
+	}
+
+	void setOptions(const MultiSourceOptions &options) { this->options = options; }
+	const MultiSourceOptions &getOptions() const { return options; }
+
+	// 変換したフレームを受け取る関数 (start() の前に設定する。プールのスレッドから呼ばれるので、重い処理は避ける)
+	void setFrameHandler(const FrameHandler &handler) { this->handler = handler; }
+
+	// 全ての取得元を開いて取得を始める (開けなければ std::runtime_error を投げる)
+	// 取得元を開くのは最初の start() だけで、stop() の後の start() は開いたままの取得元から取得し直す
+	// RGBは YUY2 で受け取れる取得元からは YUY2 で受け取り、変換はプールで行う
+	void start() {
+		if (running) return;
+		options.maxInFlight = (std::max)(options.maxInFlight, 1);
+		for (size_t n = 0; n < sources.size(); n++) {
+			Source &s = *sources[n];
+			FrameSource &source = *s.source;
+			if (!s.opened) {
+				source.preferColorFormat(FrameSource::ColorYUY2);
+				source.open(FrameSource::ColorDepth);
+				s.opened = true;
+			}
+			int colorType = (source.colorFormat == FrameSource::ColorYUY2) ? CV_8UC2 : CV_8UC4;
+			s.colorBuffer.create(source.colorHeight, source.colorWidth, colorType, 4, 12);
+			s.depthBuffer.create(source.depthHeight, source.depthWidth, CV_16UC1, 4, 12);
+			s.colorOut.create(source.colorHeight, source.colorWidth, CV_8UC4, options.maxInFlight + 2, options.maxInFlight + 6);
+			s.mapOut.create(source.depthHeight, source.depthWidth, CV_32FC2, options.maxInFlight + 2, options.maxInFlight + 6);
+			s.sync.reset();
+			s.frameNumber = 0;
+			s.calibrationTries = 0;
+			s.registrationReady = false;
+			s.sourceMapping = false;
+			s.inFlight = 0;
+			s.latest = RGBDFrame();
+			s.stats = MultiSourceStats();
+			s.processSum = s.latencySum = 0;
+		}
+		pool.reset(new WorkStealingPool(options.workers));
+		running = true;
+		for (size_t n = 0; n < sources.size(); n++) sources[n]->thread = std::thread(&MultiSourceCapture::capture, this, (int)n);
+	}
+
+	// 取得を止める (プールに入っている変換は終わらせる。取得元は開いたまま、プールの統計は次の start() まで残す)
+	void stop() {
+		if (!running) return;
+		running = false;
+		for (size_t n = 0; n < sources.size(); n++) sources[n]->thread.join();
+		pool->wait();
+	}
+
+	bool isRunning() const { return running; }
+
+	int sourceCount() const { return (int)sources.size(); }
+	const std::string &sourceName(int index) const { return sources[index]->name; }
+	const FrameSource &source(int index) const { return *sources[index]->source; }
+
+	// 取得元の最新の変換済みフレーム (RGB は BGRA、位置合わせできれば colorSpace も。まだ無ければ false)
+	// ハンドルなのでコピーせず、持っている間は上書きされない
+	bool latestFrame(int index, RGBDFrame &frame) {
+		Source &s = *sources[index];
+		std::lock_guard<std::mutex> lock(s.mutex);
+		if (s.latest.number < 0) return false;
+		frame = s.latest;
+		return true;
+	}
+
+	MultiSourceStats stats(int index) {
+		Source &s = *sources[index];
+		std::lock_guard<std::mutex> lock(s.mutex);
+		MultiSourceStats result = s.stats;
+		if (result.processed > 0) {
+			result.meanProcessMs = s.processSum / result.processed;
+			result.meanLatencyMs = s.latencySum / result.processed;
+		}
+		return result;
+	}
+
+	// 変換スレッドの数と、スレッドごとの実行数・他のスレッドから取った数 (start() 前は nullptr)
+	const WorkStealingPool *workerPool() const { return pool.get(); }
+};
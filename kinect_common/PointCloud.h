@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define POINT_CLOUD_SSE2
+#endif
+
+#include "CaptureROI.h"
+#include "DepthWarp.h"
+#include "FrameBuffer.h"
+#include "KinectCalibration.h"
+
+// Depth画像と同じ並び (組織化) の点群
+// 成分ごとに別の平面 (SoA) に置くので、SIMD で成分ごとにまとめて処理できる
+// 各平面は FrameBuffer のスロットを指すハンドルなので、持っている間は上書きされず、そのまま別のスレッドに渡してよい
+struct PointCloud {
+	long long number = -1; // 元のRGB-Dフレームの番号
+	INT64 timestamp = 0;   // 元のDepthフレームのタイムスタンプ [100ns]
+	cv::Rect rect;         // 元のDepth画像のどの範囲の点か (ROI を指定しなければ全体)
+	cv::Mat x;             // CV_32FC1 カメラ座標 [m] (Depth値が無い点と範囲外の点は NaN)
+	cv::Mat y;
+	cv::Mat z;
+	cv::Mat color;         // CV_8UC4 各点の BGRA (色を付けない場合と、座標変換が使えない場合は空)
+
+	bool empty() const { return z.empty(); }
+	int width() const { return z.cols; }
+	int height() const { return z.rows; }
+};
+
+// Depthフレームから点群を作る
+// 各Depth画素の光線 (Z=1 でのカメラ座標) を initialize() で成分ごとの配列にしておき、
+// フレームごとには X = rayX * z, Y = rayY * z を SSE2 で4点ずつ、行の帯ごとに複数のスレッドで計算する
+// 出力の平面は自分のプールに書き込むので、1つの PointCloudGenerator は1つのスレッドから使う
+class PointCloudGenerator {
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<float> rayX;
+	std::vector<float> rayY;
+
+	FrameBuffer<float> xPool;
+	FrameBuffer<float> yPool;
+	FrameBuffer<float> zPool;
+	FrameBuffer<uint32_t> colorPool;
+
+public:
+	void initialize(const KinectCalibration &c) {
+		width = c.depthWidth;
+		height = c.depthHeight;
+		size_t n = (size_t)width * height;
+		rayX.resize(n);
+		rayY.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			rayX[i] = c.depthRays[i * 2];
+			rayY[i] = c.depthRays[i * 2 + 1];
+		}
+		xPool.create(height, width, CV_32FC1);
+		yPool.create(height, width, CV_32FC1);
+		zPool.create(height, width, CV_32FC1);
+		colorPool.create(height, width, CV_8UC4);
+	}
+
+	bool isInitialized() const { return width > 0; }
+
+	// Depth画素 i から end の手前までの座標を計算する (Depth値が [minDepth, maxDepth] の外の点は NaN)
+	void computeSpan(const UINT16 *depth, float *x, float *y, float *z, int i, int end, UINT16 minDepth = 1, UINT16 maxDepth = 65535) const {
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+#ifdef POINT_CLOUD_SSE2
+		const __m128 scale = _mm_set1_ps(0.001f);
+		const __m128 nan4 = _mm_set1_ps(nan);
+		const __m128i zeroi = _mm_setzero_si128();
+		const __m128i lo = _mm_set1_epi32(minDepth), hi = _mm_set1_epi32(maxDepth);
+		for (; i + 4 <= end; i += 4) {
+			__m128i d = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(depth + i)), zeroi);
+			__m128 invalid = _mm_castsi128_ps(_mm_or_si128(_mm_cmplt_epi32(d, lo), _mm_cmpgt_epi32(d, hi)));
+			__m128 zz = _mm_mul_ps(_mm_cvtepi32_ps(d), scale);
+			__m128 xx = _mm_mul_ps(_mm_loadu_ps(&rayX[i]), zz);
+			__m128 yy = _mm_mul_ps(_mm_loadu_ps(&rayY[i]), zz);
+			_mm_storeu_ps(x + i, _mm_or_ps(_mm_and_ps(invalid, nan4), _mm_andnot_ps(invalid, xx)));
+			_mm_storeu_ps(y + i, _mm_or_ps(_mm_and_ps(invalid, nan4), _mm_andnot_ps(invalid, yy)));
+			_mm_storeu_ps(z + i, _mm_or_ps(_mm_and_ps(invalid, nan4), _mm_andnot_ps(invalid, zz)));
+		}
+#endif
+		for (; i < end; i++) {
+			if (depth[i] < minDepth || depth[i] > maxDepth) {
+				x[i] = y[i] = z[i] = nan;
+				continue;
+			}
+			float zz = depth[i] * 0.001f;
+			x[i] = rayX[i] * zz;
+			y[i] = rayY[i] * zz;
+			z[i] = zz;
+		}
+	}
+
+	// Depth画素 rowBegin 行目から rowEnd 行目の手前までの座標を計算する
+	void computeRows(const UINT16 *depth, float *x, float *y, float *z, int rowBegin, int rowEnd) const {
+		computeSpan(depth, x, y, z, rowBegin * width, rowEnd * width);
+	}
+
+	// Depthフレームの rect の範囲の座標を計算する (x, y, z はそれぞれ幅 x 高さ 個。範囲の外には書き込まない)
+	void compute(const UINT16 *depth, float *x, float *y, float *z, const CaptureROI &roi = CaptureROI()) const {
+		const cv::Rect r = clipCaptureRect(roi.depthRect, width, height);
+		const UINT16 minDepth = roi.depthMin(), maxDepth = roi.depthMax();
+		const int rowsPerStripe = 16;
+		cv::parallel_for_(cv::Range(r.y, r.y + r.height), [&](const cv::Range &rows) {
+			if (r.width == width) {
+				computeSpan(depth, x, y, z, rows.start * width, rows.end * width, minDepth, maxDepth);
+				return;
+			}
+			for (int j = rows.start; j < rows.end; j++) computeSpan(depth, x, y, z, j * width + r.x, j * width + r.x + r.width, minDepth, maxDepth);
+		}, (double)(r.height + rowsPerStripe - 1) / rowsPerStripe);
+	}
+
+	// depth (CV_16UC1) から点群を作ってプールのスロットに書き込み、cloud にそのハンドルを返す
+	// color (CV_8UC4) と colorSpace (Depth画素ごとのRGB座標) を渡すと各点にRGB画像の色を付ける
+	// roi を指定すると、窓の中だけを計算して窓の大きさの点群を返す (Depth値が範囲外の点は NaN)
+	// 全てのスロットが使用中 (利用者が持ったまま) なら false
+	bool generate(const cv::Mat &depth, PointCloud &cloud, const cv::Mat &color = cv::Mat(), const ColorSpacePoint *colorSpace = nullptr,
+		const CaptureROI &roi = CaptureROI()) {
+		CV_Assert(depth.type() == CV_16UC1 && depth.rows == height && depth.cols == width);
+		const cv::Rect rect = clipCaptureRect(roi.depthRect, width, height);
+		float *x = xPool.beginWrite();
+		float *y = yPool.beginWrite();
+		float *z = zPool.beginWrite();
+		if (x == nullptr || y == nullptr || z == nullptr) return false;
+		cv::Mat colorSlot;
+		bool withColor = !color.empty() && colorSpace != nullptr;
+		if (withColor) {
+			colorSlot = colorPool.beginWriteMat();
+			if (colorSlot.empty()) return false;
+		}
+
+		compute(depth.ptr<UINT16>(0), x, y, z, roi);
+		xPool.endWrite();
+		yPool.endWrite();
+		zPool.endWrite();
+		cloud.rect = rect;
+		cloud.x = xPool.view()(rect);
+		cloud.y = yPool.view()(rect);
+		cloud.z = zPool.view()(rect);
+
+		// 各点の色は RGB → Depth の写像と同じ (Depth画素ごとに対応するRGB画素を読む)
+		cloud.color.release();
+		if (withColor) {
+			cv::Mat colorRect = colorSlot(rect);
+			warpColorToDepth(color, colorSpace, width, height, colorRect, rect);
+			colorPool.endWrite();
+			cloud.color = colorPool.view()(rect);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameQueue.h"
+#include "PointCloud.h"
+
+// 点群ファイルの形式 (どちらもバイナリ、リトルエンディアン)
+enum PointCloudFormat {
+	PointCloudPLY = 0, // Depth値のある点だけを並べる (x, y, z : float, red, green, blue : uchar)
+	PointCloudPCD = 1  // 組織化したまま (WIDTH x HEIGHT) 全ての点を並べる (値の無い点は NaN、rgb は PCL と同じ BGRA の4バイト)
+};
+
+inline const char *pointCloudExtension(PointCloudFormat format) {
+	return (format == PointCloudPCD) ? ".pcd" : ".ply";
+}
+
+// fopen (VS の SDL チェックでは fopen_s を使う)
+inline FILE *openPointCloudFile(const std::string &path, const char *mode) {
+#ifdef _WIN32
+	FILE *fp = nullptr;
+	if (fopen_s(&fp, path.c_str(), mode) != 0) return nullptr;
+	return fp;
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+// 点群を1つのファイルに書き出す
+// SoA の平面を1行ずつ点ごとの並びに詰め替えてから work にまとめ、fwrite は1回だけ呼ぶ (work は呼び出し側で使い回す)
+inline bool writePointCloud(const std::string &path, const PointCloud &cloud, PointCloudFormat format, std::vector<char> &work) {
+	if (cloud.empty()) return false;
+	const int width = cloud.width(), height = cloud.height();
+	const bool withColor = !cloud.color.empty();
+	const size_t pointSize = (format == PointCloudPCD) ? (withColor ? 16 : 12) : (withColor ? 15 : 12);
+
+	// PLY は先に点の数を数える (ヘッダに書くため)
+	size_t points = (size_t)width * height;
+	if (format == PointCloudPLY) {
+		points = 0;
+		for (int j = 0; j < height; j++) {
+			const float *z = cloud.z.ptr<float>(j);
+			for (int i = 0; i < width; i++) {
+				if (!std::isnan(z[i])) points++;
+			}
+		}
+	}
+
+	char header[512];
+	int headerSize;
+	if (format == PointCloudPCD) {
+		headerSize = snprintf(header, sizeof(header),
+			"# .PCD v0.7 - Point Cloud Data file format\nVERSION 0.7\nFIELDS x y z%s\nSIZE 4 4 4%s\nTYPE F F F%s\nCOUNT 1 1 1%s\n"
+			"WIDTH %d\nHEIGHT %d\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS %d\nDATA binary\n",
+			withColor ? " rgb" : "", withColor ? " 4" : "", withColor ? " U" : "", withColor ? " 1" : "",
+			width, height, width * height);
+	} else {
+		headerSize = snprintf(header, sizeof(header),
+			"ply\nformat binary_little_endian 1.0\ncomment organized %dx%d, Kinect camera space [m]\nelement vertex %llu\n"
+			"property float x\nproperty float y\nproperty float z\n%send_header\n",
+			width, height, (unsigned long long)points,
+			withColor ? "property uchar red\nproperty uchar green\nproperty uchar blue\n" : "");
+	}
+	if (headerSize <= 0 || headerSize >= (int)sizeof(header)) return false;
+
+	work.resize(headerSize + points * pointSize);
+	memcpy(&work[0], header, headerSize);
+	char *p = &work[headerSize];
+	for (int j = 0; j < height; j++) {
+		const float *x = cloud.x.ptr<float>(j);
+		const float *y = cloud.y.ptr<float>(j);
+		const float *z = cloud.z.ptr<float>(j);
+		const uchar *bgra = withColor ? cloud.color.ptr<uchar>(j) : nullptr;
+		for (int i = 0; i < width; i++) {
+			if (format == PointCloudPLY && std::isnan(z[i])) continue;
+			float xyz[3] = { x[i], y[i], z[i] };
+			memcpy(p, xyz, sizeof(xyz));
+			p += sizeof(xyz);
+			if (!withColor) continue;
+			if (format == PointCloudPCD) {
+				memcpy(p, bgra + i * 4, 4);
+				p += 4;
+			} else {
+				p[0] = (char)bgra[i * 4 + 2];
+				p[1] = (char)bgra[i * 4 + 1];
+				p[2] = (char)bgra[i * 4 + 0];
+				p += 3;
+			}
+		}
+	}
+
+	FILE *fp = openPointCloudFile(path, "wb");
+	if (fp == nullptr) return false;
+	bool ok = fwrite(&work[0], 1, work.size(), fp) == work.size();
+	ok = (fclose(fp) == 0) && ok;
+	return ok;
+}
+
+// 点群を別のスレッドでファイルに書き出す (prefix_000123.ply のようにフレーム番号ごとに1ファイル)
+// push() はキューに入れるだけで待たないので、取得のスレッドから30fpsで呼んでも取得は止まらない
+// 書き込みが追いつかずキューが満杯のときは新しい点群を捨てて数える (点群は FrameBuffer のハンドルなので、
+// キューと書き込み中の分だけプールのスロットを持ち続ける。キューの容量はプールの上限より小さくしておく)
+class PointCloudWriter {
+private:
+	std::unique_ptr<FrameQueue<PointCloud> > queue;
+	std::thread writer;
+	std::string prefix;
+	PointCloudFormat format = PointCloudPLY;
+	std::atomic<unsigned long long> writtenCount;
+	std::atomic<unsigned long long> failedCount;
+	std::atomic<unsigned long long> byteCount;
+
+	void run() {
+		std::vector<char> work; // 書き出す内容 (ファイルごとには確保しない)
+		for (;;) {
+			PointCloud cloud;
+			if (!queue->pop(cloud, 100)) {
+				if (queue->isClosed()) return;
+				continue;
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "_%06lld", cloud.number);
+			if (writePointCloud(prefix + name + pointCloudExtension(format), cloud, format, work)) {
+				writtenCount++;
+				byteCount += work.size();
+			} else {
+				failedCount++;
+			}
+		}
+	}
+
+public:
+	PointCloudWriter() : writtenCount(0), failedCount(0), byteCount(0) {}
+	~PointCloudWriter() { close(); }
+
+	PointCloudWriter(const PointCloudWriter &) = delete;
+	PointCloudWriter &operator=(const PointCloudWriter &) = delete;
+
+	// 書き出しを開始する (prefix はファイル名の先頭、capacity は書き込み待ちにできる点群の数)
+	void open(const std::string &prefix, PointCloudFormat format = PointCloudPLY, size_t capacity = 4) {
+		close();
+		this->prefix = prefix;
+		this->format = format;
+		writtenCount = 0;
+		failedCount = 0;
+		byteCount = 0;
+		queue.reset(new FrameQueue<PointCloud>(capacity, FrameQueueDropNewest));
+		writer = std::thread(&PointCloudWriter::run, this);
+	}
+
+	// 書き込み待ちにする (キューが満杯で捨てたら false)
+	bool push(const PointCloud &cloud) {
+		if (!isOpen()) return false;
+		return queue->push(cloud);
+	}
+
+	// 書き込み待ちの点群を全て書き出してから終了する (書き出したファイルの数を返す)
+	unsigned long long close() {
+		if (!isOpen()) return writtenCount;
+		queue->close();
+		writer.join();
+		return writtenCount;
+	}
+
+	bool isOpen() const { return writer.joinable(); }
+
+	unsigned long long written() const { return writtenCount; }
+	unsigned long long failed() const { return failedCount; }
+	unsigned long long bytes() const { return byteCount; }
+	unsigned long long dropped() const { return queue ? queue->stats().dropped : 0; }
+	size_t pending() const { return queue ? queue->depth() : 0; }
+};
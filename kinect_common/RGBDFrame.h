@@ -0,0 +1,18 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include "CaptureROI.h"
+#include "KinectTypes.h"
+
+// パイプラインの段の間で受け渡す1フレーム分のデータ
+// Mat は全て FrameBuffer のスロットを指すハンドルで、コピーしない (持っている間は上書きされない)
+struct RGBDFrame {
+	long long number = -1; // 取得した順の通し番号
+	INT64 colorTimestamp = 0; // 取得元のタイムスタンプ [100ns] (Kinect の RelativeTime)
+	INT64 depthTimestamp = 0;
+	cv::Mat color;      // CV_8UC4 (BGRA) か、取得元が YUY2 で渡す場合は CV_8UC2 (YUY2)
+	cv::Mat depth;      // CV_16UC1
+	cv::Mat colorSpace; // Depth座標系 → RGB座標系の対応表 (CV_32FC2 の ColorSpacePoint、座標変換が使えなければ空)
+	CaptureROI roi;     // 取得したときの ROI (color は colorRect の行だけ、colorSpace は depthRect の中だけが有効。窓が空なら全体)
+};
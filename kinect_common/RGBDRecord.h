@@ -0,0 +1,445 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "DepthCodec.h"
+#include "KinectTypes.h"
+
+// RGB-D 記録ファイル (.krgbd)
+//   [ヘッダ (RGBDRecordHeader)]
+//   [フレーム0 のフレームヘッダ (RGBDRecordFrameHeader)][フレーム0 の Depth][フレーム0 の RGB][フレーム1 のフレームヘッダ] ...
+//   [インデックス (RGBDRecordIndex x フレーム数)]
+// Depth は DepthCodec で可逆圧縮、RGB は colorCodec の形式で保存する (既定は JPEG)
+// 再生側はファイルをメモリマップして読むので、シークが速くフレームごとのヒープ確保も無い
+// インデックスは記録の終了時に書くので、途中で落ちたりディスクが一杯になったりしてインデックスが無いファイルは、
+// 再生側がフレームヘッダをたどってインデックスを作り直す (最後まで書けたフレームまで読める)
+// フレームヘッダの無い "KRGBD001" のファイルも、インデックスがあれば読める
+
+// RGB の保存形式
+enum RGBDRecordColorCodec {
+	RGBDRecordColorBGRA = 0, // 無圧縮 BGRA (8MB/フレーム)
+	RGBDRecordColorBGR = 1,  // 無圧縮 BGR (6MB/フレーム、Kinect の A は常に 255 なので可逆)
+	RGBDRecordColorJPEG = 2  // JPEG (非可逆、0.3MB/フレーム程度。30fps で 10MB/s 程度)
+};
+
+#pragma pack(push, 1)
+struct RGBDRecordHeader {
+	char magic[8];        // "KRGBD002" ("KRGBD001" はフレームヘッダ無し)
+	uint32_t headerSize;
+	uint32_t colorCodec;  // RGBDRecordColorCodec
+	int32_t depthWidth;
+	int32_t depthHeight;
+	int32_t colorWidth;
+	int32_t colorHeight;
+	uint64_t frameCount;
+	uint64_t indexOffset; // インデックスの位置 (書き込み途中のファイルでは0)
+	uint8_t reserved[16];
+};
+
+struct RGBDRecordIndex {
+	int64_t timestamp;    // 100ns 単位
+	uint64_t depthOffset;
+	uint32_t depthSize;   // 0 なら Depth 無し
+	uint64_t colorOffset;
+	uint32_t colorSize;   // 0 なら RGB 無し
+};
+
+// フレームごとのデータの前に置く (続けて depthSize バイトの Depth と colorSize バイトの RGB)
+struct RGBDRecordFrameHeader {
+	char magic[4];        // "KFRM"
+	uint32_t depthSize;
+	uint32_t colorSize;
+	int64_t timestamp;
+};
+#pragma pack(pop)
+
+static const char rgbdRecordMagic[8] = { 'K', 'R', 'G', 'B', 'D', '0', '0', '2' };
+static const char rgbdRecordMagicV1[8] = { 'K', 'R', 'G', 'B', 'D', '0', '0', '1' };
+static const char rgbdRecordFrameMagic[4] = { 'K', 'F', 'R', 'M' };
+
+// fopen (VS の SDL チェックでは fopen_s を使う)
+inline FILE *openRecordFile(const std::string &path, const char *mode) {
+#ifdef _WIN32
+	FILE *fp = nullptr;
+	if (fopen_s(&fp, path.c_str(), mode) != 0) return nullptr;
+	return fp;
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+// 記録ファイルの書き込み
+class RGBDRecordWriter {
+private:
+	FILE *fp = nullptr;
+	std::string path;
+	RGBDRecordHeader header;
+	std::vector<RGBDRecordIndex> index;
+	uint64_t offset = 0;
+	int jpegQuality;
+
+	// 圧縮用の作業バッファ (フレームごとに確保しない)
+	std::vector<BYTE> depthWork;
+	std::vector<BYTE> colorWork;
+
+	void write(const void *data, size_t size) {
+		if (fwrite(data, 1, size, fp) != size) throw std::runtime_error("failed to write record file");
+		offset += size;
+	}
+
+public:
+	RGBDRecordWriter() {}
+	RGBDRecordWriter(const RGBDRecordWriter &) = delete;
+	RGBDRecordWriter &operator=(const RGBDRecordWriter &) = delete;
+
+	~RGBDRecordWriter() {
+		try {
+			close();
+		} catch (std::exception &) {
+		}
+	}
+
+	bool isOpen() const { return fp != nullptr; }
+	size_t frameCount() const { return index.size(); }
+
+	// 記録を開始する (サイズが0のストリームは記録しない)
+	void open(const std::string &path, int depthWidth, int depthHeight, int colorWidth, int colorHeight,
+		RGBDRecordColorCodec colorCodec = RGBDRecordColorJPEG, int jpegQuality = 90) {
+		close();
+		fp = openRecordFile(path, "wb");
+		if (fp == nullptr) throw std::runtime_error("failed to open " + path);
+		this->path = path;
+		setvbuf(fp, nullptr, _IOFBF, 1 << 20);
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, rgbdRecordMagic, sizeof(header.magic));
+		header.headerSize = sizeof(header);
+		header.colorCodec = colorCodec;
+		header.depthWidth = depthWidth;
+		header.depthHeight = depthHeight;
+		header.colorWidth = colorWidth;
+		header.colorHeight = colorHeight;
+		this->jpegQuality = jpegQuality;
+		index.clear();
+		offset = 0;
+		write(&header, sizeof(header));
+
+		depthWork.resize(DepthCodec::maxEncodedSize((size_t)depthWidth * depthHeight));
+		if (colorCodec == RGBDRecordColorBGR) colorWork.resize((size_t)colorWidth * colorHeight * 3);
+	}
+
+	// 1フレーム書き込む (depth, color は nullptr でもよい, color は BGRA。書き込めなければ std::runtime_error を投げる)
+	void writeFrame(INT64 timestamp, const UINT16 *depth, const BYTE *color) {
+		RGBDRecordIndex entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.timestamp = timestamp;
+
+		// 先に圧縮してフレームヘッダに大きさを書く
+		if (depth != nullptr && header.depthWidth > 0) {
+			entry.depthSize = (uint32_t)DepthCodec::encode(depth, header.depthWidth, header.depthHeight, &depthWork[0]);
+		}
+		const BYTE *colorSrc = nullptr;
+		if (color != nullptr && header.colorWidth > 0) {
+			size_t pixels = (size_t)header.colorWidth * header.colorHeight;
+			if (header.colorCodec == RGBDRecordColorBGRA) {
+				colorSrc = color;
+				entry.colorSize = (uint32_t)(pixels * 4);
+			} else if (header.colorCodec == RGBDRecordColorBGR) {
+				BYTE *dst = &colorWork[0];
+				for (size_t i = 0; i < pixels; i++) {
+					dst[i * 3 + 0] = color[i * 4 + 0];
+					dst[i * 3 + 1] = color[i * 4 + 1];
+					dst[i * 3 + 2] = color[i * 4 + 2];
+				}
+				colorSrc = dst;
+				entry.colorSize = (uint32_t)(pixels * 3);
+			} else {
+				cv::Mat bgra(header.colorHeight, header.colorWidth, CV_8UC4, (void *)color);
+				std::vector<int> params;
+				params.push_back(cv::IMWRITE_JPEG_QUALITY);
+				params.push_back(jpegQuality);
+				cv::imencode(".jpg", bgra, colorWork, params);
+				colorSrc = &colorWork[0];
+				entry.colorSize = (uint32_t)colorWork.size();
+			}
+		}
+
+		RGBDRecordFrameHeader frame;
+		memcpy(frame.magic, rgbdRecordFrameMagic, sizeof(frame.magic));
+		frame.depthSize = entry.depthSize;
+		frame.colorSize = entry.colorSize;
+		frame.timestamp = timestamp;
+		write(&frame, sizeof(frame));
+		entry.depthOffset = offset;
+		if (entry.depthSize > 0) write(&depthWork[0], entry.depthSize);
+		entry.colorOffset = offset;
+		if (entry.colorSize > 0) write(colorSrc, entry.colorSize);
+
+		index.push_back(entry);
+	}
+
+	// インデックスを書き込んでファイルを閉じる
+	// 書き込めなければファイルを閉じてから std::runtime_error を投げる (書けたフレームは再生時にフレームヘッダから読み直せる)
+	void close() {
+		if (fp == nullptr) return;
+		header.frameCount = index.size();
+		header.indexOffset = offset;
+		bool ok = index.empty() || fwrite(&index[0], sizeof(RGBDRecordIndex), index.size(), fp) == index.size();
+		ok = ok && fflush(fp) == 0; // インデックスを書き終えてからヘッダを書き換える
+		ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = (fclose(fp) == 0) && ok;
+		fp = nullptr;
+		if (!ok) throw std::runtime_error("failed to finish record file " + path);
+	}
+};
+
+// 読み込み専用のメモリマップ
+class MappedFile {
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+	const BYTE *mappedData = nullptr;
+	size_t mappedSize = 0;
+
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile() {
+		close();
+	}
+
+	void open(const std::string &path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open " + path);
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size)) throw std::runtime_error("failed to get the size of " + path);
+		mappedSize = (size_t)size.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) throw std::runtime_error("failed to map " + path);
+		mappedData = (const BYTE *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (mappedData == nullptr) throw std::runtime_error("failed to map " + path);
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("failed to open " + path);
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			::close(fd);
+			throw std::runtime_error("failed to get the size of " + path);
+		}
+		mappedSize = (size_t)st.st_size;
+		void *p = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED) throw std::runtime_error("failed to map " + path);
+		mappedData = (const BYTE *)p;
+#endif
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (mappedData != nullptr) UnmapViewOfFile(mappedData);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (mappedData != nullptr) munmap((void *)mappedData, mappedSize);
+#endif
+		mappedData = nullptr;
+		mappedSize = 0;
+	}
+
+	const BYTE *data() const { return mappedData; }
+	size_t size() const { return mappedSize; }
+};
+
+// 記録ファイルの読み込み (ランダムアクセス可)
+class RGBDRecordReader {
+private:
+	MappedFile file;
+	RGBDRecordHeader header;
+	const RGBDRecordIndex *index = nullptr;
+	std::vector<RGBDRecordIndex> recoveredIndex; // インデックスの無いファイルでフレームヘッダから作り直したもの
+
+	// フレームのデータが dataEnd より前に収まっているか (無圧縮の RGB は画像全体の大きさが要る)
+	bool validEntry(const RGBDRecordIndex &entry, uint64_t dataEnd) const {
+		size_t colorBytes = (size_t)header.colorWidth * header.colorHeight;
+		if (header.colorCodec == RGBDRecordColorBGRA) colorBytes *= 4;
+		else if (header.colorCodec == RGBDRecordColorBGR) colorBytes *= 3;
+		else colorBytes = 0;
+		return (entry.depthSize == 0 || (entry.depthOffset <= dataEnd && entry.depthSize <= dataEnd - entry.depthOffset))
+			&& (entry.colorSize == 0 || (entry.colorOffset <= dataEnd && entry.colorSize <= dataEnd - entry.colorOffset
+				&& entry.colorSize >= colorBytes));
+	}
+
+	// フレームヘッダを先頭からたどってインデックスを作り直す (ファイルの終わりか、壊れたフレームの手前まで)
+	void recoverIndex() {
+		recoveredIndex.clear();
+		uint64_t pos = sizeof(RGBDRecordHeader);
+		while (file.size() - pos >= sizeof(RGBDRecordFrameHeader)) {
+			RGBDRecordFrameHeader frame;
+			memcpy(&frame, file.data() + pos, sizeof(frame));
+			if (memcmp(frame.magic, rgbdRecordFrameMagic, sizeof(frame.magic)) != 0) break;
+			uint64_t begin = pos + sizeof(frame);
+			if ((uint64_t)frame.depthSize + frame.colorSize > file.size() - begin) break;
+			RGBDRecordIndex entry;
+			entry.timestamp = frame.timestamp;
+			entry.depthOffset = begin;
+			entry.depthSize = frame.depthSize;
+			entry.colorOffset = begin + frame.depthSize;
+			entry.colorSize = frame.colorSize;
+			if (!validEntry(entry, file.size())) break;
+			recoveredIndex.push_back(entry);
+			pos = begin + frame.depthSize + frame.colorSize;
+		}
+		index = recoveredIndex.empty() ? nullptr : &recoveredIndex[0];
+		header.frameCount = recoveredIndex.size();
+	}
+
+public:
+	// 記録ファイルかどうか (先頭のマジックで判定)
+	static bool isRecordFile(const std::string &path) {
+		FILE *fp = openRecordFile(path, "rb");
+		if (fp == nullptr) return false;
+		char magic[8];
+		bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+			&& (memcmp(magic, rgbdRecordMagic, sizeof(magic)) == 0 || memcmp(magic, rgbdRecordMagicV1, sizeof(magic)) == 0);
+		fclose(fp);
+		return ok;
+	}
+
+	void open(const std::string &path) {
+		file.open(path);
+		index = nullptr;
+		recoveredIndex.clear();
+		if (file.size() < sizeof(header)) throw std::runtime_error("not a record file: " + path);
+		memcpy(&header, file.data(), sizeof(header));
+		bool framed = memcmp(header.magic, rgbdRecordMagic, sizeof(header.magic)) == 0;
+		if (!framed && memcmp(header.magic, rgbdRecordMagicV1, sizeof(header.magic)) != 0) throw std::runtime_error("not a record file: " + path);
+		if (header.depthWidth <= 0 || header.depthHeight <= 0 || header.colorWidth <= 0 || header.colorHeight <= 0
+			|| header.depthWidth > 4096 || header.depthHeight > 4096 || header.colorWidth > 8192 || header.colorHeight > 8192) {
+			throw std::runtime_error("invalid record file: " + path);
+		}
+
+		if (header.indexOffset != 0 && header.indexOffset <= file.size()
+			&& header.frameCount <= (file.size() - header.indexOffset) / sizeof(RGBDRecordIndex)) {
+			index = (const RGBDRecordIndex *)(file.data() + header.indexOffset);
+
+			// 途中で切れたファイルや壊れたファイルを読んでマップの外に出ないように、全てのフレームの位置と大きさを確かめる
+			// (フレームのデータはインデックスより前にある)
+			for (uint64_t n = 0; n < header.frameCount; n++) {
+				if (validEntry(index[n], header.indexOffset)) continue;
+				if (framed) {
+					recoverIndex();
+					return;
+				}
+				index = nullptr;
+				header.frameCount = 0;
+				file.close();
+				throw std::runtime_error("broken record file (frame " + std::to_string(n) + "): " + path);
+			}
+		} else if (framed) {
+			// 記録の途中で落ちたファイル
+			recoverIndex();
+		} else {
+			throw std::runtime_error("record file is not finalized: " + path);
+		}
+	}
+
+	size_t frameCount() const { return (size_t)header.frameCount; }
+	int depthWidth() const { return header.depthWidth; }
+	int depthHeight() const { return header.depthHeight; }
+	int colorWidth() const { return header.colorWidth; }
+	int colorHeight() const { return header.colorHeight; }
+	RGBDRecordColorCodec colorCodec() const { return (RGBDRecordColorCodec)header.colorCodec; }
+	INT64 timestamp(size_t frame) const { return index[frame].timestamp; }
+
+	// 指定フレームの Depth を展開する (Depth が無いフレームなら false)
+	bool readDepth(size_t frame, UINT16 *dst) const {
+		const RGBDRecordIndex &entry = index[frame];
+		if (entry.depthSize == 0) return false;
+		return DepthCodec::decode(file.data() + entry.depthOffset, entry.depthSize, header.depthWidth, header.depthHeight, dst);
+	}
+
+	// 指定フレームの RGB を BGRA で展開する (RGB が無いフレームなら false)
+	bool readColor(size_t frame, BYTE *dst) {
+		const RGBDRecordIndex &entry = index[frame];
+		if (entry.colorSize == 0) return false;
+		const BYTE *src = file.data() + entry.colorOffset;
+		size_t pixels = (size_t)header.colorWidth * header.colorHeight;
+		if (header.colorCodec == RGBDRecordColorBGRA) {
+			memcpy(dst, src, pixels * 4);
+		} else if (header.colorCodec == RGBDRecordColorBGR) {
+			for (size_t i = 0; i < pixels; i++) {
+				dst[i * 4 + 0] = src[i * 3 + 0];
+				dst[i * 4 + 1] = src[i * 3 + 1];
+				dst[i * 4 + 2] = src[i * 3 + 2];
+				dst[i * 4 + 3] = 255;
+			}
+		} else {
+			cv::Mat encoded(1, (int)entry.colorSize, CV_8UC1, (void *)src);
+			cv::Mat bgr = cv::imdecode(encoded, cv::IMREAD_COLOR);
+			if (bgr.empty() || bgr.type() != CV_8UC3 || bgr.cols != header.colorWidth || bgr.rows != header.colorHeight) return false;
+			cv::Mat bgra(header.colorHeight, header.colorWidth, CV_8UC4, dst);
+			cv::cvtColor(bgr, bgra, cv::COLOR_BGR2BGRA);
+		}
+		return true;
+	}
+
+	// rowBegin 行目から rowEnd 行目の手前までだけを読む (dst の同じ位置に書き、他の行は不定)
+	// 行ごとに取り出せるのは無圧縮の形式だけで、JPEG はフレーム全体を展開する
+	bool readColorRows(size_t frame, BYTE *dst, int rowBegin, int rowEnd) {
+		if (header.colorCodec != RGBDRecordColorBGRA && header.colorCodec != RGBDRecordColorBGR) return readColor(frame, dst);
+		const RGBDRecordIndex &entry = index[frame];
+		if (entry.colorSize == 0) return false;
+		rowBegin = (std::max)(rowBegin, 0);
+		rowEnd = (std::min)(rowEnd, (int)header.colorHeight);
+		if (rowEnd <= rowBegin) return true;
+		const BYTE *src = file.data() + entry.colorOffset;
+		size_t begin = (size_t)rowBegin * header.colorWidth, end = (size_t)rowEnd * header.colorWidth;
+		if (header.colorCodec == RGBDRecordColorBGRA) {
+			memcpy(dst + begin * 4, src + begin * 4, (end - begin) * 4);
+			return true;
+		}
+		for (size_t i = begin; i < end; i++) {
+			dst[i * 4 + 0] = src[i * 3 + 0];
+			dst[i * 4 + 1] = src[i * 3 + 1];
+			dst[i * 4 + 2] = src[i * 3 + 2];
+			dst[i * 4 + 3] = 255;
+		}
+		return true;
+	}
+
+	// 無圧縮 BGRA で記録されている場合、マップしたデータを直接参照する (コピー無し)
+	const BYTE *colorData(size_t frame) const {
+		const RGBDRecordIndex &entry = index[frame];
+		if (entry.colorSize == 0 || header.colorCodec != RGBDRecordColorBGRA) return nullptr;
+		return file.data() + entry.colorOffset;
+	}
+};
@@ -0,0 +1,648 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "CaptureROI.h"
+#include "ColorConvert.h"
+#include "DepthCodec.h"
+#include "FrameQueue.h"
+#include "FrameSource.h"
+#include "KinectCalibration.h"
+#include "KinectTypes.h"
+#include "RGBDFrame.h"
+
+// 組にしたRGB-Dフレームを TCP で別の PC に送る (受け取る側は StreamFrameSource)
+// 接続するとサーバーは最初に RGBDStreamHello と位置合わせのパラメータ (serializeKinectCalibration()) を送り、以降はフレームごとに
+//   [RGBDStreamFrameHeader] [Depth (DepthCodec::encodePredictive()、ROI の Depth の窓)] [RGB (JPEG、ROI の RGB の窓)]
+// を送る。クライアントはフレームを展開するたびに RGBDStreamAck を返す
+//
+// 送る側は返事を待っているフレームが maxInFlight 個になったら次を送らず、その間に届いたフレームは最新の1つだけを残す
+// 回線や受け取る側が遅いときは古いフレームを捨てるので、キューに溜まった分の遅延が増えることは無い
+// RGB の JPEG 圧縮は別のスレッドで行い、その間に送信スレッドで Depth を圧縮する
+
+static const char rgbdStreamMagic[8] = { 'K', 'R', 'G', 'B', 'D', 'S', 'T', '1' };
+static const char rgbdStreamFrameMagic[4] = { 'K', 'F', 'R', 'M' };
+
+// 接続したときに最初に送る (続けて calibrationSize バイトの位置合わせのパラメータ)
+struct RGBDStreamHello {
+	char magic[8];
+	int32_t depthWidth;
+	int32_t depthHeight;
+	int32_t colorWidth;
+	int32_t colorHeight;
+	uint16_t minDepthReliableDistance;
+	uint16_t maxDepthReliableDistance;
+	uint32_t hostClock;       // タイムスタンプがサーバーの currentTimestamp() と同じ時計か
+	uint32_t calibrationSize; // 位置合わせのパラメータが無ければ 0
+};
+
+enum RGBDStreamFrameFlags {
+	RGBDStreamHalfColor = 1 // RGB は窓を縦横半分にしたもの
+};
+
+// フレームごとの先頭 (続けて depthSize バイトの Depth と colorSize バイトの RGB)
+struct RGBDStreamFrameHeader {
+	char magic[4];
+	uint32_t depthSize;
+	uint32_t colorSize;
+	float encodeMs;           // サーバーで圧縮にかかった時間
+	int64_t number;           // RGBDFrame::number
+	INT64 colorTimestamp;     // 取得元のタイムスタンプ (サーバーの取得元の時計)
+	INT64 depthTimestamp;
+	INT64 pushTimestamp;      // サーバーがフレームを受け取った時刻 (サーバーの currentTimestamp()。返事でそのまま返す)
+	int32_t depthRect[4];     // x, y, width, height
+	int32_t colorRect[4];
+	uint16_t minDepth;
+	uint16_t maxDepth;
+	uint32_t flags;           // RGBDStreamFrameFlags
+};
+
+// クライアントがフレームを展開したら返す
+struct RGBDStreamAck {
+	int64_t number;
+	INT64 pushTimestamp;
+	float decodeMs;
+	uint32_t reserved;
+};
+
+// TCP のソケット (Windows は Winsock、それ以外は BSD ソケット)
+class StreamSocket {
+public:
+#ifdef _WIN32
+	typedef SOCKET Handle;
+	typedef int Length;
+#else
+	typedef int Handle;
+	typedef socklen_t Length;
+#endif
+
+private:
+#ifdef _WIN32
+	static Handle invalidHandle() { return INVALID_SOCKET; }
+	static void closeHandle(Handle h) { closesocket(h); }
+	static const int sendFlags = 0;
+#else
+	static Handle invalidHandle() { return -1; }
+	static void closeHandle(Handle h) { ::close(h); }
+#ifdef MSG_NOSIGNAL
+	static const int sendFlags = MSG_NOSIGNAL; // 相手が切ったときに SIGPIPE で落ちないように
+#else
+	static const int sendFlags = 0;
+#endif
+#endif
+
+	Handle handle;
+
+	void setBlocking(bool blocking) {
+#ifdef _WIN32
+		u_long mode = blocking ? 0 : 1;
+		ioctlsocket(handle, FIONBIO, &mode);
+#else
+		int flags = fcntl(handle, F_GETFL, 0);
+		fcntl(handle, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+	}
+
+	// 接続を最大 timeoutMs 待つ (0 なら OS の既定の時間)
+	bool connectHandle(const sockaddr *addr, Length size, int timeoutMs) {
+		if (timeoutMs <= 0) return ::connect(handle, addr, size) == 0;
+		setBlocking(false);
+		bool ok = ::connect(handle, addr, size) == 0;
+#ifdef _WIN32
+		bool inProgress = !ok && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		bool inProgress = !ok && errno == EINPROGRESS;
+#endif
+		if (inProgress) {
+			fd_set writable, failed; // Windows は失敗を failed で知らせる
+			FD_ZERO(&writable);
+			FD_ZERO(&failed);
+			FD_SET(handle, &writable);
+			FD_SET(handle, &failed);
+			timeval timeout;
+			timeout.tv_sec = timeoutMs / 1000;
+			timeout.tv_usec = (timeoutMs % 1000) * 1000;
+			int error = 0;
+			Length length = sizeof(error);
+			ok = select((int)handle + 1, nullptr, &writable, &failed, &timeout) > 0 && FD_ISSET(handle, &writable) && !FD_ISSET(handle, &failed)
+				&& getsockopt(handle, SOL_SOCKET, SO_ERROR, (char *)&error, &length) == 0 && error == 0;
+		}
+		setBlocking(true);
+		return ok;
+	}
+
+	static void startup() {
+#ifdef _WIN32
+		struct Winsock {
+			Winsock() { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
+			~Winsock() { WSACleanup(); }
+		};
+		static Winsock winsock;
+#endif
+	}
+
+public:
+	StreamSocket() : handle(invalidHandle()) {
+		startup();
+	}
+
+	~StreamSocket() {
+		close();
+	}
+
+	StreamSocket(const StreamSocket &) = delete;
+	StreamSocket &operator=(const StreamSocket &) = delete;
+
+	bool isOpen() const { return handle != invalidHandle(); }
+
+	// 別のソケットと中身を入れ替える (別のスレッドでつないだソケットを使い始めるとき)
+	void swap(StreamSocket &other) { std::swap(handle, other.handle); }
+
+	void close() {
+		if (!isOpen()) return;
+		closeHandle(handle);
+		handle = invalidHandle();
+	}
+
+	// 別のスレッドで止まっている送受信を起こす (閉じるのはそのスレッドで行う)
+	void shutdown() {
+#ifdef _WIN32
+		if (isOpen()) ::shutdown(handle, SD_BOTH);
+#else
+		if (isOpen()) ::shutdown(handle, SHUT_RDWR);
+#endif
+	}
+
+	// 送ったデータをまとめずにすぐ送る (フレームの遅延を減らす)
+	void setNoDelay() {
+		int on = 1;
+		setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+	}
+
+	// port で接続を待つ (失敗したら std::runtime_error を投げる)
+	void listen(int port) {
+		close();
+		handle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (!isOpen()) throw std::runtime_error("failed to create socket");
+#ifndef _WIN32
+		int on = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on)); // 終わった直後に同じポートで開き直せるように
+#endif
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((unsigned short)port);
+		if (bind(handle, (const sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(handle, 1) != 0) {
+			close();
+			throw std::runtime_error("failed to listen on port " + std::to_string(port));
+		}
+	}
+
+	// 接続を最大 timeoutMs 待って client で受け付ける (来なければ false)
+	bool accept(StreamSocket &client, int timeoutMs) {
+		if (!waitReadable(timeoutMs)) return false;
+		Handle h = ::accept(handle, nullptr, nullptr);
+		if (h == invalidHandle()) return false;
+		client.close();
+		client.handle = h;
+		client.setNoDelay();
+		return true;
+	}
+
+	// 受け取りを最大 timeoutMs で諦める (recvAll() が false を返す。0 なら待ち続ける)
+	void setReceiveTimeout(int timeoutMs) {
+#ifdef _WIN32
+		DWORD timeout = (DWORD)(std::max)(timeoutMs, 0);
+#else
+		timeval timeout;
+		timeout.tv_sec = (std::max)(timeoutMs, 0) / 1000;
+		timeout.tv_usec = ((std::max)(timeoutMs, 0) % 1000) * 1000;
+#endif
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+	}
+
+	// host:port に接続する (失敗したら std::runtime_error を投げる)
+	// timeoutMs を指定すると、相手が応答しないときもその時間で諦める
+	void connect(const std::string &host, int port, int timeoutMs = 0) {
+		close();
+		addrinfo hints, *list = nullptr;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &list) != 0) throw std::runtime_error("unknown host " + host);
+		for (addrinfo *a = list; a != nullptr && !isOpen(); a = a->ai_next) {
+			handle = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (isOpen() && !connectHandle(a->ai_addr, (Length)a->ai_addrlen, timeoutMs)) close();
+		}
+		freeaddrinfo(list);
+		if (!isOpen()) throw std::runtime_error("failed to connect to " + host + ":" + std::to_string(port));
+		setNoDelay();
+	}
+
+	// 読めるデータ (か切断) が来るまで最大 timeoutMs 待つ
+	bool waitReadable(int timeoutMs) {
+		if (!isOpen()) return false;
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(handle, &set);
+		timeval timeout;
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_usec = (timeoutMs % 1000) * 1000;
+		return select((int)handle + 1, &set, nullptr, nullptr, &timeout) > 0;
+	}
+
+	// size バイトを全て送る (切断されたら false)
+	bool sendAll(const void *data, size_t size) {
+		const char *p = (const char *)data;
+		while (size > 0) {
+			int n = (int)send(handle, p, (int)(std::min)(size, (size_t)(1 << 30)), sendFlags);
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	// size バイトを全て受け取る (切断されたら false)
+	bool recvAll(void *data, size_t size) {
+		char *p = (char *)data;
+		while (size > 0) {
+			int n = (int)recv(handle, p, (int)(std::min)(size, (size_t)(1 << 30)), 0);
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+};
+
+// 同じ PC への接続か (タイムスタンプを比べて遅延を測れる)
+inline bool isLoopbackHost(const std::string &host) {
+	return host == "localhost" || host.compare(0, 4, "127.") == 0;
+}
+
+// 送り方の設定
+struct RGBDStreamOptions {
+	int jpegQuality = 80;    // RGB の JPEG の品質
+	bool halfColor = false;  // RGB を縦横半分にして送る (回線が細いとき用)
+	int depthQuantStep = 1;  // Depth を丸める刻み [mm] (1 なら可逆、それ以外は誤差 quantStep / 2 以下)
+	int maxInFlight = 2;     // 返事を待つフレームの上限 (これ以上は送らずに新しいフレームで置き換える)
+	int maxFrameAgeMs = 100; // 受け取ってからこれより時間が経ったフレームは送らずに捨てる
+};
+
+// 送る側の統計
+struct RGBDStreamStats {
+	unsigned long long connections = 0; // 接続されたクライアントの数 (つなぎ直しも数える)
+	unsigned long long sent = 0;
+	unsigned long long acked = 0;
+	unsigned long long superseded = 0;  // 送る前に新しいフレームで置き換えたフレーム
+	unsigned long long stale = 0;       // 古くなって捨てたフレーム
+	unsigned long long depthBytes = 0;
+	unsigned long long colorBytes = 0;
+	double megabitsPerSecond = 0;       // 最初に送ってから最後に送るまでの平均
+	double meanEncodeMs = 0;
+	double maxEncodeMs = 0;
+	double meanLatencyMs = 0;           // サーバーが受け取ってからクライアントの返事が届くまで (圧縮・転送・展開・返事の転送を含む)
+	double maxLatencyMs = 0;
+};
+
+// 組にしたフレームを TCP で1つのクライアントに送る
+// push() は取得のループから呼び、送信は別のスレッドで行うので取得は止まらない
+// クライアントが切れたら次の接続を待つ
+class RGBDStreamServer {
+private:
+	struct Pending {
+		RGBDFrame frame;
+		INT64 pushTimestamp = 0;
+	};
+
+	RGBDStreamOptions options;
+	std::vector<BYTE> hello; // RGBDStreamHello + 位置合わせのパラメータ
+	int depthWidth = 0;
+	int depthHeight = 0;
+	int colorWidth = 0;
+	int colorHeight = 0;
+
+	StreamSocket listener;
+	StreamSocket client;
+	std::mutex clientMutex; // client を閉じるのと stop() で起こすのが重ならないように
+	std::atomic<bool> connected;
+	std::atomic<bool> stopping;
+	std::thread sender;
+	FrameQueue<Pending> queue;
+	int inFlight = 0;
+
+	// RGB の圧縮スレッド
+	std::thread colorThread;
+	std::mutex colorMutex;
+	std::condition_variable colorCond;
+	RGBDFrame colorJob;
+	bool colorRequested = false;
+	bool colorFinished = false;
+	std::vector<BYTE> colorEncoded;
+	cv::Mat colorBGRA;
+
+	// 送信スレッドだけが使う
+	std::vector<BYTE> depthEncoded;
+	std::vector<BYTE> packet;
+
+	// 統計
+	mutable std::mutex statsMutex;
+	RGBDStreamStats counters;
+	double encodeSum = 0;
+	double latencySum = 0;
+	INT64 firstSent = 0;
+	INT64 lastSent = 0;
+
+	void encodeColor(const RGBDFrame &frame) {
+		cv::Mat color = frame.color(clipCaptureRect(frame.roi.colorRect, colorWidth, colorHeight));
+		if (options.halfColor) {
+			if (color.type() == CV_8UC2) yuy2ToBGRAHalf(color, colorBGRA);
+			else cv::resize(color, colorBGRA, cv::Size(color.cols / 2, color.rows / 2), 0, 0, cv::INTER_AREA);
+		} else {
+			colorToBGRA(color, colorBGRA);
+		}
+		std::vector<int> params;
+		params.push_back(cv::IMWRITE_JPEG_QUALITY);
+		params.push_back(options.jpegQuality);
+		cv::imencode(".jpg", colorBGRA, colorEncoded, params);
+	}
+
+	void runColor() {
+		std::unique_lock<std::mutex> lock(colorMutex);
+		for (;;) {
+			colorCond.wait(lock, [this]() { return colorRequested || stopping; });
+			if (stopping) return;
+			RGBDFrame frame = colorJob;
+			lock.unlock();
+			encodeColor(frame);
+			lock.lock();
+			colorJob = RGBDFrame(); // スロットを返す
+			colorRequested = false;
+			colorFinished = true;
+			colorCond.notify_all();
+		}
+	}
+
+	void closeClient() {
+		std::lock_guard<std::mutex> lock(clientMutex);
+		client.close();
+		connected = false;
+		inFlight = 0;
+	}
+
+	// 届いている返事を読む (timeoutMs は最初の返事を待つ時間。切断されたら false)
+	bool receiveAcks(int timeoutMs) {
+		while (client.waitReadable(timeoutMs)) {
+			RGBDStreamAck ack;
+			if (!client.recvAll(&ack, sizeof(ack))) return false;
+			double latency = (currentTimestamp() - ack.pushTimestamp) / 10000.0;
+			std::lock_guard<std::mutex> lock(statsMutex);
+			counters.acked++;
+			latencySum += latency;
+			counters.maxLatencyMs = (std::max)(counters.maxLatencyMs, latency);
+			if (inFlight > 0) inFlight--;
+			timeoutMs = 0;
+		}
+		return true;
+	}
+
+	bool sendFrame(const Pending &pending) {
+		const RGBDFrame &frame = pending.frame;
+		INT64 start = currentTimestamp();
+
+		// RGB を圧縮スレッドに渡し、その間に Depth を圧縮する
+		{
+			std::lock_guard<std::mutex> lock(colorMutex);
+			colorJob = frame;
+			colorRequested = true;
+			colorFinished = false;
+		}
+		colorCond.notify_all();
+		cv::Rect depthRect = clipCaptureRect(frame.roi.depthRect, depthWidth, depthHeight);
+		cv::Rect colorRect = clipCaptureRect(frame.roi.colorRect, colorWidth, colorHeight);
+		DepthCodec::encodePredictive(frame.depth.ptr<UINT16>(depthRect.y) + depthRect.x, frame.depth.step1(), depthRect.width, depthRect.height,
+			options.depthQuantStep, depthEncoded);
+		{
+			std::unique_lock<std::mutex> lock(colorMutex);
+			colorCond.wait(lock, [this]() { return colorFinished || stopping; });
+			if (!colorFinished) return false;
+		}
+		double encodeMs = (currentTimestamp() - start) / 10000.0;
+
+		RGBDStreamFrameHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, rgbdStreamFrameMagic, sizeof(header.magic));
+		header.depthSize = (uint32_t)depthEncoded.size();
+		header.colorSize = (uint32_t)colorEncoded.size();
+		header.encodeMs = (float)encodeMs;
+		header.number = frame.number;
+		header.colorTimestamp = frame.colorTimestamp;
+		header.depthTimestamp = frame.depthTimestamp;
+		header.pushTimestamp = pending.pushTimestamp;
+		int32_t d[4] = { depthRect.x, depthRect.y, depthRect.width, depthRect.height };
+		int32_t c[4] = { colorRect.x, colorRect.y, colorRect.width, colorRect.height };
+		memcpy(header.depthRect, d, sizeof(d));
+		memcpy(header.colorRect, c, sizeof(c));
+		header.minDepth = frame.roi.minDepth;
+		header.maxDepth = frame.roi.maxDepth;
+		header.flags = options.halfColor ? RGBDStreamHalfColor : 0;
+
+		// 1回の send で送る (TCP_NODELAY なので小さく分けるとパケットが増える)
+		packet.resize(sizeof(header) + depthEncoded.size() + colorEncoded.size());
+		memcpy(&packet[0], &header, sizeof(header));
+		if (!depthEncoded.empty()) memcpy(&packet[sizeof(header)], &depthEncoded[0], depthEncoded.size());
+		if (!colorEncoded.empty()) memcpy(&packet[sizeof(header) + depthEncoded.size()], &colorEncoded[0], colorEncoded.size());
+		if (!client.sendAll(&packet[0], packet.size())) return false;
+
+		INT64 now = currentTimestamp();
+		std::lock_guard<std::mutex> lock(statsMutex);
+		if (counters.sent == 0) firstSent = now;
+		lastSent = now;
+		counters.sent++;
+		counters.depthBytes += depthEncoded.size();
+		counters.colorBytes += colorEncoded.size();
+		encodeSum += encodeMs;
+		counters.maxEncodeMs = (std::max)(counters.maxEncodeMs, encodeMs);
+		inFlight++;
+		return true;
+	}
+
+	void run() {
+		while (!stopping) {
+			if (!connected) {
+				{
+					std::lock_guard<std::mutex> lock(clientMutex);
+					if (!listener.accept(client, 100)) continue;
+				}
+				if (!client.sendAll(&hello[0], hello.size())) {
+					closeClient();
+					continue;
+				}
+				inFlight = 0;
+				{
+					std::lock_guard<std::mutex> lock(statsMutex);
+					counters.connections++;
+				}
+				Pending old;
+				while (queue.tryPop(old)) {} // 接続前のフレームは送らない
+				connected = true;
+				continue;
+			}
+
+			// 返事を待っているフレームが上限なら、返事が来るまで送らない (その間のフレームはキューで新しいものに置き換わる)
+			if (!receiveAcks(inFlight >= options.maxInFlight ? 10 : 0)) {
+				closeClient();
+				continue;
+			}
+			if (inFlight >= options.maxInFlight) continue;
+
+			// 一番新しいフレームだけを送る
+			Pending pending;
+			if (!queue.pop(pending, 10)) continue;
+			Pending newer;
+			unsigned long long superseded = 0;
+			while (queue.tryPop(newer)) {
+				pending = newer;
+				superseded++;
+			}
+			bool stale = currentTimestamp() - pending.pushTimestamp > (INT64)options.maxFrameAgeMs * 10000;
+			{
+				std::lock_guard<std::mutex> lock(statsMutex);
+				counters.superseded += superseded;
+				if (stale) counters.stale++;
+			}
+			if (stale) continue;
+			if (!sendFrame(pending)) closeClient();
+		}
+	}
+
+public:
+	RGBDStreamServer() : connected(false), stopping(false), queue(1, FrameQueueDropOldest) {
+	}
+
+	~RGBDStreamServer() {
+		close();
+	}
+
+	// port で接続を待ち始める (失敗したら std::runtime_error を投げる)
+	// calibration は接続したクライアントに渡す位置合わせのパラメータ (無効なら渡さない)
+	// hostClock は取得元のタイムスタンプが currentTimestamp() と同じ時計か (同じ PC のクライアントが遅延を測れる)
+	void open(int port, int depthWidth, int depthHeight, int colorWidth, int colorHeight, UINT16 minDepthReliable, UINT16 maxDepthReliable,
+		const KinectCalibration &calibration, bool hostClock, const RGBDStreamOptions &streamOptions = RGBDStreamOptions()) {
+		close();
+		this->depthWidth = depthWidth;
+		this->depthHeight = depthHeight;
+		this->colorWidth = colorWidth;
+		this->colorHeight = colorHeight;
+		options = streamOptions;
+		options.maxInFlight = (std::max)(options.maxInFlight, 1);
+
+		std::vector<BYTE> calibrationData;
+		if (calibration.isValid()) serializeKinectCalibration(calibration, calibrationData);
+		RGBDStreamHello h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, rgbdStreamMagic, sizeof(h.magic));
+		h.depthWidth = depthWidth;
+		h.depthHeight = depthHeight;
+		h.colorWidth = colorWidth;
+		h.colorHeight = colorHeight;
+		h.minDepthReliableDistance = minDepthReliable;
+		h.maxDepthReliableDistance = maxDepthReliable;
+		h.hostClock = hostClock ? 1 : 0;
+		h.calibrationSize = (uint32_t)calibrationData.size();
+		hello.assign((const BYTE *)&h, (const BYTE *)&h + sizeof(h));
+		hello.insert(hello.end(), calibrationData.begin(), calibrationData.end());
+
+		listener.listen(port);
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			counters = RGBDStreamStats();
+			encodeSum = latencySum = 0;
+		}
+		stopping = false;
+		sender = std::thread(&RGBDStreamServer::run, this);
+		colorThread = std::thread(&RGBDStreamServer::runColor, this);
+	}
+
+	// 送信スレッドを止めて接続を閉じる
+	void close() {
+		if (!sender.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(colorMutex);
+			stopping = true;
+		}
+		colorCond.notify_all();
+		{
+			std::lock_guard<std::mutex> lock(clientMutex);
+			client.shutdown(); // 送信中なら起こす
+		}
+		sender.join();
+		colorThread.join();
+		client.close();
+		listener.close();
+		connected = false;
+		Pending old;
+		while (queue.tryPop(old)) {}
+	}
+
+	bool isOpen() const { return sender.joinable(); }
+
+	// クライアントが接続しているか
+	bool isConnected() const { return connected; }
+
+	// 送るフレームを渡す (コピーしない。送信が追いつかなければ古いものから捨てる)
+	// クライアントが接続していなければ何もしない
+	void push(const RGBDFrame &frame) {
+		if (!connected) return;
+		Pending pending;
+		pending.frame = frame;
+		pending.frame.colorSpace = cv::Mat(); // 対応表は送らない
+		pending.pushTimestamp = currentTimestamp();
+		queue.push(pending);
+	}
+
+	RGBDStreamStats stats() const {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		RGBDStreamStats s = counters;
+		s.superseded += queue.stats().dropped;
+		if (s.sent > 0) s.meanEncodeMs = encodeSum / s.sent;
+		if (s.acked > 0) s.meanLatencyMs = latencySum / s.acked;
+		double sec = (lastSent - firstSent) / 1.0e7;
+		if (s.sent > 1 && sec > 0) s.megabitsPerSecond = (s.depthBytes + s.colorBytes) * 8.0 / sec / 1.0e6 * (s.sent - 1) / s.sent;
+		return s;
+	}
+};
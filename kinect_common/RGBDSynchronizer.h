@@ -0,0 +1,143 @@
+#pragma once
+
+#include <deque>
+
+#include <opencv2/opencv.hpp>
+
+#include "KinectTypes.h"
+#include "RGBDFrame.h"
+
+struct RGBDSyncStats {
+	unsigned long long matched;        // 組にできたフレーム
+	unsigned long long unmatchedColor; // 許容範囲内に相手が無く捨てたRGBフレーム
+	unsigned long long unmatchedDepth; // 許容範囲内に相手が無く捨てたDepthフレーム
+	unsigned long long dropped;        // 組になる前に待ちが溢れて捨てたフレーム (RGBとDepthの合計)
+	INT64 maxSkew;                     // 組にしたフレームの時刻差の最大 [100ns]
+	double meanSkew;                   // 組にしたフレームの時刻差の平均 [100ns]
+};
+
+// RGBフレームとDepthフレームをタイムスタンプが一番近いもの同士で組にする
+// 時刻差が tolerance を超える組は作らない。相手が見つからないフレームは捨てて数える
+// フレームはハンドル (cv::Mat) のまま待たせるのでコピーしない
+// タイムスタンプはストリームごとに増えていくこと
+class RGBDSynchronizer {
+private:
+	struct Pending {
+		cv::Mat image;
+		INT64 timestamp;
+	};
+
+	std::deque<Pending> colors;
+	std::deque<Pending> depths;
+	INT64 lastColor = -1; // 最後に来たフレームの時刻
+	INT64 lastDepth = -1;
+	INT64 colorPeriod = 0; // フレーム間隔 (直前の2フレームから求める。不明なら0)
+	INT64 depthPeriod = 0;
+	INT64 tolerance;
+	size_t maxPending;
+
+	RGBDSyncStats counters;
+	double skewSum = 0;
+
+	static INT64 distance(INT64 a, INT64 b) { return (a > b) ? a - b : b - a; }
+
+	void push(std::deque<Pending> &queue, const cv::Mat &image, INT64 timestamp, INT64 &last, INT64 &period) {
+		period = (last >= 0 && timestamp > last) ? timestamp - last : 0;
+		last = timestamp;
+		if (queue.size() >= maxPending) {
+			queue.pop_front();
+			counters.dropped++;
+		}
+		Pending p;
+		p.image = image;
+		p.timestamp = timestamp;
+		queue.push_back(p);
+	}
+
+public:
+	// tolerance : 組にする時刻差の上限 [100ns] (既定は30fpsの半フレーム)
+	// maxPending : ストリームごとに相手を待たせておくフレーム数
+	explicit RGBDSynchronizer(INT64 tolerance = 10000000LL / 60, size_t maxPending = 3)
+		: tolerance(tolerance), maxPending(maxPending) {
+		reset();
+	}
+
+	void setTolerance(INT64 tolerance) { this->tolerance = tolerance; }
+	INT64 getTolerance() const { return tolerance; }
+
+	void pushColor(const cv::Mat &color, INT64 timestamp) { push(colors, color, timestamp, lastColor, colorPeriod); }
+	void pushDepth(const cv::Mat &depth, INT64 timestamp) { push(depths, depth, timestamp, lastDepth, depthPeriod); }
+
+	// 組にできるRGB-Dフレームがあれば一番古いものを取り出す
+	// (後から来るフレームの方が近い可能性がある間は待つ)
+	bool pop(RGBDFrame &frame) {
+		while (!colors.empty() && !depths.empty()) {
+			const Pending &c = colors.front();
+			const Pending &d = depths.front();
+
+			// 古すぎて、この先どのフレームとも組にならないもの
+			if (c.timestamp < d.timestamp - tolerance) {
+				colors.pop_front();
+				counters.unmatchedColor++;
+				continue;
+			}
+			if (d.timestamp < c.timestamp - tolerance) {
+				depths.pop_front();
+				counters.unmatchedDepth++;
+				continue;
+			}
+
+			// 次のフレームの方が近ければ、先頭は相手がいないものとして捨てる
+			if (depths.size() > 1 && distance(depths[1].timestamp, c.timestamp) < distance(d.timestamp, c.timestamp)) {
+				depths.pop_front();
+				counters.unmatchedDepth++;
+				continue;
+			}
+			if (colors.size() > 1 && distance(colors[1].timestamp, d.timestamp) < distance(c.timestamp, d.timestamp)) {
+				colors.pop_front();
+				counters.unmatchedColor++;
+				continue;
+			}
+
+			// 早い方の次のフレームがまだ来ておらず、それがもっと近いかもしれなければ待つ
+			// (フレーム間隔が分かっていれば、時刻差が間隔の半分以下のときは次のフレームの方が遠いので待たない)
+			if (d.timestamp < c.timestamp && depths.size() == 1 && !(depthPeriod > 0 && 2 * (c.timestamp - d.timestamp) <= depthPeriod)) return false;
+			if (c.timestamp < d.timestamp && colors.size() == 1 && !(colorPeriod > 0 && 2 * (d.timestamp - c.timestamp) <= colorPeriod)) return false;
+
+			INT64 skew = distance(c.timestamp, d.timestamp);
+			frame.color = c.image;
+			frame.depth = d.image;
+			frame.colorTimestamp = c.timestamp;
+			frame.depthTimestamp = d.timestamp;
+			colors.pop_front();
+			depths.pop_front();
+
+			counters.matched++;
+			if (skew > counters.maxSkew) counters.maxSkew = skew;
+			skewSum += (double)skew;
+			return true;
+		}
+		return false;
+	}
+
+	// 待っているフレームだけを捨てる (統計はそのまま。取得の設定を変えたときに古いフレームと組にしないように)
+	void clearPending() {
+		colors.clear();
+		depths.clear();
+	}
+
+	// 待っているフレームを捨てて、統計を0に戻す
+	void reset() {
+		clearPending();
+		lastColor = lastDepth = -1;
+		colorPeriod = depthPeriod = 0;
+		counters = RGBDSyncStats();
+		skewSum = 0;
+	}
+
+	RGBDSyncStats stats() const {
+		RGBDSyncStats s = counters;
+		s.meanSkew = (counters.matched > 0) ? skewSum / counters.matched : 0.0;
+		return s;
+	}
+};
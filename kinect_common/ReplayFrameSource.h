@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "FrameSource.h"
+#include "RGBDRecord.h"
+
+// 連番画像の先読み
+// 次に渡す予定のフレームから capacity フレーム分だけを別のスレッドで展開しておく (メモリに置くのはその分だけ)
+// 先読みが間に合わなかったフレームや、飛ばした先のフレームは get() の中で展開する
+class ImageSequencePrefetcher {
+private:
+	std::function<cv::Mat(int)> load; // n 番目のフレームを展開する (読めなければ空)
+	int count;
+	int capacity;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::map<int, cv::Mat> cache; // 展開済みのフレーム (mutex で保護)
+	int next = 0;                 // 次に渡す予定のフレーム
+	bool stopping = false;
+	std::thread worker;
+
+	// 先読みの範囲 (next から capacity フレーム) の外のフレームを捨てる
+	void evict() {
+		for (auto it = cache.begin(); it != cache.end();) {
+			if ((it->first - next + count) % count >= capacity) it = cache.erase(it);
+			else ++it;
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!stopping) {
+			int target = -1;
+			for (int k = 0; k < capacity && target < 0; k++) {
+				int n = (next + k) % count;
+				if (cache.find(n) == cache.end()) target = n;
+			}
+			if (target < 0) {
+				wake.wait(lock);
+				continue;
+			}
+			lock.unlock();
+			cv::Mat img = load(target);
+			lock.lock();
+			cache[target] = img;
+			evict(); // 展開している間に next が進んでいれば捨てる
+		}
+	}
+
+public:
+	ImageSequencePrefetcher(std::function<cv::Mat(int)> load, int count, int capacity)
+		: load(load), count(count), capacity((std::max)((std::min)(capacity, count), 1)) {
+		worker = std::thread(&ImageSequencePrefetcher::run, this);
+	}
+
+	~ImageSequencePrefetcher() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	ImageSequencePrefetcher(const ImageSequencePrefetcher &) = delete;
+	ImageSequencePrefetcher &operator=(const ImageSequencePrefetcher &) = delete;
+
+	// index 番目のフレーム (読めなければ空)。以降は index の次のフレームから先読みする
+	cv::Mat get(int index) {
+		cv::Mat img;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = cache.find(index);
+			if (it != cache.end()) img = it->second;
+			next = (index + 1) % count;
+			evict();
+		}
+		wake.notify_one();
+		if (img.empty()) img = load(index);
+		return img;
+	}
+};
+
+// 記録したフレームを再生する FrameSource
+// 次のどちらかを読み込む
+//   記録ファイル (.krgbd, RGBDRecordWriter で保存したもの)
+//     メモリマップして必要なフレームだけを展開する。記録時のタイムスタンプの間隔で再生する
+//   ディレクトリ内の連番画像 (cv::imwrite で保存したもの)
+//     color_000000.png ... : 1920x1080 の BGRA (または BGR)
+//     depth_000000.png ... : 512x424 の 16bit Depth [mm]
+//     画像デコードが再生速度に影響しないよう、次に渡すフレームから数フレームを別のスレッドで先に展開しておく
+class ReplayFrameSource : public FrameSource {
+private:
+	std::string path;
+	double fps;    // 連番画像の再生フレームレート (0以下ならどちらの形式もできるだけ速く)
+	bool loop;     // 最後まで再生したら先頭に戻る
+	int maxFrames; // 連番画像を読み込む最大フレーム数 (0なら全て)
+
+	// 記録ファイル
+	RGBDRecordReader record;
+	bool useRecord = false;
+
+	// 連番画像 (フレーム数は open() でファイルを数えるだけで、展開は先読みのスレッドで行う)
+	static const int prefetchFrames = 4; // ストリームごとに先読みするフレーム数 (BGRA の 1920x1080 なら 8MB/フレーム)
+	int colorFrameCount = 0;
+	int depthFrameCount = 0;
+	std::unique_ptr<ImageSequencePrefetcher> colorPrefetch;
+	std::unique_ptr<ImageSequencePrefetcher> depthPrefetch;
+
+	std::chrono::steady_clock::time_point startTime;
+	long long colorFrameIndex = -1; // 最後に渡したフレームの番号
+	long long depthFrameIndex = -1;
+
+	// 今の時刻に対応するフレーム番号
+	long long currentFrame(long long lastIndex) const {
+		if (fps <= 0) return lastIndex + 1; // 呼ばれるたびに次のフレームへ
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		if (!useRecord) return (long long)(elapsed * fps);
+
+		// 記録時のタイムスタンプから経過時間に対応するフレームを探す
+		size_t count = record.frameCount();
+		INT64 first = record.timestamp(0);
+		INT64 length = recordLength();
+		INT64 t = (INT64)(elapsed * 10000000.0);
+		long long lap = t / length;
+		t = first + t % length;
+		size_t lo = 0, hi = count;
+		while (hi - lo > 1) { // t 以前で最後のフレーム
+			size_t mid = (lo + hi) / 2;
+			if (record.timestamp(mid) <= t) lo = mid;
+			else hi = mid;
+		}
+		return lap * (long long)count + (long long)lo;
+	}
+
+	// 記録ファイルの1周の長さ [100ns] (最後のフレームも1フレーム分表示する)
+	INT64 recordLength() const {
+		return record.timestamp(record.frameCount() - 1) - record.timestamp(0) + 10000000LL / 30;
+	}
+
+	// 通し番号 n (何周目かを含む) のフレームのタイムスタンプ [100ns]
+	// 記録ファイルは記録時の時刻に周回分を足し、連番画像は fps (0以下なら30) の間隔とする
+	INT64 frameTimestamp(long long n) const {
+		if (useRecord) {
+			long long count = (long long)record.frameCount();
+			return record.timestamp((size_t)(n % count)) + (n / count) * recordLength();
+		}
+		return (INT64)(n * 10000000.0 / ((fps > 0) ? fps : 30.0));
+	}
+
+	// 通し番号 n のフレームを渡す時刻
+	std::chrono::steady_clock::time_point frameTime(long long n) const {
+		INT64 t = frameTimestamp(n) - (useRecord ? record.timestamp(0) : 0);
+		return startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<INT64, std::ratio<1, 10000000>>(t));
+	}
+
+	// 次に渡すフレームを決める (新しいフレームが無ければ -1)
+	long long nextFrame(long long &lastIndex, size_t count) {
+		if (count == 0) return -1;
+		long long n = currentFrame(lastIndex);
+		if (n <= lastIndex) return -1;
+		if (!loop && n >= (long long)count) return -1;
+		lastIndex = n;
+		return n % (long long)count;
+	}
+
+	static std::string framePath(const std::string &directory, const char *prefix, int index) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s_%06d.png", prefix, index);
+		return directory + "/" + name;
+	}
+
+	void openRecord(int streams) {
+		record.open(path);
+		if (record.frameCount() == 0) throw std::runtime_error("no frames in " + path);
+		useRecord = true;
+		if (streams & Color) {
+			colorWidth = record.colorWidth();
+			colorHeight = record.colorHeight();
+			colorBytesPerPixel = 4;
+		}
+		if (streams & Depth) {
+			depthWidth = record.depthWidth();
+			depthHeight = record.depthHeight();
+		}
+	}
+
+	static bool fileExists(const std::string &file) {
+		FILE *fp = openRecordFile(file, "rb");
+		if (fp == nullptr) return false;
+		fclose(fp);
+		return true;
+	}
+
+	// 0番から続いている連番画像の数 (最大 maxFrames)
+	int countFrames(const char *prefix) const {
+		int n = 0;
+		while ((maxFrames <= 0 || n < maxFrames) && fileExists(framePath(path, prefix, n))) n++;
+		return n;
+	}
+
+	// n 番目のRGB画像を BGRA で読む (読めないか形式が違えば空)
+	cv::Mat loadColor(int n) const {
+		cv::Mat img = cv::imread(framePath(path, "color", n), cv::IMREAD_UNCHANGED);
+		if (!img.empty() && img.channels() == 3) cv::cvtColor(img, img, cv::COLOR_BGR2BGRA);
+		if (img.type() != CV_8UC4 || img.cols != colorWidth || img.rows != colorHeight) return cv::Mat();
+		return img;
+	}
+
+	// n 番目のDepth画像を読む (読めないか形式が違えば空)
+	cv::Mat loadDepth(int n) const {
+		cv::Mat img = cv::imread(framePath(path, "depth", n), cv::IMREAD_UNCHANGED);
+		if (img.type() != CV_16UC1 || img.cols != depthWidth || img.rows != depthHeight) return cv::Mat();
+		return img;
+	}
+
+	// 先頭のフレームだけを読んで大きさと形式を確かめ、残りは先読みのスレッドに任せる
+	void openImageSequence(int streams) {
+		if (streams & Color) colorFrameCount = countFrames("color");
+		if (streams & Depth) depthFrameCount = countFrames("depth");
+		if (colorFrameCount == 0 && depthFrameCount == 0) throw std::runtime_error("no frames in " + path);
+		if (colorFrameCount > 0) {
+			cv::Mat img = cv::imread(framePath(path, "color", 0), cv::IMREAD_UNCHANGED);
+			if (!img.empty() && img.channels() == 3) cv::cvtColor(img, img, cv::COLOR_BGR2BGRA);
+			if (img.type() != CV_8UC4) throw std::runtime_error("color image must be 8bit BGRA: " + framePath(path, "color", 0));
+			colorWidth = img.cols;
+			colorHeight = img.rows;
+			colorBytesPerPixel = 4;
+			colorPrefetch.reset(new ImageSequencePrefetcher([this](int n) { return loadColor(n); }, colorFrameCount, prefetchFrames));
+		}
+		if (depthFrameCount > 0) {
+			cv::Mat img = cv::imread(framePath(path, "depth", 0), cv::IMREAD_UNCHANGED);
+			if (img.type() != CV_16UC1) throw std::runtime_error("depth image must be 16bit: " + framePath(path, "depth", 0));
+			depthWidth = img.cols;
+			depthHeight = img.rows;
+			depthPrefetch.reset(new ImageSequencePrefetcher([this](int n) { return loadDepth(n); }, depthFrameCount, prefetchFrames));
+		}
+	}
+
+	// 位置合わせパラメータのファイル (記録ファイルなら同じ名前に .kcalib を付けたもの、連番画像ならディレクトリ内の calibration.kcalib)
+	std::string calibrationPath() const {
+		if (useRecord) return path + ".kcalib";
+		return path + "/calibration.kcalib";
+	}
+
+public:
+	// path は記録ファイルまたは連番画像のディレクトリ
+	ReplayFrameSource(const std::string &path, double fps = 30.0, bool loop = true, int maxFrames = 0)
+		: path(path), fps(fps), loop(loop), maxFrames(maxFrames) {
+	}
+
+	void open(int streams) {
+		if (RGBDRecordReader::isRecordFile(path)) openRecord(streams);
+		else openImageSequence(streams);
+
+		// Kinect v2 の仕様値
+		minDepthReliableDistance = 500;
+		maxDepthReliableDistance = 4500;
+
+		startTime = std::chrono::steady_clock::now();
+	}
+
+	bool acquireColorFrame(BYTE *buffer, size_t size) {
+		if (colorWidth == 0) return false;
+		long long n = nextFrame(colorFrameIndex, useRecord ? record.frameCount() : (size_t)colorFrameCount);
+		if (n < 0) return false;
+		colorTimestamp = frameTimestamp(colorFrameIndex);
+		if (useRecord) {
+			if (size < colorBufferSize()) return false;
+			return record.readColor((size_t)n, buffer);
+		}
+		cv::Mat frame = colorPrefetch->get((int)n);
+		if (frame.empty()) return false;
+		memcpy(buffer, frame.data, (std::min)(size, frame.total() * frame.elemSize()));
+		return true;
+	}
+
+	// ROI の行だけをコピーする (JPEG で記録したファイルはフレーム全体を展開する)
+	bool acquireColorFrameRows(BYTE *buffer, size_t size, int rowBegin, int rowEnd) {
+		if (colorWidth == 0) return false;
+		long long n = nextFrame(colorFrameIndex, useRecord ? record.frameCount() : (size_t)colorFrameCount);
+		if (n < 0) return false;
+		colorTimestamp = frameTimestamp(colorFrameIndex);
+		if (useRecord) {
+			if (size < colorBufferSize()) return false;
+			return record.readColorRows((size_t)n, buffer, rowBegin, rowEnd);
+		}
+		cv::Mat frame = colorPrefetch->get((int)n);
+		if (frame.empty()) return false;
+		size_t frameSize = frame.total() * frame.elemSize();
+		size_t stride = (size_t)colorWidth * colorBytesPerPixel;
+		size_t begin = (std::min)((size_t)(std::max)(rowBegin, 0) * stride, frameSize);
+		size_t end = (std::min)((std::min)((size_t)(std::max)(rowEnd, 0) * stride, frameSize), size);
+		if (end > begin) memcpy(buffer + begin, frame.data + begin, end - begin);
+		return true;
+	}
+
+	bool acquireDepthFrame(UINT16 *buffer, size_t size) {
+		if (depthWidth == 0) return false;
+		long long n = nextFrame(depthFrameIndex, useRecord ? record.frameCount() : (size_t)depthFrameCount);
+		if (n < 0) return false;
+		depthTimestamp = frameTimestamp(depthFrameIndex);
+		if (useRecord) {
+			if (size < depthBufferSize()) return false;
+			return record.readDepth((size_t)n, buffer);
+		}
+		cv::Mat frame = depthPrefetch->get((int)n);
+		if (frame.empty()) return false;
+		memcpy(buffer, frame.data, (std::min)(size, frame.total()) * sizeof(UINT16));
+		return true;
+	}
+
+	// 次のフレームを渡す時刻まで眠る (再生fps が0以下なら待たない)
+	bool waitForFrame(int streams, int timeoutMs) {
+		if (fps <= 0) return true;
+		auto now = std::chrono::steady_clock::now();
+		auto deadline = now + std::chrono::milliseconds(timeoutMs);
+		auto due = deadline;
+		if ((streams & Color) && colorWidth > 0) due = (std::min)(due, frameTime(colorFrameIndex + 1));
+		if ((streams & Depth) && depthWidth > 0) due = (std::min)(due, frameTime(depthFrameIndex + 1));
+		if (due > now) std::this_thread::sleep_until(due);
+		return due < deadline;
+	}
+
+	// 記録と一緒に保存した位置合わせパラメータを読む (無ければ false)
+	bool getCalibration(KinectCalibration &calibration) {
+		return loadKinectCalibration(calibrationPath(), calibration);
+	}
+
+	size_t frameCount() const {
+		if (useRecord) return record.frameCount();
+		return (size_t)(std::max)(colorFrameCount, depthFrameCount);
+	}
+
+	// 1フレームを連番画像として保存する (color, depth は空でもよい)
+	static void saveFrame(const std::string &directory, int index, const cv::Mat &color, const cv::Mat &depth) {
+		if (!color.empty()) cv::imwrite(framePath(directory, "color", index), color);
+		if (!depth.empty()) cv::imwrite(framePath(directory, "depth", index), depth);
+	}
+};
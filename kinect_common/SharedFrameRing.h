@@ -0,0 +1,552 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "CaptureROI.h"
+#include "FrameSource.h"
+#include "KinectTypes.h"
+#include "RGBDFrame.h"
+
+// 共有メモリのリングで、組にしたRGB-Dフレームを同じ PC の複数のプロセスに渡す
+//   [ヘッダ (SharedFrameRingHeader)] [スロット0] [スロット1] ...
+//   スロット : [SharedFrameSlotHeader] [Depth (CV_16UC1)] [RGB (CV_8UC4 か CV_8UC2)]
+// 書き込み側 (SharedFramePublisher) は1つで、フレームごとに次のスロットへ ROI の窓の部分だけを書き込む
+// 読み込み側 (SharedFrameReader) はいくつあってもよく、スロットを指す Mat をコピーせずに使う
+//
+// スロットの sequence は seqlock になっていて、n 番目 (1から) のフレームを書いている間は 2n-1、書き終わると 2n になる
+// 書き込み側は読み込み側を一切待たない (ロックも参照カウントも無い) ので、遅い読み込み側はフレームを取りこぼすだけで済む
+// 読み込み側はスロットの数のフレーム時間のうちに使い終わり、isValid() で使っている間に上書きされなかったかを確かめる
+//
+// 名前に / か \ が含まれていればそのパスのファイルを、無ければ名前付きの共有メモリを使う
+// (Windows は "Local\名前" のファイルマッピング、それ以外は shm_open("/名前"))
+// 新しいフレームの通知は Linux なら futex、Windows なら読み込み側ごとの名前付きイベント、それ以外は短い間隔の確認
+
+static const char sharedFrameRingMagic[8] = { 'K', 'S', 'H', 'M', 'R', 'N', 'G', '1' };
+static const int sharedFrameRingMaxReaders = 16;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared memory needs lock-free atomics");
+
+struct SharedFrameRingHeader {
+	char magic[8];            // 初期化が終わってから書く (読み込み側は magic で書き込み側の準備ができたかを判断する)
+	uint32_t headerSize;
+	uint32_t slotCount;
+	int32_t depthWidth;
+	int32_t depthHeight;
+	int32_t colorWidth;
+	int32_t colorHeight;
+	int32_t colorFormat;      // FrameSource::ColorFormat
+	int32_t colorBytesPerPixel;
+	uint64_t slotSize;        // スロットの間隔 [byte]
+	uint64_t slotsOffset;     // スロット0の位置 [byte]
+	uint64_t depthOffset;     // スロットの中の Depth の位置 [byte]
+	uint64_t colorOffset;     // スロットの中の RGB の位置 [byte]
+	std::atomic<uint64_t> published; // 書き終わったフレームの数 (最新のフレームは (published - 1) % slotCount 番目のスロット)
+	std::atomic<uint32_t> wake;      // フレームを書くたびに増やす (futex で待つ値)
+	std::atomic<uint32_t> waiters;   // 待っている読み込み側の数
+	std::atomic<uint32_t> closed;    // 書き込み側が閉じたら 1
+	std::atomic<uint32_t> readers[sharedFrameRingMaxReaders]; // 読み込み側の登録 (使用中なら 1。Windows の通知用のイベントの番号)
+};
+
+struct SharedFrameSlotHeader {
+	std::atomic<uint64_t> sequence;
+	int64_t number;           // RGBDFrame::number
+	INT64 colorTimestamp;
+	INT64 depthTimestamp;
+	INT64 publishTimestamp;   // 書き込んだ時刻 (currentTimestamp()、同じ PC なら他のプロセスでも同じ時計)
+	int32_t depthRect[4];     // x, y, width, height (窓の外のデータは不定)
+	int32_t colorRect[4];
+	uint16_t minDepth;
+	uint16_t maxDepth;
+};
+
+// 読み込み側が受け取るフレーム (frame の Mat は共有メモリのスロットを指す。読み取り専用)
+struct SharedFrame {
+	RGBDFrame frame;          // colorSpace は空 (位置合わせは受け取った側で行う)
+	uint64_t sequence = 0;    // 何番目 (1から) に書き込まれたフレームか
+	INT64 publishTimestamp = 0;
+	int slot = -1;
+};
+
+// 書き込み側と読み込み側で共通のマッピング
+class SharedFrameMapping {
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+	BYTE *mappedData = nullptr;
+	size_t mappedSize = 0;
+	std::string unlinkName; // 閉じるときに消す名前 (書き込み側で作ったものだけ)
+	bool fileBacked = false;
+
+	static bool isPath(const std::string &name) {
+		return name.find('/') != std::string::npos || name.find('\\') != std::string::npos;
+	}
+
+public:
+	SharedFrameMapping() {}
+	SharedFrameMapping(const SharedFrameMapping &) = delete;
+	SharedFrameMapping &operator=(const SharedFrameMapping &) = delete;
+
+	~SharedFrameMapping() {
+		close();
+	}
+
+	// size > 0 なら作る (既にあれば、Windows はそのまま使い、それ以外は消して作り直す)、0 なら既存のものを開く
+	// 作り直すと、古いものを開いている読み込み側は古い方を見続ける (closed を見て開き直す)
+	// 作ったときは true、既存のものを使ったときは false を返す
+	bool open(const std::string &name, size_t size) {
+		close();
+		fileBacked = isPath(name);
+		bool created = size > 0;
+#ifdef _WIN32
+		if (fileBacked) {
+			file = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+				(size > 0) ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_TEMPORARY, NULL);
+			if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open " + name);
+		}
+		std::string objectName = fileBacked ? std::string() : "Local\\" + name;
+		if (size > 0) {
+			SetLastError(0);
+			mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, fileBacked ? NULL : objectName.c_str());
+			created = fileBacked || GetLastError() != ERROR_ALREADY_EXISTS;
+		} else if (fileBacked) {
+			mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+		} else {
+			mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, objectName.c_str());
+		}
+		if (mapping == NULL) throw std::runtime_error("failed to map " + name);
+		mappedData = (BYTE *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (mappedData == nullptr) throw std::runtime_error("failed to map " + name);
+		MEMORY_BASIC_INFORMATION info;
+		VirtualQuery(mappedData, &info, sizeof(info));
+		mappedSize = (size > 0) ? size : (size_t)info.RegionSize;
+		if (fileBacked && size == 0) {
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize)) throw std::runtime_error("failed to get the size of " + name);
+			mappedSize = (size_t)fileSize.QuadPart;
+		}
+#else
+		std::string path = fileBacked ? name : "/" + name;
+		int fd;
+		if (size > 0) {
+			if (fileBacked) unlink(path.c_str());
+			else shm_unlink(path.c_str());
+			fd = fileBacked ? ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666) : shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+			if (fd < 0) throw std::runtime_error("failed to create " + name);
+			if (ftruncate(fd, (off_t)size) != 0) {
+				::close(fd);
+				throw std::runtime_error("failed to allocate " + name);
+			}
+			unlinkName = path;
+		} else {
+			fd = fileBacked ? ::open(path.c_str(), O_RDWR) : shm_open(path.c_str(), O_RDWR, 0666);
+			if (fd < 0) throw std::runtime_error("failed to open " + name);
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				::close(fd);
+				throw std::runtime_error("failed to get the size of " + name);
+			}
+			size = (size_t)st.st_size;
+		}
+		void *p = (size > 0) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (p == MAP_FAILED) throw std::runtime_error("failed to map " + name);
+		mappedData = (BYTE *)p;
+		mappedSize = size;
+#endif
+		return created;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (mappedData != nullptr) UnmapViewOfFile(mappedData);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (mappedData != nullptr) munmap(mappedData, mappedSize);
+		if (!unlinkName.empty()) {
+			if (fileBacked) unlink(unlinkName.c_str());
+			else shm_unlink(unlinkName.c_str());
+		}
+#endif
+		unlinkName.clear();
+		mappedData = nullptr;
+		mappedSize = 0;
+	}
+
+	BYTE *data() const { return mappedData; }
+	size_t size() const { return mappedSize; }
+};
+
+// 新しいフレームの通知
+// Linux は共有メモリ上の wake を futex で待つ。Windows は読み込み側ごとの自動リセットのイベントを書き込み側が全てシグナルにする
+namespace sharedframe {
+
+#ifdef _WIN32
+inline std::string eventName(const std::string &name, int reader) {
+	std::string safe = name;
+	std::replace(safe.begin(), safe.end(), '\\', '_');
+	std::replace(safe.begin(), safe.end(), '/', '_');
+	std::replace(safe.begin(), safe.end(), ':', '_');
+	return "Local\\" + safe + ".reader" + std::to_string(reader);
+}
+#endif
+
+// wake が expected のままなら最大 timeoutMs 待つ (futex が無ければ 1ms 待つだけ)
+inline void waitWake(std::atomic<uint32_t> &wake, uint32_t expected, int timeoutMs) {
+#if defined(__linux__)
+	struct timespec ts;
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t *)&wake, FUTEX_WAIT, expected, &ts, nullptr, 0); // 他のプロセスと共有するので PRIVATE は付けない
+#else
+	(void)wake;
+	(void)expected;
+	std::this_thread::sleep_for(std::chrono::milliseconds((std::min)(timeoutMs, 1)));
+#endif
+}
+
+inline void wakeAll(std::atomic<uint32_t> &wake) {
+#if defined(__linux__)
+	syscall(SYS_futex, (uint32_t *)&wake, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+	(void)wake;
+#endif
+}
+
+} // namespace sharedframe
+
+// 書き込み側 (1つの共有メモリに1つだけ)
+class SharedFramePublisher {
+private:
+	SharedFrameMapping mapping;
+	SharedFrameRingHeader *header = nullptr;
+	std::string ringName;
+#ifdef _WIN32
+	HANDLE readerEvents[sharedFrameRingMaxReaders] = {};
+#endif
+	unsigned long long publishCount = 0;
+	double publishTimeSum = 0;
+	double publishTimeMax = 0;
+
+	SharedFrameSlotHeader *slotHeader(uint64_t slot) const {
+		return (SharedFrameSlotHeader *)(mapping.data() + header->slotsOffset + slot * header->slotSize);
+	}
+
+	// 窓の行を、スロットの同じ位置に書き込む
+	static void copyRect(const cv::Mat &src, BYTE *dst, size_t dstStep, const cv::Rect &r) {
+		const size_t elem = src.elemSize();
+		for (int j = r.y; j < r.y + r.height; j++) {
+			memcpy(dst + j * dstStep + r.x * elem, src.ptr<BYTE>(j) + r.x * elem, r.width * elem);
+		}
+	}
+
+	void notifyReaders() {
+		header->wake.fetch_add(1, std::memory_order_release);
+#ifdef _WIN32
+		for (int k = 0; k < sharedFrameRingMaxReaders; k++) {
+			if (header->readers[k].load(std::memory_order_acquire) == 0) continue;
+			if (readerEvents[k] == NULL) readerEvents[k] = OpenEventA(EVENT_MODIFY_STATE, FALSE, sharedframe::eventName(ringName, k).c_str());
+			if (readerEvents[k] != NULL) SetEvent(readerEvents[k]);
+		}
+#else
+		if (header->waiters.load(std::memory_order_acquire) > 0) sharedframe::wakeAll(header->wake);
+#endif
+	}
+
+public:
+	~SharedFramePublisher() {
+		close();
+	}
+
+	// 共有メモリを作る (slots はリングのスロット数。読み込み側は slots フレーム分の時間のうちにフレームを使い終わること)
+	// 失敗したら std::runtime_error を投げる
+	void open(const std::string &name, int slots, int depthWidth, int depthHeight, int colorWidth, int colorHeight, FrameSource::ColorFormat colorFormat) {
+		close();
+		const size_t pageSize = 4096;
+		const int colorBytesPerPixel = (colorFormat == FrameSource::ColorYUY2) ? 2 : 4;
+		const size_t headerSize = (sizeof(SharedFrameRingHeader) + pageSize - 1) / pageSize * pageSize;
+		const size_t depthOffset = 128; // スロットのヘッダの後 (SIMD で読めるように 64 バイト境界)
+		const size_t depthSize = ((size_t)depthWidth * depthHeight * 2 + 63) / 64 * 64;
+		const size_t colorOffset = depthOffset + depthSize;
+		const size_t colorSize = (size_t)colorWidth * colorHeight * colorBytesPerPixel;
+		const size_t slotSize = (colorOffset + colorSize + pageSize - 1) / pageSize * pageSize;
+		static_assert(sizeof(SharedFrameSlotHeader) <= 128, "slot header must fit before the depth data");
+
+		bool created = mapping.open(name, headerSize + slotSize * slots);
+		ringName = name;
+		header = (SharedFrameRingHeader *)mapping.data();
+		if (!created) {
+			// Windows で読み込み側が前の共有メモリを開いたままなら、同じ大きさの場合だけ使い続ける (published は続きから数える)
+			if (memcmp(header->magic, sharedFrameRingMagic, sizeof(header->magic)) != 0 || header->slotCount != (uint32_t)slots ||
+				header->depthWidth != depthWidth || header->depthHeight != depthHeight || header->colorWidth != colorWidth ||
+				header->colorHeight != colorHeight || header->colorFormat != (int32_t)colorFormat) {
+				close();
+				throw std::runtime_error("shared memory is in use with a different frame size: " + name);
+			}
+			header->closed.store(0, std::memory_order_release);
+			return;
+		}
+		header->headerSize = (uint32_t)headerSize;
+		header->slotCount = (uint32_t)slots;
+		header->depthWidth = depthWidth;
+		header->depthHeight = depthHeight;
+		header->colorWidth = colorWidth;
+		header->colorHeight = colorHeight;
+		header->colorFormat = (int32_t)colorFormat;
+		header->colorBytesPerPixel = colorBytesPerPixel;
+		header->slotSize = slotSize;
+		header->slotsOffset = headerSize;
+		header->depthOffset = depthOffset;
+		header->colorOffset = colorOffset;
+		header->published.store(0, std::memory_order_relaxed);
+		header->closed.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(header->magic, sharedFrameRingMagic, sizeof(header->magic));
+	}
+
+	void close() {
+		if (header != nullptr) {
+			header->closed.store(1, std::memory_order_release);
+			notifyReaders();
+		}
+#ifdef _WIN32
+		for (int k = 0; k < sharedFrameRingMaxReaders; k++) {
+			if (readerEvents[k] != NULL) CloseHandle(readerEvents[k]);
+			readerEvents[k] = NULL;
+		}
+#endif
+		header = nullptr;
+		mapping.close();
+	}
+
+	bool isOpen() const { return header != nullptr; }
+
+	// フレームを次のスロットに書き込んで読み込み側に知らせる (読み込み側は待たない)
+	// RGBとDepthは frame.roi の窓の部分だけをコピーする。大きさか RGB の形式が違うフレームは書き込まずに false を返す
+	bool publish(const RGBDFrame &frame) {
+		if (header == nullptr) return false;
+		if (frame.depth.rows != header->depthHeight || frame.depth.cols != header->depthWidth || frame.depth.type() != CV_16UC1) return false;
+		if (frame.color.rows != header->colorHeight || frame.color.cols != header->colorWidth || (int)frame.color.elemSize() != header->colorBytesPerPixel) return false;
+		double start = (double)cv::getTickCount();
+
+		const uint64_t n = header->published.load(std::memory_order_relaxed) + 1;
+		SharedFrameSlotHeader *slot = slotHeader((n - 1) % header->slotCount);
+		BYTE *base = (BYTE *)slot;
+		cv::Rect depthRect = clipCaptureRect(frame.roi.depthRect, header->depthWidth, header->depthHeight);
+		cv::Rect colorRect = clipCaptureRect(frame.roi.colorRect, header->colorWidth, header->colorHeight);
+
+		// 書き込み中にする (読み込み側は sequence が奇数か、読む前と後で違えば使わない)
+		slot->sequence.store(n * 2 - 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot->number = frame.number;
+		slot->colorTimestamp = frame.colorTimestamp;
+		slot->depthTimestamp = frame.depthTimestamp;
+		slot->publishTimestamp = currentTimestamp();
+		int32_t d[4] = { depthRect.x, depthRect.y, depthRect.width, depthRect.height };
+		int32_t c[4] = { colorRect.x, colorRect.y, colorRect.width, colorRect.height };
+		memcpy(slot->depthRect, d, sizeof(d));
+		memcpy(slot->colorRect, c, sizeof(c));
+		slot->minDepth = frame.roi.minDepth;
+		slot->maxDepth = frame.roi.maxDepth;
+		copyRect(frame.depth, base + header->depthOffset, (size_t)header->depthWidth * 2, depthRect);
+		copyRect(frame.color, base + header->colorOffset, (size_t)header->colorWidth * header->colorBytesPerPixel, colorRect);
+		slot->sequence.store(n * 2, std::memory_order_release);
+		header->published.store(n, std::memory_order_release);
+		notifyReaders();
+
+		double ms = ((double)cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+		publishCount++;
+		publishTimeSum += ms;
+		publishTimeMax = (std::max)(publishTimeMax, ms);
+		return true;
+	}
+
+	// 登録している読み込み側の数 (異常終了した読み込み側の分も残る)
+	int readerCount() const {
+		int count = 0;
+		for (int k = 0; header != nullptr && k < sharedFrameRingMaxReaders; k++) count += header->readers[k].load(std::memory_order_relaxed) != 0;
+		return count;
+	}
+
+	unsigned long long published() const { return publishCount; }
+	double meanPublishMs() const { return (publishCount > 0) ? publishTimeSum / publishCount : 0; }
+	double maxPublishMs() const { return publishTimeMax; }
+};
+
+// 読み込み側 (プロセスごと、スレッドごとにいくつ開いてもよい)
+class SharedFrameReader {
+private:
+	SharedFrameMapping mapping;
+	SharedFrameRingHeader *header = nullptr;
+	int readerSlot = -1;
+#ifdef _WIN32
+	HANDLE wakeEvent = NULL;
+#endif
+	uint64_t lastSequence = 0;
+	unsigned long long receivedCount = 0;
+	unsigned long long missedCount = 0;
+	unsigned long long tornCount = 0;
+
+	SharedFrameSlotHeader *slotHeader(uint64_t slot) const {
+		return (SharedFrameSlotHeader *)(mapping.data() + header->slotsOffset + slot * header->slotSize);
+	}
+
+public:
+	~SharedFrameReader() {
+		close();
+	}
+
+	// 書き込み側が作った共有メモリを開く (まだ無いか準備中なら std::runtime_error を投げるので、開けるまで繰り返す)
+	// 開いた時点の最新のフレームより後のフレームから受け取る
+	void open(const std::string &name) {
+		close();
+		mapping.open(name, 0);
+		header = (SharedFrameRingHeader *)mapping.data();
+		if (mapping.size() < sizeof(SharedFrameRingHeader) || memcmp(header->magic, sharedFrameRingMagic, sizeof(header->magic)) != 0) {
+			close();
+			throw std::runtime_error("shared frame ring is not ready: " + name);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (mapping.size() < header->slotsOffset + header->slotSize * header->slotCount) {
+			close();
+			throw std::runtime_error("shared frame ring is truncated: " + name);
+		}
+		for (int k = 0; k < sharedFrameRingMaxReaders && readerSlot < 0; k++) {
+			uint32_t expected = 0;
+			if (header->readers[k].compare_exchange_strong(expected, 1)) readerSlot = k;
+		}
+#ifdef _WIN32
+		if (readerSlot >= 0) wakeEvent = CreateEventA(NULL, FALSE, FALSE, sharedframe::eventName(name, readerSlot).c_str());
+#endif
+		lastSequence = header->published.load(std::memory_order_acquire);
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (wakeEvent != NULL) CloseHandle(wakeEvent);
+		wakeEvent = NULL;
+#endif
+		if (header != nullptr && readerSlot >= 0) header->readers[readerSlot].store(0, std::memory_order_release);
+		readerSlot = -1;
+		header = nullptr;
+		mapping.close();
+	}
+
+	bool isOpen() const { return header != nullptr; }
+
+	// 書き込み側が閉じたか (同じ名前で書き込み側が開き直したら、読み込み側も開き直す)
+	bool writerClosed() const { return header == nullptr || header->closed.load(std::memory_order_acquire) != 0; }
+
+	int depthWidth() const { return header->depthWidth; }
+	int depthHeight() const { return header->depthHeight; }
+	int colorWidth() const { return header->colorWidth; }
+	int colorHeight() const { return header->colorHeight; }
+	FrameSource::ColorFormat colorFormat() const { return (FrameSource::ColorFormat)header->colorFormat; }
+	int slotCount() const { return (int)header->slotCount; }
+
+	// まだ受け取っていないフレームが書き込まれるまで最大 timeoutMs 待つ (書き込まれたら true)
+	bool waitFrame(int timeoutMs) {
+		if (header == nullptr) return false;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		for (;;) {
+			uint32_t wake = header->wake.load(std::memory_order_acquire);
+			if (header->published.load(std::memory_order_acquire) > lastSequence) return true;
+			if (header->closed.load(std::memory_order_acquire) != 0) return false;
+			auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remain <= 0) return false;
+#ifdef _WIN32
+			if (wakeEvent != NULL) WaitForSingleObject(wakeEvent, (DWORD)remain);
+			else sharedframe::waitWake(header->wake, wake, (int)remain);
+#else
+			header->waiters.fetch_add(1, std::memory_order_acq_rel);
+			if (header->published.load(std::memory_order_acquire) <= lastSequence) sharedframe::waitWake(header->wake, wake, (int)remain);
+			header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+#endif
+		}
+	}
+
+	// 最新のフレームを受け取る (コピーしない。まだ受け取っていないフレームが無ければ false)
+	// 間に書き込まれたフレームは取りこぼしとして数える。使い終わったら isValid() で上書きされていないことを確かめる
+	bool latest(SharedFrame &shared) {
+		if (header == nullptr) return false;
+		for (int attempt = 0; attempt < 4; attempt++) {
+			uint64_t n = header->published.load(std::memory_order_acquire);
+			if (n <= lastSequence) return false;
+			uint64_t slotIndex = (n - 1) % header->slotCount;
+			SharedFrameSlotHeader *slot = slotHeader(slotIndex);
+			if (slot->sequence.load(std::memory_order_acquire) != n * 2) continue; // 読む前に次の周回で上書きが始まった
+
+			RGBDFrame &frame = shared.frame;
+			frame = RGBDFrame();
+			frame.number = slot->number;
+			frame.colorTimestamp = slot->colorTimestamp;
+			frame.depthTimestamp = slot->depthTimestamp;
+			const int32_t *d = slot->depthRect, *c = slot->colorRect;
+			frame.roi.depthRect = cv::Rect(d[0], d[1], d[2], d[3]);
+			frame.roi.colorRect = cv::Rect(c[0], c[1], c[2], c[3]);
+			frame.roi.minDepth = slot->minDepth;
+			frame.roi.maxDepth = slot->maxDepth;
+			shared.publishTimestamp = slot->publishTimestamp;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot->sequence.load(std::memory_order_relaxed) != n * 2) continue;
+
+			BYTE *base = (BYTE *)slot;
+			frame.depth = cv::Mat(header->depthHeight, header->depthWidth, CV_16UC1, base + header->depthOffset);
+			frame.color = cv::Mat(header->colorHeight, header->colorWidth, (header->colorFormat == FrameSource::ColorYUY2) ? CV_8UC2 : CV_8UC4, base + header->colorOffset);
+			shared.sequence = n;
+			shared.slot = (int)slotIndex;
+			missedCount += n - lastSequence - 1;
+			receivedCount++;
+			lastSequence = n;
+			return true;
+		}
+		return false;
+	}
+
+	// shared を受け取ってから今までに、そのスロットが上書きされていないか (false ならそのフレームで計算した結果は捨てる)
+	bool isValid(const SharedFrame &shared) {
+		if (header == nullptr || shared.slot < 0) return false;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slotHeader(shared.slot)->sequence.load(std::memory_order_relaxed) == shared.sequence * 2) return true;
+		tornCount++;
+		return false;
+	}
+
+	// 受け取ったフレーム、取りこぼしたフレーム、使っている間に上書きされたフレームの数
+	unsigned long long received() const { return receivedCount; }
+	unsigned long long missed() const { return missedCount; }
+	unsigned long long torn() const { return tornCount; }
+};
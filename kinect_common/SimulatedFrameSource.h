@@ -0,0 +1,217 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ColorConvert.h"
+#include "FrameSource.h"
+
+// Kinect の代わりに合成したフレームを一定の間隔で届ける FrameSource (Kinect が無い環境で遅延や処理速度を測る用)
+// 別のスレッドが fps の間隔でフレームを作り、届いた瞬間に waitForFrame() で待っている側を起こす
+// タイムスタンプは届いた時刻 (currentTimestamp()) なので、届いてから処理するまでの遅延を測れる
+//   Depth : 奥の壁の前を円盤が左右に往復する
+//   RGB   : 円盤とほぼ同じ位置を四角が往復する (preferColorFormat(ColorYUY2) なら Kinect と同じく YUY2 で作る)
+class SimulatedFrameSource : public FrameSource {
+private:
+	double fps;
+	int openedStreams = 0;
+
+	std::thread producer;
+	std::mutex mutex;
+	std::condition_variable arrived;
+	bool stopping = false;
+
+	// 最新のフレーム (mutex で保護)
+	std::vector<BYTE> color;
+	std::vector<UINT16> depth;
+	unsigned long long colorSequence = 0; // 届いたフレームの番号
+	unsigned long long depthSequence = 0;
+	unsigned long long colorTaken = 0;    // 最後に取得したフレームの番号
+	unsigned long long depthTaken = 0;
+	INT64 colorArrival = 0;
+	INT64 depthArrival = 0;
+
+	// 作成中のフレーム (生成スレッドだけが使う)
+	std::vector<BYTE> colorBack;
+	std::vector<UINT16> depthBack;
+
+	// n 番目のフレームの円盤の中心 (Depth座標)
+	void objectPosition(long long n, int &x, int &y) const {
+		const double pi = 3.14159265358979;
+		x = (int)(kinectDepthWidth / 2 + kinectDepthWidth / 3 * std::sin(2 * pi * n / 90.0));
+		y = kinectDepthHeight / 2;
+	}
+
+	void renderDepth(long long n) {
+		int cx, cy;
+		objectPosition(n, cx, cy);
+		const int radius = 60;
+		for (int j = 0; j < depthHeight; j++) {
+			UINT16 *row = &depthBack[(size_t)j * depthWidth];
+			for (int i = 0; i < depthWidth; i++) {
+				int dx = i - cx, dy = j - cy;
+				int r2 = dx * dx + dy * dy;
+				if (i < 10) row[i] = 0; // 無効画素
+				else if (r2 < radius * radius) row[i] = (UINT16)(900 + r2 / 50);
+				else row[i] = (UINT16)(2500 + i);
+			}
+		}
+	}
+
+	void renderColor(long long n) {
+		int cx, cy;
+		objectPosition(n, cx, cy);
+		int x0 = (cx - 60) * colorWidth / kinectDepthWidth, x1 = (cx + 60) * colorWidth / kinectDepthWidth;
+		int y0 = (cy - 60) * colorHeight / kinectDepthHeight, y1 = (cy + 60) * colorHeight / kinectDepthHeight;
+		size_t stride = (size_t)colorWidth * colorBytesPerPixel;
+		if (colorFormat == ColorYUY2) {
+			BYTE boxY, boxU, boxV;
+			bgrToYUV(40, 40, 220, boxY, boxU, boxV);
+			for (int j = 0; j < colorHeight; j++) {
+				BYTE *row = &colorBack[j * stride];
+				BYTE y, u, v;
+				int gray = 64 + j * 128 / colorHeight;
+				bgrToYUV(gray, gray, gray, y, u, v);
+				for (int i = 0; i < colorWidth; i += 2) {
+					row[i * 2 + 0] = y;
+					row[i * 2 + 1] = u;
+					row[i * 2 + 2] = y;
+					row[i * 2 + 3] = v;
+				}
+				if (j < y0 || j >= y1) continue;
+				for (int i = (std::max)(x0, 0) & ~1; i < (std::min)(x1, colorWidth); i += 2) {
+					row[i * 2 + 0] = row[i * 2 + 2] = boxY;
+					row[i * 2 + 1] = boxU;
+					row[i * 2 + 3] = boxV;
+				}
+			}
+			return;
+		}
+		for (int j = 0; j < colorHeight; j++) {
+			BYTE *row = &colorBack[j * stride];
+			memset(row, 64 + j * 128 / colorHeight, stride); // 縦方向のグラデーション
+			if (j < y0 || j >= y1) continue;
+			for (int i = (std::max)(x0, 0); i < (std::min)(x1, colorWidth); i++) {
+				row[i * colorBytesPerPixel + 0] = 40;
+				row[i * colorBytesPerPixel + 1] = 40;
+				row[i * colorBytesPerPixel + 2] = 220;
+			}
+		}
+	}
+
+	void run() {
+		auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+		auto next = std::chrono::steady_clock::now();
+		for (long long n = 0;; n++) {
+			// 次の時刻までにフレームを作っておき、時刻になったら届ける
+			if (openedStreams & Color) renderColor(n);
+			if (openedStreams & Depth) renderDepth(n);
+			next += period;
+
+			std::unique_lock<std::mutex> lock(mutex);
+			if (arrived.wait_until(lock, next, [this]() { return stopping; })) return;
+			INT64 now = currentTimestamp();
+			if (openedStreams & Color) {
+				color.swap(colorBack);
+				colorSequence++;
+				colorArrival = now;
+			}
+			if (openedStreams & Depth) {
+				depth.swap(depthBack);
+				depthSequence++;
+				depthArrival = now;
+			}
+			lock.unlock();
+			arrived.notify_all();
+		}
+	}
+
+	bool hasNewFrame(int requested) const {
+		return ((requested & Color) && colorSequence != colorTaken) || ((requested & Depth) && depthSequence != depthTaken);
+	}
+
+public:
+	explicit SimulatedFrameSource(double fps = 30.0) : fps(fps > 0 ? fps : 30.0) {
+		hostClock = true;
+	}
+
+	~SimulatedFrameSource() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		arrived.notify_all();
+		if (producer.joinable()) producer.join();
+	}
+
+	void open(int streams) {
+		openedStreams = streams;
+		if (streams & Color) {
+			colorWidth = kinectColorWidth;
+			colorHeight = kinectColorHeight;
+			colorFormat = requestedColorFormat;
+			colorBytesPerPixel = (colorFormat == ColorYUY2) ? 2 : kinectColorBytesPerPixel;
+			color.assign(colorBufferSize(), 0);
+			colorBack.assign(colorBufferSize(), 0);
+		}
+		if (streams & Depth) {
+			depthWidth = kinectDepthWidth;
+			depthHeight = kinectDepthHeight;
+			depth.assign(depthBufferSize(), 0);
+			depthBack.assign(depthBufferSize(), 0);
+		}
+		// Kinect v2 の仕様値
+		minDepthReliableDistance = 500;
+		maxDepthReliableDistance = 4500;
+
+		producer = std::thread(&SimulatedFrameSource::run, this);
+	}
+
+	bool acquireColorFrame(BYTE *buffer, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (colorSequence == colorTaken) return false;
+		memcpy(buffer, &color[0], (std::min)(size, color.size()));
+		colorTaken = colorSequence;
+		colorTimestamp = colorArrival;
+		return true;
+	}
+
+	// ROI の行だけをコピーする
+	bool acquireColorFrameRows(BYTE *buffer, size_t size, int rowBegin, int rowEnd) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (colorSequence == colorTaken) return false;
+		size_t stride = (size_t)colorWidth * colorBytesPerPixel;
+		size_t begin = (std::min)((size_t)(std::max)(rowBegin, 0) * stride, color.size());
+		size_t end = (std::min)((std::min)((size_t)(std::max)(rowEnd, 0) * stride, color.size()), size);
+		if (end > begin) memcpy(buffer + begin, &color[begin], end - begin);
+		colorTaken = colorSequence;
+		colorTimestamp = colorArrival;
+		return true;
+	}
+
+	bool acquireDepthFrame(UINT16 *buffer, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (depthSequence == depthTaken) return false;
+		memcpy(buffer, &depth[0], (std::min)(size, depth.size()) * sizeof(UINT16));
+		depthTaken = depthSequence;
+		depthTimestamp = depthArrival;
+		return true;
+	}
+
+	// 合成フレームには本体の値が無いので Kinect v2 の代表値を使う
+	bool getCalibration(KinectCalibration &calibration) {
+		calibration = defaultKinectCalibration();
+		return true;
+	}
+
+	// 新しいフレームが届くまで待つ (届いた瞬間に起きる)
+	bool waitForFrame(int streams, int timeoutMs) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() { return stopping || hasNewFrame(streams); }) && !stopping;
+	}
+};
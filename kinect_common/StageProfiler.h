@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// 処理段ごとの時間の計測 (フレームが遅れたときに、取得・コピー・位置合わせ・変換・表示のどこに時間がかかっているかを調べる)
+//
+//   KINECT_PROFILE_SCOPE("acquire color");  // この行からスコープの終わりまでを "acquire color" の段として計る
+//   KINECT_PROFILE_FRAME(frame.number);      // このスレッドで以降に計る区間をそのフレームのものとして記録する (トレース用)
+//   KINECT_PROFILE_THREAD("capture");         // トレースに表示するこのスレッドの名前
+//
+// KINECT_PROFILE を定義してビルドしたときだけ計測し、定義しなければマクロは何も生成しない (StageProfiler の集計と表示は空になる)
+// 計った時間はスレッドごとのヒストグラム (対数の階級) に入れる。書き込むのはそのスレッドだけなので、ロックも不可分な加算も使わない
+// 表示側は全スレッドのヒストグラムを足して、段ごとの回数、平均、p50、p99、最大を出す (printInterval() は前回からの分)
+// setTracing() で区間の記録も有効にすると、writeChromeTrace() で Chrome の chrome://tracing や Perfetto で開ける JSON を書き出す
+// 1区間の計測は時計の読み出し2回とヒストグラムの更新だけで、1フレームに数十の区間を計っても 1% よりずっと小さい (kinect_bench の profiler で計測できる)
+
+// 計った時間を入れる階級 [ns] (2倍ごとに4つに分ける。階級の幅は値の 1/4 以下)
+struct ProfileBuckets {
+	static const int count = 160; // 0ns ～ 約 2^40ns (18分)
+
+	static int index(uint64_t ns) {
+		if (ns < 4) return (int)ns;
+		int msb = 0;
+		for (int shift = 32; shift > 0; shift >>= 1) {
+			if (ns >> (msb + shift)) msb += shift;
+		}
+		int bucket = (msb - 1) * 4 + (int)((ns >> (msb - 2)) & 3);
+		return (std::min)(bucket, count - 1);
+	}
+
+	// 階級の上限 [ns]
+	static uint64_t upper(int bucket) {
+		if (bucket < 4) return (uint64_t)bucket;
+		int msb = bucket / 4 + 1, sub = bucket % 4;
+		return ((uint64_t)(4 + sub + 1) << (msb - 2)) - 1;
+	}
+};
+
+// 段ごとの集計 (全スレッドの合計)
+struct ProfileStageStats {
+	std::string name;
+	uint64_t count = 0;
+	uint64_t totalNs = 0;
+	uint64_t maxNs = 0;
+	std::vector<uint64_t> buckets;
+
+	double meanMs() const { return count ? totalNs / 1e6 / count : 0; }
+
+	// 割合 p (0 - 1) の値 [ms] (階級の上限。最大は超えない)
+	double percentileMs(double p) const {
+		if (count == 0) return 0;
+		uint64_t rank = (uint64_t)(p * count + 0.5), seen = 0;
+		if (rank < 1) rank = 1;
+		for (size_t b = 0; b < buckets.size(); b++) {
+			seen += buckets[b];
+			if (seen >= rank) return (std::min)(ProfileBuckets::upper((int)b), maxNs) / 1e6;
+		}
+		return maxNs / 1e6;
+	}
+};
+
+class StageProfiler {
+public:
+	static const int maxStages = 64;
+
+private:
+	// トレースの1区間
+	struct Event {
+		int stage;
+		long long frame;
+		int64_t startNs; // 計測の開始 (StageProfiler を作った時刻) から
+		int64_t durationNs;
+	};
+
+	// スレッドごとの記録 (書き込むのはそのスレッドだけ。スレッドが終わっても集計に残す)
+	struct ThreadRecord {
+		int id;
+		std::string name;
+		long long frame = -1;
+		std::atomic<uint32_t> buckets[maxStages][ProfileBuckets::count];
+		std::atomic<uint64_t> totalNs[maxStages];
+		std::atomic<uint64_t> maxNs[maxStages];
+		std::atomic<Event *> events;        // トレースの区間 (setTracing() 後の最初の計測で確保し、作り直さない)
+		std::atomic<size_t> eventCount;     // 書き終わった区間の数 (これより前は読んでよい)
+		std::unique_ptr<Event[]> eventStore;
+		size_t eventCapacity = 0;
+		std::atomic<unsigned long long> eventsDropped;
+
+		ThreadRecord(int id) : id(id), events(nullptr), eventCount(0), eventsDropped(0) {
+			for (int s = 0; s < maxStages; s++) {
+				for (int b = 0; b < ProfileBuckets::count; b++) buckets[s][b].store(0, std::memory_order_relaxed);
+				totalNs[s].store(0, std::memory_order_relaxed);
+				maxNs[s].store(0, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	std::chrono::steady_clock::time_point epoch;
+	mutable std::mutex mutex; // 段とスレッドの登録、表示
+	const char *stageNames[maxStages];
+	std::atomic<int> stageCount;
+	std::vector<std::unique_ptr<ThreadRecord> > threads;
+	std::atomic<bool> tracing;
+	size_t traceCapacity = 0;
+	std::vector<ProfileStageStats> lastInterval; // printInterval() の前回の集計
+
+	StageProfiler() : epoch(std::chrono::steady_clock::now()), stageCount(0), tracing(false) {}
+
+	// このスレッドの記録 (最初の呼び出しで登録する)
+	ThreadRecord &threadRecord() {
+		static thread_local ThreadRecord *record = nullptr;
+		if (record == nullptr) {
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.push_back(std::unique_ptr<ThreadRecord>(new ThreadRecord((int)threads.size() + 1)));
+			record = threads.back().get();
+		}
+		return *record;
+	}
+
+	void addEvent(ThreadRecord &t, int stage, int64_t startNs, int64_t durationNs) {
+		if (t.events.load(std::memory_order_relaxed) == nullptr) {
+			std::lock_guard<std::mutex> lock(mutex);
+			t.eventCapacity = traceCapacity;
+			t.eventStore.reset(new Event[t.eventCapacity]);
+			t.events.store(t.eventStore.get(), std::memory_order_release);
+		}
+		size_t n = t.eventCount.load(std::memory_order_relaxed);
+		if (n >= t.eventCapacity) {
+			t.eventsDropped.store(t.eventsDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+		Event &e = t.eventStore[n];
+		e.stage = stage;
+		e.frame = t.frame;
+		e.startNs = startNs;
+		e.durationNs = durationNs;
+		t.eventCount.store(n + 1, std::memory_order_release);
+	}
+
+	static std::string jsonString(const std::string &text) {
+		std::string s = "\"";
+		for (size_t i = 0; i < text.size(); i++) {
+			if (text[i] == '"' || text[i] == '\\') s += '\\';
+			s += text[i];
+		}
+		return s + "\"";
+	}
+
+	static void printStats(std::ostream &out, const std::vector<ProfileStageStats> &stats) {
+		char line[256];
+		snprintf(line, sizeof(line), "%-36s %8s %9s %9s %9s %9s", "stage [ms]", "count", "mean", "p50", "p99", "max");
+		out << line << std::endl;
+		for (size_t s = 0; s < stats.size(); s++) {
+			const ProfileStageStats &st = stats[s];
+			if (st.count == 0) continue;
+			snprintf(line, sizeof(line), "%-36s %8llu %9.3f %9.3f %9.3f %9.3f", st.name.c_str(), (unsigned long long)st.count, st.meanMs(),
+				st.percentileMs(0.5), st.percentileMs(0.99), st.maxNs / 1e6);
+			out << line << std::endl;
+		}
+	}
+
+public:
+	static StageProfiler &instance() {
+		static StageProfiler profiler;
+		return profiler;
+	}
+
+	StageProfiler(const StageProfiler &) = delete;
+	StageProfiler &operator=(const StageProfiler &) = delete;
+
+	// 段の番号 (name は文字列リテラルなど、ずっと残る文字列。同じ名前なら同じ番号、段が多すぎれば -1)
+	int stage(const char *name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		int n = stageCount.load(std::memory_order_relaxed);
+		for (int s = 0; s < n; s++) {
+			if (strcmp(stageNames[s], name) == 0) return s;
+		}
+		if (n >= maxStages) return -1;
+		stageNames[n] = name;
+		stageCount.store(n + 1, std::memory_order_release);
+		return n;
+	}
+
+	// 1区間を記録する (StageTimer から呼ぶ)
+	void record(int stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+		if (stage < 0) return;
+		ThreadRecord &t = threadRecord();
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+		std::atomic<uint32_t> &bucket = t.buckets[stage][ProfileBuckets::index(ns)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		t.totalNs[stage].store(t.totalNs[stage].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+		if (ns > t.maxNs[stage].load(std::memory_order_relaxed)) t.maxNs[stage].store(ns, std::memory_order_relaxed);
+		if (tracing.load(std::memory_order_relaxed)) {
+			addEvent(t, stage, std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count(), (int64_t)ns);
+		}
+	}
+
+	// このスレッドで以降に記録する区間のフレーム番号
+	void setThreadFrame(long long number) { threadRecord().frame = number; }
+
+	// トレースに表示するこのスレッドの名前
+	void setThreadName(const char *name) {
+		ThreadRecord &t = threadRecord();
+		std::lock_guard<std::mutex> lock(mutex);
+		t.name = name;
+	}
+
+	// 区間の記録を有効にする (スレッドごとに最大 eventsPerThread 区間。超えた区間は捨てて数える)
+	// 記録した区間は writeChromeTrace() まで残る。有効にするのは1回だけ (2回目以降は容量を変えない)
+	void setTracing(bool enable, size_t eventsPerThread = 1 << 18) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (traceCapacity == 0) traceCapacity = eventsPerThread;
+		tracing = enable;
+	}
+
+	bool isTracing() const { return tracing; }
+
+	// 段ごとの集計 (全スレッドの合計。計測中に呼んでよい)
+	std::vector<ProfileStageStats> stats() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		int n = stageCount.load(std::memory_order_acquire);
+		std::vector<ProfileStageStats> result(n);
+		for (int s = 0; s < n; s++) {
+			result[s].name = stageNames[s];
+			result[s].buckets.assign(ProfileBuckets::count, 0);
+			for (size_t k = 0; k < threads.size(); k++) {
+				const ThreadRecord &t = *threads[k];
+				for (int b = 0; b < ProfileBuckets::count; b++) {
+					uint64_t c = t.buckets[s][b].load(std::memory_order_relaxed);
+					result[s].buckets[b] += c;
+					result[s].count += c;
+				}
+				result[s].totalNs += t.totalNs[s].load(std::memory_order_relaxed);
+				result[s].maxNs = (std::max)(result[s].maxNs, t.maxNs[s].load(std::memory_order_relaxed));
+			}
+		}
+		return result;
+	}
+
+	// 計測を始めてからの集計を表示する (何も計っていなければ何も表示しない)
+	void printTotal(std::ostream &out) const {
+		std::vector<ProfileStageStats> total = stats();
+		if (total.empty()) return;
+		printStats(out, total);
+	}
+
+	// 前回の printInterval() からの集計を表示する (定期的に呼ぶ。最大は階級の上限で近似する)
+	void printInterval(std::ostream &out) {
+		std::vector<ProfileStageStats> total = stats();
+		if (total.empty()) return;
+		std::vector<ProfileStageStats> interval = total;
+		for (size_t s = 0; s < interval.size() && s < lastInterval.size(); s++) {
+			ProfileStageStats &st = interval[s];
+			st.count -= lastInterval[s].count;
+			st.totalNs -= lastInterval[s].totalNs;
+			for (int b = 0; b < ProfileBuckets::count; b++) st.buckets[b] -= lastInterval[s].buckets[b];
+		}
+		for (size_t s = 0; s < interval.size(); s++) {
+			ProfileStageStats &st = interval[s];
+			int top = ProfileBuckets::count - 1;
+			while (top > 0 && st.buckets[top] == 0) top--;
+			st.maxNs = (std::min)(st.maxNs, ProfileBuckets::upper(top));
+		}
+		lastInterval = total;
+		printStats(out, interval);
+	}
+
+	// 記録した区間を Chrome のトレースの形式 (JSON) で書き出す (書き出した区間の数、書けなければ -1)
+	long long writeChromeTrace(const std::string &path) const {
+		std::ofstream out(path.c_str());
+		if (!out) return -1;
+		std::lock_guard<std::mutex> lock(mutex);
+		long long written = 0;
+		unsigned long long dropped = 0;
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+		bool first = true;
+		char number[96];
+		for (size_t k = 0; k < threads.size(); k++) {
+			const ThreadRecord &t = *threads[k];
+			std::string name = t.name.empty() ? "thread " + std::to_string(t.id) : t.name;
+			out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t.id << ",\"args\":{\"name\":" << jsonString(name) << "}}";
+			first = false;
+			const Event *events = t.events.load(std::memory_order_acquire);
+			size_t count = (events != nullptr) ? t.eventCount.load(std::memory_order_acquire) : 0;
+			for (size_t n = 0; n < count; n++) {
+				const Event &e = events[n];
+				snprintf(number, sizeof(number), "\"ts\":%.3f,\"dur\":%.3f", e.startNs / 1000.0, e.durationNs / 1000.0);
+				out << ",\n{\"name\":" << jsonString(stageNames[e.stage]) << ",\"cat\":\"kinect\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t.id << "," << number;
+				if (e.frame >= 0) out << ",\"args\":{\"frame\":" << e.frame << "}";
+				out << "}";
+				written++;
+			}
+			dropped += t.eventsDropped.load(std::memory_order_relaxed);
+		}
+		out << "\n],\"otherData\":{\"droppedEvents\":" << dropped << "}}" << std::endl;
+		return out ? written : -1;
+	}
+};
+
+// スコープの間を1区間として計る
+class StageTimer {
+private:
+	int stage;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	explicit StageTimer(int stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+	~StageTimer() { StageProfiler::instance().record(stage, start, std::chrono::steady_clock::now()); }
+
+	StageTimer(const StageTimer &) = delete;
+	StageTimer &operator=(const StageTimer &) = delete;
+};
+
+#ifdef KINECT_PROFILE
+#define KINECT_PROFILE_CONCAT_(a, b) a##b
+#define KINECT_PROFILE_CONCAT(a, b) KINECT_PROFILE_CONCAT_(a, b)
+#define KINECT_PROFILE_SCOPE(name) \
+	static const int KINECT_PROFILE_CONCAT(profileStage, __LINE__) = StageProfiler::instance().stage(name); \
+	StageTimer KINECT_PROFILE_CONCAT(profileTimer, __LINE__)(KINECT_PROFILE_CONCAT(profileStage, __LINE__))
+#define KINECT_PROFILE_FRAME(number) StageProfiler::instance().setThreadFrame(number)
+#define KINECT_PROFILE_THREAD(name) StageProfiler::instance().setThreadName(name)
+#else
+#define KINECT_PROFILE_SCOPE(name)
+#define KINECT_PROFILE_FRAME(number)
+#define KINECT_PROFILE_THREAD(name)
+#endif
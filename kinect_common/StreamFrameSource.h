@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "DepthCodec.h"
+#include "FrameSource.h"
+#include "KinectCalibration.h"
+#include "RGBDStream.h"
+
+// 受け取る側の統計
+struct RGBDStreamClientStats {
+	unsigned long long received = 0;
+	unsigned long long failed = 0;      // 展開できなかったフレーム
+	unsigned long long reconnects = 0;
+	unsigned long long bytes = 0;
+	double megabitsPerSecond = 0;       // 最初に受け取ってから最後に受け取るまでの平均
+	double meanDecodeMs = 0;
+	double maxDecodeMs = 0;
+	double meanLatencyMs = -1;          // サーバーが受け取ってから展開し終わるまで (同じ PC のときだけ。それ以外は -1)
+	double maxLatencyMs = -1;
+};
+
+// RGBDStreamServer が TCP で送るフレームを受け取る FrameSource
+// 受信スレッドがフレームを受け取って展開し、最新の1つだけを残す (取得が遅ければ間のフレームは捨てる)
+// RGB は BGRA で渡し、ROI で送られてきた場合は窓の外は 0 になる。接続が切れたらつなぎ直す
+// タイムスタンプはサーバーの取得元のものなので、同じ PC のサーバーでその時計が currentTimestamp() のときだけ hostClock になる
+class StreamFrameSource : public FrameSource {
+private:
+	std::string host;
+	int port;
+
+	StreamSocket socket;
+	std::mutex socketMutex; // 受信スレッドが閉じるのと、終了時に起こすのが重ならないように
+	std::thread receiver;
+	int openedStreams = 0;
+
+	// 接続と最初のメッセージを待つ時間の上限 [ms] (つなぎ直している間は終了時に起こせないので、終了はこの時間だけ遅れることがある)
+	static const int handshakeTimeoutMs = 3000;
+
+	std::mutex mutex;
+	std::condition_variable arrived;
+	bool stopping = false;
+	bool connected = false;
+
+	KinectCalibration calibration; // サーバーから受け取った位置合わせのパラメータ (無ければ無効)
+	bool remoteHostClock = false;
+
+	// 最新のフレーム (mutex で保護)
+	std::vector<BYTE> color;
+	std::vector<UINT16> depth;
+	unsigned long long colorSequence = 0;
+	unsigned long long depthSequence = 0;
+	unsigned long long colorTaken = 0;
+	unsigned long long depthTaken = 0;
+	INT64 colorArrival = 0;
+	INT64 depthArrival = 0;
+
+	// 展開中のフレーム (受信スレッドだけが使う)
+	std::vector<BYTE> colorBack;
+	std::vector<UINT16> depthBack;
+	std::vector<BYTE> payload;
+	cv::Mat decodedColor;
+	cv::Mat scaledColor;
+	int clearFrames = 0;    // 窓が変わったときに窓の外を 0 にし直すバッファの数 (表と裏の2つ)
+	cv::Rect lastDepthRect;
+	cv::Rect lastColorRect;
+
+	// 統計 (mutex で保護)
+	RGBDStreamClientStats counters;
+	double decodeSum = 0;
+	double latencySum = 0;
+	INT64 firstReceived = 0;
+	INT64 lastReceived = 0;
+
+	// s で接続して最初のメッセージを読む (reconnect なら画像サイズが open() のときと同じか確かめるだけ)
+	// 相手が応答しない、つないだのに最初のメッセージを送らない場合も handshakeTimeoutMs で諦める
+	void handshake(StreamSocket &s, bool reconnect) {
+		s.connect(host, port, handshakeTimeoutMs);
+		s.setReceiveTimeout(handshakeTimeoutMs);
+		RGBDStreamHello hello;
+		if (!s.recvAll(&hello, sizeof(hello)) || memcmp(hello.magic, rgbdStreamMagic, sizeof(hello.magic)) != 0) {
+			throw std::runtime_error("invalid stream from " + host);
+		}
+		std::vector<BYTE> calibrationData(hello.calibrationSize);
+		if (hello.calibrationSize > 0 && !s.recvAll(&calibrationData[0], calibrationData.size())) throw std::runtime_error("invalid stream from " + host);
+		s.setReceiveTimeout(0); // フレームの間隔は決まっていないので、以降は待ち続ける (終了時は shutdown() で起こす)
+		if (reconnect) {
+			if (hello.depthWidth != depthWidth || hello.depthHeight != depthHeight || hello.colorWidth != colorWidth || hello.colorHeight != colorHeight) {
+				throw std::runtime_error("stream size changed");
+			}
+			return;
+		}
+		if (hello.depthWidth <= 0 || hello.depthHeight <= 0 || hello.colorWidth <= 0 || hello.colorHeight <= 0
+			|| hello.depthWidth > 4096 || hello.depthHeight > 4096 || hello.colorWidth > 8192 || hello.colorHeight > 8192) {
+			throw std::runtime_error("invalid stream from " + host);
+		}
+		depthWidth = hello.depthWidth;
+		depthHeight = hello.depthHeight;
+		colorWidth = hello.colorWidth;
+		colorHeight = hello.colorHeight;
+		minDepthReliableDistance = hello.minDepthReliableDistance;
+		maxDepthReliableDistance = hello.maxDepthReliableDistance;
+		remoteHostClock = hello.hostClock != 0;
+		if (!calibrationData.empty()) deserializeKinectCalibration(&calibrationData[0], calibrationData.size(), calibration);
+	}
+
+	// 受け取ったフレームを裏のバッファに展開する
+	bool decodeFrame(const RGBDStreamFrameHeader &header) {
+		cv::Rect depthRect(header.depthRect[0], header.depthRect[1], header.depthRect[2], header.depthRect[3]);
+		cv::Rect colorRect(header.colorRect[0], header.colorRect[1], header.colorRect[2], header.colorRect[3]);
+		if ((depthRect & cv::Rect(0, 0, depthWidth, depthHeight)) != depthRect || depthRect.area() == 0) return false;
+		if ((colorRect & cv::Rect(0, 0, colorWidth, colorHeight)) != colorRect || colorRect.area() == 0) return false;
+
+		// 窓が変わったら、窓の外に前の窓のデータが残らないように表と裏の両方を 0 にする
+		if (depthRect != lastDepthRect || colorRect != lastColorRect) clearFrames = 2;
+		lastDepthRect = depthRect;
+		lastColorRect = colorRect;
+		if (clearFrames > 0) {
+			std::fill(depthBack.begin(), depthBack.end(), (UINT16)0);
+			std::fill(colorBack.begin(), colorBack.end(), (BYTE)0);
+			clearFrames--;
+		}
+
+		if (!DepthCodec::decodePredictive(&payload[0], header.depthSize, depthRect.width, depthRect.height,
+			&depthBack[(size_t)depthRect.y * depthWidth + depthRect.x], depthWidth)) return false;
+
+		cv::Mat encoded(1, (int)header.colorSize, CV_8UC1, &payload[header.depthSize]);
+		decodedColor = cv::imdecode(encoded, cv::IMREAD_COLOR);
+		if (decodedColor.empty()) return false;
+		cv::Mat dst = cv::Mat(colorHeight, colorWidth, CV_8UC4, &colorBack[0])(colorRect);
+		if (decodedColor.cols == colorRect.width && decodedColor.rows == colorRect.height) {
+			cv::cvtColor(decodedColor, dst, cv::COLOR_BGR2BGRA);
+		} else { // 縮小して送られてきた
+			cv::cvtColor(decodedColor, scaledColor, cv::COLOR_BGR2BGRA);
+			cv::resize(scaledColor, dst, dst.size());
+		}
+		return true;
+	}
+
+	void closeSocket() {
+		std::lock_guard<std::mutex> lock(socketMutex);
+		socket.close();
+	}
+
+	void run() {
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (stopping) return;
+				if (!connected) { // つなぎ直す (失敗したら少し待ってから)
+					lock.unlock();
+					// 別のソケットで socketMutex を持たずにつなぎ、つながってから入れ替える (待っている間も終了時に socketMutex を取れるように)
+					StreamSocket fresh;
+					bool ok = true;
+					try {
+						handshake(fresh, true);
+					} catch (std::exception&) {
+						ok = false;
+					}
+					// つないでいる間に終了し始めていたら、入れ替えずに閉じて終わる
+					// (終了時の shutdown() は前のソケットに届いているので、入れ替えると受信を待ったまま止まらない)
+					// stopping を確かめてから mutex を持ったまま入れ替えるので、この後に終了し始めれば新しいソケットが起こされる
+					lock.lock();
+					if (stopping) {
+						fresh.close();
+						return;
+					}
+					if (!ok) {
+						arrived.wait_for(lock, std::chrono::milliseconds(500), [this]() { return stopping; });
+						continue;
+					}
+					{
+						std::lock_guard<std::mutex> socketLock(socketMutex);
+						socket.swap(fresh); // 前のソケット (閉じてある) は fresh と一緒に消える
+					}
+					connected = true;
+					counters.reconnects++;
+					lastDepthRect = lastColorRect = cv::Rect();
+				}
+			}
+
+			RGBDStreamFrameHeader header;
+			bool ok = socket.recvAll(&header, sizeof(header)) && memcmp(header.magic, rgbdStreamFrameMagic, sizeof(header.magic)) == 0
+				&& header.depthSize > 0 && header.colorSize > 0 && (size_t)header.depthSize + header.colorSize <= colorBack.size() + depthBack.size() * 4;
+			if (ok) {
+				payload.resize((size_t)header.depthSize + header.colorSize);
+				ok = socket.recvAll(&payload[0], payload.size());
+			}
+			if (!ok) {
+				closeSocket();
+				std::lock_guard<std::mutex> lock(mutex);
+				connected = false;
+				continue;
+			}
+
+			INT64 start = currentTimestamp();
+			bool decoded = decodeFrame(header);
+			INT64 now = currentTimestamp();
+			double decodeMs = (now - start) / 10000.0;
+
+			// 展開し終わったら返事を返す (サーバーはこれを待って次のフレームを送る)
+			RGBDStreamAck ack;
+			memset(&ack, 0, sizeof(ack));
+			ack.number = header.number;
+			ack.pushTimestamp = header.pushTimestamp;
+			ack.decodeMs = (float)decodeMs;
+			bool acked = socket.sendAll(&ack, sizeof(ack));
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!decoded) {
+					counters.failed++;
+				} else {
+					color.swap(colorBack);
+					depth.swap(depthBack);
+					colorSequence++;
+					depthSequence++;
+					// 取得元のタイムスタンプのまま渡す (RGBとDepthの組はサーバーで決めたものを崩さない)
+					colorArrival = header.colorTimestamp;
+					depthArrival = header.depthTimestamp;
+					if (counters.received == 0) firstReceived = now;
+					lastReceived = now;
+					counters.received++;
+					counters.bytes += sizeof(header) + payload.size();
+					decodeSum += decodeMs;
+					counters.maxDecodeMs = (std::max)(counters.maxDecodeMs, decodeMs);
+					if (hostClock) {
+						double latency = (now - header.pushTimestamp) / 10000.0;
+						latencySum += latency;
+						counters.maxLatencyMs = (std::max)(counters.maxLatencyMs, latency);
+					}
+				}
+				if (!acked) connected = false;
+			}
+			if (!acked) closeSocket();
+			if (decoded) arrived.notify_all();
+		}
+	}
+
+	bool hasNewFrame(int requested) const {
+		requested &= openedStreams;
+		return ((requested & Color) && colorSequence != colorTaken) || ((requested & Depth) && depthSequence != depthTaken);
+	}
+
+public:
+	StreamFrameSource(const std::string &host, int port) : host(host), port(port) {
+	}
+
+	~StreamFrameSource() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		arrived.notify_all();
+		{
+			std::lock_guard<std::mutex> lock(socketMutex);
+			socket.shutdown(); // 受信中なら起こす
+		}
+		if (receiver.joinable()) receiver.join();
+	}
+
+	// サーバーに接続して画像サイズと位置合わせのパラメータを受け取る (失敗したら std::runtime_error を投げる)
+	// RGB は常に BGRA で渡す (preferColorFormat() は使わない)
+	// サーバーは常に両方を送ってくるが、streams に無い方は acquire*Frame() で渡さない
+	void open(int streams) {
+		handshake(socket, false);
+		openedStreams = streams;
+		colorFormat = ColorBGRA;
+		colorBytesPerPixel = kinectColorBytesPerPixel;
+		hostClock = remoteHostClock && isLoopbackHost(host);
+		color.assign(colorBufferSize(), 0);
+		colorBack.assign(colorBufferSize(), 0);
+		depth.assign(depthBufferSize(), 0);
+		depthBack.assign(depthBufferSize(), 0);
+		connected = true;
+		receiver = std::thread(&StreamFrameSource::run, this);
+	}
+
+	bool acquireColorFrame(BYTE *buffer, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!(openedStreams & Color) || colorSequence == colorTaken) return false;
+		memcpy(buffer, &color[0], (std::min)(size, color.size()));
+		colorTaken = colorSequence;
+		colorTimestamp = colorArrival;
+		return true;
+	}
+
+	// ROI の行だけをコピーする
+	bool acquireColorFrameRows(BYTE *buffer, size_t size, int rowBegin, int rowEnd) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!(openedStreams & Color) || colorSequence == colorTaken) return false;
+		size_t stride = (size_t)colorWidth * colorBytesPerPixel;
+		size_t begin = (std::min)((size_t)(std::max)(rowBegin, 0) * stride, color.size());
+		size_t end = (std::min)((std::min)((size_t)(std::max)(rowEnd, 0) * stride, color.size()), size);
+		if (end > begin) memcpy(buffer + begin, &color[begin], end - begin);
+		colorTaken = colorSequence;
+		colorTimestamp = colorArrival;
+		return true;
+	}
+
+	bool acquireDepthFrame(UINT16 *buffer, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!(openedStreams & Depth) || depthSequence == depthTaken) return false;
+		memcpy(buffer, &depth[0], (std::min)(size, depth.size()) * sizeof(UINT16));
+		depthTaken = depthSequence;
+		depthTimestamp = depthArrival;
+		return true;
+	}
+
+	// サーバーから受け取ったパラメータ (サーバーの取得元に無ければ false)
+	bool getCalibration(KinectCalibration &c) {
+		if (!calibration.isValid()) return false;
+		c = calibration;
+		return true;
+	}
+
+	// 新しいフレームが届くまで待つ (展開し終わった瞬間に起きる)
+	bool waitForFrame(int streams, int timeoutMs) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() { return stopping || hasNewFrame(streams); }) && !stopping;
+	}
+
+	// サーバーにつながっているか
+	bool isConnected() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return connected;
+	}
+
+	RGBDStreamClientStats stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		RGBDStreamClientStats s = counters;
+		if (s.received > 0) s.meanDecodeMs = decodeSum / s.received;
+		if (s.received > 0 && hostClock) s.meanLatencyMs = latencySum / s.received;
+		double sec = (lastReceived - firstReceived) / 1.0e7;
+		if (s.received > 1 && sec > 0) s.megabitsPerSecond = s.bytes * 8.0 / sec / 1.0e6 * (s.received - 1) / s.received;
+		return s;
+	}
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "PointCloud.h"
+
+// 点群を切り出す3次元の範囲 (カメラ座標 [m]、境界を含む。既定は全て)
+struct PointCloudBox {
+	float minX = -std::numeric_limits<float>::infinity();
+	float maxX = std::numeric_limits<float>::infinity();
+	float minY = -std::numeric_limits<float>::infinity();
+	float maxY = std::numeric_limits<float>::infinity();
+	float minZ = -std::numeric_limits<float>::infinity();
+	float maxZ = std::numeric_limits<float>::infinity();
+
+	// NaN は範囲外
+	bool contains(float x, float y, float z) const {
+		return x >= minX && x <= maxX && y >= minY && y <= maxY && z >= minZ && z <= maxZ;
+	}
+};
+
+// ボクセルグリッドの設定
+struct VoxelGridOptions {
+	float leafSize = 0.01f; // ボクセルの一辺 [m]
+	PointCloudBox box;      // この範囲の点だけを使う
+	bool withColor = true;  // 点群に色があればボクセルごとの平均の色も求める
+	int minPoints = 1;      // これより点の少ないボクセルは出力しない (孤立した雑音を除く)
+};
+
+// 間引いた点群 (ボクセルごとに1点、並びは最初に点が入った順)
+// 配列は使い回すので、2回目以降のフレームでは確保しない
+struct VoxelCloud {
+	std::vector<float> x; // ボクセル内の点の重心 [m]
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<uint32_t> color;  // ボクセル内の点の平均の BGRA (色を求めない場合は空)
+	std::vector<uint32_t> count;  // ボクセル内の点の数
+	size_t inputPoints = 0;       // 範囲内で値のあった点の数
+
+	size_t size() const { return x.size(); }
+};
+
+// 点群をボクセルグリッドで間引く
+// 点を1回だけ順に見て、ボクセルの番号 (整数座標を詰めたキー) をオープンアドレス法のハッシュ表で引き、重心と色を足し込む
+// ハッシュ表と足し込み用の配列は reserve() で最大の点数分を確保しておき、フレームごとには世代番号を進めるだけで
+// 表を消さずに使い回す (フレームごとの確保も全体の初期化も無い)
+// 1つの VoxelGrid は1つのスレッドから使う
+class VoxelGrid {
+private:
+	struct Slot {
+		uint64_t key;
+		uint32_t generation; // この世代で使われたスロットか
+		uint32_t voxel;      // 足し込み用の配列の番号
+	};
+
+	std::vector<Slot> table; // 大きさは2のべき乗 (最大の点数の2倍以上、使用率は半分以下)
+	int tableBits = 0;
+	uint32_t generation = 0;
+
+	// ボクセルごとの足し込み (1つのボクセルの値が1つのキャッシュラインに収まるようにまとめる)
+	struct Sum {
+		float x, y, z;
+		uint32_t points;
+		uint32_t b, g, r;
+		uint32_t reserved;
+	};
+	std::vector<Sum> sums; // voxelCount 個だけ使う
+	uint32_t voxelCount = 0;
+
+	// 切り捨て (std::floor より速い)
+	static int floorToInt(float v) {
+		int i = (int)v;
+		return i - (v < i);
+	}
+
+	// ボクセルの整数座標 (各21bit、負の値も扱えるように 2^20 ずらす) を1つのキーに詰める
+	static uint64_t voxelKey(float x, float y, float z, float inv) {
+		const int bias = 1 << 20;
+		uint64_t ix = (uint64_t)(floorToInt(x * inv) + bias) & 0x1fffff;
+		uint64_t iy = (uint64_t)(floorToInt(y * inv) + bias) & 0x1fffff;
+		uint64_t iz = (uint64_t)(floorToInt(z * inv) + bias) & 0x1fffff;
+		return ix | (iy << 21) | (iz << 42);
+	}
+
+	// キーのボクセルの番号 (無ければ新しく割り当てる)
+	uint32_t findVoxel(uint64_t key) {
+		size_t mask = table.size() - 1;
+		size_t h = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - tableBits));
+		for (;; h = (h + 1) & mask) { // 線形探査
+			Slot &s = table[h];
+			if (s.generation != generation) {
+				s.key = key;
+				s.generation = generation;
+				s.voxel = voxelCount;
+				memset(&sums[voxelCount], 0, sizeof(Sum));
+				return voxelCount++;
+			}
+			if (s.key == key) return s.voxel;
+		}
+	}
+
+	void nextGeneration() {
+		if (++generation == 0) { // 一周したら全て未使用に戻す
+			for (size_t i = 0; i < table.size(); i++) table[i].generation = 0;
+			generation = 1;
+		}
+		voxelCount = 0;
+	}
+
+public:
+	// 1フレームの最大の点数 (Depth画像の画素数) 分の領域を確保する
+	void reserve(size_t maxPoints) {
+		tableBits = 1;
+		while (((size_t)1 << tableBits) < maxPoints * 2) tableBits++;
+		Slot empty = { 0, 0, 0 };
+		table.assign((size_t)1 << tableBits, empty);
+		generation = 0;
+		sums.resize(maxPoints);
+	}
+
+	size_t capacity() const { return sums.size(); }
+
+	// cloud を options で切り出して間引き、out に書き込む (reserve() より点の多い点群は確保し直す)
+	void filter(const PointCloud &cloud, const VoxelGridOptions &options, VoxelCloud &out) {
+		size_t n = (size_t)cloud.width() * cloud.height();
+		if (n > capacity()) reserve(n);
+		nextGeneration();
+		out.inputPoints = 0;
+
+		const bool withColor = options.withColor && !cloud.color.empty();
+		const float inv = 1.0f / options.leafSize;
+		const PointCloudBox &box = options.box;
+		uint64_t lastKey = ~(uint64_t)0; // 同じ行で隣の点はたいてい同じボクセルなので、直前の結果を使えば表を引かずに済む
+		uint32_t lastVoxel = 0;
+		for (int j = 0; j < cloud.height(); j++) {
+			const float *x = cloud.x.ptr<float>(j);
+			const float *y = cloud.y.ptr<float>(j);
+			const float *z = cloud.z.ptr<float>(j);
+			const uchar *bgra = withColor ? cloud.color.ptr<uchar>(j) : nullptr;
+			for (int i = 0; i < cloud.width(); i++) {
+				if (!box.contains(x[i], y[i], z[i])) continue; // 範囲外と値の無い点 (NaN)
+				uint64_t key = voxelKey(x[i], y[i], z[i], inv);
+				if (key != lastKey) {
+					lastVoxel = findVoxel(key);
+					lastKey = key;
+				}
+				Sum &sum = sums[lastVoxel];
+				sum.x += x[i];
+				sum.y += y[i];
+				sum.z += z[i];
+				sum.points++;
+				if (withColor) {
+					sum.b += bgra[i * 4];
+					sum.g += bgra[i * 4 + 1];
+					sum.r += bgra[i * 4 + 2];
+				}
+				out.inputPoints++;
+			}
+		}
+
+		// ボクセルごとに平均する
+		out.x.clear();
+		out.y.clear();
+		out.z.clear();
+		out.color.clear();
+		out.count.clear();
+		out.x.reserve(voxelCount); // 一度大きくなれば確保しない
+		out.y.reserve(voxelCount);
+		out.z.reserve(voxelCount);
+		out.count.reserve(voxelCount);
+		if (withColor) out.color.reserve(voxelCount);
+		for (uint32_t v = 0; v < voxelCount; v++) {
+			const Sum &sum = sums[v];
+			uint32_t c = sum.points;
+			if ((int)c < options.minPoints) continue;
+			float s = 1.0f / c;
+			out.x.push_back(sum.x * s);
+			out.y.push_back(sum.y * s);
+			out.z.push_back(sum.z * s);
+			out.count.push_back(c);
+			if (withColor) {
+				uint32_t b = (sum.b + c / 2) / c, g = (sum.g + c / 2) / c, r = (sum.r + c / 2) / c;
+				out.color.push_back(b | (g << 8) | (r << 16) | 0xff000000u);
+			}
+		}
+	}
+
+	// 直前の filter() で点が入ったボクセルの数 (minPoints で除く前)
+	size_t occupiedVoxels() const { return voxelCount; }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 変換処理を複数のスレッドで実行するプール (ワークスティーリング)
+// スレッドごとにキューを持ち、submit() は hint のスレッドのキューに入れる (同じ取得元の処理は同じスレッドに集まり、キャッシュに残りやすい)
+// 自分のキューが空になったスレッドは他のスレッドのキューの後ろから取って実行するので、重い取得元があっても他のスレッドは遊ばない
+// 自分のキューは前から (古い順に) 取り出すので、フレームは届いた順に処理される
+// 処理の中では cv::parallel_for_ を使わず1スレッドで処理する (並列にするのは取得元やフレームの間)
+class WorkStealingPool {
+private:
+	struct Worker {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+		std::thread thread;
+		std::atomic<unsigned long long> executed;
+		std::atomic<unsigned long long> stolen; // 他のスレッドのキューから取った数
+		Worker() : executed(0), stolen(0) {}
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::mutex waitMutex;
+	std::condition_variable workCond; // 空いたスレッドが処理を待つ
+	std::condition_variable doneCond; // wait() が全ての処理の終わりを待つ (submit() の通知を wait() 側が受け取ってしまわないように分ける)
+	std::atomic<size_t> pending; // キューに入っている処理の数
+	std::atomic<size_t> running; // 実行中の処理の数
+	bool stopping = false;
+
+	bool popLocal(size_t index, std::function<void()> &task) {
+		Worker &w = *workers[index];
+		std::lock_guard<std::mutex> lock(w.mutex);
+		if (w.tasks.empty()) return false;
+		task = std::move(w.tasks.front());
+		w.tasks.pop_front();
+		return true;
+	}
+
+	bool steal(size_t index, std::function<void()> &task) {
+		for (size_t n = 1; n < workers.size(); n++) {
+			Worker &victim = *workers[(index + n) % workers.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.tasks.empty()) continue;
+			task = std::move(victim.tasks.back());
+			victim.tasks.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t index) {
+		Worker &self = *workers[index];
+		for (;;) {
+			std::function<void()> task;
+			bool local = popLocal(index, task);
+			if (local || steal(index, task)) {
+				running++;
+				pending--;
+				if (!local) self.stolen++;
+				task();
+				self.executed++;
+				running--;
+				if (pending == 0 && running == 0) {
+					std::lock_guard<std::mutex> lock(waitMutex);
+					doneCond.notify_all(); // wait() で待っている側を起こす
+				}
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(waitMutex);
+			if (stopping) return;
+			workCond.wait(lock, [this]() { return stopping || pending > 0; });
+			if (stopping && pending == 0) return;
+		}
+	}
+
+public:
+	// threads は 0 なら CPU の数
+	explicit WorkStealingPool(int threads = 0) : pending(0), running(0) {
+		if (threads <= 0) threads = (int)(std::max)(std::thread::hardware_concurrency(), 1u);
+		for (int n = 0; n < threads; n++) workers.push_back(std::unique_ptr<Worker>(new Worker()));
+		for (int n = 0; n < threads; n++) workers[n]->thread = std::thread(&WorkStealingPool::run, this, (size_t)n);
+	}
+
+	// キューに残っている処理も全て実行してから止める
+	~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> lock(waitMutex);
+			stopping = true;
+		}
+		workCond.notify_all();
+		for (size_t n = 0; n < workers.size(); n++) workers[n]->thread.join();
+	}
+
+	WorkStealingPool(const WorkStealingPool &) = delete;
+	WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+	// 処理を hint 番目のスレッドのキューに入れる (待たない)
+	void submit(std::function<void()> task, size_t hint = 0) {
+		Worker &w = *workers[hint % workers.size()];
+		pending++; // 取り出した側が先に減らさないように、入れる前に数える
+		{
+			std::lock_guard<std::mutex> lock(w.mutex);
+			w.tasks.push_back(std::move(task));
+		}
+		std::lock_guard<std::mutex> lock(waitMutex); // 待ちに入る直前のスレッドを起こし損ねないように
+		workCond.notify_one();
+	}
+
+	// キューが空になり、実行中の処理も終わるまで待つ
+	void wait() {
+		std::unique_lock<std::mutex> lock(waitMutex);
+		doneCond.wait(lock, [this]() { return pending == 0 && running == 0; });
+	}
+
+	size_t threadCount() const { return workers.size(); }
+	size_t pendingTasks() const { return pending; }
+
+	// スレッドごとの実行した数と、そのうち他のスレッドのキューから取った数
+	unsigned long long executed(size_t thread) const { return workers[thread]->executed; }
+	unsigned long long stolen(size_t thread) const { return workers[thread]->stolen; }
+};
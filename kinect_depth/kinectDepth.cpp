@@ -1,126 +1,199 @@
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
-#include <Kinect.h>
-
-#include <atlbase.h>
-
-#define ERROR_CHECK( ret )  \
-    if ( (ret) != S_OK ) {    \
-        std::stringstream ss;	\
-        ss << "failed " #ret " " << std::hex << ret << std::endl;			\
-        throw std::runtime_error( ss.str().c_str() );			\
-    }
+#include "../kinect_common/DepthBackground.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/DepthSpatialFilter.h"
+#include "../kinect_common/DepthTemporalFilter.h"
+#include "../kinect_common/FrameBuffer.h"
+#include "../kinect_common/FrameSource.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SimulatedFrameSource.h"
 
 class KinectApp {
 private:
-	// Kinect SDK
-	CComPtr<IKinectSensor> kinect = nullptr;
-	CComPtr<IDepthFrameReader> depthFrameReader = nullptr;
+	// フレームの取得元 (Kinect本体 or 記録データ)
+	std::unique_ptr<FrameSource> source;
+
+	FrameBuffer<UINT16> depthBuffer; // Depthフレームのプール (参照カウントで寿命を管理する)
+	DepthWindowLUT depthLut; // 256諧調への変換テーブル
+
+	// 時間方向のフィルタ (有効なら取得したフレームをその場で書き換える)
+	DepthTemporalFilter temporalFilter;
+	bool temporalEnabled = false;
+
+	// 空間方向のフィルタ (段差を保って平滑化し、小さな穴を埋める。時間方向の後にかける)
+	DepthSpatialFilter spatialFilter;
+	bool spatialEnabled = false;
 
-	std::vector<UINT16> depthBuffer;
+	// 背景モデル (有効なら取得したフレームごとに生のDepthから前景と塊を求める)
+	DepthBackground background;
+	bool backgroundEnabled = false;
 public:
 	int depthWidth;
 	int depthHeight;
 
-	~KinectApp() {
-		// Kinect̓I
-		if (kinect != nullptr) {
-			kinect->Close();
+	// 初期化 (replayPath を指定すると Kinect の代わりに記録データを fps で再生する。"sim" なら合成フレームを fps で届ける)
+	void initialize(const char *replayPath = nullptr, double fps = 30.0) {
+		if (replayPath != nullptr && std::string(replayPath) == "sim") {
+			source.reset(new SimulatedFrameSource(fps));
+		} else if (replayPath != nullptr) {
+			source.reset(new ReplayFrameSource(replayPath, fps));
+		} else {
+#ifdef _WIN32
+			source.reset(new KinectSensorSource());
+#else
+			throw std::runtime_error("Kinect is not available on this platform (specify a recorded data directory)");
+#endif
 		}
+		source->open(FrameSource::Depth);
+
+		depthWidth = source->depthWidth;
+		depthHeight = source->depthHeight;
+
+		// バッファーを作成する
+		depthBuffer.create(depthHeight, depthWidth, CV_16UC1);
+		temporalFilter.initialize(depthWidth, depthHeight);
+		spatialFilter.initialize(depthWidth, depthHeight);
+		background.initialize(depthWidth, depthHeight);
 	}
 
-	// 
-	void initialize() {
-		// ftHgKinect擾
-		ERROR_CHECK(::GetDefaultKinectSensor(&kinect));
-		ERROR_CHECK(kinect->Open());
-
-		// Depth[_[擾
-		CComPtr<IDepthFrameSource> depthFrameSource;
-		ERROR_CHECK(kinect->get_DepthFrameSource(&depthFrameSource));
-		ERROR_CHECK(depthFrameSource->OpenReader(&depthFrameReader));
-
-		// Depth摜̃TCY擾
-		CComPtr<IFrameDescription> depthFrameDescription;
-		ERROR_CHECK(depthFrameSource->get_FrameDescription( &depthFrameDescription));
-		ERROR_CHECK(depthFrameDescription->get_Width(&depthWidth));
-		ERROR_CHECK(depthFrameDescription->get_Height(&depthHeight));
-		std::cout << "Depth       : " << depthWidth << std::endl;
-		std::cout << "Depth       : " << depthHeight << std::endl;
-		
-		// Depth̍őlAŏl擾
-		UINT16 minDepthReliableDistance;
-		UINT16 maxDepthReliableDistance;
-		ERROR_CHECK(depthFrameSource->get_DepthMinReliableDistance( &minDepthReliableDistance));
-		ERROR_CHECK(depthFrameSource->get_DepthMaxReliableDistance( &maxDepthReliableDistance));
-		std::cout << "Depthŏl       : " << minDepthReliableDistance << std::endl;
-		std::cout << "Depthől       : " << maxDepthReliableDistance << std::endl;
-
-		// obt@[쐬
-		depthBuffer.resize(depthWidth * depthHeight);
+	// Depthフレームの更新 (新しいフレームを取得できたら true)
+	bool updateDepthFrame(){
+		// Depthフレームを取得する
+		UINT16 *depth = depthBuffer.beginWrite(); // 空いているスロット (利用者が持っているフレームには書き込まない)
+		if (depth == nullptr || !source->acquireDepthFrame(depth, depthBuffer.size())) return false;
+		if (backgroundEnabled) background.apply(depth); // 背景モデルはフィルタをかける前の生のDepthで更新する
+		if (temporalEnabled) temporalFilter.apply(depth); // 書き込み中のスロットなので他の利用者には見えない
+		if (spatialEnabled) spatialFilter.apply(depth);
+		depthBuffer.endWrite();
+		return true;
+	}
+
+	// 新しいDepthフレーム ができるまで最大 timeoutMs 待つ (できたら true)
+	// 取得元にフレームが届いた時点で起きて取得するので、ポーリングの空回りや待ち時間による遅延が無い
+	bool waitDepthFrame(int timeoutMs) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		for (;;) {
+			if (updateDepthFrame()) return true;
+			auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remain <= 0) return false;
+			source->waitForFrame(FrameSource::Depth, (int)remain);
+		}
 	}
 
-	// Deptht[̍XV
-	void updateDepthFrame(){
-		// Deptht[擾
-		CComPtr<IDepthFrame> depthFrame;
-		auto ret = depthFrameReader->AcquireLatestFrame(&depthFrame);
-		if (ret != S_OK) return;
+	// 最新フレームが届いてから今までの時間 [ms] (取得元のタイムスタンプがこの PC の時計でなければ -1)
+	double frameLatency() const {
+		if (!source->hostClock) return -1;
+		return (currentTimestamp() - source->depthTimestamp) / 10000.0;
+	}
+
+	// 時間方向のフィルタを使うか (有効にするときは履歴を捨ててから始める)
+	void setTemporalFilter(bool enable, const DepthTemporalOptions &options = DepthTemporalOptions()) {
+		temporalFilter.setOptions(options);
+		if (enable && !temporalEnabled) temporalFilter.reset();
+		temporalEnabled = enable;
+	}
+
+	bool temporalFilterEnabled() const { return temporalEnabled; }
+
+	// 時間方向のフィルタの処理時間の統計
+	const DepthTemporalFilter &temporalFilterStats() const { return temporalFilter; }
+
+	// 空間方向のフィルタを使うか
+	void setSpatialFilter(bool enable, const DepthSpatialOptions &options = DepthSpatialOptions()) {
+		spatialFilter.setOptions(options);
+		spatialEnabled = enable;
+	}
+
+	bool spatialFilterEnabled() const { return spatialEnabled; }
+
+	// 空間方向のフィルタの処理時間の統計
+	const DepthSpatialFilter &spatialFilterStats() const { return spatialFilter; }
 
-		// f[^擾
-		ERROR_CHECK(depthFrame->CopyFrameDataToArray( depthBuffer.size(), &depthBuffer[0]));
+	// 背景モデルを使うか (有効にするときは背景を学習し直す)
+	void setBackgroundModel(bool enable, const DepthBackgroundOptions &options = DepthBackgroundOptions()) {
+		background.setOptions(options);
+		if (enable && !backgroundEnabled) background.reset();
+		backgroundEnabled = enable;
 	}
 
-	// DepthMat`̐f[^Ŏ擾
+	bool backgroundModelEnabled() const { return backgroundEnabled; }
+
+	// 最新フレームの前景のマスク (CV_8UC1、前景は255。次のフレームで書き換わる) と塊 (面積の大きい順)
+	cv::Mat foregroundMask() { return background.foreground(); }
+	const std::vector<DepthBlob> &foregroundBlobs() const { return background.blobs(); }
+
+	// 背景モデルの状態と処理時間の統計
+	const DepthBackground &backgroundStats() const { return background; }
+
+	// DepthをMat形式の生データで取得 (img にコピーする)
 	void updateDepthRawImage(cv::Mat &img) {
-		int i, j, c = 0;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				img.at<UINT16>(j, i) = depthBuffer[c];
-				c++;
-			}
-		}
+		depthBuffer.copyTo(img);
 	}
 
-	// DepthMat`256~ɕϊĎ擾 (ŏlAől)
+	// DepthをMat形式の生データで取得 (コピーせずにフレームを指す。読み取り専用)
+	// img を持っている間はそのフレームのデータは上書きされないので、次のフレームを取得した後も使える
+	void updateDepthRawView(cv::Mat &img) {
+		img = depthBuffer.view();
+	}
+
+	// DepthをMat形式の256諧調に変換して取得 (最小値、最大値)
 	void updateDepthCvtImage(cv::Mat &img, int min, int max) {
-		int i, j, c = 0;
-		float del = (max - min) / 255;
-		UINT16 d;
-		for (j = 0; j < depthHeight; j++) {
-			for (i = 0; i < depthWidth; i++) {
-				d = depthBuffer[c];
-				if (d < min) img.at<uchar>(j, i) = 0;
-				else if (d >= max) img.at<uchar>(j, i) = 255;
-				else img.at<uchar>(j, i) = (uchar)((d - min) / del);
-				c++;
-			}
-		}
+		depthLut.set(min, max); // 範囲が変わったときだけテーブルを作り直す
+		depthLut.apply(depthBuffer.view(), img);
 	}
 };
 
-int main() {
+// 引数: [記録データのディレクトリ ("sim" なら合成フレーム) [再生fps (0ならできるだけ速く)] [処理フレーム数 [使う処理 ("t" : 時間方向のフィルタ, "s" : 空間方向のフィルタ, "b" : 背景モデル、"tsb" のように組み合わせる)]]]
+// 処理フレーム数を指定すると、画像を表示せずにそのフレーム数を処理して処理速度を表示する
+// 表示中は t キーで時間方向、s キーで空間方向のフィルタ、b キーで背景モデル (前景の塊を枠で囲む) を切り替える
+int main(int argc, char *argv[]) {
 	KinectApp knct;
 	cv::Mat depRawM, dispM;
 
-	try { knct.initialize(); } // Kinect̏
-	catch (std::exception& ex) { std::cout << ex.what() << std::endl; }
+	const char *replayPath = (argc > 1) ? argv[1] : nullptr;
+	double replayFps = (argc > 2) ? atof(argv[2]) : 30.0;
+	int benchFrames = (argc > 3) ? atoi(argv[3]) : 0;
+	bool display = (benchFrames <= 0);
+
+	try { knct.initialize(replayPath, replayFps); } // Kinectの初期化
+	catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+	std::string filters = (argc > 4) ? argv[4] : "";
+	if (filters.find('t') != std::string::npos) knct.setTemporalFilter(true);
+	if (filters.find('s') != std::string::npos) knct.setSpatialFilter(true);
+	if (filters.find('b') != std::string::npos) knct.setBackgroundModel(true);
 
 	depRawM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_16UC1);
 	dispM = cv::Mat(knct.depthHeight, knct.depthWidth, CV_8UC1);
 
-	while (1) { // C[v
-		knct.updateDepthFrame();
+	int frames = 0;
+	double latencySum = 0, latencyMax = 0; // 届いてから取得するまでの時間 [ms] (合成フレームのときだけ測れる)
+	int latencyCount = 0;
+	double startTick = (double)cv::getTickCount();
+	while (1) { // メインループ
+		// フレームが届くまで待つ (表示中はウィンドウの処理のため最大30ms)
+		if (knct.waitDepthFrame(display ? 30 : 1000)) {
+			frames++;
+			double latency = knct.frameLatency();
+			if (latency >= 0) {
+				latencySum += latency;
+				latencyMax = (std::max)(latencyMax, latency);
+				latencyCount++;
+			}
+		}
 
-		//f[^ϊꍇ
+		//生データから変換する場合
 		/*
 		int i, j;
 		float min, max, del;
 		min = 600;
 		max = 1000;
 		del = (max - min) / 255;
-		knct.updateDepthRawImage(depRawM);
+		knct.updateDepthRawView(depRawM);
 		for (j = 0; j < knct.depthHeight; j++) {
 			for (i = 0; i < knct.depthWidth; i++) {
 				UINT16 d = depRawM.at<UINT16>(j, i);
@@ -133,11 +206,46 @@ int main() {
 
 		knct.updateDepthCvtImage(dispM, 600, 3000);
 
+		if (!display) { // 表示せずに処理速度を計測
+			if (frames >= benchFrames) break;
+			continue;
+		}
+		if (knct.backgroundModelEnabled()) { // 前景の塊を枠で囲み、一番手前の距離を書く
+			const std::vector<DepthBlob> &blobs = knct.foregroundBlobs();
+			for (size_t n = 0; n < blobs.size(); n++) {
+				cv::rectangle(dispM, blobs[n].box, cv::Scalar(255), 2);
+				cv::putText(dispM, std::to_string(blobs[n].minDepth) + "mm", cv::Point(blobs[n].box.x + 2, blobs[n].box.y + 14), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255));
+			}
+		}
 		cv::imshow("depth Image", dispM);
-		auto key = cv::waitKey(10);
+		auto key = cv::waitKey(1);
 		if (key == 'q') {
 			break;
 		}
+		if (key == 't') { // 時間方向のフィルタの切り替え
+			knct.setTemporalFilter(!knct.temporalFilterEnabled());
+			std::cout << "temporal filter: " << (knct.temporalFilterEnabled() ? "on" : "off") << std::endl;
+		}
+		if (key == 's') { // 空間方向のフィルタの切り替え
+			knct.setSpatialFilter(!knct.spatialFilterEnabled());
+			std::cout << "spatial filter: " << (knct.spatialFilterEnabled() ? "on" : "off") << std::endl;
+		}
+		if (key == 'b') { // 背景モデルの切り替え (有効にすると最初の数十フレームで背景を学習する)
+			knct.setBackgroundModel(!knct.backgroundModelEnabled());
+			std::cout << "background model: " << (knct.backgroundModelEnabled() ? "on" : "off") << std::endl;
+		}
+	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+	std::cout << "frames: " << frames << ", " << sec << " sec, " << frames / sec << " fps" << std::endl;
+	if (latencyCount > 0) std::cout << "latency (arrival -> acquired): mean " << latencySum / latencyCount << " ms, max " << latencyMax << " ms" << std::endl;
+	const DepthTemporalFilter &temporal = knct.temporalFilterStats();
+	if (temporal.frames() > 0) std::cout << "temporal filter: " << temporal.frames() << " frames, mean " << temporal.meanFrameMs() << " ms, max " << temporal.maxFrameMs() << " ms" << std::endl;
+	const DepthSpatialFilter &spatial = knct.spatialFilterStats();
+	if (spatial.frames() > 0) std::cout << "spatial filter: " << spatial.frames() << " frames, mean " << spatial.meanFrameMs() << " ms, max " << spatial.maxFrameMs() << " ms" << std::endl;
+	const DepthBackground &background = knct.backgroundStats();
+	if (background.frames() > 0) {
+		std::cout << "background model: " << background.frames() << " frames, mean " << background.meanFrameMs() << " ms, max " << background.maxFrameMs() << " ms, blobs labeled in "
+			<< background.blobFrames() << " frames, last " << background.blobs().size() << " blobs / " << background.foregroundPixels() << " foreground pixels" << std::endl;
 	}
 	return 0;
 }
\ No newline at end of file
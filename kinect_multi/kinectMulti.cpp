@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "../kinect_common/ColorConvert.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/DepthWarp.h"
+#include "../kinect_common/FrameSource.h"
+#include "../kinect_common/KinectSensorSource.h"
+#include "../kinect_common/MultiSourceCapture.h"
+#include "../kinect_common/RGBDFrame.h"
+#include "../kinect_common/ReplayFrameSource.h"
+#include "../kinect_common/SimulatedFrameSource.h"
+#include "../kinect_common/StreamFrameSource.h"
+
+// 複数の取得元 (Kinect、記録データ、合成フレーム、TCP の受信) を同時に取得して変換する
+// 取得は取得元ごとのスレッド、変換 (YUY2 → BGRA と位置合わせ) は全ての取得元で共有するスレッドのプールで行う
+class KinectApp {
+private:
+	MultiSourceCapture capture;
+
+public:
+	// 取得元を追加する (spec は "kinect" / "sim" / "sim:fps" / "tcp://host:port" / 記録データのディレクトリ)
+	void addSource(const std::string &spec) {
+		FrameSource *source;
+		if (spec == "kinect") {
+#ifdef _WIN32
+			source = new KinectSensorSource();
+#else
+			throw std::runtime_error("Kinect is not available on this platform");
+#endif
+		} else if (spec == "sim" || spec.compare(0, 4, "sim:") == 0) {
+			source = new SimulatedFrameSource((spec.size() > 4) ? atof(spec.c_str() + 4) : 30.0);
+		} else if (spec.compare(0, 6, "tcp://") == 0) {
+			size_t colon = spec.rfind(':');
+			if (colon == std::string::npos || colon < 6) throw std::runtime_error("invalid stream address " + spec);
+			source = new StreamFrameSource(spec.substr(6, colon - 6), atoi(spec.c_str() + colon + 1));
+		} else {
+			source = new ReplayFrameSource(spec.c_str(), 30.0);
+		}
+		capture.addSource(spec, source);
+	}
+
+	// 取得を始める (workers は変換スレッドの数、0 なら CPU の数)
+	void initialize(int workers) {
+		MultiSourceOptions options;
+		options.workers = workers;
+		capture.setOptions(options);
+		capture.start();
+	}
+
+	void stop() { capture.stop(); }
+
+	int sourceCount() const { return capture.sourceCount(); }
+	const std::string &sourceName(int index) const { return capture.sourceName(index); }
+
+	// 取得元の最新の変換済みフレーム (まだ無ければ false)
+	bool currentFrame(int index, RGBDFrame &frame) { return capture.latestFrame(index, frame); }
+
+	// RGBを縦横半分の BGRA で取得
+	void updateColorHalfImage(const RGBDFrame &frame, cv::Mat &img) const {
+		cv::resize(frame.color, img, cv::Size(frame.color.cols / 2, frame.color.rows / 2));
+	}
+
+	// DepthをMat形式の256諧調に変換して取得 (最小値、最大値)
+	void updateDepthCvtImage(const RGBDFrame &frame, cv::Mat &img, int min, int max) const {
+		depthWindowLUT(min, max).apply(frame.depth, img);
+	}
+
+	// RGBをDepthの空間に写像して取得 (位置合わせできなければ false)
+	bool updateColor2DepthImage(const RGBDFrame &frame, cv::Mat &img) const {
+		if (frame.colorSpace.empty()) return false;
+		warpColorToDepth(frame.color, frame.colorSpace.ptr<ColorSpacePoint>(0), frame.depth.cols, frame.depth.rows, img);
+		return true;
+	}
+
+	MultiSourceStats stats(int index) { return capture.stats(index); }
+	const WorkStealingPool *workerPool() const { return capture.workerPool(); }
+};
+
+// 引数: 計測秒数 (0 なら表示) 変換スレッド数 (0 なら CPU の数) 取得元 [取得元 ...]
+// 取得元は "kinect" / "sim" / "sim:fps" / "tcp://host:port" / 記録データのディレクトリ (Kinect は1台だけ)
+// 計測秒数を指定すると、表示せずにその時間だけ取得して、取得元ごとの fps、捨てたフレーム、遅延と、スレッドごとの処理数を表示する
+int main(int argc, char *argv[]) {
+	KinectApp knct;
+
+	int benchSec = (argc > 1) ? atoi(argv[1]) : 0;
+	int workers = (argc > 2) ? atoi(argv[2]) : 0;
+	bool display = (benchSec <= 0);
+	try {
+		for (int n = 3; n < argc; n++) knct.addSource(argv[n]);
+		if (knct.sourceCount() == 0) knct.addSource("sim");
+		knct.initialize(workers); // 全ての取得元を開く
+	} catch (std::exception& ex) { std::cout << ex.what() << std::endl; return 1; }
+
+	cv::Mat dispCol, dispDep, depRGBsp;
+	std::vector<long long> shown(knct.sourceCount(), -1);
+	double startTick = (double)cv::getTickCount();
+	while (1) { // メインループ
+		if (!display) { // 表示せずに計測
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			if (((double)cv::getTickCount() - startTick) / cv::getTickFrequency() >= benchSec) break;
+			continue;
+		}
+		for (int i = 0; i < knct.sourceCount(); i++) {
+			RGBDFrame frame;
+			if (!knct.currentFrame(i, frame) || frame.number == shown[i]) continue;
+			shown[i] = frame.number;
+			std::string name = std::to_string(i) + ": " + knct.sourceName(i);
+			knct.updateColorHalfImage(frame, dispCol);
+			knct.updateDepthCvtImage(frame, dispDep, 600, 3000);
+			cv::imshow(name + " color", dispCol);
+			cv::imshow(name + " depth", dispDep);
+			if (knct.updateColor2DepthImage(frame, depRGBsp)) cv::imshow(name + " color from depth space", depRGBsp);
+		}
+		auto key = cv::waitKey(10);
+		if (key == 'q') {
+			break;
+		}
+	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+	knct.stop();
+
+	for (int i = 0; i < knct.sourceCount(); i++) {
+		MultiSourceStats s = knct.stats(i);
+		std::cout << i << ": " << knct.sourceName(i) << " : processed " << s.processed << " (" << s.processed / sec << " fps), captured " << s.captured
+			<< ", throttled " << s.throttled << ", late " << s.late << ", no slot " << s.noSlot << std::endl;
+		std::cout << "   process mean " << s.meanProcessMs << " ms, max " << s.maxProcessMs << " ms, latency (paired -> processed) mean "
+			<< s.meanLatencyMs << " ms, max " << s.maxLatencyMs << " ms" << std::endl;
+	}
+	const WorkStealingPool *pool = knct.workerPool();
+	if (pool != nullptr) {
+		for (size_t t = 0; t < pool->threadCount(); t++) {
+			std::cout << "worker " << t << ": executed " << pool->executed(t) << ", stolen " << pool->stolen(t) << std::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <opencv2/opencv.hpp>
+
+#include "../kinect_common/ColorConvert.h"
+#include "../kinect_common/DepthConvert.h"
+#include "../kinect_common/RGBDFrame.h"
+#include "../kinect_common/SharedFrameRing.h"
+
+// kinect_RGBD が共有メモリに配信するフレームを別のプロセスで受け取る
+// Kinect SDK は使わないので Linux でもビルドできる
+//   g++ -O2 -std=c++11 kinectShmViewer.cpp -o kinectShmViewer $(pkg-config --cflags --libs opencv4)
+
+class KinectApp {
+private:
+	SharedFrameReader reader;
+	SharedFrame shared; // 最後に受け取ったフレーム (共有メモリのスロットを指す)
+
+public:
+	int colorWidth = 0;
+	int colorHeight = 0;
+
+	int depthWidth = 0;
+	int depthHeight = 0;
+
+	// 共有メモリを開く (配信側がまだ無ければ false。開けるまで繰り返し呼ぶ)
+	bool initialize(const std::string &name) {
+		try { reader.open(name); }
+		catch (std::exception&) { return false; }
+		colorWidth = reader.colorWidth();
+		colorHeight = reader.colorHeight();
+		depthWidth = reader.depthWidth();
+		depthHeight = reader.depthHeight();
+		return true;
+	}
+
+	bool isOpen() const { return reader.isOpen(); }
+
+	// 新しいフレームを最大 timeoutMs 待って受け取る (受け取ったら true)
+	// 配信側が閉じたら共有メモリを閉じる (次の initialize() で開き直す)
+	bool updateRGBDFrame(int timeoutMs) {
+		if (!reader.isOpen()) return false;
+		if (reader.waitFrame(timeoutMs) && reader.latest(shared)) return true;
+		if (reader.writerClosed()) reader.close();
+		return false;
+	}
+
+	// 受け取ったフレームを使っている間に上書きされていないか (false なら作った画像は捨てる)
+	bool isFrameValid() { return reader.isValid(shared); }
+
+	const RGBDFrame &currentFrame() const { return shared.frame; }
+
+	// 配信側が書き込んでから今までの時間 [ms]
+	double frameLatency() const { return (currentTimestamp() - shared.publishTimestamp) / 10000.0; }
+
+	// RGBを縦横半分の BGRA で取得 (ROI の窓の部分、YUY2 なら縮小しながら変換する)
+	void updateColorHalfImage(cv::Mat &img) const {
+		const RGBDFrame &frame = shared.frame;
+		cv::Mat color = frame.color(frame.roi.colorRect);
+		if (color.type() == CV_8UC2) yuy2ToBGRAHalf(color, img);
+		else cv::resize(color, img, cv::Size(color.cols / 2, color.rows / 2));
+	}
+
+	// DepthをMat形式の256諧調に変換して取得 (最小値、最大値。ROI の窓の部分)
+	void updateDepthCvtImage(cv::Mat &img, int min, int max) const {
+		const RGBDFrame &frame = shared.frame;
+		depthWindowLUT(min, max, frame.roi.depthMin(), frame.roi.depthMax()).apply(frame.depth(frame.roi.depthRect), img);
+	}
+
+	// 受け取り、取りこぼし、使っている間に上書きされたフレームの数
+	unsigned long long received() const { return reader.received(); }
+	unsigned long long missed() const { return reader.missed(); }
+	unsigned long long torn() const { return reader.torn(); }
+};
+
+// 引数: [共有メモリの名前 [受け取るフレーム数 [1フレームの処理時間 [ms]]]]
+// 受け取るフレーム数を指定すると、表示せずにそのフレーム数を受け取って取りこぼしと遅延を表示する
+// 処理時間を指定すると受け取るたびにその時間だけ止まる (遅い読み込み側の確認用。配信側は待たずに取りこぼしが増えるだけ)
+int main(int argc, char *argv[]) {
+	KinectApp knct;
+
+	std::string name = (argc > 1) ? argv[1] : "kinect_rgbd";
+	int benchFrames = (argc > 2) ? atoi(argv[2]) : 0;
+	int workMs = (argc > 3) ? atoi(argv[3]) : 0;
+	bool display = (benchFrames <= 0);
+
+	cv::Mat dispCol, dispDep;
+	int frames = 0;
+	double latencySum = 0, latencyMax = 0;
+	double startTick = 0;
+	while (1) { // メインループ
+		if (!knct.isOpen()) { // 配信側が始まる (開き直す) まで待つ
+			if (!knct.initialize(name)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				if (display && cv::waitKey(1) == 'q') break;
+				continue;
+			}
+			std::cout << "open: " << name << " (depth " << knct.depthWidth << "x" << knct.depthHeight << ", color " << knct.colorWidth << "x" << knct.colorHeight << ")" << std::endl;
+		}
+
+		if (knct.updateRGBDFrame(100)) {
+			if (frames == 0) startTick = (double)cv::getTickCount();
+			double latency = knct.frameLatency();
+			latencySum += latency;
+			latencyMax = (std::max)(latencyMax, latency);
+
+			// 共有メモリのフレームを直接読んで変換し、上書きされていなければ使う
+			knct.updateColorHalfImage(dispCol);
+			knct.updateDepthCvtImage(dispDep, 600, 3000);
+			if (workMs > 0) std::this_thread::sleep_for(std::chrono::milliseconds(workMs));
+			if (knct.isFrameValid()) {
+				frames++;
+				if (display) {
+					cv::imshow("color Image", dispCol);
+					cv::imshow("depth Image", dispDep);
+				}
+			}
+		}
+
+		if (!display) { // 表示せずに受け取りを計測 (配信側が閉じても終わる)
+			if (frames >= benchFrames || (knct.received() > 0 && !knct.isOpen())) break;
+			continue;
+		}
+		auto key = cv::waitKey(1);
+		if (key == 'q') {
+			break;
+		}
+	}
+	double sec = ((double)cv::getTickCount() - startTick) / cv::getTickFrequency();
+
+	std::cout << "frames: " << frames << ", " << sec << " sec, " << frames / sec << " fps" << std::endl;
+	std::cout << "received " << knct.received() << ", missed " << knct.missed() << ", torn " << knct.torn() << std::endl;
+	if (knct.received() > 0) std::cout << "latency (publish -> received): mean " << latencySum / knct.received() << " ms, max " << latencyMax << " ms" << std::endl;
+	return 0;
+}